@@ -0,0 +1,120 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_ASSET_LOADER_H
+#define STEP_3_ASSET_LOADER_H
+
+#include "engine/util/std.h"
+#include "engine/world.h"
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <deque>
+#include <thread>
+
+namespace Raytracing {
+
+    /**
+     * Loads the meshes and decodes the textures of a scene on a pool of worker threads while the scene is being set up.
+     * The BVH of every mesh starts building as soon as the mesh is loaded, so by the time the world BVH is built only the top level is left.
+     * Nothing is added to the world until wait() is called, so the world is only ever changed by the thread using it.
+     */
+    class AssetLoader {
+        private:
+            enum Stage {
+                MESH_LOAD = 0, TEXTURE_DECODE = 1, MESH_BVH = 2, STAGE_COUNT = 3
+            };
+
+            struct StageTiming {
+                size_t count = 0;
+                // milliseconds spent on the stage summed over every thread
+                double work = 0;
+                // milliseconds since the loader was created at which the last task of the stage finished
+                double finished = 0;
+            };
+
+            struct MeshJob {
+                std::string file;
+                std::shared_ptr<MeshAsset> mesh;
+            };
+
+            struct TextureJob {
+                std::string name;
+                std::string file;
+                float scale;
+                std::shared_ptr<const TextureImage> image;
+            };
+
+            World& world;
+            // copied so the workers never touch the world
+            BVHBuildOptions bvhOptions;
+            // mesh BVHs the BVH cache already has aren't built here, the world uses the cached ones if the rest of the scene matches
+            // and builds the ones still missing if it doesn't
+            std::string bvhCachePath;
+            unsigned int threadCount;
+            // threads OpenMP may use, shared between the tasks running at once
+            int parallelThreads = 1;
+            std::chrono::steady_clock::time_point start;
+
+            // everything below is shared with the workers and guarded by the lock
+            std::mutex lock;
+            std::condition_variable condition;
+            std::deque<std::function<void()>> tasks;
+            // queued plus running, running tasks can queue more so the workers can't stop until this is zero
+            size_t unfinishedTasks = 0;
+            int runningTasks = 0;
+            bool finishing = false;
+            std::exception_ptr error;
+            StageTiming timings[STAGE_COUNT];
+            size_t cachedMeshBVHs = 0;
+            std::vector<MeshJob> meshes;
+            std::vector<TextureJob> textures;
+
+            std::vector<std::thread> workers;
+
+            void submit(Stage stage, std::function<void()> task);
+
+            void work();
+
+            /**
+             * Lets the workers stop once every task is done and waits for them.
+             */
+            void finish();
+
+        public:
+            /**
+             * @param threads number of worker threads, 0 to use every core
+             */
+            explicit AssetLoader(World& world, unsigned int threads = 0);
+
+            AssetLoader(const AssetLoader& loader) = delete;
+
+            ~AssetLoader();
+
+            /**
+             * Queues an OBJ file to be loaded, as World::loadMesh would, followed by building its BVH.
+             * Files which have already been queued are ignored.
+             */
+            void loadMesh(const std::string& file);
+
+            /**
+             * Queues an image to be decoded into a TexturedMaterial added to the world under the name. The image comes from the
+             * TextureCache, so materials using the same image share it. Names which have already been queued are ignored,
+             * the world only keeps the first material with a name anyway.
+             */
+            void loadTexture(const std::string& name, const std::string& file, float scale = 1);
+
+            /**
+             * Waits for everything queued, adds the meshes and materials to the world in the order they were queued and logs how long
+             * every stage took and the memory used by the textures. World::loadMesh returns the loaded meshes afterwards. Throws the first error any of the tasks threw.
+             */
+            void wait();
+    };
+
+}
+
+#endif //STEP_3_ASSET_LOADER_H
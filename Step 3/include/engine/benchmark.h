@@ -0,0 +1,37 @@
+/*
+ * Created by Brett Terpstra 6920201 on 16/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_BENCHMARK_H
+#define STEP_3_BENCHMARK_H
+
+#include "engine/util/std.h"
+#include "engine/util/parser.h"
+#include <functional>
+
+namespace Raytracing {
+
+    /**
+     * Small benchmarks of individual parts of the engine which can be run from the command line instead of rendering the scene.
+     * Every benchmark checks its results against a simple reference implementation so it doubles as a correctness check.
+     */
+    class Benchmarks {
+        public:
+            struct Benchmark {
+                std::string name;
+                std::string description;
+                // returns non-zero if the benchmark failed, which is used as the exit code of the program.
+                std::function<int(Parser&)> func;
+            };
+
+            /**
+             * Runs the benchmark with the provided name. "all" runs every benchmark and "list" prints them.
+             * @return 0 if the benchmark ran and its results were correct
+             */
+            static int run(const std::string& name, Parser& parser);
+    };
+
+}
+
+#endif //STEP_3_BENCHMARK_H
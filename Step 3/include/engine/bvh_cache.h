@@ -0,0 +1,75 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_BVH_CACHE_H
+#define STEP_3_BVH_CACHE_H
+
+#include "engine/util/std.h"
+#include "engine/math/bvh.h"
+
+namespace Raytracing {
+    
+    class MeshAsset;
+
+    // has to be changed whenever the layout of the file, the nodes or the builders change so old caches are rebuilt
+    constexpr uint32_t BVH_CACHE_VERSION = 4;
+
+    /**
+     * Stores the built world BVH and the BVH of every mesh in a single file so the next run of the same scene doesn't have to build them.
+     * The file is mapped into memory and the trees use the nodes in it directly, all the arrays are stored exactly as they are in memory.
+     * The file is keyed by a hash of the scene, if anything which would change the trees changes the cache is ignored and rewritten.
+     * Tree 0 is the world BVH, followed by the BVH of every mesh in the order the objects of the world first use them.
+     */
+    class BVHCache {
+        private:
+            // owns the mapped file, shared with every tree using it
+            std::shared_ptr<void> mapping;
+            std::vector<BVHCachedTree> trees;
+
+            BVHCache(std::shared_ptr<void> mapping, std::vector<BVHCachedTree> trees): mapping(std::move(mapping)), trees(std::move(trees)) {}
+
+        public:
+            /**
+             * FNV-1a hash of everything the BVH of the mesh depends on, its build options and its triangles.
+             */
+            static uint64_t hashMesh(const MeshAsset& mesh);
+            
+            /**
+             * FNV-1a hash of everything the trees depend on: the build options, the position and bounds of every object and the triangles of every mesh.
+             * @param meshHashes hashMesh of every mesh used by the objects, once each
+             * @param worldOptions options the world BVH is built with, the meshes use their own
+             */
+            static uint64_t hashScene(const std::vector<Object*>& objects, const std::vector<uint64_t>& meshHashes, const BVHBuildOptions& worldOptions);
+            
+            /**
+             * Checks whether the cache file has a BVH for the mesh, without needing the rest of the scene. The whole cache is still only
+             * used if the scene matches, this is for deciding whether a mesh's BVH is worth building before the scene is known.
+             * @param meshHash hashMesh of the mesh
+             */
+            static bool containsMesh(const std::string& path, uint64_t meshHash);
+
+            /**
+             * Maps the cache file into memory.
+             * @param treeCount number of trees the scene has, including the world BVH
+             * @return the cache or nullptr if the file doesn't exist, is from another version or is for a different scene
+             */
+            static std::unique_ptr<BVHCache> load(const std::string& path, uint64_t sceneHash, size_t treeCount);
+
+            /**
+             * Writes the trees to the cache file. The file is written to a temporary file first and then renamed,
+             * so other processes (like the other MPI ranks) never see a partially written cache.
+             * @param meshHashes hashMesh of the mesh of every tree after the world BVH
+             * @return true if the cache was written
+             */
+            static bool write(const std::string& path, uint64_t sceneHash, const std::vector<const FlatBVH*>& trees, const std::vector<uint64_t>& meshHashes);
+
+            [[nodiscard]] const BVHCachedTree& getTree(size_t i) const { return trees[i]; }
+
+            [[nodiscard]] std::shared_ptr<void> getMapping() const { return mapping; }
+    };
+
+}
+
+#endif //STEP_3_BVH_CACHE_H
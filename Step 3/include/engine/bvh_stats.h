@@ -0,0 +1,34 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_BVH_STATS_H
+#define STEP_3_BVH_STATS_H
+
+#include "engine/util/std.h"
+#include "engine/world.h"
+#include "engine/raytracing.h"
+
+namespace Raytracing {
+
+    /**
+     * Describes the world BVH and the BVHs of the meshes in JSON: their size, depth, leaf sizes, SAH cost, memory and overlap,
+     * along with how many nodes and primitives camera rays visit. Nothing in the report depends on timing,
+     * so reports from different builds or BVH options of the same scene can be diffed.
+     */
+    class BVHStatsReport {
+        public:
+            /**
+             * Generates the BVH of the world, traces the camera rays through it and writes the report.
+             * The rays are spread over the image using a fixed seed so every run traces the same rays.
+             * @param rayCount number of camera rays to trace
+             * @param output file to write the report to, or "-" to print it
+             * @return 0 if the report was written
+             */
+            static int write(World& world, Camera& camera, const Image& image, int rayCount, const std::string& output);
+    };
+
+}
+
+#endif //STEP_3_BVH_STATS_H
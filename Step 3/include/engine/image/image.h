@@ -65,6 +65,11 @@ namespace Raytracing {
                 return int(255.0 * getPixelColor(x, y).a());
             }
             
+            /**
+             * @return the pixels stored column by column, pixel (x, y) is at x * getHeight() + y
+             */
+            [[nodiscard]] inline const Vec4* getPixelData() const { return pixelData; }
+            
             [[nodiscard]] inline int getWidth() const { return int(width); }
             
             [[nodiscard]] inline int getHeight() const { return int(height); }
@@ -0,0 +1,241 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_TEXTURE_CACHE_H
+#define STEP_3_TEXTURE_CACHE_H
+
+#include "engine/util/std.h"
+#include "engine/math/vectors.h"
+#include <atomic>
+
+namespace Raytracing {
+
+    // textures are stored in square tiles of this many texels a side, 8x8 RGBA8 texels being four cache lines
+    constexpr int TEXTURE_TILE_SIZE = 8;
+    // tiles are grouped into square pages of this many texels a side, the unit paged textures are read from disk and kept in memory in
+    constexpr int TEXTURE_PAGE_SIZE = 64;
+    constexpr size_t TEXTURE_PAGE_TEXELS = (size_t) TEXTURE_PAGE_SIZE * TEXTURE_PAGE_SIZE;
+    // has to be changed whenever the page layout or the tiled texture file changes so old tiled files are made again
+    constexpr uint32_t TEXTURE_FILE_VERSION = 1;
+
+    /**
+     * Memory holding one page of a paged TextureImage, handed out by the TextureCache from a pool no larger than the texture budget.
+     * The page it holds can be evicted and the memory refilled with another page while render threads are reading it, so readers
+     * check the owner after reading a texel and only use the texel if the memory still held their page.
+     */
+    struct TexturePage {
+        // the image's key plus the index of the page, 0 while the memory is free or being filled
+        std::atomic<uint64_t> owner{0};
+        // set by lookups finding the page, cleared by the eviction clock passing over it
+        std::atomic<bool> referenced{false};
+        alignas(64) uint32_t texels[TEXTURE_PAGE_TEXELS];
+    };
+
+    /**
+     * An image file decoded by stb_image and converted to a mip chain of packed RGBA8 texels, owned by the TextureCache and shared by
+     * every material using it. Every level is stored in TEXTURE_TILE_SIZE square tiles with the texels of a tile in Morton order,
+     * so texels near each other in the image are near each other in memory whichever direction the rays walk across it.
+     * The tiles are grouped into TEXTURE_PAGE_SIZE square pages, with the levels small enough to fit in a quarter of a page sharing the last one.
+     *
+     * A resident image keeps every page in memory. A paged image only has the tiled texture file the TextureCache wrote for it open,
+     * and reads a page from it the first time a texel in it is looked up, into memory from the cache's pool which is shared by every paged image.
+     */
+    class TextureImage {
+        private:
+            friend class TexturePool;
+            
+            struct MipLevel {
+                int width, height;
+                // pages across the level, which is padded out to whole pages, and tiles across a row of one of its pages.
+                // levels sharing the last page have one page with their tiles packed across the level instead.
+                int pagesX, pageTilesX;
+                size_t firstPage;
+                // first texel of the level in its page, only used by the levels sharing the last page
+                size_t offset;
+            };
+            
+            // every level, level 0 (the full image) first, each half the size of the one before down to 1x1
+            std::vector<MipLevel> levels;
+            size_t pageCount = 0;
+            // every page one after the other when the image is resident, empty when it is paged
+            std::vector<uint32_t> texels;
+            // the memory holding each page of a paged image, nullptr for pages which aren't in memory
+            std::unique_ptr<std::atomic<TexturePage*>[]> pages;
+            // the open tiled texture file of a paged image and where its pages start in it
+            int file = -1;
+            uint64_t pagesOffset = 0;
+            // unique to the image and added to the index of a page to give the owner of the memory holding it
+            uint64_t key = 0;
+            // channels the file had, the texels always have all four
+            int channels;
+            // geometric mean of the width and height, the length in texels of one unit of UV
+            PRECISION_TYPE size;
+            // FNV-1a of the file the image was decoded from
+            uint64_t contentHash;
+            size_t fileSize;
+            
+            [[nodiscard]] static inline size_t pageOf(const MipLevel& level, unsigned int x, unsigned int y) {
+                return level.firstPage + (size_t) (y / TEXTURE_PAGE_SIZE) * level.pagesX + x / TEXTURE_PAGE_SIZE;
+            }
+            
+            /**
+             * Index of the texel inside its page, texels inside a tile are Morton ordered.
+             */
+            [[nodiscard]] static inline size_t indexInPage(const MipLevel& level, unsigned int x, unsigned int y) {
+                // spreads the three low bits of a coord out to every other bit
+                auto spread = [](unsigned int i) -> unsigned int { return (i & 1) | ((i & 2) << 1) | ((i & 4) << 2); };
+                x %= TEXTURE_PAGE_SIZE;
+                y %= TEXTURE_PAGE_SIZE;
+                auto tile = (size_t) (y / TEXTURE_TILE_SIZE) * level.pageTilesX + x / TEXTURE_TILE_SIZE;
+                return level.offset + tile * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE + (spread(x % TEXTURE_TILE_SIZE) | spread(y % TEXTURE_TILE_SIZE) << 1);
+            }
+            
+            /**
+             * Lays out the mip chain of an image of the size in pages.
+             */
+            void layout(int width, int height);
+            
+            /**
+             * Reads the page from the tiled texture file if no other thread already is, evicting another page if the pool is full.
+             * Only called when a lookup doesn't find the page in memory, and the only part of a lookup which takes a lock.
+             */
+            [[nodiscard]] uint32_t loadTexel(size_t page, size_t index) const;
+        
+        public:
+            /**
+             * Tiles the RGBA8 pixels and builds the mip chain from them, the image is resident.
+             * @param pixels width * height row major RGBA8 pixels, as given by stb_image when asked for 4 channels
+             */
+            TextureImage(const unsigned char* pixels, int width, int height, int channels, uint64_t contentHash, size_t fileSize);
+            
+            /**
+             * Creates a paged image reading its pages from the tiled texture file, which it closes when it is destroyed.
+             * @param pagesOffset where the first page starts in the file
+             */
+            TextureImage(int file, uint64_t pagesOffset, int width, int height, int channels, uint64_t contentHash, size_t fileSize);
+            
+            TextureImage(const TextureImage& image) = delete;
+            
+            ~TextureImage();
+            
+            [[nodiscard]] inline int getWidth(int level = 0) const { return levels[level].width; }
+            
+            [[nodiscard]] inline int getHeight(int level = 0) const { return levels[level].height; }
+            
+            [[nodiscard]] inline int getLevelCount() const { return (int) levels.size(); }
+            
+            [[nodiscard]] inline PRECISION_TYPE getSize() const { return size; }
+            
+            [[nodiscard]] inline int getChannels() const { return channels; }
+            
+            [[nodiscard]] inline uint64_t getContentHash() const { return contentHash; }
+            
+            [[nodiscard]] inline size_t getFileSize() const { return fileSize; }
+            
+            [[nodiscard]] inline size_t getPageCount() const { return pageCount; }
+            
+            [[nodiscard]] inline bool isPaged() const { return pages != nullptr; }
+            
+            /**
+             * @return the memory used by the image itself, the pages of a paged image are counted by the TextureCache
+             */
+            [[nodiscard]] inline size_t getMemoryUsage() const {
+                return texels.size() * sizeof(uint32_t) + levels.size() * sizeof(MipLevel) + (pages ? pageCount * sizeof(pages[0]) : 0);
+            }
+            
+            /**
+             * The pages of a resident image one after the other, as they are stored in its tiled texture file.
+             */
+            [[nodiscard]] inline const std::vector<uint32_t>& getPages() const { return texels; }
+            
+            /**
+             * @return the texel packed as R | G << 8 | B << 16 | A << 24
+             */
+            [[nodiscard]] inline uint32_t getTexel(int x, int y, int level = 0) const {
+                const auto& mip = levels[level];
+                auto page = pageOf(mip, x, y);
+                auto index = indexInPage(mip, x, y);
+                if (pages == nullptr)
+                    return texels[page * TEXTURE_PAGE_TEXELS + index];
+                // no lock is taken while the page is in memory. The texel is read first and the owner checked after it, if the memory
+                // has been given to another page since the texel may be from that page, and the page is loaded again.
+                if (auto* resident = pages[page].load(std::memory_order_acquire)) {
+                    auto texel = std::atomic_ref<uint32_t>(resident->texels[index]).load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (resident->owner.load(std::memory_order_relaxed) == key + page) {
+                        // only written when it changes, so the threads reading a page don't fight over its cache line
+                        if (!resident->referenced.load(std::memory_order_relaxed))
+                            resident->referenced.store(true, std::memory_order_relaxed);
+                        return texel;
+                    }
+                }
+                return loadTexel(page, index);
+            }
+            
+            /**
+             * Point samples a level. u and v are in [0, 1) with v = 0 at the top of the image.
+             */
+            [[nodiscard]] inline Vec4 sample(PRECISION_TYPE u, PRECISION_TYPE v, int level) const {
+                const auto& mip = levels[level];
+                auto x = std::min((int) (mip.width * u), mip.width - 1);
+                auto y = std::min((int) (mip.height * v), mip.height - 1);
+                auto texel = getTexel(x, y, level);
+                // the engine works on [0, 1], a single division followed by multiplications is cheaper than dividing every channel
+                const PRECISION_TYPE colorFactor = 1.0 / 255.0;
+                return {PRECISION_TYPE(texel & 0xFF) * colorFactor, PRECISION_TYPE((texel >> 8) & 0xFF) * colorFactor,
+                        PRECISION_TYPE((texel >> 16) & 0xFF) * colorFactor};
+            }
+    };
+
+    /**
+     * Decodes every image once for the whole process. Images are looked up by path first, and by the hash of the file's contents
+     * when the path hasn't been seen, so the same file under two paths or two copies of a file also share one image.
+     * The cache only holds weak references, an image is freed as soon as the last material using it is.
+     * Safe to use from any thread, images are decoded outside the lock so different images decode at the same time.
+     *
+     * Once a texture budget is set images are paged. Each image is decoded once into a tiled texture file next to it, with the extension
+     * .rttex added, which is used instead of the image for as long as the image doesn't change. Pages are read from it as they are
+     * looked up, and once the budget is used up the page least recently looked up is evicted to make room, approximated with a clock.
+     * Images are kept resident if their tiled file can't be written.
+     */
+    class TextureCache {
+        public:
+            struct Stats {
+                // images currently decoded and the memory their pixels use
+                size_t residentImages = 0;
+                size_t residentBytes = 0;
+                // calls to load, and how many of them were given an image which was already decoded
+                size_t requests = 0;
+                size_t shared = 0;
+                // how many of the images are paged, the pages in memory, the most the budget allows and how often pages were read and evicted
+                size_t pagedImages = 0;
+                size_t residentPages = 0;
+                size_t budgetPages = 0;
+                size_t pageLoads = 0;
+                size_t evictions = 0;
+            };
+
+            /**
+             * @return the decoded image, or nullptr if the file couldn't be read or decoded
+             */
+            static std::shared_ptr<const TextureImage> load(const std::string& file);
+            
+            /**
+             * Sets the memory the pages of paged images may use, and makes every image loaded afterwards paged.
+             * 0, the default, keeps images loaded afterwards resident. Pages already in memory stay until they are evicted.
+             */
+            static void setBudget(size_t bytes);
+            
+            /**
+             * @return the path of the tiled texture file belonging to the image file
+             */
+            static std::string pathFor(const std::string& imageFile);
+
+            static Stats getStats();
+    };
+
+}
+
+#endif //STEP_3_TEXTURE_CACHE_H
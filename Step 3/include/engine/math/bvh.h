@@ -19,6 +19,7 @@
 #endif
 
 #include <utility>
+#include <span>
 
 namespace Raytracing {
 
@@ -28,54 +29,338 @@ namespace Raytracing {
     extern int selected;
 #endif
     
+    /**
+     * Reference to a primitive while the tree is being built. The builders only care about the bounds,
+     * so the same builders can be used for objects in the world and triangles in a mesh.
+     */
     struct BVHObject {
-        Object* ptr = nullptr;
         AABB aabb;
+        // index of the primitive in the tree's primitive array
+        uint32_t index = 0;
+    };
+    
+    // builders will create a leaf instead of going any deeper than this, which lets traversal use a fixed size stack.
+    constexpr int BVH_MAX_DEPTH = 64;
+    
+    enum BVHBuilderType {
+        // the original builder, splits the space in half along the longest axis
+        MIDPOINT = 0,
+        // binned surface area heuristic builder
+        SAH = 1,
+        // linear BVH, sorts the objects along a morton curve. Much faster to build than SAH but slower to trace.
+        LBVH = 2,
+        // spatial split BVH, the SAH builder but nodes can also be split by a plane with the objects crossing it referenced on both sides.
+        // slower to build and uses more memory, but large objects stop overlapping everything else in the tree.
+        SBVH = 3
     };
     
-    struct BVHPartitionedSpace {
-        // corresponds to the AABB pair used to generate the partitioned space
-        std::vector<BVHObject> left;
-        std::vector<BVHObject> right;
+    /**
+     * Parameters used when building the BVH. The costs are only relative to each other and are used by the SAH builder
+     * to decide where to split and when creating a leaf is cheaper than splitting.
+     */
+    struct BVHBuildOptions {
+        BVHBuilderType builder = SAH;
+        // number of buckets the centroids are sorted into along each axis
+        int binCount = 16;
+        // nodes with this many objects or fewer can become leaves if the SAH says splitting isn't worth it.
+        // the LBVH builder always creates a leaf once a node is this small.
+        int maxLeafSize = 4;
+        // cost of testing the ray against a node's AABB
+        PRECISION_TYPE traversalCost = 1.0;
+        // cost of testing the ray against an object inside a leaf
+        PRECISION_TYPE intersectionCost = 2.0;
+        // BVHTree::update rebuilds the tree once its SAH cost has grown by this factor since it was built
+        PRECISION_TYPE rebuildThreshold = 1.5;
+        // number of children per node used when tracing. 2 traces the binary tree the builders create,
+        // 4 collapses it into a BVH4 which tests all four children of a node at once.
+        int width = 4;
+        // extra references the SBVH builder may create by splitting objects, as a fraction of the number of objects.
+        // 0.25 lets the tree reference up to 25% more objects than there are. 0 only allows object splits, making it the SAH builder.
+        PRECISION_TYPE splitBudget = 0.25;
+
+        /**
+         * @param name name of the builder, either "sah", "sbvh", "lbvh" or "midpoint"
+         * @return the builder type described by the name. Throws if the name isn't a known builder.
+         */
+        static BVHBuilderType builderFromString(const std::string& name);
+        
+        static std::string builderToString(BVHBuilderType type);
     };
     
-    inline bool operator==(const BVHPartitionedSpace& left, const BVHPartitionedSpace& right) {
-        // sometimes the partition function creates spaces with the same objects, which leads to infinite recursion.
-        // We can check if the spaces are equal and change the strategy used to split the AABB.
-        // and if that fails we can use this to just end the recursion.
-        if (left.left.size() != right.left.size() || left.right.size() != right.right.size())
-            return false;
-        for (int i = 0; i < left.left.size(); i++) {
-            if (left.left[i].aabb != right.left[i].aabb)
-                return false;
+    /**
+     * Compact node used by the BVH once it has been built. All the nodes are stored in a single array in depth first order,
+     * so the first (left) child of an interior node is always the next node in the array and only the second child needs an offset.
+     * Leaves point to a contiguous range of the tree's primitive index array.
+     * The bounds are stored as plain arrays to avoid the padding (and copying) of a full AABB object.
+     */
+    struct alignas(64) BVHFlatNode {
+        PRECISION_TYPE min[3];
+        PRECISION_TYPE max[3];
+        // for leaves this is the first index into the primitive index array, for interior nodes it is the index of the right child
+        uint32_t offset;
+        // number of primitives in this leaf, 0 for interior nodes
+        uint32_t count;
+        // axis which best separates the two children. Used to decide which child is closer to the ray
+        uint32_t axis;
+        
+        [[nodiscard]] inline bool isLeaf() const { return count > 0; }
+        
+        [[nodiscard]] inline AABB getAABB() const { return {min[0], min[1], min[2], max[0], max[1], max[2]}; }
+        
+        inline void setAABB(const AABB& aabb) {
+            auto aabbMin = aabb.getMin();
+            auto aabbMax = aabb.getMax();
+            min[0] = aabbMin.x(), min[1] = aabbMin.y(), min[2] = aabbMin.z();
+            max[0] = aabbMax.x(), max[1] = aabbMax.y(), max[2] = aabbMax.z();
+        }
+
+        /**
+         * Slab test against the node's bounds. Same algorithm as AABB::simpleSlabRayAABBMethod but works directly on the node's memory.
+         */
+        [[nodiscard]] inline AABBHitData intersects(const Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax) const {
+            const auto start = ray.getStartingPoint();
+            const auto inverse = ray.getInverseDirection();
+            PRECISION_TYPE origin[3] = {start.x(), start.y(), start.z()};
+            PRECISION_TYPE inv[3] = {inverse.x(), inverse.y(), inverse.z()};
+            for (int i = 0; i < 3; i++) {
+                PRECISION_TYPE t1 = (min[i] - origin[i]) * inv[i];
+                PRECISION_TYPE t2 = (max[i] - origin[i]) * inv[i];
+                tmin = std::max(tmin, std::min(t1, t2));
+                tmax = std::min(tmax, std::max(t1, t2));
+            }
+            tmin = std::max(tmin, (PRECISION_TYPE) 0.0);
+            // has to include equality, the bounds of an axis aligned triangle have no thickness and the ray enters and leaves at the same t
+            return {tmax >= tmin, tmin, tmax};
         }
-        for (int i = 0; i < left.right.size(); i++) {
-            if (left.right[i].aabb != right.right[i].aabb)
-                return false;
+    };
+    
+    // nodes should always fit inside a single cache line
+    static_assert(sizeof(BVHFlatNode) <= 64);
+    
+    // number of children in a BVH4Node. One AVX2 register holds a single coordinate of all four children.
+    constexpr int BVH4_WIDTH = 4;
+    
+    /**
+     * The parts of the ray the BVH4 slab test needs, split into separate coordinates once per ray instead of once per node.
+     * The sign of the direction is used to pick which side of each box the ray enters from.
+     */
+    struct BVH4Ray {
+        PRECISION_TYPE origin[3]{};
+        PRECISION_TYPE inverse[3]{};
+        int sign[3]{};
+        
+        explicit BVH4Ray(const Ray& ray) {
+            const auto start = ray.getStartingPoint();
+            const auto inverseDirection = ray.getInverseDirection();
+            origin[0] = start.x(), origin[1] = start.y(), origin[2] = start.z();
+            inverse[0] = inverseDirection.x(), inverse[1] = inverseDirection.y(), inverse[2] = inverseDirection.z();
+            for (int i = 0; i < 3; i++)
+                sign[i] = std::signbit(inverse[i]) ? 1 : 0;
         }
-        return true;
-    }
+    };
     
+    /**
+     * Node of the wide BVH. The bounds of the children are stored as structure of arrays so the same coordinate of every child
+     * can be loaded into one register. Children are either other nodes or leaves, which reference a range of the primitive index array
+     * of the binary tree they were collapsed from.
+     */
+    struct alignas(64) BVH4Node {
+        // [0] is the min and [1] the max of each child's bounds, stored [side][axis][child].
+        // Empty slots have their min and max swapped at infinity, so the slab test never hits them.
+        PRECISION_TYPE bounds[2][3][BVH4_WIDTH];
+        // index of the child node, or the offset into the primitive index array if the child is a leaf
+        uint32_t child[BVH4_WIDTH];
+        // number of primitives in the child if it is a leaf, 0 if it is a node or the slot is empty
+        uint32_t count[BVH4_WIDTH];
+        
+        inline void setChildAABB(int slot, const AABB& aabb) {
+            auto aabbMin = aabb.getMin();
+            auto aabbMax = aabb.getMax();
+            bounds[0][0][slot] = aabbMin.x(), bounds[0][1][slot] = aabbMin.y(), bounds[0][2][slot] = aabbMin.z();
+            bounds[1][0][slot] = aabbMax.x(), bounds[1][1][slot] = aabbMax.y(), bounds[1][2][slot] = aabbMax.z();
+        }
+        
+        [[nodiscard]] inline AABB getChildAABB(int slot) const {
+            return {bounds[0][0][slot], bounds[0][1][slot], bounds[0][2][slot], bounds[1][0][slot], bounds[1][1][slot], bounds[1][2][slot]};
+        }
+        
+        /**
+         * Slab test against every child at once, using the kernel SIMD picked for the CPU. Gives the same results as BVHFlatNode::intersects for each child.
+         * @param tEntry filled with the distance at which the ray enters each child, only valid for the children which were hit
+         * @return mask with bit i set if child i was hit
+         */
+        [[nodiscard]] inline int intersects(const BVH4Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax, PRECISION_TYPE tEntry[BVH4_WIDTH]) const {
+            return SIMD::kernels().boxes4(*this, ray, tmin, tmax, tEntry);
+        }
+    };
+    
+    /**
+     * Counts the work done by a traversal when passed to traverseClosestHit, used by the BVH statistics report.
+     */
+    struct BVHTraversalStats {
+        // nodes whose children were tested against the ray, plus the leaves reached
+        uint32_t nodesVisited = 0;
+        // primitives the intersect function was called for
+        uint32_t primitivesTested = 0;
+        
+        inline void visitNode() { nodesVisited++; }
+        
+        inline void testPrimitive() { primitivesTested++; }
+        
+        inline void testPrimitives(uint32_t count) { primitivesTested += count; }
+    };
+    
+    /**
+     * Used by traverseClosestHit when no statistics are wanted, the empty functions compile away.
+     */
+    struct BVHNoStats {
+        inline void visitNode() {}
+        
+        inline void testPrimitive() {}
+        
+        inline void testPrimitives(uint32_t) {}
+    };
+    
+    /**
+     * Entry of the BVH4 traversal stack, either a node or a leaf waiting to be visited.
+     */
+    struct BVH4StackEntry {
+        uint32_t child;
+        // 0 for nodes, the number of primitives for leaves
+        uint32_t count;
+        PRECISION_TYPE tEntry;
+    };
+    
+    /**
+     * Four wide BVH created by collapsing a binary BVH. Every node holds up to four children which are tested at once,
+     * so a ray visits about half as many nodes and the box tests are done with SIMD instead of one box at a time.
+     * Leaves are the leaves of the binary tree, so the primitives are referenced through the binary tree's index array.
+     * Small subtrees can be merged into a single leaf, for primitives which are cheaper to test together than to walk down to.
+     */
+    class BVH4 {
+        private:
+            std::vector<BVH4Node> nodeStorage;
+            // either the storage or nodes loaded from the BVH cache
+            std::span<BVH4Node> nodes;
+            
+            /**
+             * Range of the primitive index array referenced by the leaves under a binary node.
+             */
+            struct SubtreeRange {
+                uint32_t first = 0, count = 0;
+                // false if other leaves reference slots in between, in which case the subtree can't become one leaf
+                bool contiguous = false;
+            };
+
+            /**
+             * Creates the wide node for the binary node and recursively its children.
+             * @return the index of the wide node
+             */
+            uint32_t collapse(std::span<const BVHFlatNode> binaryNodes, std::span<const SubtreeRange> ranges, uint32_t mergeSize, uint32_t index);
+        
+        public:
+            /**
+             * Replaces the tree with one collapsed from the binary nodes. Interior nodes of the binary tree are pulled up into
+             * their parent, largest surface area first, until the parent has four children.
+             * @param mergeSize subtrees referencing this many primitives or fewer become a single leaf, 0 keeps the leaves of the binary tree
+             */
+            void build(std::span<const BVHFlatNode> binaryNodes, uint32_t mergeSize = 0);
+            
+            /**
+             * Uses nodes which were already collapsed, without copying them. The memory must outlive the tree.
+             */
+            void useNodes(std::span<BVH4Node> wideNodes) {
+                nodeStorage.clear();
+                nodes = wideNodes;
+            }
+            
+            [[nodiscard]] std::span<const BVH4Node> getNodes() const { return nodes; }
+
+            [[nodiscard]] size_t getMemoryUsage() const { return nodes.size() * sizeof(BVH4Node); }
+            
+            /**
+             * Same as FlatBVH::traverseClosestHit except the intersect function is called with the slot in the primitive index array
+             * instead of the primitive itself.
+             */
+            template<typename IntersectFunc, typename Stats = BVHNoStats>
+            inline void traverseClosestHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE& max, IntersectFunc&& intersect, Stats&& stats = {}) const {
+                traverseClosestHitLeaves(
+                        ray, min, max, [&](uint32_t first, uint32_t count, PRECISION_TYPE& tMax) {
+                            for (uint32_t i = first; i < first + count; i++)
+                                intersect(i, tMax);
+                        }, stats
+                );
+            }
+            
+            /**
+             * Same as FlatBVH::traverseClosestHitLeaves.
+             */
+            template<typename IntersectLeafFunc, typename Stats = BVHNoStats>
+            inline void traverseClosestHitLeaves(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE& max, IntersectLeafFunc&& intersectLeaf,
+                                                 Stats&& stats = {}) const {
+                if (nodes.empty())
+                    return;
+                
+                BVH4Ray wideRay{ray};
+                // every node visited replaces itself with at most four children
+                BVH4StackEntry stack[(BVH4_WIDTH - 1) * BVH_MAX_DEPTH + 1];
+                int stackSize = 0;
+                stack[stackSize++] = {0, 0, min};
+                
+                while (stackSize > 0) {
+                    auto entry = stack[--stackSize];
+                    if (entry.tEntry > max)
+                        continue;
+                    stats.visitNode();
+                    if (entry.count > 0) {
+                        stats.testPrimitives(entry.count);
+                        intersectLeaf(entry.child, entry.count, max);
+                        continue;
+                    }
+                    const auto& node = nodes[entry.child];
+                    alignas(32) PRECISION_TYPE tEntry[BVH4_WIDTH];
+                    int mask = node.intersects(wideRay, min, max, tEntry);
+                    if (mask == 0)
+                        continue;
+                    // push the hit children farthest first so the closest is visited next.
+                    // with at most four children an insertion sort is the fastest way to order them
+                    int hits[BVH4_WIDTH];
+                    int hitCount = 0;
+                    for (int c = 0; c < BVH4_WIDTH; c++) {
+                        if (!(mask & (1 << c)))
+                            continue;
+                        int pos = hitCount++;
+                        while (pos > 0 && tEntry[hits[pos - 1]] < tEntry[c]) {
+                            hits[pos] = hits[pos - 1];
+                            pos--;
+                        }
+                        hits[pos] = c;
+                    }
+                    for (int i = 0; i < hitCount; i++)
+                        stack[stackSize++] = {node.child[hits[i]], node.count[hits[i]], tEntry[hits[i]]};
+                }
+            }
+    };
+
+    /**
+     * Node used while building the BVH. Once the tree is built it is flattened into BVHFlatNodes and these are deleted.
+     * The builders reorder the primitive index array in place, so a leaf is just the range of the array it owns.
+     */
     struct BVHNode {
         public:
-            struct BVHHitData {
-                BVHNode* ptr{};
-                AABBHitData data{};
-                bool hit = false;
-            };
-            std::vector<BVHObject> objs;
             AABB aabb;
-            BVHNode* left;
-            BVHNode* right;
-            // debug ints.
-            int index, hit = 0;
+            BVHNode* left = nullptr;
+            BVHNode* right = nullptr;
+            // range of the index array held by this node if it is a leaf
+            size_t begin = 0, end = 0;
+            // the SBVH builder can put an object in more than one leaf, so its leaves hold their objects until they are copied into the index array
+            std::vector<uint32_t> references;
             
-            BVHNode(std::vector<BVHObject> objs, AABB aabb, BVHNode* left, BVHNode* right): objs(std::move(objs)), aabb(std::move(aabb)),
-                                                                                            left(left), right(right) {
-#ifdef COMPILE_GUI
-                index = count++;
-#endif
-            }
+            BVHNode(AABB aabb, size_t begin, size_t end): aabb(std::move(aabb)), begin(begin), end(end) {}
+            
+            BVHNode(AABB aabb, std::vector<uint32_t> references): aabb(std::move(aabb)), references(std::move(references)) {}
+
+            BVHNode(AABB aabb, BVHNode* left, BVHNode* right): aabb(std::move(aabb)), left(left), right(right) {}
             
             ~BVHNode() {
                 delete (left);
@@ -83,34 +368,362 @@ namespace Raytracing {
             }
     };
     
-    class BVHTree {
+    // everything the builders share while creating a tree, only exists during FlatBVH::build
+    struct BVHBuildState;
+    
+    /**
+     * The arrays of a tree stored in the BVH cache file, pointing into the mapped file.
+     */
+    struct BVHCachedTree {
+        std::span<BVHFlatNode> nodes;
+        std::span<uint32_t> primitiveIndices;
+        // empty if the tree was cached with a width of 2
+        std::span<BVH4Node> wideNodes;
+        PRECISION_TYPE sahCost = 0;
+    };
+
+    /**
+     * Node waiting to be visited during traversal, along with the distance at which the ray enters it.
+     */
+    struct BVHStackEntry {
+        uint32_t index;
+        PRECISION_TYPE tEntry;
+    };
+    
+    /**
+     * Shape of a built tree, see FlatBVH::computeStatistics
+     */
+    struct BVHStatistics {
+        size_t nodeCount = 0;
+        size_t leafCount = 0;
+        // nodes in the four wide tree, 0 if the tree is traced as a binary tree
+        size_t wideNodeCount = 0;
+        // number of nodes at each depth, the root is at depth 0
+        std::vector<size_t> depthHistogram;
+        // number of leaves holding each number of primitives
+        std::vector<size_t> leafSizeHistogram;
+        PRECISION_TYPE sahCost = 0;
+        size_t memoryUsage = 0;
+        // surface area shared by the two children of every interior node, and the surface area of those interior nodes
+        PRECISION_TYPE overlapArea = 0;
+        PRECISION_TYPE interiorArea = 0;
+        
+        /**
+         * @return how much siblings overlap, relative to the size of their parents. 0 if no siblings overlap,
+         * 1 if every node's children both cover the whole parent.
+         */
+        [[nodiscard]] PRECISION_TYPE getOverlapRatio() const { return interiorArea > 0 ? overlapArea / interiorArea : 0; }
+    };
+    
+    /**
+     * The part of the BVH which doesn't care what is stored in it. Builds the flat node array from the bounds of the primitives
+     * and walks it for the closest hit. Used by both the world BVH (top level, over objects) and the BVH of each mesh (bottom level, over triangles)
+     */
+    class FlatBVH {
         private:
-            BVHNode* root = nullptr;
+            /**
+             * Internal function which builds the tree by splitting the space in half, the original algorithm used by the BVH.
+             * Indices between begin and end are reordered in place as the tree is created.
+             */
+            BVHNode* addObjectsMidpoint(BVHBuildState& state, size_t begin, size_t end, int depth);
+            
+            /**
+             * Internal function which builds the tree using the binned surface area heuristic. Indices between begin and end
+             * are reordered in place as the tree is created.
+             */
+            BVHNode* addObjectsSAH(BVHBuildState& state, size_t begin, size_t end, int depth);
+            
+            /**
+             * Internal function which builds the tree from objects sorted by their morton code. Nodes are split where the highest
+             * bit of the codes changes, found with a binary search, so no objects are moved while building.
+             */
+            BVHNode* addObjectsLBVH(BVHBuildState& state, size_t begin, size_t end, int depth);
+            
+            /**
+             * Internal function which builds the tree using the SAH, also trying splits by a plane which put the objects crossing it
+             * in both children. The references are the parts of the objects inside the node, their index is the position of the object in the build state.
+             * @param splitBudget number of references this node and its children are allowed to add by splitting objects
+             */
+            BVHNode* addObjectsSBVH(BVHBuildState& state, std::vector<BVHObject>& references, size_t splitBudget, int depth);
+
+            /**
+             * Calls the builder selected in the options for the range of indices
+             */
+            BVHNode* addObjects(BVHBuildState& state, size_t begin, size_t end, int depth);
+            
+            /**
+             * Builds the two children of a node. Large ranges are built as parallel tasks when OpenMP is enabled.
+             * The ranges don't overlap, so the tree is the same no matter how many threads are used.
+             */
+            std::pair<BVHNode*, BVHNode*> addChildren(BVHBuildState& state, size_t begin, size_t mid, size_t end, int depth);
+            
+            /**
+             * Converts the tree created by the builders into the flat array, depth first.
+             * @return the index of the node in the flattened array
+             */
+            uint32_t flatten(const BVHNode* node);
+    
+        protected:
+            std::vector<BVHFlatNode> nodeStorage;
+            std::vector<uint32_t> primitiveIndexStorage;
+            // the tree in depth first order. nodes[0] is the root. Points at the storage or at a mapped BVH cache file
+            std::span<BVHFlatNode> nodes;
+            // leaves reference ranges of this array, which in turn references the primitives of the derived tree
+            std::span<uint32_t> primitiveIndices;
+            // keeps the BVH cache file mapped while the tree uses its memory
+            std::shared_ptr<void> cacheMapping;
+            BVHBuildOptions options;
+            PRECISION_TYPE sahCost = 0;
+            // SAH cost after the last refit, starts as the cost of the built tree
+            PRECISION_TYPE refitSAHCost = 0;
+            // milliseconds spent in build()
+            double buildTime = 0;
+            // the tree collapsed into four wide nodes, only created if the width in the options is 4
+            BVH4 wideTree;
+            // subtrees of the binary tree with this many primitives or fewer become a single leaf of the wide tree, see BVH4::build
+            uint32_t wideLeafSize = 0;
+    
+            explicit FlatBVH(const BVHBuildOptions& buildOptions): options(buildOptions) {
+                if (options.width != 2 && options.width != BVH4_WIDTH)
+                    throw std::runtime_error("BVH width must be either 2 or 4, not " + std::to_string(options.width));
+            }
+            
+            /**
+             * Collapses the binary nodes into the wide tree, has to be called whenever the binary nodes change.
+             */
+            void buildWideTree();
+            
+            /**
+             * Uses a tree loaded from the BVH cache instead of building one. The arrays are used as they are,
+             * so the mapping has to own the memory they point to.
+             * @param primitiveCount number of primitives the tree should have been built over
+             * @return false if the tree doesn't fit the primitives or references something outside its arrays, in which case it isn't used
+             */
+            bool useCachedTree(const BVHCachedTree& tree, std::shared_ptr<void> mapping, size_t primitiveCount);
+            
+            /**
+             * Forgets the current tree so a new one can be built.
+             */
+            void clear();
+            
+            /**
+             * Splits part of a primitive by an axis aligned plane, used by the SBVH builder. All the tree knows about a primitive
+             * is its bounds so this clips the bounds, trees over primitives with a known shape can clip the shape itself for tighter bounds.
+             * @param primitive index of the primitive in the derived tree
+             * @param bounds the part of the primitive being split, which may already have been clipped by other planes
+             * @return the bounds of the part of the primitive on the low and high side of the plane, both inside bounds
+             */
+            [[nodiscard]] virtual std::pair<AABB, AABB> splitPrimitive(uint32_t primitive, const AABB& bounds, int axis, PRECISION_TYPE position) const;
+
+            /**
+             * Builds the tree with the configured builder. The index of every object must refer to the primitive it was made from.
+             * @param objs bounds of the primitives, reordered by the builder
+             */
+            void build(std::vector<BVHObject>& objs);
+    
+        public:
+            FlatBVH(const FlatBVH& bvh) = delete;
+    
+            FlatBVH(const FlatBVH&& bvh) = delete;
+    
+            /**
+             * @return the flattened nodes of the tree, the first node being the root. Empty if there was nothing to build over.
+             */
+            [[nodiscard]] std::span<const BVHFlatNode> getNodes() const { return nodes; }
+            
+            /**
+             * @return the array the leaves reference, each entry is the index of a primitive in the derived tree
+             */
+            [[nodiscard]] std::span<const uint32_t> getPrimitiveIndices() const { return primitiveIndices; }
+            
+            [[nodiscard]] const BVHBuildOptions& getOptions() const { return options; }
+
+            /**
+             * @return the bounds of the primitive referenced by the leaf slot i, where i is in the range [offset, offset + count) of a leaf node
+             */
+            [[nodiscard]] virtual AABB getPrimitiveAABB(uint32_t i) const = 0;
+    
+            /**
+             * @return the number of bytes used by the nodes and primitive references
+             */
+            [[nodiscard]] virtual size_t getMemoryUsage() const {
+                return nodes.size() * sizeof(BVHFlatNode) + primitiveIndices.size() * sizeof(uint32_t) + wideTree.getMemoryUsage();
+            }
+            
+            /**
+             * @return the four wide version of the tree, empty unless the tree was built with a width of 4
+             */
+            [[nodiscard]] const BVH4& getWideTree() const { return wideTree; }
+
+            /**
+             * The SAH cost is the expected cost of tracing a random ray through the tree, using the costs in the build options.
+             * Lower is better, and it can be used to compare the quality of trees made by different builders.
+             * @return the SAH cost of the tree as it was built
+             */
+            [[nodiscard]] PRECISION_TYPE getSAHCost() const { return sahCost; }
             
             /**
-             * partition the objects to each AABB based on if they intersect with or not. if intersects both left will be preferred.
+             * @return the SAH cost of the tree after the last refit, which grows as the primitives move away from where they were built
              */
-            static BVHPartitionedSpace partition(const std::pair<AABB, AABB>& aabbs, const std::vector<BVHObject>& objs);
+            [[nodiscard]] PRECISION_TYPE getRefitSAHCost() const { return refitSAHCost; }
             
             /**
-             * Internal function to add objects to the correct BVH node. Creates the entire tree structure recursively. DO NOT USE.
+             * @return how long it took to build the tree in milliseconds
              */
-            BVHNode* addObjectsRecursively(const std::vector<BVHObject>& objects, const BVHPartitionedSpace& prevSpace);
+            [[nodiscard]] double getBuildTime() const { return buildTime; }
             
+            /**
+             * Recomputes the bounds of every node bottom up using the current bounds of the primitives. The structure of the tree
+             * isn't changed so this is much cheaper than a rebuild, but the tree gets worse the further the primitives move.
+             * Leaves without any primitives left collapse to a point so they no longer grow their parents.
+             * Leaves of an SBVH get the bounds of their whole primitives, losing the tighter bounds the spatial splits gave them.
+             * Must not be called while rays are being traced through the tree.
+             */
+            void refit();
+
+            /**
+             * Goes through the nodes computing the expected cost of a ray using the surface area heuristic.
+             * @param traversalCost cost of testing a node
+             * @param intersectionCost cost of testing an object in a leaf
+             */
+            [[nodiscard]] PRECISION_TYPE computeSAHCost(PRECISION_TYPE traversalCost, PRECISION_TYPE intersectionCost) const;
+            
+            /**
+             * Walks the tree collecting its size, depth and leaf sizes along with how much the children of each node overlap.
+             */
+            [[nodiscard]] BVHStatistics computeStatistics() const;
+
+            /**
+             * Walks the tree looking for the closest hit. Children are visited front to back and nodes which start behind max are skipped.
+             * Doesn't allocate. This is a template so the primitive test gets inlined into the loop.
+             * @param ray ray to check intersection with
+             * @param min min of the ray to check
+             * @param max max of the ray to check, shrunk by the intersect function every time a primitive is hit.
+             * @param intersect called as intersect(primitiveIndex, max) for every primitive in a leaf the ray reaches.
+             * It should test the primitive between min and max and set max to the distance of the hit if there was one.
+             * @param stats a BVHTraversalStats to count the nodes and primitives visited, nothing is counted by default
+             */
+            template<typename IntersectFunc, typename Stats = BVHNoStats>
+            inline void traverseClosestHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE& max, IntersectFunc&& intersect, Stats&& stats = {}) const {
+                traverseClosestHitLeaves(
+                        ray, min, max, [&](uint32_t first, uint32_t count, PRECISION_TYPE& tMax) {
+                            for (uint32_t i = first; i < first + count; i++)
+                                intersect(primitiveIndices[i], tMax);
+                        }, stats
+                );
+            }
+            
+            /**
+             * Same as traverseClosestHit, except every leaf the ray reaches is handed over as a whole so its primitives can be tested together.
+             * @param intersectLeaf called as intersectLeaf(first, count, max) where [first, first + count) is the range of the primitive
+             * index array held by the leaf. Same as the intersect function of traverseClosestHit it should shrink max to the closest hit.
+             */
+            template<typename IntersectLeafFunc, typename Stats = BVHNoStats>
+            inline void traverseClosestHitLeaves(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE& max, IntersectLeafFunc&& intersectLeaf,
+                                                 Stats&& stats = {}) const {
+                if (options.width == BVH4_WIDTH) {
+                    wideTree.traverseClosestHitLeaves(ray, min, max, intersectLeaf, stats);
+                    return;
+                }
+                if (nodes.empty())
+                    return;
+
+                auto rootHit = nodes[0].intersects(ray, min, max);
+                if (!rootHit.hit)
+                    return;
+    
+                // the builders never create a tree deeper than BVH_MAX_DEPTH, and we push at most one node per level.
+                BVHStackEntry stack[BVH_MAX_DEPTH + 1];
+                int stackSize = 0;
+                stack[stackSize++] = {0, rootHit.tMin};
+    
+                while (stackSize > 0) {
+                    auto entry = stack[--stackSize];
+                    // something closer was found after this node was pushed, everything inside it is behind that hit.
+                    if (entry.tEntry > max)
+                        continue;
+                    uint32_t index = entry.index;
+                    // walk down the tree always taking the closer child and saving the farther one for later
+                    while (!nodes[index].isLeaf()) {
+                        stats.visitNode();
+                        uint32_t leftIndex = index + 1;
+                        uint32_t rightIndex = nodes[index].offset;
+                        auto leftHit = nodes[leftIndex].intersects(ray, min, max);
+                        auto rightHit = nodes[rightIndex].intersects(ray, min, max);
+                        if (leftHit.hit && rightHit.hit) {
+                            if (leftHit.tMin <= rightHit.tMin) {
+                                stack[stackSize++] = {rightIndex, rightHit.tMin};
+                                index = leftIndex;
+                            } else {
+                                stack[stackSize++] = {leftIndex, leftHit.tMin};
+                                index = rightIndex;
+                            }
+                        } else if (leftHit.hit)
+                            index = leftIndex;
+                        else if (rightHit.hit)
+                            index = rightIndex;
+                        else
+                            break;
+                    }
+                    const auto& node = nodes[index];
+                    if (!node.isLeaf())
+                        continue;
+                    stats.visitNode();
+                    stats.testPrimitives(node.count);
+                    intersectLeaf(node.offset, node.count, max);
+                }
+            }
+    
+            virtual ~FlatBVH() = default;
+    };
+    
+    /**
+     * The top level of the acceleration structure. Built over the objects in the world, where meshes are a single object
+     * which have their own TriangleBVHTree.
+     */
+    class BVHTree : public FlatBVH {
+        private:
+            // all the objects which are stored in the tree. Removed objects are left as nullptr until the next rebuild
+            std::vector<Object*> primitives;
+            // type of the object at the same index, read by traversal instead of asking the object
+            std::vector<ObjectType> primitiveTypes;
+            // objects added since the tree was built, they are tested by every ray until the next rebuild puts them in the tree
+            std::vector<Object*> insertedObjects;
+            size_t removedCount = 0;
+    
             /**
              * adds all the objects provided to the BVH, skipping objects which don't have proper AABBs
+             * @param cachedTree tree loaded from the BVH cache to use instead of building one, or nullptr to build the tree
              */
-            void addObjects(const std::vector<Object*>& objects);
-        
+            void addObjects(const std::vector<Object*>& objects, const BVHCachedTree* cachedTree = nullptr, std::shared_ptr<void> mapping = {});
+
+            /**
+             * Builds a new tree over the objects currently in the tree, including the inserted ones and excluding the removed ones.
+             */
+            void rebuild();
+
         public:
+            // objects without bounds, such as infinite planes, can't be put in the tree and are tested by every ray
             std::vector<Object*> noAABBObjects;
-            
+    
             /**
              * creates the BVH using the provided objects, which should come from the world.
              * @param objectsInWorld objects from the world to create the BVH which
+             * @param buildOptions which builder to use and the parameters to build with
              */
-            explicit BVHTree(const std::vector<Object*>& objectsInWorld) {
-                addObjects(objectsInWorld);
+            explicit BVHTree(const std::vector<Object*>& objectsInWorld, const BVHBuildOptions& buildOptions = {}):
+                    BVHTree(objectsInWorld, buildOptions, nullptr, {}) {}
+            
+            /**
+             * creates the BVH using a tree loaded from the BVH cache. If the cached tree doesn't match the objects it is built instead.
+             * @param cachedTree tree from the cache, which must have been built over the same objects with the same options
+             * @param mapping owner of the memory used by the cached tree
+             */
+            BVHTree(
+                    const std::vector<Object*>& objectsInWorld, const BVHBuildOptions& buildOptions, const BVHCachedTree* cachedTree,
+                    std::shared_ptr<void> mapping
+            ): FlatBVH(buildOptions) {
+                addObjects(objectsInWorld, cachedTree, std::move(mapping));
 #ifdef COMPILE_GUI
                 if (aabbVAO == nullptr) {
                     // create a basic cube for displaying the AABBs when debugging
@@ -119,114 +732,136 @@ namespace Raytracing {
                 }
 #endif
             }
+    
+            /**
+             * @return the object referenced by the leaf slot i, where i is in the range [offset, offset + count) of a leaf node.
+             * nullptr if the object has been removed since the tree was built.
+             */
+            [[nodiscard]] inline Object* getPrimitive(uint32_t i) const { return primitives[primitiveIndices[i]]; }
+            
+            /**
+             * @return the object with the primitive index passed to the intersect function of traverseClosestHit, nullptr if it was removed
+             */
+            [[nodiscard]] inline Object* getObject(uint32_t index) const { return primitives[index]; }
+            
+            /**
+             * @return objects inserted since the tree was built, which aren't in the tree yet
+             */
+            [[nodiscard]] const std::vector<Object*>& getInsertedObjects() const { return insertedObjects; }
+
+            [[nodiscard]] AABB getPrimitiveAABB(uint32_t i) const override;
+    
+            [[nodiscard]] size_t getMemoryUsage() const override {
+                return FlatBVH::getMemoryUsage() + (primitives.size() + insertedObjects.size()) * sizeof(Object*) + primitiveTypes.size() * sizeof(ObjectType);
+            }
+            
+            /**
+             * Adds an object to an already built tree. The object isn't placed in the tree until the next rebuild,
+             * until then it is tested by every ray, which is counted by getDegradation().
+             * None of the update functions may be called while rays are being traced.
+             */
+            void insert(Object* object);
             
             /**
-             * @return the root node of the BVH tree
+             * Removes an object from the tree. The object is not deleted.
+             * @return true if the object was found in the tree
              */
-            BVHNode* getRoot() { return root; }
+            bool remove(Object* object);
             
             /**
+             * Compares the cost of the tree in its current state against the cost it had when it was built.
+             * The current cost is the cost of the last refit plus the cost of testing every inserted object.
+             * @return 1 for a tree which is as good as when it was built, 2 for a tree which is expected to be twice as slow, etc
+             */
+            [[nodiscard]] PRECISION_TYPE getDegradation() const;
+            
+            /**
+             * Updates the tree after objects have been moved, inserted or removed. The tree is refit and if the refit tree
+             * has degraded past the rebuild threshold in the build options it is rebuilt.
+             * @return true if the tree was rebuilt
+             */
+            bool update();
+
+            /**
+             * Finds the closest object hit by the ray. The max t of the ray is shrunk every time an object is hit,
+             * so nodes behind the closest hit are skipped.
              * @param ray ray to check intersection with
              * @param min min of the ray to check
              * @param max max of the ray to check
-             * @return a list of objects which the ray might intersect with between min and max
+             * @return the hit record of the closest object between min and max, which has no object if nothing was hit
              */
-            std::vector<BVHObject> rayAnyHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max);
-            
-            ~BVHTree() {
-                delete (root);
-            }
+            [[nodiscard]] HitRecord rayClosestHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
     };
     
     /**
-     * Everything below this line is unused due to inconsistencies in performance. Some parts of the code may contain references to this
-     * however the actual algorithm doesn't take into account BVHs at the object level.
+     * The bottom level of the acceleration structure, built once per mesh over its triangles.
+     * The triangles are stored relative to the mesh, the bounds in the tree are in world space.
      */
-    
-    struct TriangleBVHObject {
-        Vec4 position;
-        std::shared_ptr<Triangle> tri;
-        AABB aabb;
-    };
-    
-    struct TriangleBVHPartitionedSpace {
-        std::vector<TriangleBVHObject> left;
-        std::vector<TriangleBVHObject> right;
-    };
-    
-    inline bool operator==(const TriangleBVHPartitionedSpace& left, const TriangleBVHPartitionedSpace& right) {
-        if (left.left.size() != right.left.size() || left.right.size() != right.right.size())
-            return false;
-        for (int i = 0; i < left.left.size(); i++) {
-            if (!(left.left[i].aabb == right.left[i].aabb))
-                return false;
-        }
-        for (int i = 0; i < left.right.size(); i++) {
-            if (!(left.right[i].aabb == right.right[i].aabb))
-                return false;
-        }
-        return true;
-    }
-    
-    struct TriangleBVHNode {
-        struct BVHHitData {
-            TriangleBVHNode* ptr{};
-            AABBHitData data{};
-            bool hit = false;
-        };
-        std::vector<TriangleBVHObject> objs;
-        AABB aabb;
-        TriangleBVHNode* left;
-        TriangleBVHNode* right;
-        // debug ints.
-        int index, hit = 0;
-        
-        BVHHitData firstHitRayIntersectTraversal(const Ray& r, PRECISION_TYPE min, PRECISION_TYPE max);
-        
-        TriangleBVHNode(std::vector<TriangleBVHObject> objs, AABB aabb, TriangleBVHNode* left, TriangleBVHNode* right)
-                : objs(std::move(objs)), aabb(std::move(aabb)), left(left), right(right) {
-#ifdef COMPILE_GUI
-            index = count++;
-#endif
-        }
-        
-        ~TriangleBVHNode() {
-            delete (left);
-            delete (right);
-        }
-    };
-    
-    class TriangleBVHTree {
+    class TriangleBVHTree : public FlatBVH {
         private:
-            TriangleBVHNode* root = nullptr;
-            
-            static TriangleBVHPartitionedSpace partition(const std::pair<AABB, AABB>& aabbs, const std::vector<TriangleBVHObject>& objs);
+            // owned by the MeshAsset the tree belongs to
+            const IndexedMesh& mesh;
+            // the triangles of every leaf packed into blocks in the order of the primitive index array, each leaf starting a new block
+            std::vector<TriangleBlock> blocks;
+            // first block of the leaf starting at each slot of the primitive index array, only set for the slots leaves start at
+            std::vector<uint32_t> leafBlocks;
             
-            TriangleBVHNode* addObjectsRecursively(const std::vector<TriangleBVHObject>& objects, const TriangleBVHPartitionedSpace& prevSpace);
-        
+            /**
+             * Packs the triangles of the leaves into blocks, has to be redone whenever the tree changes.
+             */
+            void buildBlocks();
         public:
-            int index;
-            
-            explicit TriangleBVHTree(const std::vector<TriangleBVHObject>& objectsInWorld) {
-                addObjects(objectsInWorld);
-#ifdef COMPILE_GUI
-                auto aabbVertexData = Shapes::cubeVertexBuilder{};
-                if (aabbVAO == nullptr)
-                    aabbVAO = std::make_shared<VAO>(aabbVertexData.cubeVerticesRaw, aabbVertexData.cubeUVs);
-                index = count++;
-#endif
+            /**
+             * @param mesh the mesh to build over, the index of a triangle in the mesh is what the traversal reports. The tree is built
+             * in the mesh's own space, rays have to be moved into it. The mesh has to outlive the tree
+             * @param buildOptions which builder to use and the parameters to build with
+             * @param cachedTree tree loaded from the BVH cache to use instead of building one, or nullptr to build the tree
+             * @param mapping owner of the memory used by the cached tree
+             */
+            TriangleBVHTree(
+                    const IndexedMesh& mesh, const BVHBuildOptions& buildOptions = {},
+                    const BVHCachedTree* cachedTree = nullptr, std::shared_ptr<void> mapping = {}
+            );
+
+            [[nodiscard]] AABB getPrimitiveAABB(uint32_t i) const override {
+                return mesh.getTriangleAABB(primitiveIndices[i]);
             }
             
-            void addObjects(const std::vector<TriangleBVHObject>& objects);
-            
-            TriangleBVHNode* getRoot() { return root; }
-            
-            std::vector<TriangleBVHObject> rayFirstHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max);
+            /**
+             * Clips the triangle instead of its bounds, so a triangle crossing the plane at an angle is only as big as the part of it on each side.
+             */
+            [[nodiscard]] std::pair<AABB, AABB> splitPrimitive(uint32_t primitive, const AABB& bounds, int axis, PRECISION_TYPE position) const override;
+
+            [[nodiscard]] size_t getMemoryUsage() const override {
+                return FlatBVH::getMemoryUsage() + blocks.size() * sizeof(TriangleBlock) +
+                       leafBlocks.size() * sizeof(uint32_t);
+            }
             
-            std::vector<TriangleBVHObject> rayAnyHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max);
+            [[nodiscard]] std::span<const TriangleBlock> getBlocks() const { return blocks; }
             
-            ~TriangleBVHTree() {
-                delete (root);
+            /**
+             * Same as traverseClosestHit, except the triangles of each leaf are first tested eight at a time by TriangleBlock::intersects.
+             * The intersect function is only called for the triangles that test couldn't rule out, in the same order traverseClosestHit would.
+             * Stats count every triangle of the leaves reached.
+             */
+            template<typename IntersectFunc, typename Stats = BVHNoStats>
+            inline void traverseClosestHitBlocks(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE& max, IntersectFunc&& intersect, Stats&& stats = {}) const {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                traverseClosestHitLeaves(
+                        ray, min, max, [&](uint32_t first, uint32_t count, PRECISION_TYPE& tMax) {
+                            uint32_t begin = leafBlocks[first];
+                            uint32_t end = begin + (count + TRIANGLE_BLOCK_WIDTH - 1) / TRIANGLE_BLOCK_WIDTH;
+                            for (uint32_t b = begin; b < end; b++) {
+                                const auto& block = blocks[b];
+                                int mask = block.intersects(block.makeRay(origin, direction, min, tMax));
+                                while (mask != 0) {
+                                    intersect(block.triangle[__builtin_ctz(mask)], tMax);
+                                    mask &= mask - 1;
+                                }
+                            }
+                        }, stats
+                );
             }
     };
     
@@ -139,9 +139,20 @@ namespace Raytracing {
              * @return the exact center of the AABB
              */
             [[nodiscard]] inline Vec4 getCenter() const {
-                return {min.x() + (max.x() - min.x()) * 0.5, min.y() + (max.y() - min.y()) * 0.5, min.z() + (max.z() - min.z()) * 0.5};
+                return {min.x() + (max.x() - min.x()) * (PRECISION_TYPE) 0.5, min.y() + (max.y() - min.y()) * (PRECISION_TYPE) 0.5,
+                        min.z() + (max.z() - min.z()) * (PRECISION_TYPE) 0.5};
             }
             
+            /**
+             * @return the surface area of the AABB, used by the BVH surface area heuristic
+             */
+            [[nodiscard]] inline PRECISION_TYPE surfaceArea() const {
+                PRECISION_TYPE dx = max.x() - min.x();
+                PRECISION_TYPE dy = max.y() - min.y();
+                PRECISION_TYPE dz = max.z() - min.z();
+                return 2 * (dx * dy + dy * dz + dz * dx);
+            }
+
             /**
              * @return the longest axis distance from the center point of the AABB
              */
@@ -0,0 +1,140 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_SIMD_H
+#define STEP_3_SIMD_H
+
+#include "engine/util/std.h"
+#include "engine/math/vectors.h"
+
+namespace Raytracing {
+
+    struct BVH4Node;
+    struct BVH4Ray;
+    struct TriangleBlock;
+    struct TriangleBlockRay;
+    class SphereObject;
+
+    /**
+     * Instruction sets the hot kernels are compiled for. Each level includes everything the levels before it can use.
+     */
+    enum class SIMDLevel {
+        SCALAR = 0,
+        // SSE4.2, which every x86-64 CPU from the last decade has and is the baseline the rest of the engine is compiled for
+        SSE42 = 1,
+        // AVX2 with FMA
+        AVX2 = 2,
+        // AVX-512 F, VL, DQ and BW
+        AVX512 = 3
+    };
+
+    // most spheres a single call to the sphere kernel tests, one per double of an AVX-512 register
+    constexpr int SPHERE_BATCH_WIDTH = 8;
+    // width and height of the block of pixels the pixel kernel converts in one call
+    constexpr int PIXEL_BLOCK_SIZE = 8;
+
+    /**
+     * Spheres gathered from the objects they belong to so one ray can be tested against all of them at once.
+     * Always stored in double, the sphere test needs it even in a float build.
+     */
+    struct alignas(64) SphereBatch {
+        double centerX[SPHERE_BATCH_WIDTH];
+        double centerY[SPHERE_BATCH_WIDTH];
+        double centerZ[SPHERE_BATCH_WIDTH];
+        double radius[SPHERE_BATCH_WIDTH];
+        SphereObject* spheres[SPHERE_BATCH_WIDTH];
+        int count = 0;
+
+        [[nodiscard]] inline bool full() const { return count == SPHERE_BATCH_WIDTH; }
+
+        inline void add(SphereObject* sphere, const Vec4& center, PRECISION_TYPE sphereRadius) {
+            centerX[count] = center.x();
+            centerY[count] = center.y();
+            centerZ[count] = center.z();
+            radius[count] = sphereRadius;
+            spheres[count++] = sphere;
+        }
+    };
+
+    /**
+     * The hot kernels of the CPU ray tracer compiled for one SIMDLevel. Every level gives exactly the same results as the scalar kernels,
+     * except the triangle filter which may let different (but always conservative) lanes through.
+     */
+    struct SIMDKernels {
+        SIMDLevel level;
+        // BVH4Node::intersects, slab test of a ray against the four children of a node
+        int (* boxes4)(const BVH4Node& node, const BVH4Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax, PRECISION_TYPE* tEntry);
+        // TriangleBlock::intersects, single precision filter of a ray against the eight triangles of a block
+        int (* triangles8)(const TriangleBlock& block, const TriangleBlockRay& ray);
+        // same as above, also giving the distance and barycentric coordinates in every lane
+        int (* triangleHits8)(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v);
+        // closest hit of the ray against the spheres of the batch, returns the index of the sphere hit and sets t or returns -1
+        int (* spheres)(const SphereBatch& batch, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max, PRECISION_TYPE& t);
+        // converts a PIXEL_BLOCK_SIZE square block of an image stored column by column (pixel x, y at pixels[x * height + y]) to 8 bit RGB
+        // the same way Image::getPixelR/G/B do. Pixel x, y of the block is written to rgb + y * rowStride + x * 3.
+        void (* pixelsToRGB8)(const Vec4* pixels, size_t height, unsigned char* rgb, ptrdiff_t rowStride);
+    };
+
+    // the kernel table of each level, defined by the simd file of the level
+    extern const SIMDKernels SCALAR_KERNELS;
+#if defined(__x86_64__) || defined(__i386__)
+    extern const SIMDKernels SSE42_KERNELS;
+    extern const SIMDKernels AVX2_KERNELS;
+    extern const SIMDKernels AVX512_KERNELS;
+#endif
+
+    /**
+     * Picks the kernels the CPU ray tracer uses, so one binary can run on every render node and still use the fastest instructions each
+     * has. The widest level isn't the fastest for every kernel on every CPU, so select() times each kernel at every level up to the cap,
+     * scalar included, and uses the fastest. The cap is the widest level the CPU supports unless --isa lowers it.
+     */
+    class SIMD {
+        private:
+            static SIMDKernels active;
+        public:
+            /**
+             * @return the widest level the CPU running the program supports
+             */
+            static SIMDLevel detect();
+
+            /**
+             * Switches the kernels to the fastest ones at or below the level. Must not be called while rays are being traced.
+             * @return false if the CPU doesn't support the level, in which case the kernels are left as they are
+             */
+            static bool select(SIMDLevel level);
+
+            /**
+             * @return the kernels in use, the widest level the CPU supports until select() is called
+             */
+            [[nodiscard]] static inline const SIMDKernels& kernels() { return active; }
+
+            /**
+             * @return the kernels compiled for exactly the level
+             */
+            [[nodiscard]] static const SIMDKernels& kernelsFor(SIMDLevel level);
+
+            /**
+             * Times every kernel at each level up to the level on a few thousand made up calls, a few milliseconds in all.
+             * @return the fastest kernel of each slot at or below the level, the table select() installs. Its level is the cap.
+             */
+            [[nodiscard]] static SIMDKernels dispatchFor(SIMDLevel level);
+
+            /**
+             * @return the level of each kernel of the table, "boxes sse4.2, triangles avx512, ..."
+             */
+            static std::string describe(const SIMDKernels& kernels);
+
+            /**
+             * @param name one of "scalar", "sse4.2", "avx2" or "avx512"
+             * @return the level with the name. Throws if the name isn't a known level.
+             */
+            static SIMDLevel levelFromString(const std::string& name);
+
+            static std::string levelToString(SIMDLevel level);
+    };
+
+}
+
+#endif //STEP_3_SIMD_H
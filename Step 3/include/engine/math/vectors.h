@@ -44,7 +44,9 @@
 // 70.9977ms normal
 // 286.656ms avx
 
-#ifdef COMPILER_DEBUG_ENABLED
+// the AVX vector holds four doubles, so it can't be used by a float build.
+// Vec4 is used everywhere so it can't switch at runtime like the kernels in simd.h, it's only used when the whole build targets AVX
+#if defined(COMPILER_DEBUG_ENABLED) && !defined(USE_FLOAT_PRECISION) && defined(__AVX__)
     #define USE_SIMD_CPU
 #endif
 
@@ -246,8 +248,12 @@ namespace Raytracing {
     }
 
 #else
-    // change this if you want
+    // set by the USE_FLOAT_PRECISION CMake option
+    #ifdef USE_FLOAT_PRECISION
+    typedef float PRECISION_TYPE;
+    #else
     typedef double PRECISION_TYPE;
+    #endif
     
     class Vec4 {
         private:
@@ -445,6 +451,10 @@ namespace Raytracing {
         public:
             Ray(const Vec4& start, const Vec4& direction): start(start), direction(direction), inverseDirection(1 / direction) {}
             
+            // for when the inverse of the direction is already known, like a ray which has only been moved
+            Ray(const Vec4& start, const Vec4& direction, const Vec4& inverseDirection):
+                    start(start), direction(direction), inverseDirection(inverseDirection) {}
+            
             [[nodiscard]] Vec4 getStartingPoint() const { return start; }
             
             [[nodiscard]] Vec4 getDirection() const { return direction; }
@@ -454,7 +464,16 @@ namespace Raytracing {
             [[nodiscard]] Vec4 getInverseDirection() const { return inverseDirection; }
             
             // returns a point along the ray, extended away from start by the length.
+#ifdef USE_FLOAT_PRECISION
+            // this is the hit point the next ray starts from. Done in double so it is only rounded once, a float rounded
+            // after both the multiply and the add can land far enough under the surface for the next ray to hit it again.
+            [[nodiscard]] inline Vec4 along(PRECISION_TYPE length) const {
+                return {PRECISION_TYPE(start.x() + double(length) * direction.x()), PRECISION_TYPE(start.y() + double(length) * direction.y()),
+                        PRECISION_TYPE(start.z() + double(length) * direction.z())};
+            }
+#else
             [[nodiscard]] inline Vec4 along(PRECISION_TYPE length) const { return start + length * direction; }
+#endif
         
     };
     
@@ -799,6 +818,72 @@ namespace Raytracing {
  << "         {" << v.m30() << ", " << v.m31() << ", " << v.m32() << ", " << v.m33() << "} \n";
     }
     
+    /**
+     * Affine transform from an object's own space into the world: scaled, then rotated around x, y and z in that order, then translated.
+     * Rays are moved into object space instead of moving the object, which lets any number of objects share the same geometry.
+     * The direction of a ray isn't normalized when it is transformed, so the distance along a ray is the same in both spaces.
+     */
+    class Transform {
+        private:
+            // the rotation and scale, and its inverse
+            PRECISION_TYPE linear[3][3]{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+            PRECISION_TYPE inverse[3][3]{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+            Vec4 translation;
+            // most objects are only ever moved, which lets the rays skip the matrices
+            bool translationOnly = true;
+            
+            static inline Vec4 multiply(const PRECISION_TYPE m[3][3], const Vec4& v) {
+                return {m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z()};
+            }
+        
+        public:
+            Transform() = default;
+            
+            /**
+             * @param rotation angles in radians around the x, y and z axis
+             * @param scale scale along each axis, none of which can be zero
+             */
+            explicit Transform(const Vec4& translation, const Vec4& rotation = {}, const Vec4& scale = {1, 1, 1});
+            
+            [[nodiscard]] inline Vec4 getTranslation() const { return translation; }
+            
+            inline void setTranslation(const Vec4& newTranslation) { translation = newTranslation; }
+            
+            [[nodiscard]] inline bool isTranslationOnly() const { return translationOnly; }
+            
+            [[nodiscard]] inline Vec4 pointToWorld(const Vec4& point) const {
+                return translationOnly ? point + translation : multiply(linear, point) + translation;
+            }
+            
+            [[nodiscard]] inline Vec4 vectorToWorld(const Vec4& vector) const {
+                return translationOnly ? vector : multiply(linear, vector);
+            }
+            
+            /**
+             * Normals are transformed by the inverse transpose so they stay perpendicular to the surface under non-uniform scales.
+             */
+            [[nodiscard]] inline Vec4 normalToWorld(const Vec4& normal) const {
+                if (translationOnly)
+                    return normal;
+                return Vec4{inverse[0][0] * normal.x() + inverse[1][0] * normal.y() + inverse[2][0] * normal.z(),
+                            inverse[0][1] * normal.x() + inverse[1][1] * normal.y() + inverse[2][1] * normal.z(),
+                            inverse[0][2] * normal.x() + inverse[1][2] * normal.y() + inverse[2][2] * normal.z()}.normalize();
+            }
+            
+            [[nodiscard]] inline Ray rayToObject(const Ray& ray) const {
+                if (translationOnly)
+                    return {ray.getStartingPoint() - translation, ray.getDirection(), ray.getInverseDirection()};
+                return {multiply(inverse, ray.getStartingPoint() - translation), multiply(inverse, ray.getDirection())};
+            }
+            
+            /**
+             * The transform as a matrix for OpenGL.
+             */
+            [[nodiscard]] Mat4x4 toMatrix() const;
+    };
+    
 };
 
 #endif //STEP_2_VECTORS_H
@@ -77,6 +77,11 @@ namespace Raytracing {
              */
             Ray projectRay(PRECISION_TYPE x, PRECISION_TYPE y);
             
+            /**
+             * @return the angle in radians between the rays of neighbouring pixels, which is how wide the cone of a camera ray starts out
+             */
+            [[nodiscard]] inline PRECISION_TYPE getPixelSpread() const { return viewportHeight / focalLength / PRECISION_TYPE(image.getHeight() - 1); }
+            
             void setPosition(const Vec4& pos) { this->position = pos; }
             
             /**
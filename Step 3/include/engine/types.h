@@ -36,6 +36,30 @@ namespace Raytracing {
         PRECISION_TYPE length{0};
         // Texture UV Coords.
         PRECISION_TYPE u, v;
+        // how far the UVs move for every unit moved across the surface around the hit, used to pick the mip level of textures.
+        // 0 if the object doesn't know, in which case the full resolution texture is used.
+        PRECISION_TYPE uvDensity{0};
+        // width of the ray cone where it hit the surface, filled in by the ray caster once the surface is known
+        PRECISION_TYPE footprint{0};
+    };
+    
+    class Object;
+    
+    /**
+     * The result of an intersection test, holding only what is needed to find the closest hit along a ray.
+     * The hit point, normal and UVs of the closest hit are computed from it afterwards by Object::surfaceInteraction.
+     */
+    struct HitRecord {
+        // all the other values only matter if this is true
+        bool hit{false};
+        // distance along the ray to the hit, the max of the ray if nothing was hit
+        PRECISION_TYPE t{0};
+        // the triangle of a mesh that was hit, unused by objects without primitives
+        uint32_t primitive{0};
+        // barycentric coords of the hit on the triangle, along its first and second edge
+        PRECISION_TYPE u{0}, v{0};
+        // the object that was hit, set by the world and the world BVH
+        Object* object{nullptr};
     };
     
     struct ScatterResults {
@@ -45,6 +69,8 @@ namespace Raytracing {
         Ray newRay;
         // the color of the material
         Vec4 attenuationColor;
+        // angle in radians the material widens the ray cone by, 0 for a perfect mirror
+        PRECISION_TYPE spread{0};
     };
     
     class Material {
@@ -76,6 +102,14 @@ namespace Raytracing {
         bool isRegular;
     };
     
+    /**
+     * The kinds of objects the world BVH knows about. The BVH stores the type of every object next to it so spheres and meshes
+     * are tested with a direct call instead of going through the vtable. Any other object is OBJECT and uses the virtual intersect.
+     */
+    enum class ObjectType : uint8_t {
+        OBJECT, SPHERE, MODEL
+    };
+    
     class Object {
         protected:
             AABB aabb;
@@ -87,11 +121,24 @@ namespace Raytracing {
         public:
             Object(Material* material, const Vec4& position): material(material), position(position), aabb({}) {};
             
-            // return true if the ray intersects with this object, only between min and max
-            [[nodiscard]] virtual HitData checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const = 0;
+            // finds the closest hit of the ray with this object, only between min and max
+            [[nodiscard]] virtual HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const = 0;
+            
+            // computes the hit point, normal and UVs of a hit found by intersect. Only done once a ray has found its closest hit
+            [[nodiscard]] virtual HitData surfaceInteraction(const Ray& ray, const HitRecord& record) const = 0;
+            
+            // intersect followed by surfaceInteraction, for when the surface of the hit is always needed
+            [[nodiscard]] HitData checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+                auto record = intersect(ray, min, max);
+                if (!record.hit)
+                    return {false, Vec4(), Vec4(), max};
+                return surfaceInteraction(ray, record);
+            }
             
             [[nodiscard]] Material* getMaterial() const { return material; }
             
+            [[nodiscard]] virtual ObjectType getType() const { return ObjectType::OBJECT; }
+            
             [[nodiscard]] virtual AABB& getAABB() { return aabb; }
             
             // FIXME: Use of void* is inadvisable. Although this is only for debug consider another method.
@@ -99,11 +146,24 @@ namespace Raytracing {
             
             [[nodiscard]] Vec4 getPosition() const { return position; }
             
+            // the world BVH has to be updated with World::updateBVH() after an object is moved
+            virtual void setPosition(const Vec4& pos) { this->position = pos; }
+            
+            // builds the acceleration structure over the object's own primitives, if it has one. Called by the world before building its BVH
+            virtual void buildBVH() {}
+
             virtual void setAABB(const AABB& ab) { this->aabb = ab; }
 
 #ifdef COMPILE_GUI
             
             [[nodiscard]] inline VAO* getVAO() { return vao; }
+            
+            // where the VAO is drawn in the world
+            [[nodiscard]] virtual Mat4x4 getModelMatrix() const {
+                Mat4x4 matrix{};
+                matrix.translate(position);
+                return matrix;
+            }
 
 #endif
             
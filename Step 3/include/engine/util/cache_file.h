@@ -0,0 +1,53 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_CACHE_FILE_H
+#define STEP_3_CACHE_FILE_H
+
+#include "engine/util/std.h"
+#include <functional>
+#include <optional>
+#include <ostream>
+
+namespace Raytracing {
+
+    /**
+     * Size and modification time of the file a cached file was made from. The cached file is only used while they still match the file.
+     */
+    struct SourceStamp {
+        uint64_t size = 0;
+        int64_t modified = 0;
+
+        bool operator==(const SourceStamp& stamp) const = default;
+
+        /**
+         * @return the stamp of the file, or std::nullopt if the file can't be read
+         */
+        static std::optional<SourceStamp> of(const std::string& file);
+    };
+
+    /**
+     * The files the engine writes next to the scene to load faster next time (.rtmesh, .rttex and the BVH cache).
+     */
+    class CacheFile {
+        public:
+            /**
+             * Writes the file through a temporary file next to it which is renamed over it once complete, so other processes and threads
+             * never see a partially written file. The temporary file is removed if anything fails.
+             * @param contents writes the whole file to the stream
+             * @param error set to why the file couldn't be written
+             * @return true if the file was written
+             */
+            static bool write(const std::string& path, const std::function<void(std::ostream&)>& contents, std::string& error);
+
+            /**
+             * Writes zeros until the stream is at the offset, to start the next array on its alignment.
+             */
+            static void padTo(std::ostream& file, uint64_t offset);
+    };
+
+}
+
+#endif //STEP_3_CACHE_FILE_H
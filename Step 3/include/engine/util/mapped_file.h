@@ -0,0 +1,46 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_MAPPED_FILE_H
+#define STEP_3_MAPPED_FILE_H
+
+#include "engine/util/std.h"
+#include <sys/mman.h>
+
+namespace Raytracing {
+
+    enum class MapMode {
+        READ,
+        // read only, and the file is read front to back once so the kernel can read ahead of it
+        READ_SEQUENTIAL,
+        // copy on write, changing the memory never changes the file
+        COPY_ON_WRITE
+    };
+
+    /**
+     * A whole file mapped into memory, unmapped when it is destroyed. Shared by everything using memory inside the file,
+     * usually through a std::shared_ptr<void> so they don't have to know what owns it.
+     */
+    struct MappedFile {
+        void* data = nullptr;
+        size_t size = 0;
+
+        MappedFile(void* data, size_t size): data(data), size(size) {}
+
+        MappedFile(const MappedFile& file) = delete;
+
+        ~MappedFile() {
+            munmap(data, size);
+        }
+
+        /**
+         * @return the mapping, or nullptr if the file can't be opened or mapped or is empty
+         */
+        static std::shared_ptr<MappedFile> map(const std::string& path, MapMode mode = MapMode::READ);
+    };
+
+}
+
+#endif //STEP_3_MAPPED_FILE_H
@@ -0,0 +1,52 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+
+#ifndef STEP_3_MESH_FILE_H
+#define STEP_3_MESH_FILE_H
+
+#include "engine/util/std.h"
+#include "engine/util/models.h"
+#include <optional>
+
+namespace Raytracing {
+
+    // has to be changed whenever the layout of the file or the encoding of the vertices changes so old mesh files are ignored
+    constexpr uint32_t MESH_FILE_VERSION = 1;
+
+    /**
+     * An IndexedMesh stored exactly as it is in memory, so the mesh can be mapped and used straight away instead of parsing the OBJ file it
+     * was made from on every run and on every MPI rank. The file sits next to the OBJ file with the extension .rtmesh and remembers the size
+     * and modification time of the OBJ, once the OBJ changes the mesh file is ignored until it is converted again.
+     */
+    class MeshFile {
+        public:
+            /**
+             * @return the path of the mesh file belonging to the OBJ file
+             */
+            static std::string pathFor(const std::string& objFile);
+
+            /**
+             * Maps the mesh file made from the OBJ file. The mesh uses the arrays in the file directly.
+             * @return the mesh, or nothing if there is no mesh file or it is from another version, damaged or made from an older OBJ
+             */
+            static std::optional<IndexedMesh> load(const std::string& objFile);
+
+            /**
+             * Writes the mesh as the mesh file of the OBJ file. The file is written to a temporary file first and then renamed,
+             * so other processes never see a partially written mesh.
+             * @return true if the file was written
+             */
+            static bool write(const std::string& objFile, const IndexedMesh& mesh);
+
+            /**
+             * Parses the OBJ file and writes its mesh file. Throws if the OBJ file can't be loaded.
+             * @return true if the file was written
+             */
+            static bool convert(const std::string& objFile);
+    };
+
+}
+
+#endif //STEP_3_MESH_FILE_H
@@ -9,10 +9,16 @@
 #include "engine/util/std.h"
 #include "engine/math/vectors.h"
 #include "engine/math/colliders.h"
+#include "engine/math/simd.h"
+#include <span>
+
 
 namespace Raytracing {
     
-    // triangle type for model loading
+    /**
+     * A triangle with its vertices, normals and uvs written out in full. Meshes aren't stored like this, it's only made
+     * when a whole mesh has to be handed to something else such as the GPU.
+     */
     struct Triangle {
         public:
             Vec4 vertex1, vertex2, vertex3;
@@ -26,6 +32,90 @@ namespace Raytracing {
             ): vertex1(v1), vertex2(v2), vertex3(v3), uv1(uv1), uv2(uv2), uv3(uv3), normal1(n1), normal2(n2), normal3(n3) {}
     };
     
+    // number of triangles tested at once by a TriangleBlock, one per float of an AVX register
+    constexpr int TRIANGLE_BLOCK_WIDTH = 8;
+    // error allowed on the products the single precision test is made of, relative to the size of the vectors multiplied.
+    // Around 170 times the rounding error of a float, comfortably more than the handful of roundings the test makes.
+    constexpr float TRIANGLE_BLOCK_TOLERANCE = 1e-5f;
+    
+    /**
+     * A ray in single precision, relative to the anchor of the TriangleBlock it is tested against.
+     */
+    struct TriangleBlockRay {
+        float origin[3];
+        float direction[3];
+        // sums of the absolute values of the coordinates, used to bound the rounding error
+        float originSize, directionSize;
+        float min, max;
+    };
+    
+    /**
+     * Up to eight triangles of a BVH leaf stored as structure of arrays in single precision, so one ray can be tested against all of them
+     * with a handful of AVX instructions. The vertices are stored relative to an anchor in the block, which keeps the numbers small enough
+     * that a float doesn't lose the precision of the hit no matter how far the mesh is from the origin.
+     *
+     * The test is a conservative filter: every rejection is widened by a bound on the rounding error, so a triangle is only rejected if
+     * the double precision test would reject it too. The lanes which pass are then tested in double precision, which decides the hit.
+     */
+    struct alignas(32) TriangleBlock {
+        // first vertex relative to the anchor and the two edges leaving it, stored [axis][lane]
+        float vertex0[3][TRIANGLE_BLOCK_WIDTH];
+        float edge1[3][TRIANGLE_BLOCK_WIDTH];
+        float edge2[3][TRIANGLE_BLOCK_WIDTH];
+        // sums of the absolute values of the vectors above
+        float vertex0Size[TRIANGLE_BLOCK_WIDTH];
+        float edge1Size[TRIANGLE_BLOCK_WIDTH];
+        float edge2Size[TRIANGLE_BLOCK_WIDTH];
+        // index of the triangle in each lane
+        uint32_t triangle[TRIANGLE_BLOCK_WIDTH];
+        // world position the vertices are relative to
+        PRECISION_TYPE anchor[3];
+        // bit i is set if lane i holds a triangle, the empty lanes at the end of a leaf are never reported
+        uint32_t laneMask;
+        
+        /**
+         * Moves the ray into the space of the block. Has to be redone when max shrinks.
+         */
+        [[nodiscard]] inline TriangleBlockRay makeRay(const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max) const {
+            TriangleBlockRay ray{};
+            ray.origin[0] = (float) (origin.x() - anchor[0]);
+            ray.origin[1] = (float) (origin.y() - anchor[1]);
+            ray.origin[2] = (float) (origin.z() - anchor[2]);
+            ray.direction[0] = (float) direction.x();
+            ray.direction[1] = (float) direction.y();
+            ray.direction[2] = (float) direction.z();
+            ray.originSize = std::abs(ray.origin[0]) + std::abs(ray.origin[1]) + std::abs(ray.origin[2]);
+            ray.directionSize = std::abs(ray.direction[0]) + std::abs(ray.direction[1]) + std::abs(ray.direction[2]);
+            // the double precision test also rejects hits closer than EPSILON
+            ray.min = (float) std::max(min, (PRECISION_TYPE) EPSILON);
+            ray.max = (float) max;
+            return ray;
+        }
+        
+        /**
+         * Möller–Trumbore against every triangle of the block at once in single precision.
+         *
+         * The determinant and the numerators of u, v and t are triple products of the ray and the triangle's vectors, and the rounding
+         * error of a triple product is bounded by TRIANGLE_BLOCK_TOLERANCE times the product of the sizes (sums of absolute values) of its
+         * vectors. Multiplying the tests through by the determinant leaves no division, and every test is widened by those bounds.
+         * Lanes where the determinant is within its error of 0 can't be decided and are always reported.
+         * Runs the kernel SIMD picked for the CPU, the wider ones use FMA so the lanes which pass can differ slightly between CPUs.
+         * @return mask with bit i set if the ray may hit the triangle in lane i between the min and max of the ray
+         */
+        [[nodiscard]] inline int intersects(const TriangleBlockRay& ray) const {
+            return SIMD::kernels().triangles8(*this, ray);
+        }
+        
+        /**
+         * Same as above, also giving the hit in each lane.
+         * @param t, u, v filled with the distance and the barycentric coordinates along edge1 and edge2 of the hit in each lane,
+         * only meaningful for lanes which were reported and weren't undecided
+         */
+        inline int intersects(const TriangleBlockRay& ray, float t[TRIANGLE_BLOCK_WIDTH], float u[TRIANGLE_BLOCK_WIDTH], float v[TRIANGLE_BLOCK_WIDTH]) const {
+            return SIMD::kernels().triangleHits8(*this, ray, t, u, v);
+        }
+    };
+    
     // face type for model loading
     struct face {
         int v1, v2, v3;
@@ -33,28 +123,180 @@ namespace Raytracing {
         int n1, n2, n3;
     };
     
+    // the model as it was read from the file. Only kept until the mesh has been made from it, see IndexedMesh.
     struct ModelData {
-        // storing all this data is memory inefficient
-        // since normals and vertices are only vec3s
-        // and uvs are vec2s
-        // TODO: create lower order vector classes
         std::vector<Vec4> vertices;
         std::vector<Vec4> uvs;
         std::vector<Vec4> normals;
         std::vector<face> faces;
     };
     
-    struct TriangulatedModel {
-        std::vector<std::shared_ptr<Triangle>> triangles;
-        AABB aabb;
+    /**
+     * Position of a mesh vertex. Models are read as floats, so a float keeps all of it in 12 bytes instead of the 32 of a Vec4.
+     */
+    struct MeshPosition {
+        float x, y, z;
+        
+        [[nodiscard]] inline Vec4 toVec4() const { return {x, y, z}; }
+    };
+    
+    /**
+     * What shading needs from a mesh vertex, in 8 bytes. The normal is folded onto an octahedron and stored as two 16 bit signed
+     * normalized values, which keeps its direction to within a few thousandths of a degree. The uv is stored as two half precision floats,
+     * which are exact to 1/2048 between 0 and 1.
+     */
+    struct MeshVertexAttributes {
+        int16_t normal[2];
+        uint16_t uv[2];
+        
+        static MeshVertexAttributes encode(const Vec4& normal, const Vec4& uv);
+        
+        // always of length 1, or 0 if the normal encoded was 0
+        [[nodiscard]] Vec4 decodeNormal() const;
         
-        explicit TriangulatedModel(const ModelData& data);
+        [[nodiscard]] Vec4 decodeUV() const;
+    };
+    
+    /**
+     * A mesh stored as indexed vertex buffers, split by how often each part is read. The hot part is all the intersection tests and
+     * the BVH builders read: the float positions of the vertices and three vertex indices per triangle. The cold part is the compressed
+     * normal and uv of each vertex, which are only read to shade the closest hit.
+     * A vertex is a distinct combination of the position, uv and normal the faces of the model use, so only the corners on a seam
+     * between uvs or normals are stored more than once.
+     */
+    class IndexedMesh {
+        private:
+            std::vector<MeshPosition> positionStorage;
+            std::vector<uint32_t> indexStorage;
+            std::vector<MeshVertexAttributes> attributeStorage;
+            // point at the storage or at a mapped mesh file, see MeshFile
+            std::span<const MeshPosition> positions;
+            std::span<const uint32_t> indices;
+            std::span<const MeshVertexAttributes> attributes;
+            // keeps the mesh file mapped while the mesh uses its memory
+            std::shared_ptr<void> mapping;
+            AABB aabb;
+        public:
+            IndexedMesh() = default;
+            
+            explicit IndexedMesh(const ModelData& data);
+            
+            /**
+             * Uses arrays which are already indexed as they are, without copying them. The mapping has to own the memory they point to.
+             */
+            IndexedMesh(
+                    std::span<const MeshPosition> positions, std::span<const uint32_t> indices, std::span<const MeshVertexAttributes> attributes,
+                    const AABB& aabb, std::shared_ptr<void> mapping
+            ): positions(positions), indices(indices), attributes(attributes), mapping(std::move(mapping)), aabb(aabb) {}
+            
+            // the arrays can point at the storage, which a copy would leave behind. Moving takes the storage along
+            IndexedMesh(const IndexedMesh& mesh) = delete;
+            
+            IndexedMesh(IndexedMesh&& mesh) = default;
+            
+            IndexedMesh& operator=(IndexedMesh&& mesh) = default;
+            
+            /**
+             * @param corner 0, 1 or 2
+             */
+            [[nodiscard]] inline Vec4 getVertex(size_t triangle, int corner) const { return positions[indices[triangle * 3 + corner]].toVec4(); }
+            
+            [[nodiscard]] inline Vec4 getNormal(size_t triangle, int corner) const { return attributes[indices[triangle * 3 + corner]].decodeNormal(); }
+            
+            [[nodiscard]] inline Vec4 getUV(size_t triangle, int corner) const { return attributes[indices[triangle * 3 + corner]].decodeUV(); }
+            
+            [[nodiscard]] AABB getTriangleAABB(size_t triangle) const;
+            
+            /**
+             * Tests the ray against a triangle using Möller–Trumbore, in the same precision as the rest of the engine.
+             * @param t set to the distance along the ray of the hit if there was one in [min, max]
+             * @return true if the ray hit the triangle between min and max
+             */
+            [[nodiscard]] inline bool intersects(size_t i, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max,
+                                                 PRECISION_TYPE& t) const {
+                PRECISION_TYPE u, v;
+                return intersects(i, origin, direction, min, max, t, u, v);
+            }
+            
+            /**
+             * Same as above, also giving the barycentric coordinates of the hit along edge1 and edge2.
+             */
+            [[nodiscard]] inline bool intersects(size_t i, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max,
+                                                 PRECISION_TYPE& t, PRECISION_TYPE& u, PRECISION_TYPE& v) const {
+                const auto* corners = &indices[i * 3];
+                Vec4 vertex0 = positions[corners[0]].toVec4();
+                Vec4 edge1 = positions[corners[1]].toVec4() - vertex0;
+                Vec4 edge2 = positions[corners[2]].toVec4() - vertex0;
+                
+                Vec4 h = Vec4::cross(direction, edge2);
+                PRECISION_TYPE a = Vec4::dot(edge1, h);
+                if (a > -EPSILON && a < EPSILON)
+                    return false; //parallel to triangle
+                
+                PRECISION_TYPE f = 1.0 / a;
+                Vec4 s = origin - vertex0;
+                u = f * Vec4::dot(s, h);
+                if (u < 0.0 || u > 1.0)
+                    return false;
+                
+                Vec4 q = Vec4::cross(s, edge1);
+                v = f * Vec4::dot(direction, q);
+                if (v < 0.0 || u + v > 1.0)
+                    return false;
+                
+                t = f * Vec4::dot(edge2, q);
+                // keep t in reasonable bounds, ensuring we respect depth
+                return t > EPSILON && t >= min && t <= max;
+            }
+            
+            /**
+             * @return the triangle written out in full, with the normals and uvs as they are after compression
+             */
+            [[nodiscard]] Triangle getTriangle(size_t triangle) const;
+            
+            [[nodiscard]] std::vector<Triangle> getTriangles() const;
+            
+            [[nodiscard]] inline size_t getTriangleCount() const { return indices.size() / 3; }
+            
+            [[nodiscard]] inline size_t getVertexCount() const { return positions.size(); }
+            
+            // bounds of every vertex used by a triangle
+            [[nodiscard]] inline const AABB& getAABB() const { return aabb; }
+            
+            [[nodiscard]] inline std::span<const MeshPosition> getPositions() const { return positions; }
+            
+            // three per triangle
+            [[nodiscard]] inline std::span<const uint32_t> getIndices() const { return indices; }
+            
+            // one per position
+            [[nodiscard]] inline std::span<const MeshVertexAttributes> getAttributes() const { return attributes; }
+            
+            // true if the arrays are in a mapped mesh file instead of the mesh's own storage
+            [[nodiscard]] inline bool isMapped() const { return mapping != nullptr; }
+            
+            // memory read by the intersection tests
+            [[nodiscard]] inline size_t getHotMemoryUsage() const { return positions.size() * sizeof(MeshPosition) + indices.size() * sizeof(uint32_t); }
+            
+            // memory only read while shading
+            [[nodiscard]] inline size_t getColdMemoryUsage() const { return attributes.size() * sizeof(MeshVertexAttributes); }
+            
+            [[nodiscard]] inline size_t getMemoryUsage() const { return getHotMemoryUsage() + getColdMemoryUsage(); }
     };
     
     class OBJLoader {
         private:
         public:
+            /**
+             * Parses the OBJ file. Triangles, quads and larger polygons, negative indices and faces without uvs or normals are all supported.
+             * Throws if the file can't be read or isn't a valid OBJ file.
+             */
             static ModelData loadModel(const std::string& file);
+            
+            /**
+             * Loads the mesh from the .rtmesh file next to the OBJ file if there is one made from the OBJ as it is now, see MeshFile.
+             * Otherwise the OBJ file is parsed and indexed.
+             */
+            static IndexedMesh loadMesh(const std::string& file);
     };
 }
 #endif //STEP_2_MODELS_H
@@ -27,6 +27,7 @@
 #include <random>
 #include <cstdlib>
 #include <memory>
+#include <cstdint>
 
 #define RTAssert(condition) static_cast <bool> (condition) ? void(0) : throw std::runtime_error("Assert Failed!");
 
@@ -10,6 +10,7 @@
 #include "engine/math/vectors.h"
 #include "engine/util/models.h"
 #include "engine/math/bvh.h"
+#include "engine/image/texture_cache.h"
 #include "types.h"
 
 #include <config.h>
@@ -31,43 +32,205 @@ namespace Raytracing {
             PRECISION_TYPE radius;
         public:
             SphereObject(const Vec4& position, PRECISION_TYPE radius, Material* material):
-                    radius(radius), Object(material, position) {}
+                    radius(radius), Object(material, position) {
+                // the bounds are relative to the position like every other object, which lets the sphere go in the BVH
+                this->aabb = AABB(0, 0, 0, std::abs(radius));
+            }
+            
+            [[nodiscard]] ObjectType getType() const override { return ObjectType::SPHERE; }
+            
+            [[nodiscard]] PRECISION_TYPE getRadius() const { return radius; }
+            
+            [[nodiscard]] HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const override;
+            
+            /**
+             * Tests every sphere in the batch at once with the kernel SIMD picked for the CPU, then empties the batch.
+             * Gives the same result as calling intersect on each sphere in order with max shrinking to the closest hit.
+             * @param closest the hit to beat, replaced by the closest sphere hit if there is one
+             */
+            static void intersect(SphereBatch& batch, const Ray& ray, PRECISION_TYPE min, HitRecord& closest);
+            
+            inline void addTo(SphereBatch& batch) { batch.add(this, position, radius); }
             
-            [[nodiscard]] virtual HitData checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
+            [[nodiscard]] HitData surfaceInteraction(const Ray& ray, const HitRecord& record) const override;
     };
     
-    class ModelObject : public Object {
+    /**
+     * A mesh loaded and triangulated once and shared by every ModelObject drawing it. Everything in here is in the mesh's own space,
+     * so the geometry and the triangle BVH exist once no matter how many instances of the mesh there are.
+     * Nothing in it changes once the BVH has been built, the instances only add a transform.
+     */
+    class MeshAsset {
         private:
-            std::vector<std::shared_ptr<Triangle>> triangles;
+            IndexedMesh geometry;
+            // the mesh's own BVH, the world BVH only sees the instances as single objects and hands rays which reach them to this tree
             std::unique_ptr<TriangleBVHTree> triangleBVH;
+            BVHBuildOptions bvhOptions;
+#ifdef COMPILE_GUI
+            // created by the first instance, meshes can be loaded on other threads but OpenGL can only be used on the main one
+            mutable VAO* vao = nullptr;
+#endif
+            
+            /**
+             * Finds the closest triangle using the triangle BVH, counting the work done in stats.
+             */
+            template<typename Stats>
+            [[nodiscard]] HitRecord intersectTriangles(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, Stats&& stats) const;
         public:
-            ModelObject(const Vec4& position, ModelData& data, Material* material):
-                    Object(material, position) {
-                // since all of this occurs before the main ray tracing algorithm it's fine to do sequentially
-                TriangulatedModel model{data};
-                this->triangles = model.triangles;
-                this->aabb = std::move(model.aabb);
-                // a required step to generate a BVH however we aren't using the triangle bvh due to issues with it
-                // so ignore this and sequential triangle BVH nonsense.
-                std::vector<TriangleBVHObject> triangulatedObjects;
-                for (const auto& tri : triangles) {
-                    TriangleBVHObject triangleObject;
-                    triangleObject.tri = tri;
-                    triangleObject.aabb = tri->aabb;
-                    triangleObject.position = position;
-                    triangulatedObjects.push_back(triangleObject);
-                }
-                triangleBVH = std::make_unique<TriangleBVHTree>(triangulatedObjects);
+            explicit MeshAsset(IndexedMesh mesh, const BVHBuildOptions& bvhOptions = {});
+            
+            explicit MeshAsset(const ModelData& data, const BVHBuildOptions& bvhOptions = {}): MeshAsset(IndexedMesh{data}, bvhOptions) {}
+            
+            MeshAsset(const MeshAsset& mesh) = delete;
+            
+            /**
+             * Builds the triangle BVH if it hasn't been built or loaded from the BVH cache yet.
+             */
+            void buildBVH() {
+                if (triangleBVH == nullptr)
+                    triangleBVH = std::make_unique<TriangleBVHTree>(geometry, bvhOptions);
+            }
+            
+            /**
+             * Uses a triangle BVH loaded from the BVH cache, which is built instead if it doesn't match the mesh.
+             */
+            void useCachedBVH(const BVHCachedTree& tree, std::shared_ptr<void> mapping) {
+                triangleBVH = std::make_unique<TriangleBVHTree>(geometry, bvhOptions, &tree, std::move(mapping));
+            }
+            
+            [[nodiscard]] const TriangleBVHTree* getTriangleBVH() const { return triangleBVH.get(); }
+            
+            [[nodiscard]] const BVHBuildOptions& getBVHOptions() const { return bvhOptions; }
+            
+            [[nodiscard]] const IndexedMesh& getGeometry() const { return geometry; }
+            
+            // bounds of the mesh in its own space
+            [[nodiscard]] const AABB& getAABB() const { return geometry.getAABB(); }
+            
+            [[nodiscard]] size_t getMemoryUsage() const {
+                return geometry.getMemoryUsage() + (triangleBVH == nullptr ? 0 : triangleBVH->getMemoryUsage());
+            }
+
+#ifdef COMPILE_GUI
+            
+            [[nodiscard]] inline VAO* getVAO() const {
+                if (vao == nullptr)
+                    vao = new VAO(geometry.getTriangles());
+                return vao;
+            }
+
+#endif
+            
+            /**
+             * Tests a ray in the mesh's space using the triangle BVH, or every triangle if the BVH hasn't been built yet.
+             */
+            [[nodiscard]] HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
+            
+            /**
+             * Same as intersect, also counting the triangle BVH nodes visited and the triangles tested.
+             */
+            [[nodiscard]] HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, BVHTraversalStats& stats) const;
+            
+            /**
+             * Checks every triangle in the mesh without using the triangle BVH. Used as a reference by the benchmarks.
+             */
+            [[nodiscard]] HitRecord intersectBruteForce(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
+            
+            /**
+             * Interpolates the normals and UVs of the hit triangle using the barycentric coords in the record.
+             * The normal is in the mesh's space and the hit point is left for the instance to fill in.
+             */
+            [[nodiscard]] HitData surfaceInteraction(const HitRecord& record) const;
+            
+            /**
+             * @return how far the UVs of the triangle move for every unit moved across it once it has been transformed into the world
+             */
+            [[nodiscard]] PRECISION_TYPE getUVDensity(size_t triangle, const Transform& transform) const;
+    };
+    
+    /**
+     * An instance of a mesh, placed in the world by an affine transform. Rays are moved into the mesh's space to be tested,
+     * so an instance costs about the same memory however large its mesh is.
+     */
+    class ModelObject : public Object {
+        private:
+            std::shared_ptr<MeshAsset> mesh;
+            Transform transform;
+            
+            /**
+             * The bounds of the transformed mesh, relative to the position like every other object.
+             */
+            void updateAABB();
+        public:
+            ModelObject(std::shared_ptr<MeshAsset> mesh, const Transform& transform, Material* material):
+                    Object(material, transform.getTranslation()), mesh(std::move(mesh)), transform(transform) {
+                updateAABB();
 #ifdef COMPILE_GUI
-                vao = new VAO(triangles);
+                vao = this->mesh->getVAO();
 #endif
             }
             
-            [[nodiscard]] virtual DebugBVHData getBVHTree() { return {triangleBVH.get(), false}; }
+            /**
+             * Creates an instance of its own copy of the mesh, for meshes which are only used once.
+             */
+            ModelObject(const Vec4& position, const ModelData& data, Material* material, const BVHBuildOptions& bvhOptions = {}):
+                    ModelObject(std::make_shared<MeshAsset>(data, bvhOptions), Transform{position}, material) {}
+            
+            /**
+             * Builds the BVH of the mesh, which only happens for the first instance of it.
+             */
+            void buildBVH() override { mesh->buildBVH(); }
+            
+            [[nodiscard]] ObjectType getType() const override { return ObjectType::MODEL; }
+            
+            [[nodiscard]] virtual DebugBVHData getBVHTree() { return {(void*) mesh->getTriangleBVH(), false}; }
+            
+            [[nodiscard]] const std::shared_ptr<MeshAsset>& getMesh() const { return mesh; }
+            
+            [[nodiscard]] const Transform& getTransform() const { return transform; }
+            
+            // the world BVH has to be updated with World::updateBVH() after the transform changes
+            void setTransform(const Transform& newTransform) {
+                transform = newTransform;
+                Object::setPosition(transform.getTranslation());
+                updateAABB();
+            }
+            
+            void setPosition(const Vec4& pos) override {
+                Object::setPosition(pos);
+                transform.setTranslation(pos);
+            }
+            
+            [[nodiscard]] virtual std::vector<Triangle> getTriangles() { return mesh->getGeometry().getTriangles(); }
+
+#ifdef COMPILE_GUI
+            
+            [[nodiscard]] Mat4x4 getModelMatrix() const override { return transform.toMatrix(); }
+
+#endif
+            
+            /**
+             * Tests the ray against the mesh, moved into the mesh's space.
+             */
+            [[nodiscard]] HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const override {
+                return mesh->intersect(transform.rayToObject(ray), min, max);
+            }
             
-            [[nodiscard]] virtual std::vector<std::shared_ptr<Triangle>> getTriangles() { return triangles; }
+            /**
+             * Same as intersect, also counting the triangle BVH nodes visited and the triangles tested.
+             */
+            [[nodiscard]] HitRecord intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, BVHTraversalStats& stats) const {
+                return mesh->intersect(transform.rayToObject(ray), min, max, stats);
+            }
+            
+            /**
+             * Checks every triangle in the mesh without using the triangle BVH. Used as a reference by the benchmarks.
+             */
+            [[nodiscard]] HitRecord intersectBruteForce(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+                return mesh->intersectBruteForce(transform.rayToObject(ray), min, max);
+            }
             
-            [[nodiscard]] virtual HitData checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
+            [[nodiscard]] HitData surfaceInteraction(const Ray& ray, const HitRecord& record) const override;
     };
     
     class DiffuseMaterial : public Material {
@@ -105,24 +268,37 @@ namespace Raytracing {
     
     class TexturedMaterial : public Material {
         protected:
-            int width{}, height{}, channels{};
             float scale = 1;
-            unsigned char* data;
+            // shared with every other material using the same image, null if it couldn't be loaded
+            std::shared_ptr<const TextureImage> image;
         public:
             explicit TexturedMaterial(const std::string& file);
             
             explicit TexturedMaterial(const std::string& file, float scale);
             
+            /**
+             * Creates the material from an image already loaded from the TextureCache.
+             * @param file the image was loaded from, only used for logging
+             */
+            TexturedMaterial(const std::string& file, std::shared_ptr<const TextureImage> image, float scale = 1);
+            
             [[nodiscard]] virtual ScatterResults scatter(const Ray& ray, const HitData& hitData) const override;
             
-            [[nodiscard]] Vec4 getColor(PRECISION_TYPE u, PRECISION_TYPE v) const;
+            /**
+             * Samples the mip level whose texels are about the size of the footprint, which is in UV units.
+             * Between two levels one of them is picked at random in proportion to how close it is, so many samples average to a trilinear filter.
+             */
+            [[nodiscard]] Vec4 getColor(PRECISION_TYPE u, PRECISION_TYPE v, PRECISION_TYPE footprint = 0) const;
             
-            ~TexturedMaterial();
+            [[nodiscard]] const std::shared_ptr<const TextureImage>& getImage() const { return image; }
     };
     
     struct WorldConfig {
         bool useBVH = true;
         bool padding[7]{};
+        BVHBuildOptions bvhOptions{};
+        // file the built BVHs are cached in between runs, empty to always build them
+        std::string bvhCachePath;
 #ifdef COMPILE_GUI
         Shader& worldShader;
         
@@ -138,7 +314,14 @@ namespace Raytracing {
             std::vector<Object*> objects;
             std::unique_ptr<BVHTree> bvhObjects;
             std::unordered_map<std::string, Material*> materials;
+            // meshes loaded by loadMesh, by the file they were loaded from
+            std::unordered_map<std::string, std::shared_ptr<MeshAsset>> meshes;
             WorldConfig m_config;
+            
+            /**
+             * Builds the triangle BVH of every mesh which doesn't have one yet, several meshes at once.
+             */
+            static void buildMeshBVHs(const std::vector<MeshAsset*>& models);
         public:
             explicit World(WorldConfig config):
                     m_config(config) {};
@@ -151,20 +334,56 @@ namespace Raytracing {
             // this allows us to generate a statically unchanging BVH for easy rendering
             void generateBVH();
             
+            /**
+             * Adds an object to the world, which takes ownership of it. If the BVH has already been generated the object
+             * is inserted into it, and will be part of the tree after the next rebuild.
+             */
             inline void add(Object* object) {
                 objects.push_back(object);
+                if (bvhObjects != nullptr) {
+                    object->buildBVH();
+                    bvhObjects->insert(object);
+                }
 #ifdef COMPILE_GUI
                 // this will show up in the debug mode
-                // disabled because we aren't using object local BVHs
+                // disabled because every mesh would get its own window
                 //if (object->getBVHTree().bvhTree != nullptr && !object->getBVHTree().isRegular)
                 //    new DebugBVH{(TriangleBVHTree*) object->getBVHTree().bvhTree, m_config.worldShader};
 #endif
             }
             
-            inline void add(const std::string& materialName, Material* mat) { materials.insert({materialName, mat}); }
+            /**
+             * Removes an object from the world and the BVH. The world no longer owns the object, so it is up to the caller to delete it.
+             * @return true if the object was in the world
+             */
+            bool remove(Object* object);
             
+            /**
+             * Brings the BVH up to date after objects have been moved with setPosition/setAABB, added or removed.
+             * The BVH is refit, which is cheap enough to do every frame, and is rebuilt once the refit tree has become too slow.
+             * Must not be called while the world is being rendered.
+             * @return true if the BVH was rebuilt
+             */
+            bool updateBVH();
+            
+            inline void add(const std::string& materialName, Material* mat) { materials.insert({materialName, mat}); }
+
             inline Material* getMaterial(const std::string& materialName) { return materials.at(materialName); }
             
+            [[nodiscard]] inline const WorldConfig& getConfig() const { return m_config; }
+            
+            /**
+             * Loads and triangulates an OBJ file into a mesh which any number of ModelObjects can use. Every file is only loaded once,
+             * later calls return the same mesh. The mesh is built with the BVH options of the world.
+             */
+            std::shared_ptr<MeshAsset> loadMesh(const std::string& file);
+            
+            /**
+             * Adds a mesh loaded somewhere else, such as by the AssetLoader, which loadMesh will then return for the file.
+             * Does nothing if a mesh has already been loaded from the file.
+             */
+            inline void addMesh(const std::string& file, std::shared_ptr<MeshAsset> mesh) { meshes.insert({file, std::move(mesh)}); }
+            
             [[nodiscard]] inline BVHTree* getBVH() { return bvhObjects.get(); }
             
             [[nodiscard]] inline std::vector<Object*> getObjectsInWorld() { return objects; }
@@ -174,10 +393,16 @@ namespace Raytracing {
              * @param ray ray to check
              * @param min min of the ray
              * @param max max of the ray
-             * @return HitData about the closest object that was hit.
+             * @return the closest hit along with the object hit, Object::surfaceInteraction gives the surface at the hit.
              */
-            [[nodiscard]] virtual std::pair<HitData, Object*> checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
+            [[nodiscard]] virtual HitRecord checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const;
             
+            /**
+             * Same as checkIfHit, also counting the nodes visited and primitives tested in the world BVH and in the BVHs of the meshes the ray reaches.
+             * Objects without an AABB are tested by every ray and are counted as primitives. The BVH must have been generated.
+             */
+            [[nodiscard]] HitRecord checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, BVHTraversalStats& stats) const;
+
             ~World();
         
     };
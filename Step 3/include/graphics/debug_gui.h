@@ -38,13 +38,15 @@ namespace Raytracing {
     
     class DebugBVH : public DebugObject {
         private:
-            BVHTree* m_bvhTree = nullptr;
-            TriangleBVHTree* m_triangleBVHTree = nullptr;
+            FlatBVH* m_bvhTree = nullptr;
+            std::string m_name;
             Shader& m_shader;
         public:
-            explicit DebugBVH(BVHTree* bvhTree, Shader& shader);
-            
-            explicit DebugBVH(TriangleBVHTree* bvhTree, Shader& shader);
+            /**
+             * @param bvhTree either the world BVH or the BVH of a mesh
+             * @param name title of the debug window
+             */
+            explicit DebugBVH(FlatBVH* bvhTree, Shader& shader, std::string name = "BVH Data");
             
             void render();
             
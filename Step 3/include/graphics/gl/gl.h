@@ -263,6 +263,9 @@ class VAO {
         // draw as if it's a box that we need to bulk draw.
         void draw(Raytracing::Shader& shader, const std::vector<Raytracing::Vec4>& positions) const;
         
+        // draws a single copy moved by the transform
+        void draw(Raytracing::Shader& shader, Raytracing::Mat4x4 transform) const;
+        
         void draw(Raytracing::Shader& shader);
         
         ~VAO();
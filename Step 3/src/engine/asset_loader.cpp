@@ -0,0 +1,168 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include "engine/asset_loader.h"
+#include "engine/util/loaders.h"
+#include "engine/bvh_cache.h"
+
+#ifdef USE_OPENMP
+
+    #include <omp.h>
+
+#endif
+
+namespace Raytracing {
+
+    static const char* STAGE_NAMES[] = {"mesh loading", "texture decoding", "mesh BVH building"};
+
+    static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    AssetLoader::AssetLoader(World& world, unsigned int threads):
+            world(world), bvhOptions(world.getConfig().bvhOptions), bvhCachePath(world.getConfig().bvhCachePath), start(std::chrono::steady_clock::now()) {
+        threadCount = threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+#ifdef USE_OPENMP
+        parallelThreads = omp_get_max_threads();
+#endif
+        for (unsigned int i = 0; i < threadCount; i++)
+            workers.emplace_back(&AssetLoader::work, this);
+    }
+
+    AssetLoader::~AssetLoader() {
+        finish();
+    }
+
+    void AssetLoader::submit(Stage stage, std::function<void()> task) {
+        std::scoped_lock guard(lock);
+        auto timedTask = [this, stage, task = std::move(task)]() {
+            auto taskStart = std::chrono::steady_clock::now();
+            task();
+            auto time = millisecondsSince(taskStart);
+            std::scoped_lock timingGuard(lock);
+            timings[stage].count++;
+            timings[stage].work += time;
+            timings[stage].finished = std::max(timings[stage].finished, millisecondsSince(start));
+        };
+        // BVH builds go ahead of everything still queued, a mesh is only done once its BVH is
+        if (stage == MESH_BVH)
+            tasks.push_front(std::move(timedTask));
+        else
+            tasks.push_back(std::move(timedTask));
+        unfinishedTasks++;
+        condition.notify_one();
+    }
+
+    void AssetLoader::work() {
+        std::unique_lock guard(lock);
+        while (true) {
+            condition.wait(guard, [this]() { return !tasks.empty() || (finishing && unfinishedTasks == 0); });
+            if (tasks.empty())
+                return;
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            runningTasks++;
+#ifdef USE_OPENMP
+            // the loaders and BVH builders use OpenMP themselves. Each task gets an even share of the cores between the tasks running
+            // when it starts, so many small assets don't all start a team of every core while a lone large one still gets the machine.
+            omp_set_num_threads(std::max(1, parallelThreads / runningTasks));
+#endif
+            guard.unlock();
+            try {
+                task();
+            } catch (...) {
+                std::scoped_lock errorGuard(lock);
+                if (error == nullptr)
+                    error = std::current_exception();
+            }
+            guard.lock();
+            runningTasks--;
+            // the last task finishing has to wake the workers waiting to stop
+            if (--unfinishedTasks == 0)
+                condition.notify_all();
+        }
+    }
+
+    void AssetLoader::finish() {
+        {
+            std::scoped_lock guard(lock);
+            finishing = true;
+        }
+        condition.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    void AssetLoader::loadMesh(const std::string& file) {
+        size_t index;
+        {
+            std::scoped_lock guard(lock);
+            for (const auto& job : meshes)
+                if (job.file == file)
+                    return;
+            index = meshes.size();
+            meshes.push_back({file, nullptr});
+        }
+        submit(
+                MESH_LOAD, [this, file, index]() {
+                    auto mesh = std::make_shared<MeshAsset>(OBJLoader::loadMesh(file), bvhOptions);
+                    {
+                        std::scoped_lock guard(lock);
+                        meshes[index].mesh = mesh;
+                    }
+                    // the cache is checked for this mesh's own tree, the file existing says nothing about whether it is for this scene
+                    if (!bvhCachePath.empty() && BVHCache::containsMesh(bvhCachePath, BVHCache::hashMesh(*mesh))) {
+                        std::scoped_lock guard(lock);
+                        cachedMeshBVHs++;
+                    } else
+                        submit(MESH_BVH, [mesh]() { mesh->buildBVH(); });
+                }
+        );
+    }
+
+    void AssetLoader::loadTexture(const std::string& name, const std::string& file, float scale) {
+        size_t index;
+        {
+            std::scoped_lock guard(lock);
+            for (const auto& job : textures)
+                if (job.name == name)
+                    return;
+            index = textures.size();
+            textures.push_back({name, file, scale, {}});
+        }
+        submit(
+                TEXTURE_DECODE, [this, file, index]() {
+                    auto image = TextureCache::load(file);
+                    std::scoped_lock guard(lock);
+                    textures[index].image = image;
+                }
+        );
+    }
+
+    void AssetLoader::wait() {
+        finish();
+        if (error != nullptr)
+            std::rethrow_exception(error);
+        for (auto& job : meshes)
+            world.addMesh(job.file, job.mesh);
+        for (auto& job : textures)
+            world.add(job.name, new TexturedMaterial(job.file, std::move(job.image), job.scale));
+        ilog << "Loaded " << meshes.size() << " meshes and " << textures.size() << " textures on " << threadCount << " threads in "
+             << millisecondsSince(start) << "ms.\n";
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            ilog << "\t" << STAGE_NAMES[i] << ": " << timings[i].count << " done by " << timings[i].finished << "ms, " << timings[i].work
+                 << "ms of work" << (i == MESH_BVH ? ", " + std::to_string(cachedMeshBVHs) + " left for the BVH cache.\n" : ".\n");
+        }
+        auto textureStats = TextureCache::getStats();
+        ilog << "\ttexture cache: " << textureStats.residentImages << " images resident using " << (double) textureStats.residentBytes / 1024.0 / 1024.0
+             << " MB, " << textureStats.shared << " of " << textureStats.requests << " loads shared an image already decoded.\n";
+        if (textureStats.pagedImages > 0)
+            ilog << "\t" << textureStats.pagedImages << " of the images are paged, with a budget of " << textureStats.budgetPages << " pages ("
+                 << (double) (textureStats.budgetPages * sizeof(TexturePage)) / 1024.0 / 1024.0 << " MB).\n";
+        meshes.clear();
+        textures.clear();
+    }
+
+}
@@ -0,0 +1,1716 @@
+/*
+ * Created by Brett Terpstra 6920201 on 16/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/benchmark.h>
+#include <engine/world.h>
+#include <engine/raytracing.h>
+#include <engine/math/simd.h>
+#include <engine/util/mesh_file.h>
+#include <engine/image/texture_cache.h>
+#include <engine/image/stb/stb_image.h>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <unordered_set>
+#include <filesystem>
+#include <thread>
+
+namespace Raytracing {
+
+    using BenchmarkClock = std::chrono::steady_clock;
+
+    static double millisecondsSince(const BenchmarkClock::time_point& start) {
+        return std::chrono::duration<double, std::milli>(BenchmarkClock::now() - start).count();
+    }
+
+    /**
+     * Creates a UV sphere of radius 1, used to get meshes of any size for the benchmarks.
+     * @return a mesh with 2 * rings * segments triangles
+     */
+    static ModelData generateSphere(int rings, int segments) {
+        ModelData data;
+        for (int r = 0; r <= rings; r++) {
+            PRECISION_TYPE phi = M_PI * r / rings;
+            for (int s = 0; s <= segments; s++) {
+                PRECISION_TYPE theta = 2 * M_PI * s / segments;
+                Vec4 pos{std::sin(phi) * std::cos(theta), std::cos(phi), std::sin(phi) * std::sin(theta)};
+                data.vertices.push_back(pos);
+                data.normals.push_back(pos);
+                data.uvs.emplace_back((PRECISION_TYPE) s / segments, (PRECISION_TYPE) r / rings, 0);
+            }
+        }
+        for (int r = 0; r < rings; r++) {
+            for (int s = 0; s < segments; s++) {
+                int i1 = r * (segments + 1) + s;
+                int i2 = i1 + segments + 1;
+                data.faces.push_back({i1, i2, i1 + 1, i1, i2, i1 + 1, i1, i2, i1 + 1});
+                data.faces.push_back({i1 + 1, i2, i2 + 1, i1 + 1, i2, i2 + 1, i1 + 1, i2, i2 + 1});
+            }
+        }
+        return data;
+    }
+
+    /**
+     * Creates rays which start outside the AABB and point at random points inside it, so most of them will be near the mesh.
+     */
+    static std::vector<Ray> generateRaysTowards(const AABB& aabb, int count) {
+        Random random{0.0, 1.0};
+        std::vector<Ray> rays;
+        rays.reserve(count);
+        auto center = aabb.getCenter();
+        auto extent = aabb.getMax() - aabb.getMin();
+        auto radius = std::max(extent.magnitude(), (PRECISION_TYPE) 1.0);
+        for (int i = 0; i < count; i++) {
+            Vec4 direction;
+            do {
+                direction = {(PRECISION_TYPE) (random.getDouble() * 2 - 1), (PRECISION_TYPE) (random.getDouble() * 2 - 1), (PRECISION_TYPE) (random.getDouble() * 2 - 1)};
+            } while (direction.lengthSquared() > 1 || direction.lengthSquared() < EPSILON);
+            auto origin = center + direction.normalize() * radius * 2;
+            Vec4 target{
+                    center.x() + (PRECISION_TYPE) (random.getDouble() - 0.5) * extent.x(), center.y() + (PRECISION_TYPE) (random.getDouble() - 0.5) * extent.y(),
+                    center.z() + (PRECISION_TYPE) (random.getDouble() - 0.5) * extent.z()};
+            rays.emplace_back(origin, (target - origin).normalize());
+        }
+        return rays;
+    }
+
+    /**
+     * Compares tracing rays through the per mesh triangle BVH against testing every triangle of the mesh.
+     */
+    static int meshBVHBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const auto resources = parser.getOptionValue("--resources");
+
+        std::vector<std::pair<std::string, ModelData>> meshes;
+        for (const std::string model : {"debugcube.obj", "house.obj", "deathsphere.obj", "spider.obj", "monkey.obj"})
+            meshes.emplace_back(model, OBJLoader::loadModel(resources + "models/" + model));
+        for (int size : {8, 24, 64})
+            meshes.emplace_back("sphere " + std::to_string(size), generateSphere(size, size * 2));
+
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        int failures = 0;
+        std::stringstream results;
+        results << std::left << std::setw(18) << "mesh" << std::right << std::setw(10) << "triangles" << std::setw(14) << "brute (ms)"
+                << std::setw(14) << "bvh (ms)" << std::setw(10) << "speedup" << std::setw(12) << "mismatches" << "\n";
+        for (auto& mesh : meshes) {
+            ModelObject object{{0, 0, 0}, mesh.second, &material};
+            object.buildBVH();
+            auto rays = generateRaysTowards(object.getAABB(), rayCount);
+
+            std::vector<HitRecord> bruteResults;
+            bruteResults.reserve(rays.size());
+            auto start = BenchmarkClock::now();
+            for (const auto& ray : rays)
+                bruteResults.push_back(object.intersectBruteForce(ray, 0.001, infinity));
+            auto bruteTime = millisecondsSince(start);
+
+            std::vector<HitRecord> bvhResults;
+            bvhResults.reserve(rays.size());
+            start = BenchmarkClock::now();
+            for (const auto& ray : rays)
+                bvhResults.push_back(object.intersect(ray, 0.001, infinity));
+            auto bvhTime = millisecondsSince(start);
+
+            // both should find the same closest hit, triangles sharing an edge can give either one but the distance will be the same.
+            int mismatches = 0;
+            for (size_t i = 0; i < rays.size(); i++) {
+                if (bruteResults[i].hit != bvhResults[i].hit ||
+                    (bruteResults[i].hit && std::abs(bruteResults[i].t - bvhResults[i].t) > EPSILON))
+                    mismatches++;
+            }
+            failures += mismatches;
+
+            results << std::left << std::setw(18) << mesh.first << std::right << std::setw(10) << mesh.second.faces.size() << std::fixed
+                    << std::setprecision(2) << std::setw(14) << bruteTime << std::setw(14) << bvhTime << std::setw(9) << bruteTime / bvhTime
+                    << "x" << std::setw(12) << mismatches << "\n";
+        }
+        ilog << "Mesh BVH vs brute force, " << rayCount << " rays per mesh:\n" << results.str();
+        if (failures > 0)
+            elog << "The mesh BVH disagreed with brute force on " << failures << " rays!\n";
+        return failures > 0;
+    }
+
+    /**
+     * Creates triangles scattered randomly through a large box, like the fields of small objects the main scene generates but much bigger.
+     * @param largeCount number of extra triangles with their corners anywhere in the box, which overlap everything like the floor and skybox do
+     */
+    static ModelData generateTriangleField(int count, int largeCount = 0) {
+        Random random{0.0, 1.0};
+        ModelData data;
+        data.uvs.emplace_back(0, 0, 0);
+        data.normals.emplace_back(0, 1, 0);
+        for (int i = 0; i < count + largeCount; i++) {
+            Vec4 center{(PRECISION_TYPE) (random.getDouble() * 1000), (PRECISION_TYPE) (random.getDouble() * 100), (PRECISION_TYPE) (random.getDouble() * 1000)};
+            for (int v = 0; v < 3; v++) {
+                if (i < count)
+                    data.vertices.push_back(center + Vec4{(PRECISION_TYPE) (random.getDouble() - 0.5), (PRECISION_TYPE) (random.getDouble() - 0.5),
+                                                           (PRECISION_TYPE) (random.getDouble() - 0.5)});
+                else
+                    data.vertices.push_back({(PRECISION_TYPE) (random.getDouble() * 1000), (PRECISION_TYPE) (random.getDouble() * 100), (PRECISION_TYPE) (random.getDouble() * 1000)});
+            }
+            data.faces.push_back({i * 3, i * 3 + 1, i * 3 + 2, 0, 0, 0, 0, 0, 0});
+        }
+        return data;
+    }
+    
+    /**
+     * Compares the time it takes each builder to create a tree against how long it then takes to trace rays through it.
+     */
+    static int bvhBuildBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        
+        std::vector<std::pair<std::string, ModelData>> meshes;
+        meshes.emplace_back("sphere 128", generateSphere(128, 256));
+        meshes.emplace_back("field 100000", generateTriangleField(100000));
+        meshes.emplace_back("field + 64 large", generateTriangleField(100000, 64));
+        
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        int failures = 0;
+        std::stringstream results;
+        results << std::left << std::setw(18) << "mesh" << std::setw(10) << "builder" << std::right << std::setw(12) << "build (ms)"
+                << std::setw(10) << "SAH cost" << std::setw(10) << "nodes" << std::setw(14) << "trace (ms)" << std::setw(12) << "mismatches" << "\n";
+        for (auto& mesh : meshes) {
+            std::vector<HitRecord> reference;
+            for (auto builder : {SAH, SBVH, LBVH, MIDPOINT}) {
+                BVHBuildOptions options;
+                options.builder = builder;
+                ModelObject object{{0, 0, 0}, mesh.second, &material, options};
+                object.buildBVH();
+                auto rays = generateRaysTowards(object.getAABB(), rayCount);
+                const auto* tree = object.getMesh()->getTriangleBVH();
+                
+                std::vector<HitRecord> hits;
+                hits.reserve(rays.size());
+                auto start = BenchmarkClock::now();
+                for (const auto& ray : rays)
+                    hits.push_back(object.intersect(ray, 0.001, infinity));
+                auto traceTime = millisecondsSince(start);
+                
+                // every builder should find the same hits as the first one
+                int mismatches = 0;
+                if (reference.empty())
+                    reference = hits;
+                for (size_t i = 0; i < rays.size(); i++) {
+                    if (reference[i].hit != hits[i].hit || (hits[i].hit && std::abs(reference[i].t - hits[i].t) > EPSILON))
+                        mismatches++;
+                }
+                failures += mismatches;
+                
+                results << std::left << std::setw(18) << mesh.first << std::setw(10) << BVHBuildOptions::builderToString(builder) << std::right
+                        << std::fixed << std::setprecision(2) << std::setw(12) << tree->getBuildTime() << std::setw(10) << tree->getSAHCost()
+                        << std::setw(10) << tree->getNodes().size() << std::setw(14) << traceTime << std::setw(12) << mismatches << "\n";
+            }
+        }
+        ilog << "BVH builders, " << rayCount << " rays per mesh:\n" << results.str();
+        if (failures > 0)
+            elog << "The builders disagreed on " << failures << " rays!\n";
+        return failures > 0;
+    }
+    
+    /**
+     * Counts the rays where the two sets of hits disagree, either on whether something was hit or how far away it was.
+     */
+    static int countMismatches(const std::vector<HitRecord>& a, const std::vector<HitRecord>& b) {
+        int mismatches = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].hit != b[i].hit || (a[i].hit && std::abs(a[i].t - b[i].t) > EPSILON))
+                mismatches++;
+        }
+        return mismatches;
+    }
+    
+    /**
+     * Moves a field of meshes a little further every frame and compares refitting the world BVH against building a new one.
+     * Then removes and inserts objects and checks the updated tree against a tree built over the same objects.
+     */
+    static int bvhUpdateBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const int objectCount = 1000;
+        const int frames = 8;
+        
+        Random random{0.0, 1.0};
+        auto randomPosition = [&random]() -> Vec4 {
+            return {(PRECISION_TYPE) (random.getDouble() * 500), (PRECISION_TYPE) (random.getDouble() * 50), (PRECISION_TYPE) (random.getDouble() * 500)};
+        };
+        auto sphere = std::make_shared<MeshAsset>(generateSphere(4, 8));
+        sphere->buildBVH();
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        std::vector<std::unique_ptr<ModelObject>> owned;
+        std::vector<Object*> objects;
+        for (int i = 0; i < objectCount; i++) {
+            owned.push_back(std::make_unique<ModelObject>(sphere, Transform{randomPosition()}, &material));
+            objects.push_back(owned.back().get());
+        }
+        auto trace = [](const BVHTree& tree, const std::vector<Ray>& rays, std::vector<HitRecord>& hits) -> double {
+            hits.clear();
+            auto start = BenchmarkClock::now();
+            for (const auto& ray : rays)
+                hits.push_back(tree.rayClosestHitIntersect(ray, 0.001, infinity));
+            return millisecondsSince(start);
+        };
+        
+        BVHTree tree{objects};
+        int failures = 0;
+        std::stringstream results;
+        results << std::left << std::setw(8) << "frame" << std::right << std::setw(12) << "refit (ms)" << std::setw(14) << "rebuild (ms)"
+                << std::setw(13) << "degradation" << std::setw(20) << "refit trace (ms)" << std::setw(22) << "rebuilt trace (ms)"
+                << std::setw(12) << "mismatches" << "\n";
+        std::vector<HitRecord> refitHits, rebuiltHits;
+        for (int frame = 1; frame <= frames; frame++) {
+            // every frame the objects move further, so the refit tree slowly gets worse than a freshly built one
+            for (auto* obj : objects) {
+                Vec4 offset{(PRECISION_TYPE) (random.getDouble() - 0.5), (PRECISION_TYPE) (random.getDouble() - 0.5), (PRECISION_TYPE) (random.getDouble() - 0.5)};
+                obj->setPosition(obj->getPosition() + offset * (10.0 * frame));
+            }
+            auto start = BenchmarkClock::now();
+            tree.refit();
+            auto refitTime = millisecondsSince(start);
+            
+            start = BenchmarkClock::now();
+            BVHTree rebuilt{objects};
+            auto rebuildTime = millisecondsSince(start);
+            
+            auto rays = generateRaysTowards(rebuilt.getNodes()[0].getAABB(), rayCount);
+            auto refitTraceTime = trace(tree, rays, refitHits);
+            auto rebuiltTraceTime = trace(rebuilt, rays, rebuiltHits);
+            int mismatches = countMismatches(refitHits, rebuiltHits);
+            failures += mismatches;
+            
+            results << std::left << std::setw(8) << frame << std::right << std::fixed << std::setprecision(2) << std::setw(12) << refitTime
+                    << std::setw(14) << rebuildTime << std::setw(13) << tree.getDegradation() << std::setw(20) << refitTraceTime
+                    << std::setw(22) << rebuiltTraceTime << std::setw(12) << mismatches << "\n";
+        }
+        ilog << "Refitting the world BVH against rebuilding it, " << objectCount << " objects and " << rayCount << " rays per frame:\n"
+             << results.str();
+        
+        // swap out a tenth of the objects, the removed ones should disappear and the inserted ones should be hit right away.
+        for (int i = 0; i < objectCount / 10; i++) {
+            size_t index = (size_t) (random.getDouble() * (PRECISION_TYPE) objects.size()) % objects.size();
+            tree.remove(objects[index]);
+            objects.erase(objects.begin() + (long) index);
+            owned.push_back(std::make_unique<ModelObject>(sphere, Transform{randomPosition()}, &material));
+            owned.back()->buildBVH();
+            objects.push_back(owned.back().get());
+            tree.insert(objects.back());
+        }
+        auto degradation = tree.getDegradation();
+        BVHTree reference{objects};
+        auto rays = generateRaysTowards(reference.getNodes()[0].getAABB(), rayCount);
+        trace(reference, rays, rebuiltHits);
+        trace(tree, rays, refitHits);
+        int insertMismatches = countMismatches(refitHits, rebuiltHits);
+        bool rebuiltAfterUpdate = tree.update();
+        trace(tree, rays, refitHits);
+        int updateMismatches = countMismatches(refitHits, rebuiltHits);
+        failures += insertMismatches + updateMismatches;
+        ilog << "After removing and inserting " << objectCount / 10 << " objects the degradation was " << degradation << ", update() "
+             << (rebuiltAfterUpdate ? "rebuilt" : "refit") << " the tree. Mismatches before update: " << insertMismatches << ", after: "
+             << updateMismatches << "\n";
+        
+        if (failures > 0)
+            elog << "The updated BVH disagreed with a rebuilt BVH on " << failures << " rays!\n";
+        return failures > 0;
+    }
+    
+    /**
+     * Creates the objects of the scene rendered by main.cpp, using the same random seed so everything is in the same place.
+     * Only the geometry matters to the benchmarks so every object uses the provided material.
+     */
+    static std::vector<std::unique_ptr<Object>> createStandardScene(Parser& parser, Material* material, const BVHBuildOptions& options) {
+        const auto resources = parser.getOptionValue("--resources");
+        std::unordered_map<std::string, std::shared_ptr<MeshAsset>> models;
+        for (const std::string model : {"spider", "house", "plane", "planeflipped", "debugcube", "cubeflipped", "floor", "deathsphere"}) {
+            auto mesh = std::make_shared<MeshAsset>(OBJLoader::loadModel(resources + "models/" + model + ".obj"), options);
+            mesh->buildBVH();
+            models.insert({model, mesh});
+        }
+        
+        std::vector<std::unique_ptr<Object>> objects;
+        auto addModel = [&](const Vec4& position, const std::string& model) -> void {
+            objects.push_back(std::make_unique<ModelObject>(models[model], Transform{position}, material));
+        };
+        addModel({0, 0, 0}, "floor");
+        addModel({0, 0, 0}, "cubeflipped");
+        addModel({10, 4, -20}, "deathsphere");
+        addModel({0, 2, 0}, "spider");
+        addModel({-5, 5, 0}, "plane");
+        addModel({-5.001, 5, 0}, "planeflipped");
+        addModel({0, 1, -5}, "house");
+        addModel({0, 1, 5}, "house");
+        
+        Random chance(0.0, 1.0);
+        for (int i = -49; i < 50; i += 3) {
+            for (int j = -49; j < 50; j += 3) {
+                if (i * i + j * j < 125)
+                    continue;
+                if (chance.getDouble() <= 0.25) {
+                    auto pos = Vec4{(PRECISION_TYPE) (i + chance.getDouble()), 0, (PRECISION_TYPE) (j + chance.getDouble())};
+                    if (i % 2 == 0) {
+                        addModel({pos.x(), 1, pos.z()}, "debugcube");
+                    } else {
+                        PRECISION_TYPE radius = (chance.getDouble() + 0.15f) * 2.0f;
+                        pos = Vec4{pos.x(), radius, pos.z()};
+                        if (chance.getDouble() <= 0.75)
+                            objects.push_back(std::make_unique<SphereObject>(pos, radius, material));
+                        else
+                            objects.push_back(std::make_unique<SphereObject>(pos, chance.getDouble() * 2.5f, material));
+                    }
+                }
+            }
+        }
+        return objects;
+    }
+    
+    /**
+     * Compares the binary BVH against the collapsed BVH4, first just the box tests and then tracing camera rays through the standard scene.
+     */
+    static int bvhWideBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        int failures = 0;
+        
+        // the same rays go through both widths, from the camera used by main.cpp
+        Image image(160, 90);
+        Camera camera(90, image);
+        camera.setPosition({15.5, 10, 22});
+        camera.lookAt({0, 4, 0});
+        Random random{0.0, 1.0};
+        std::vector<Ray> rays;
+        rays.reserve(rayCount);
+        for (int i = 0; i < rayCount; i++)
+            rays.push_back(camera.projectRay(random.getDouble() * (PRECISION_TYPE) image.getWidth(), random.getDouble() * (PRECISION_TYPE) image.getHeight()));
+        
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        BVHBuildOptions binaryOptions;
+        binaryOptions.width = 2;
+        BVHBuildOptions wideOptions;
+        wideOptions.width = BVH4_WIDTH;
+        auto binaryScene = createStandardScene(parser, &material, binaryOptions);
+        auto wideScene = createStandardScene(parser, &material, wideOptions);
+        std::vector<Object*> binaryObjects, wideObjects;
+        for (auto& obj : binaryScene)
+            binaryObjects.push_back(obj.get());
+        for (auto& obj : wideScene)
+            wideObjects.push_back(obj.get());
+        BVHTree binaryTree{binaryObjects, binaryOptions};
+        BVHTree wideTree{wideObjects, wideOptions};
+        
+        // box tests on their own, every ray against every wide node of the largest mesh compared to four binary node tests.
+        const BVH4* largest = &wideTree.getWideTree();
+        for (auto* obj : wideObjects) {
+            auto* model = dynamic_cast<ModelObject*>(obj);
+            if (model != nullptr && model->getMesh()->getTriangleBVH()->getWideTree().getNodes().size() > largest->getNodes().size())
+                largest = &model->getMesh()->getTriangleBVH()->getWideTree();
+        }
+        const auto& wideNodes = largest->getNodes();
+        std::vector<BVHFlatNode> boxes;
+        for (const auto& node : wideNodes) {
+            for (int slot = 0; slot < BVH4_WIDTH; slot++) {
+                // empty slots have their bounds inverted, the binary test would treat them as a real box
+                if (node.bounds[0][0][slot] > node.bounds[1][0][slot])
+                    continue;
+                BVHFlatNode box{};
+                box.setAABB(node.getChildAABB(slot));
+                boxes.push_back(box);
+            }
+        }
+        long scalarHits = 0, wideHits = 0;
+        auto start = BenchmarkClock::now();
+        for (const auto& ray : rays) {
+            for (const auto& box : boxes)
+                scalarHits += box.intersects(ray, 0.001, infinity).hit;
+        }
+        auto scalarTime = millisecondsSince(start);
+        start = BenchmarkClock::now();
+        for (const auto& ray : rays) {
+            BVH4Ray wideRay{ray};
+            alignas(32) PRECISION_TYPE tEntry[BVH4_WIDTH];
+            for (const auto& node : wideNodes)
+                wideHits += std::popcount((unsigned int) node.intersects(wideRay, 0.001, infinity, tEntry));
+        }
+        auto wideTime = millisecondsSince(start);
+
+        std::stringstream results;
+        results << std::fixed << std::setprecision(2) << "Slab tests of " << boxes.size() << " boxes against " << rays.size() << " rays: "
+                << scalarTime << "ms one box at a time, " << wideTime << "ms four boxes at a time (" << scalarTime / wideTime << "x). Hits "
+                << scalarHits << " / " << wideHits << "\n";
+        
+        std::vector<HitRecord> binaryHits, wideHitResults;
+        start = BenchmarkClock::now();
+        for (const auto& ray : rays)
+            binaryHits.push_back(binaryTree.rayClosestHitIntersect(ray, 0.001, infinity));
+        auto binaryTraceTime = millisecondsSince(start);
+        start = BenchmarkClock::now();
+        for (const auto& ray : rays)
+            wideHitResults.push_back(wideTree.rayClosestHitIntersect(ray, 0.001, infinity));
+        auto wideTraceTime = millisecondsSince(start);
+        int mismatches = countMismatches(binaryHits, wideHitResults);
+        failures += mismatches;
+        
+        results << "Standard scene, " << rays.size() << " camera rays: " << binaryTraceTime << "ms through the binary BVH, " << wideTraceTime
+                << "ms through the BVH4 (" << binaryTraceTime / wideTraceTime << "x). " << binaryTree.getNodes().size() << " binary nodes, "
+                << wideTree.getWideTree().getNodes().size() << " wide nodes. Mismatches: " << mismatches << "\n";
+        ilog << results.str();
+        if (scalarHits != wideHits) {
+            elog << "The BVH4 box test disagreed with the binary box test!\n";
+            failures++;
+        }
+        if (mismatches > 0)
+            elog << "The BVH4 disagreed with the binary BVH on " << mismatches << " rays!\n";
+        return failures > 0;
+    }
+    
+    /**
+     * Checks the eight wide single precision triangle test against the double precision test on every triangle of the bundled models,
+     * then times the two on their own and while tracing through the mesh BVHs.
+     */
+    static int triangleSIMDBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const auto resources = parser.getOptionValue("--resources");
+        
+        std::vector<std::pair<std::string, ModelData>> meshes;
+        for (const std::string model : {"debugcube.obj", "house.obj", "deathsphere.obj", "spider.obj", "monkey.obj"})
+            meshes.emplace_back(model, OBJLoader::loadModel(resources + "models/" + model));
+        for (int size : {8, 24, 64})
+            meshes.emplace_back("sphere " + std::to_string(size), generateSphere(size, size * 2));
+        
+        int failures = 0;
+        std::stringstream results;
+        results << std::left << std::setw(18) << "mesh" << std::right << std::setw(10) << "triangles" << std::setw(9) << "missed" << std::setw(12)
+                << "max t err" << std::setw(12) << "max uv err" << std::setw(10) << "passed" << std::setw(12) << "scalar ns" << std::setw(11)
+                << "simd ns" << std::setw(9) << "speedup" << std::setw(14) << "scalar (ms)" << std::setw(12) << "simd (ms)" << std::setw(9)
+                << "speedup" << std::setw(12) << "mismatches" << "\n";
+        for (auto& mesh : meshes) {
+            // the mesh itself is moved away from the origin so the blocks have to keep their precision through the anchor
+            for (auto& vertex : mesh.second.vertices)
+                vertex = vertex + Vec4{250, -40, 125};
+            MeshAsset object{mesh.second};
+            object.buildBVH();
+            const auto& geometry = object.getGeometry();
+            auto blocks = object.getTriangleBVH()->getBlocks();
+            auto rays = generateRaysTowards(object.getAABB(), rayCount);
+            
+            // every ray against every triangle in both precisions. A triangle the double precision test hits must never be rejected
+            long missed = 0, passed = 0, tested = 0;
+            PRECISION_TYPE maxTError = 0, maxUVError = 0;
+            for (const auto& ray : rays) {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                for (const auto& block : blocks) {
+                    alignas(32) float t[TRIANGLE_BLOCK_WIDTH], u[TRIANGLE_BLOCK_WIDTH], v[TRIANGLE_BLOCK_WIDTH];
+                    int mask = block.intersects(block.makeRay(origin, direction, 0.001, infinity), t, u, v);
+                    for (int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+                        if (!(block.laneMask & (1u << lane)))
+                            continue;
+                        tested++;
+                        bool reported = mask & (1 << lane);
+                        passed += reported;
+                        PRECISION_TYPE exactT, exactU, exactV;
+                        if (!geometry.intersects(block.triangle[lane], origin, direction, 0.001, infinity, exactT, exactU, exactV))
+                            continue;
+                        if (!reported) {
+                            missed++;
+                            continue;
+                        }
+                        maxTError = std::max(maxTError, std::abs(t[lane] - exactT) / exactT);
+                        maxUVError = std::max(maxUVError, std::max(std::abs(u[lane] - exactU), std::abs(v[lane] - exactV)));
+                    }
+                }
+            }
+            failures += (int) missed;
+            
+            // throughput of the tests on their own, without the early max of a closest hit search
+            long scalarHits = 0, simdHits = 0;
+            auto start = BenchmarkClock::now();
+            for (const auto& ray : rays) {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                for (size_t i = 0; i < geometry.getTriangleCount(); i++) {
+                    PRECISION_TYPE t;
+                    scalarHits += geometry.intersects(i, origin, direction, 0.001, infinity, t);
+                }
+            }
+            auto scalarTime = millisecondsSince(start);
+            start = BenchmarkClock::now();
+            for (const auto& ray : rays) {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                for (const auto& block : blocks)
+                    simdHits += std::popcount((unsigned int) block.intersects(block.makeRay(origin, direction, 0.001, infinity)));
+            }
+            auto simdTime = millisecondsSince(start);
+            auto tests = (double) rays.size() * (double) geometry.getTriangleCount();
+            
+            // closest hits through the mesh BVH, every triangle tested in double precision against the blocks filtering them first
+            std::vector<PRECISION_TYPE> scalarResults, simdResults;
+            start = BenchmarkClock::now();
+            for (const auto& ray : rays) {
+                PRECISION_TYPE max = infinity;
+                object.getTriangleBVH()->traverseClosestHit(
+                        ray, 0.001, max, [&](uint32_t index, PRECISION_TYPE& tMax) {
+                            PRECISION_TYPE t;
+                            if (geometry.intersects(index, ray.getStartingPoint(), ray.getDirection(), 0.001, tMax, t))
+                                tMax = t;
+                        }
+                );
+                scalarResults.push_back(max);
+            }
+            auto scalarTraceTime = millisecondsSince(start);
+            start = BenchmarkClock::now();
+            for (const auto& ray : rays)
+                simdResults.push_back(object.intersect(ray, 0.001, infinity).t);
+            auto simdTraceTime = millisecondsSince(start);
+            int mismatches = 0;
+            for (size_t i = 0; i < rays.size(); i++) {
+                if (scalarResults[i] != simdResults[i])
+                    mismatches++;
+            }
+            failures += mismatches;
+            
+            results << std::left << std::setw(18) << mesh.first << std::right << std::setw(10) << geometry.getTriangleCount() << std::setw(9) << missed
+                    << std::scientific << std::setprecision(2) << std::setw(12) << maxTError << std::setw(12) << maxUVError << std::fixed
+                    << std::setw(9) << (double) passed / (double) std::max(tested, 1l) * 100 << "%" << std::setw(12) << scalarTime * 1e6 / tests
+                    << std::setw(11) << simdTime * 1e6 / tests << std::setw(8) << scalarTime / simdTime << "x" << std::setw(14) << scalarTraceTime
+                    << std::setw(12) << simdTraceTime << std::setw(8) << scalarTraceTime / simdTraceTime << "x" << std::setw(12) << mismatches << "\n";
+            if (scalarHits > simdHits) {
+                elog << "The SIMD triangle test reported fewer hits than the scalar test on " << mesh.first << "!\n";
+                failures++;
+            }
+        }
+        ilog << "Single precision eight wide triangle test vs double precision test, " << rayCount << " rays per mesh:\n" << results.str();
+        if (failures > 0)
+            elog << "The SIMD triangle test disagreed with the scalar test " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    /**
+     * Copy of the mesh with the transform applied to its vertices, which is what an instance should look like to a ray.
+     */
+    static ModelData bakeTransform(ModelData data, const Transform& transform) {
+        for (auto& vertex : data.vertices)
+            vertex = transform.pointToWorld(vertex);
+        for (auto& normal : data.normals)
+            normal = transform.normalToWorld(normal);
+        return data;
+    }
+    
+    /**
+     * Fills a large area with rotated and scaled instances of a few meshes and traces rays through the world BVH over them.
+     * Some instances are first checked against copies of their mesh with the transform baked into the triangles.
+     */
+    static int meshInstancingBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const int instanceCount = 100000;
+        const int checkedCount = 100;
+        const auto resources = parser.getOptionValue("--resources");
+        
+        std::vector<ModelData> models;
+        std::vector<std::shared_ptr<MeshAsset>> meshes;
+        for (const std::string model : {"monkey.obj", "house.obj", "spider.obj", "debugcube.obj"}) {
+            models.push_back(OBJLoader::loadModel(resources + "models/" + model));
+            meshes.push_back(std::make_shared<MeshAsset>(models.back()));
+            meshes.back()->buildBVH();
+        }
+        Random random{0.0, 1.0};
+        auto randomTransform = [&random](PRECISION_TYPE area) -> Transform {
+            Vec4 position{(PRECISION_TYPE) (random.getDouble() * area), (PRECISION_TYPE) (random.getDouble() * 10), (PRECISION_TYPE) (random.getDouble() * area)};
+            Vec4 rotation{(PRECISION_TYPE) (random.getDouble() * 2 * M_PI), (PRECISION_TYPE) (random.getDouble() * 2 * M_PI),
+                          (PRECISION_TYPE) (random.getDouble() * 2 * M_PI)};
+            Vec4 scale{(PRECISION_TYPE) (0.5 + random.getDouble() * 1.5), (PRECISION_TYPE) (0.5 + random.getDouble() * 1.5),
+                       (PRECISION_TYPE) (0.5 + random.getDouble() * 1.5)};
+            return Transform{position, rotation, scale};
+        };
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        
+        // an instance has to find the same hits as the transformed copy, the distances only differ by rounding
+        // the baked mesh has its transformed positions rounded to floats like every mesh, so the distances only agree to a few digits of a float
+        const auto tolerance = std::max((PRECISION_TYPE) EPSILON, (PRECISION_TYPE) std::numeric_limits<float>::epsilon() * 1000);
+        int mismatches = 0;
+        for (int i = 0; i < checkedCount; i++) {
+            auto transform = randomTransform(100);
+            ModelObject instance{meshes[i % meshes.size()], transform, &material};
+            ModelObject baked{{0, 0, 0}, bakeTransform(models[i % models.size()], transform), &material};
+            baked.buildBVH();
+            for (const auto& ray : generateRaysTowards(instance.getAABB().translate(instance.getPosition()), std::max(rayCount / checkedCount, 10))) {
+                auto instanceHit = instance.intersect(ray, 0.001, infinity);
+                auto bakedHit = baked.intersect(ray, 0.001, infinity);
+                if (instanceHit.hit != bakedHit.hit || (instanceHit.hit && std::abs(instanceHit.t - bakedHit.t) > tolerance * std::max(bakedHit.t, (PRECISION_TYPE) 1.0)))
+                    mismatches++;
+            }
+        }
+        
+        auto start = BenchmarkClock::now();
+        std::vector<std::unique_ptr<ModelObject>> instances;
+        std::vector<Object*> objects;
+        instances.reserve(instanceCount);
+        objects.reserve(instanceCount);
+        // about one instance every 10 units
+        auto area = std::sqrt((PRECISION_TYPE) instanceCount) * 10;
+        size_t copiedMemory = 0;
+        for (int i = 0; i < instanceCount; i++) {
+            const auto& mesh = meshes[i % meshes.size()];
+            instances.push_back(std::make_unique<ModelObject>(mesh, randomTransform(area), &material));
+            objects.push_back(instances.back().get());
+            copiedMemory += mesh->getMemoryUsage();
+        }
+        auto createTime = millisecondsSince(start);
+        BVHTree tree{objects};
+        size_t meshMemory = 0;
+        for (const auto& mesh : meshes)
+            meshMemory += mesh->getMemoryUsage();
+        
+        auto rays = generateRaysTowards(tree.getNodes()[0].getAABB(), rayCount);
+        int hits = 0;
+        start = BenchmarkClock::now();
+        for (const auto& ray : rays)
+            hits += tree.rayClosestHitIntersect(ray, 0.001, infinity).hit;
+        auto traceTime = millisecondsSince(start);
+        
+        ilog << instanceCount << " instances of " << meshes.size() << " meshes created in " << createTime << "ms, world BVH built in "
+             << tree.getBuildTime() << "ms.\n";
+        ilog << "Memory: " << meshMemory << " bytes of meshes, " << sizeof(ModelObject) << " bytes per instance, " << tree.getMemoryUsage()
+             << " bytes of world BVH. A copy of the mesh for every instance would take " << copiedMemory << " bytes.\n";
+        ilog << rays.size() << " rays traced in " << traceTime << "ms, " << hits << " hit an instance. Rays through " << checkedCount
+             << " instances which disagreed with the transformed meshes: " << mismatches << "\n";
+        if (mismatches > 0)
+            elog << "Instanced meshes disagreed with the transformed meshes on " << mismatches << " rays!\n";
+        return mismatches > 0;
+    }
+    
+    static constexpr char PRECISION_REFERENCE_MAGIC[8] = {'R', 'T', 'P', 'R', 'E', 'C', 'R', 'F'};
+    
+    struct PrecisionReferenceHeader {
+        char magic[8];
+        // sizeof(PRECISION_TYPE) of the build which wrote the file
+        uint32_t precisionSize;
+        uint32_t width, height;
+        uint32_t padding;
+        double traceTime;
+        uint64_t geometryBytes, pixelBytes;
+    };
+    
+    struct PrecisionReferencePixel {
+        double t;
+        double shade;
+        // index of the object the camera ray hit, -1 for the sky
+        int64_t object;
+    };
+    
+    /**
+     * Renders the standard scene with one camera ray and one shadow ray per pixel. Since a build only has one PRECISION_TYPE the image is
+     * written to a reference file, which the same benchmark run from a build with the other precision compares its throughput and image against.
+     */
+    static int precisionBenchmark(Parser& parser) {
+        const auto referencePath = parser.getOptionValue("--benchmarkReference");
+        const uint32_t width = 320, height = 180;
+        const int passes = 3;
+        
+        Image image(width, height);
+        Camera camera(90, image);
+        camera.setPosition({15.5, 10, 22});
+        camera.lookAt({0, 4, 0});
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        auto scene = createStandardScene(parser, &material, {});
+        // the flipped cube around the scene is left out so rays leaving the scene miss, the same as the sky of the renderer
+        std::vector<Object*> objects;
+        std::unordered_map<Object*, int64_t> objectIndices;
+        for (size_t i = 0; i < scene.size(); i++) {
+            if (i == 1)
+                continue;
+            objectIndices.insert({scene[i].get(), (int64_t) i});
+            objects.push_back(scene[i].get());
+        }
+        BVHTree tree{objects};
+        size_t geometryBytes = tree.getMemoryUsage();
+        std::unordered_set<MeshAsset*> meshes;
+        for (auto* obj : objects) {
+            auto* model = dynamic_cast<ModelObject*>(obj);
+            if (model != nullptr && meshes.insert(model->getMesh().get()).second)
+                geometryBytes += model->getMesh()->getMemoryUsage();
+        }
+        
+        // the shadow rays start on the surface the camera rays hit, which is where too little precision shows up as acne
+        const auto light = Vec4{0.5, 1, 0.3}.normalize();
+        std::vector<PrecisionReferencePixel> pixels(width * height);
+        double traceTime = 0;
+        for (int pass = 0; pass < passes; pass++) {
+            auto start = BenchmarkClock::now();
+            for (uint32_t y = 0; y < height; y++) {
+                for (uint32_t x = 0; x < width; x++) {
+                    auto ray = camera.projectRay((PRECISION_TYPE) x + 0.5, (PRECISION_TYPE) y + 0.5);
+                    auto hit = tree.rayClosestHitIntersect(ray, 0.001, infinity);
+                    auto& pixel = pixels[y * width + x];
+                    if (!hit.hit) {
+                        pixel = {0, 1, -1};
+                        continue;
+                    }
+                    auto surface = hit.object->surfaceInteraction(ray, hit);
+                    auto normal = surface.normal;
+                    if (Vec4::dot(normal, ray.getDirection()) > 0)
+                        normal = -normal;
+                    auto lit = !tree.rayClosestHitIntersect(Ray{surface.hitPoint, light}, 0.001, infinity).hit;
+                    pixel = {(double) hit.t, 0.1 + 0.9 * std::max(0.0, (double) Vec4::dot(normal, light)) * lit, objectIndices[hit.object]};
+                }
+            }
+            // the fastest pass, the others are slowed down by whatever else the machine was doing
+            auto passTime = millisecondsSince(start);
+            traceTime = pass == 0 ? passTime : std::min(traceTime, passTime);
+        }
+        const double rayCount = 2.0 * width * height;
+        const size_t pixelBytes = (size_t) width * height * sizeof(Vec4);
+        ilog << std::fixed << std::setprecision(2) << sizeof(PRECISION_TYPE) * 8 << " bit build: " << width << "x" << height << " camera and shadow rays in "
+             << traceTime << "ms (" << rayCount / traceTime / 1000 << " million rays per second). " << geometryBytes << " bytes of geometry and BVHs, "
+             << pixelBytes << " bytes of pixels.\n";
+        
+        PrecisionReferenceHeader reference{};
+        std::ifstream referenceFile(referencePath, std::ios::binary);
+        if (referenceFile)
+            referenceFile.read(reinterpret_cast<char*>(&reference), sizeof(reference));
+        bool usable = referenceFile && std::memcmp(reference.magic, PRECISION_REFERENCE_MAGIC, sizeof(PRECISION_REFERENCE_MAGIC)) == 0 &&
+                      reference.width == width && reference.height == height;
+        std::vector<PrecisionReferencePixel> referencePixels(pixels.size());
+        if (usable)
+            usable = (bool) referenceFile.read(reinterpret_cast<char*>(referencePixels.data()), (std::streamsize) (pixels.size() * sizeof(PrecisionReferencePixel)));
+        referenceFile.close();
+        
+        if (!usable || reference.precisionSize == sizeof(PRECISION_TYPE)) {
+            PrecisionReferenceHeader header{};
+            std::memcpy(header.magic, PRECISION_REFERENCE_MAGIC, sizeof(PRECISION_REFERENCE_MAGIC));
+            header.precisionSize = sizeof(PRECISION_TYPE);
+            header.width = width;
+            header.height = height;
+            header.traceTime = traceTime;
+            header.geometryBytes = geometryBytes;
+            header.pixelBytes = pixelBytes;
+            std::ofstream file(referencePath, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(pixels.data()), (std::streamsize) (pixels.size() * sizeof(PrecisionReferencePixel)));
+            if (!file) {
+                elog << "Unable to write the precision reference to " << referencePath << "\n";
+                return 1;
+            }
+            ilog << "Wrote the image to " << referencePath << ", run this benchmark from a build with" << (sizeof(PRECISION_TYPE) == sizeof(float) ? "out" : "")
+                 << " USE_FLOAT_PRECISION to compare the two.\n";
+            return 0;
+        }
+        
+        // the double image is the reference for the error, whichever build wrote the file
+        bool referenceIsDouble = reference.precisionSize == sizeof(double);
+        auto& doublePixels = referenceIsDouble ? referencePixels : pixels;
+        auto& floatPixels = referenceIsDouble ? pixels : referencePixels;
+        double doubleTime = referenceIsDouble ? reference.traceTime : traceTime;
+        double floatTime = referenceIsDouble ? traceTime : reference.traceTime;
+        size_t doubleGeometry = referenceIsDouble ? reference.geometryBytes : geometryBytes;
+        size_t floatGeometry = referenceIsDouble ? geometryBytes : reference.geometryBytes;
+        size_t doublePixelBytes = referenceIsDouble ? reference.pixelBytes : pixelBytes;
+        size_t floatPixelBytes = referenceIsDouble ? pixelBytes : reference.pixelBytes;
+        long objectMismatches = 0, shadeMismatches = 0;
+        double totalError = 0, maxError = 0, squaredError = 0, maxTError = 0;
+        for (size_t i = 0; i < pixels.size(); i++) {
+            const auto& exact = doublePixels[i];
+            const auto& approximate = floatPixels[i];
+            if (exact.object != approximate.object) {
+                objectMismatches++;
+            } else if (exact.object >= 0) {
+                maxTError = std::max(maxTError, std::abs(exact.t - approximate.t) / exact.t);
+            }
+            double error = std::abs(exact.shade - approximate.shade);
+            // a pixel which is lit in one image and shadowed in the other
+            shadeMismatches += error > 0.05;
+            totalError += error;
+            squaredError += error * error;
+            maxError = std::max(maxError, error);
+        }
+        double meanError = totalError / (double) pixels.size();
+        double psnr = squaredError == 0 ? infinity : 10 * std::log10((double) pixels.size() / squaredError);
+        ilog << std::fixed << std::setprecision(2) << "Float vs double: " << floatTime << "ms / " << doubleTime << "ms, " << doubleTime / floatTime
+             << "x the throughput. Geometry and BVHs " << floatGeometry << " / " << doubleGeometry << " bytes, pixels " << floatPixelBytes << " / "
+             << doublePixelBytes << " bytes.\n";
+        ilog << std::setprecision(6) << "Image error: mean " << meanError << ", max " << maxError << ", PSNR " << std::setprecision(2) << psnr << "dB. "
+             << objectMismatches << " of " << pixels.size() << " camera rays hit a different object, " << shadeMismatches
+             << " pixels changed shadow or shading. Largest relative error in t: " << std::scientific << maxTError << "\n";
+        // edges of objects and shadows can move by a pixel, a whole region changing means the float build is broken
+        bool failed = (double) objectMismatches > 0.001 * (double) pixels.size() || (double) shadeMismatches > 0.005 * (double) pixels.size();
+        if (failed)
+            elog << "The float build's image is too different from the double build's!\n";
+        return failed;
+    }
+    
+    /**
+     * Runs the kernels compiled for every instruction set the CPU supports, then the mix SIMD picked. The box, sphere and pixel kernels
+     * have to give exactly the results of the scalar code, the triangle filter only has to stay conservative since the wider kernels use FMA.
+     * The pixel kernels are also timed against converting the image a row at a time, the way the image output used to.
+     */
+    static int simdKernelsBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const auto resources = parser.getOptionValue("--resources");
+        
+        // boxes and triangles of one mesh, moved away from the origin like the triangle benchmark
+        auto data = OBJLoader::loadModel(resources + "models/monkey.obj");
+        for (auto& vertex : data.vertices)
+            vertex = vertex + Vec4{250, -40, 125};
+        MeshAsset mesh{data};
+        mesh.buildBVH();
+        const auto& geometry = mesh.getGeometry();
+        auto nodes = mesh.getTriangleBVH()->getWideTree().getNodes();
+        auto blocks = mesh.getTriangleBVH()->getBlocks();
+        auto meshRays = generateRaysTowards(mesh.getAABB(), rayCount);
+        
+        // batches of one to eight spheres spread around the scene the camera of main.cpp looks at
+        Random random{0.0, 1.0};
+        DiffuseMaterial material{{1, 1, 1, 1}};
+        std::vector<std::unique_ptr<SphereObject>> sphereObjects;
+        std::vector<SphereBatch> batches(256);
+        for (size_t i = 0; i < batches.size(); i++) {
+            for (size_t j = 0; j <= i % SPHERE_BATCH_WIDTH; j++) {
+                Vec4 center{(PRECISION_TYPE) (random.getDouble() * 40 - 20), (PRECISION_TYPE) (random.getDouble() * 10), (PRECISION_TYPE) (random.getDouble() * 40 - 20)};
+                sphereObjects.push_back(std::make_unique<SphereObject>(center, (PRECISION_TYPE) (0.5 + random.getDouble() * 2.5), &material));
+                sphereObjects.back()->addTo(batches[i]);
+            }
+        }
+        Image rayImage(160, 90);
+        Camera camera(90, rayImage);
+        camera.setPosition({15.5, 10, 22});
+        camera.lookAt({0, 4, 0});
+        std::vector<Ray> cameraRays;
+        cameraRays.reserve(rayCount);
+        for (int i = 0; i < rayCount; i++)
+            cameraRays.push_back(camera.projectRay(random.getDouble() * (PRECISION_TYPE) rayImage.getWidth(), random.getDouble() * (PRECISION_TYPE) rayImage.getHeight()));
+        
+        // what every level has to match. The boxes against the scalar kernel, the triangles against the double precision test
+        // and the spheres against SphereObject::intersect one sphere at a time
+        std::vector<int> expectedBoxes;
+        std::vector<PRECISION_TYPE> expectedEntries;
+        for (const auto& ray : meshRays) {
+            BVH4Ray wideRay{ray};
+            for (const auto& node : nodes) {
+                alignas(32) PRECISION_TYPE tEntry[BVH4_WIDTH];
+                expectedBoxes.push_back(SCALAR_KERNELS.boxes4(node, wideRay, 0.001, infinity, tEntry));
+                expectedEntries.insert(expectedEntries.end(), tEntry, tEntry + BVH4_WIDTH);
+            }
+        }
+        std::vector<int> expectedTriangles;
+        for (const auto& ray : meshRays) {
+            for (const auto& block : blocks) {
+                int mask = 0;
+                for (int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+                    PRECISION_TYPE t;
+                    if ((block.laneMask & (1u << lane)) &&
+                        geometry.intersects(block.triangle[lane], ray.getStartingPoint(), ray.getDirection(), 0.001, infinity, t))
+                        mask |= 1 << lane;
+                }
+                expectedTriangles.push_back(mask);
+            }
+        }
+        std::vector<std::pair<int, PRECISION_TYPE>> expectedSpheres;
+        for (const auto& ray : cameraRays) {
+            for (const auto& batch : batches) {
+                HitRecord closest{false, (PRECISION_TYPE) infinity};
+                int index = -1;
+                for (int i = 0; i < batch.count; i++) {
+                    auto result = batch.spheres[i]->SphereObject::intersect(ray, 0.001, closest.t);
+                    if (result.hit) {
+                        closest = result;
+                        index = i;
+                    }
+                }
+                expectedSpheres.emplace_back(index, closest.t);
+            }
+        }
+        
+        // a frame of random pixels, converted a row at a time like getPixelR/G/B. The row walk jumps a whole column between pixels.
+        Image image(1920, 1080);
+        for (int x = 0; x < image.getWidth(); x++) {
+            for (int y = 0; y < image.getHeight(); y++)
+                image.setPixelColor(x, y, Vec4{(PRECISION_TYPE) random.getDouble(), (PRECISION_TYPE) random.getDouble(), (PRECISION_TYPE) random.getDouble()});
+        }
+        const auto rowSize = (ptrdiff_t) image.getWidth() * 3;
+        const auto frameSize = (size_t) rowSize * image.getHeight();
+        const int frames = 10;
+        std::vector<unsigned char> expectedPixels(frameSize);
+        auto start = BenchmarkClock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            size_t pixelIndex = 0;
+            for (int j = image.getHeight() - 1; j >= 0; j--) {
+                for (int i = 0; i < image.getWidth(); i++) {
+                    expectedPixels[pixelIndex++] = image.getPixelR(i, j);
+                    expectedPixels[pixelIndex++] = image.getPixelG(i, j);
+                    expectedPixels[pixelIndex++] = image.getPixelB(i, j);
+                }
+            }
+        }
+        const double rowWalkTime = millisecondsSince(start) / frames;
+        
+        // every level on its own, then the kernels the ray tracer runs with
+        std::vector<std::pair<std::string, SIMDKernels>> tables;
+        for (int level = (int) SIMDLevel::SCALAR; level <= (int) SIMD::detect(); level++)
+            tables.emplace_back(SIMD::levelToString((SIMDLevel) level), SIMD::kernelsFor((SIMDLevel) level));
+        tables.emplace_back("selected", SIMD::kernels());
+        
+        int failures = 0;
+        double scalarTimes[3]{};
+        std::stringstream results;
+        results << std::left << std::setw(9) << "level" << std::right << std::setw(11) << "boxes ns" << std::setw(9) << "speedup" << std::setw(14)
+                << "triangles ns" << std::setw(9) << "speedup" << std::setw(12) << "spheres ns" << std::setw(9) << "speedup" << std::setw(13)
+                << "pixels (ms)" << std::setw(9) << "speedup" << std::setw(12) << "mismatches" << std::setw(14) << "missed hits" << "\n";
+        for (const auto& [name, kernels] : tables) {
+            long mismatches = 0, missed = 0;
+            
+            std::vector<int> boxes;
+            std::vector<PRECISION_TYPE> entries(expectedEntries.size());
+            boxes.reserve(expectedBoxes.size());
+            start = BenchmarkClock::now();
+            for (const auto& ray : meshRays) {
+                BVH4Ray wideRay{ray};
+                for (const auto& node : nodes)
+                    boxes.push_back(kernels.boxes4(node, wideRay, 0.001, infinity, &entries[boxes.size() * BVH4_WIDTH]));
+            }
+            double boxTime = millisecondsSince(start);
+            for (size_t i = 0; i < boxes.size(); i++) {
+                bool same = boxes[i] == expectedBoxes[i];
+                for (int c = 0; c < BVH4_WIDTH; c++)
+                    same &= !(boxes[i] & (1 << c)) || entries[i * BVH4_WIDTH + c] == expectedEntries[i * BVH4_WIDTH + c];
+                mismatches += !same;
+            }
+            
+            std::vector<int> triangles;
+            triangles.reserve(expectedTriangles.size());
+            start = BenchmarkClock::now();
+            for (const auto& ray : meshRays) {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                for (const auto& block : blocks)
+                    triangles.push_back(kernels.triangles8(block, block.makeRay(origin, direction, 0.001, infinity)));
+            }
+            double triangleTime = millisecondsSince(start);
+            for (size_t i = 0; i < triangles.size(); i++)
+                missed += std::popcount((unsigned int) (expectedTriangles[i] & ~triangles[i]));
+            
+            std::vector<std::pair<int, PRECISION_TYPE>> spheres;
+            spheres.reserve(expectedSpheres.size());
+            start = BenchmarkClock::now();
+            for (const auto& ray : cameraRays) {
+                auto origin = ray.getStartingPoint();
+                auto direction = ray.getDirection();
+                for (const auto& batch : batches) {
+                    PRECISION_TYPE t = infinity;
+                    int index = kernels.spheres(batch, origin, direction, 0.001, infinity, t);
+                    spheres.emplace_back(index, index >= 0 ? t : (PRECISION_TYPE) infinity);
+                }
+            }
+            double sphereTime = millisecondsSince(start);
+            for (size_t i = 0; i < spheres.size(); i++)
+                mismatches += spheres[i] != expectedSpheres[i];
+            
+            // 1920 and 1080 are both whole blocks
+            std::vector<unsigned char> pixels(frameSize);
+            start = BenchmarkClock::now();
+            for (int frame = 0; frame < frames; frame++) {
+                for (int x = 0; x < image.getWidth(); x += PIXEL_BLOCK_SIZE) {
+                    for (int y = 0; y < image.getHeight(); y += PIXEL_BLOCK_SIZE)
+                        kernels.pixelsToRGB8(image.getPixelData() + (size_t) x * image.getHeight() + y, image.getHeight(),
+                                             pixels.data() + (image.getHeight() - 1 - y) * rowSize + x * 3, -rowSize);
+                }
+            }
+            double pixelTime = millisecondsSince(start) / frames;
+            for (size_t i = 0; i < frameSize; i++)
+                mismatches += pixels[i] != expectedPixels[i];
+            
+            if (&kernels == &tables.front().second) {
+                scalarTimes[0] = boxTime, scalarTimes[1] = triangleTime, scalarTimes[2] = sphereTime;
+            }
+            auto boxCalls = (double) meshRays.size() * (double) nodes.size();
+            auto blockCalls = (double) meshRays.size() * (double) blocks.size();
+            auto batchCalls = (double) cameraRays.size() * (double) batches.size();
+            results << std::left << std::setw(9) << name << std::right << std::fixed << std::setprecision(2)
+                    << std::setw(11) << boxTime * 1e6 / boxCalls << std::setw(8) << scalarTimes[0] / boxTime << "x" << std::setw(14)
+                    << triangleTime * 1e6 / blockCalls << std::setw(8) << scalarTimes[1] / triangleTime << "x" << std::setw(12)
+                    << sphereTime * 1e6 / batchCalls << std::setw(8) << scalarTimes[2] / sphereTime << "x" << std::setw(13) << pixelTime << std::setw(8)
+                    << rowWalkTime / pixelTime << "x" << std::setw(12) << mismatches << std::setw(14) << missed << "\n";
+            if (mismatches > 0 || missed > 0) {
+                elog << "The " << name << " kernels disagreed with the scalar code " << mismatches + missed << " times!\n";
+                failures++;
+            }
+        }
+        ilog << "Kernels of each instruction set, " << rayCount << " rays against " << nodes.size() << " BVH4 nodes, " << blocks.size()
+             << " triangle blocks and " << sphereObjects.size() << " spheres in " << batches.size() << " batches, " << image.getWidth() << "x"
+             << image.getHeight() << " pixels against " << rowWalkTime << "ms converting them a row at a time. Selected up to "
+             << SIMD::levelToString(SIMD::kernels().level) << " (" << SIMD::describe(SIMD::kernels()) << "):\n" << results.str();
+        return failures > 0;
+    }
+    
+    /**
+     * Möller–Trumbore on a triangle as the model file gave it, in the precision of the build.
+     */
+    static bool intersectsModelTriangle(const Vec4& vertex1, const Vec4& vertex2, const Vec4& vertex3, const Ray& ray, PRECISION_TYPE max, PRECISION_TYPE& t) {
+        auto edge1 = vertex2 - vertex1;
+        auto edge2 = vertex3 - vertex1;
+        auto h = Vec4::cross(ray.getDirection(), edge2);
+        auto a = Vec4::dot(edge1, h);
+        if (a > -EPSILON && a < EPSILON)
+            return false;
+        PRECISION_TYPE f = 1.0 / a;
+        auto s = ray.getStartingPoint() - vertex1;
+        auto u = f * Vec4::dot(s, h);
+        if (u < 0.0 || u > 1.0)
+            return false;
+        auto q = Vec4::cross(s, edge1);
+        auto v = f * Vec4::dot(ray.getDirection(), q);
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+        t = f * Vec4::dot(edge2, q);
+        return t > EPSILON && t >= 0.001 && t <= max;
+    }
+    
+    /**
+     * Memory of the indexed meshes against every triangle stored on its own, which is how the meshes were kept before. Checks the compressed
+     * normals and uvs against the model files and the closest hits against testing the triangles exactly as they were loaded.
+     */
+    static int meshMemoryBenchmark(Parser& parser) {
+        const int rayCount = std::stoi(parser.getOptionValue("--benchmarkRays"));
+        const auto resources = parser.getOptionValue("--resources");
+        
+        std::vector<std::pair<std::string, ModelData>> meshes;
+        for (const std::string model : {"debugcube.obj", "house.obj", "deathsphere.obj", "spider.obj", "monkey.obj"})
+            meshes.emplace_back(model, OBJLoader::loadModel(resources + "models/" + model));
+        for (int size : {8, 24, 64})
+            meshes.emplace_back("sphere " + std::to_string(size), generateSphere(size, size * 2));
+        
+        // a shared Triangle with its nine vectors and bounds, the pointers to it in the mesh and in the triangle BVH, and the vertex and
+        // edges copied out for the intersection test. The control blocks of the pointers and the allocator's overhead aren't counted.
+        constexpr size_t separateTriangleBytes = sizeof(Triangle) + 2 * sizeof(std::shared_ptr<Triangle>) + 9 * sizeof(PRECISION_TYPE);
+        // the sphere positions are rounded to floats, which moves a hit by far less than this
+        constexpr PRECISION_TYPE tolerance = 1e-4;
+        // half of a step of the encodings, as an angle for the normals and relative to the uv for the uvs
+        constexpr double maxAllowedNormalError = 0.01, maxAllowedUVError = 1.0 / 2048;
+        
+        int failures = 0;
+        size_t totalBefore = 0, totalAfter = 0;
+        std::stringstream results;
+        results << std::left << std::setw(18) << "mesh" << std::right << std::setw(10) << "triangles" << std::setw(10) << "vertices" << std::setw(11)
+                << "hot (KB)" << std::setw(11) << "cold (KB)" << std::setw(10) << "bvh (KB)" << std::setw(13) << "bytes/tri" << std::setw(13)
+                << "before (KB)" << std::setw(11) << "reduction" << std::setw(18) << "normal err (deg)" << std::setw(12) << "uv err" << std::setw(12)
+                << "mismatches" << "\n";
+        for (auto& mesh : meshes) {
+            const auto& data = mesh.second;
+            MeshAsset asset{data};
+            asset.buildBVH();
+            const auto& geometry = asset.getGeometry();
+            
+            double maxNormalError = 0, maxUVError = 0;
+            for (size_t i = 0; i < data.faces.size(); i++) {
+                const auto& f = data.faces[i];
+                const int normals[3] = {f.n1, f.n2, f.n3};
+                const int uvs[3] = {f.uv1, f.uv2, f.uv3};
+                for (int corner = 0; corner < 3; corner++) {
+                    // the angle between the two, from the chord so it stays accurate for tiny angles
+                    auto chord = (data.normals[normals[corner]].normalize() - geometry.getNormal(i, corner)).magnitude();
+                    maxNormalError = std::max(maxNormalError, 2 * std::asin(std::min((double) chord / 2, 1.0)) * 180 / M_PI);
+                    auto uv = data.uvs[uvs[corner]];
+                    auto decoded = geometry.getUV(i, corner);
+                    maxUVError = std::max(maxUVError, (double) std::abs(uv.x() - decoded.x()) / std::max((double) std::abs(uv.x()), 1.0));
+                    maxUVError = std::max(maxUVError, (double) std::abs(uv.y() - decoded.y()) / std::max((double) std::abs(uv.y()), 1.0));
+                }
+            }
+            if (maxNormalError > maxAllowedNormalError || maxUVError > maxAllowedUVError)
+                failures++;
+            
+            int mismatches = 0;
+            for (const auto& ray : generateRaysTowards(asset.getAABB(), rayCount)) {
+                HitRecord expected{false, (PRECISION_TYPE) infinity};
+                for (const auto& f : data.faces) {
+                    PRECISION_TYPE t;
+                    if (intersectsModelTriangle(data.vertices[f.v1], data.vertices[f.v2], data.vertices[f.v3], ray, expected.t, t))
+                        expected = {true, t};
+                }
+                auto hit = asset.intersect(ray, 0.001, infinity);
+                if (hit.hit != expected.hit || (hit.hit && std::abs(hit.t - expected.t) > tolerance * std::max(expected.t, (PRECISION_TYPE) 1.0)))
+                    mismatches++;
+            }
+            failures += mismatches;
+            
+            auto triangles = geometry.getTriangleCount();
+            auto bvhBytes = asset.getTriangleBVH()->getMemoryUsage();
+            auto before = triangles * separateTriangleBytes + bvhBytes;
+            auto after = asset.getMemoryUsage();
+            totalBefore += before;
+            totalAfter += after;
+            results << std::left << std::setw(18) << mesh.first << std::right << std::setw(10) << triangles << std::setw(10)
+                    << geometry.getVertexCount() << std::fixed << std::setprecision(1) << std::setw(11) << geometry.getHotMemoryUsage() / 1024.0
+                    << std::setw(11) << geometry.getColdMemoryUsage() / 1024.0 << std::setw(10) << bvhBytes / 1024.0 << std::setw(6)
+                    << (double) geometry.getMemoryUsage() / (double) triangles << " / " << std::setw(4) << separateTriangleBytes << std::setw(13)
+                    << before / 1024.0 << std::setw(10) << (double) before / (double) after << "x" << std::scientific << std::setprecision(2)
+                    << std::setw(18) << maxNormalError << std::setw(12) << maxUVError << std::setw(12) << mismatches << "\n";
+        }
+        ilog << "Indexed meshes against separately stored triangles, bytes per triangle of the mesh data against before, " << rayCount
+             << " rays per mesh:\n" << results.str();
+        ilog << "All meshes together: " << totalAfter << " bytes with their BVHs, " << totalBefore << " before, "
+             << (double) totalBefore / (double) totalAfter << "x less.\n";
+        if (failures > 0)
+            elog << "The indexed meshes disagreed with the model files " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    /**
+     * The OBJ loader as it was before it mapped the file and parsed it in parallel, reading the file into a string and splitting every line
+     * and every token into strings of their own. Kept to check the loader against.
+     */
+    static ModelData loadModelLineByLine(const std::string& file) {
+        std::ifstream modelFile;
+        modelFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        modelFile.open(file);
+        std::stringstream modelSource;
+        modelSource << modelFile.rdbuf();
+        modelFile.close();
+        
+        ModelData data;
+        for (const auto& line : String::split(modelSource.str(), "\n")) {
+            auto spaces = String::split(line, " ");
+            if (line.starts_with("v ")) {
+                data.vertices.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), std::stof(spaces[3]));
+            } else if (line.starts_with("vt ")) {
+                data.uvs.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), 0);
+            } else if (line.starts_with("vn ")) {
+                data.normals.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), std::stof(spaces[3]));
+            } else if (line.starts_with("f ")) {
+                auto t1 = String::split(spaces[1], "/");
+                auto t2 = String::split(spaces[2], "/");
+                auto t3 = String::split(spaces[3], "/");
+                data.faces.push_back({std::stoi(t1[0]) - 1, std::stoi(t2[0]) - 1, std::stoi(t3[0]) - 1, std::stoi(t1[1]) - 1, std::stoi(t2[1]) - 1,
+                                      std::stoi(t3[1]) - 1, std::stoi(t1[2]) - 1, std::stoi(t2[2]) - 1, std::stoi(t3[2]) - 1});
+            }
+        }
+        return data;
+    }
+    
+    /**
+     * Writes a UV sphere as an OBJ file. With quads each band of faces is written as soon as the ring of vertices below it is, as quads using
+     * negative indices and with no uvs or normals, which covers what the loader handles beyond plain triangles.
+     */
+    static void writeSphereOBJ(const std::string& path, int rings, int segments, bool quads) {
+        auto data = generateSphere(rings, segments);
+        std::ofstream file(path);
+        // enough digits to get every float back exactly
+        file << std::setprecision(9);
+        if (!quads) {
+            for (const auto& v : data.vertices)
+                file << "v " << (float) v.x() << " " << (float) v.y() << " " << (float) v.z() << "\n";
+            for (const auto& uv : data.uvs)
+                file << "vt " << (float) uv.x() << " " << (float) uv.y() << "\n";
+            for (const auto& n : data.normals)
+                file << "vn " << (float) n.x() << " " << (float) n.y() << " " << (float) n.z() << "\n";
+            for (const auto& f : data.faces)
+                file << "f " << f.v1 + 1 << "/" << f.uv1 + 1 << "/" << f.n1 + 1 << " " << f.v2 + 1 << "/" << f.uv2 + 1 << "/" << f.n2 + 1 << " "
+                     << f.v3 + 1 << "/" << f.uv3 + 1 << "/" << f.n3 + 1 << "\n";
+            return;
+        }
+        const int ringSize = segments + 1;
+        for (int r = 0; r <= rings; r++) {
+            for (int s = 0; s < ringSize; s++) {
+                const auto& v = data.vertices[r * ringSize + s];
+                file << "v " << (float) v.x() << " " << (float) v.y() << " " << (float) v.z() << "\n";
+            }
+            if (r == 0)
+                continue;
+            const int written = (r + 1) * ringSize;
+            for (int s = 0; s < segments; s++) {
+                int i1 = (r - 1) * ringSize + s;
+                int i2 = i1 + ringSize;
+                file << "f " << i1 - written << " " << i2 - written << " " << i2 + 1 - written << " " << i1 + 1 - written << "\n";
+            }
+        }
+    }
+    
+    /**
+     * Load time of the OBJ loader against reading the file line by line into strings, checking both read the same model. Also loads the same
+     * meshes written as quads with negative indices and no uvs or normals, checking they are split into the right triangles.
+     */
+    static int objLoaderBenchmark(Parser&) {
+        const auto trianglesPath = (std::filesystem::temp_directory_path() / "raytracing_benchmark_triangles.obj").string();
+        const auto quadsPath = (std::filesystem::temp_directory_path() / "raytracing_benchmark_quads.obj").string();
+        auto sameVectors = [](const std::vector<Vec4>& a, const std::vector<Vec4>& b) -> bool {
+            return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const Vec4& x, const Vec4& y) -> bool {
+                return x.x() == y.x() && x.y() == y.y() && x.z() == y.z();
+            });
+        };
+        
+        int mismatches = 0;
+        std::stringstream results;
+        results << std::left << std::setw(30) << "file" << std::right << std::setw(10) << "MB" << std::setw(12) << "triangles" << std::setw(14)
+                << "time (ms)" << std::setw(10) << "MB/s" << "\n" << std::fixed << std::setprecision(2);
+        auto addResult = [&results](const std::string& name, const std::string& path, size_t triangles, double time) {
+            auto megabytes = (double) std::filesystem::file_size(path) / (1024.0 * 1024.0);
+            results << std::left << std::setw(30) << name << std::right << std::setw(10) << megabytes << std::setw(12) << triangles << std::setw(14)
+                    << time << std::setw(10) << megabytes / (time / 1000) << "\n";
+        };
+        // the line by line loader takes time quadratic in the size of the file, so it only reads the smaller sphere
+        for (int rings : {64, 256}) {
+            const int segments = rings * 2;
+            const auto size = std::to_string(rings) + "x" + std::to_string(segments);
+            writeSphereOBJ(trianglesPath, rings, segments, false);
+            writeSphereOBJ(quadsPath, rings, segments, true);
+            auto expected = generateSphere(rings, segments);
+            
+            if (rings == 64) {
+                auto start = BenchmarkClock::now();
+                auto lineByLine = loadModelLineByLine(trianglesPath);
+                addResult("triangles " + size + ", by line", trianglesPath, lineByLine.faces.size(), millisecondsSince(start));
+                // the floats written to the file are what both loaders have to read back
+                expected = lineByLine;
+            }
+            auto start = BenchmarkClock::now();
+            auto loaded = OBJLoader::loadModel(trianglesPath);
+            addResult("triangles " + size, trianglesPath, loaded.faces.size(), millisecondsSince(start));
+            start = BenchmarkClock::now();
+            auto quads = OBJLoader::loadModel(quadsPath);
+            addResult("quads " + size, quadsPath, quads.faces.size(), millisecondsSince(start));
+            
+            mismatches += !sameVectors(loaded.vertices, quads.vertices);
+            mismatches += loaded.faces.size() != expected.faces.size();
+            for (size_t i = 0; i < std::min(expected.faces.size(), loaded.faces.size()); i++)
+                mismatches += std::memcmp(&expected.faces[i], &loaded.faces[i], sizeof(face)) != 0;
+            if (rings == 64) {
+                mismatches += !sameVectors(expected.vertices, loaded.vertices) + !sameVectors(expected.uvs, loaded.uvs) +
+                              !sameVectors(expected.normals, loaded.normals);
+            }
+            
+            // every quad is split into the triangles 0 1 2 and 0 2 3, all sharing one uv and each with its own flat normal
+            if (quads.faces.size() != (size_t) rings * segments * 2 || quads.uvs.size() != 1) {
+                mismatches++;
+                continue;
+            }
+            for (int r = 0; r < rings; r++) {
+                for (int s = 0; s < segments; s++) {
+                    int i1 = r * (segments + 1) + s;
+                    int i2 = i1 + segments + 1;
+                    const auto& first = quads.faces[(r * segments + s) * 2];
+                    const auto& second = quads.faces[(r * segments + s) * 2 + 1];
+                    mismatches += first.v1 != i1 || first.v2 != i2 || first.v3 != i2 + 1 || second.v1 != i1 || second.v2 != i2 + 1 || second.v3 != i1 + 1;
+                    mismatches += first.n1 != first.n2 || first.n1 != first.n3 || first.uv1 != 0 || second.uv3 != 0;
+                }
+            }
+        }
+        std::filesystem::remove(trianglesPath);
+        std::filesystem::remove(quadsPath);
+        
+        ilog << "OBJ loading of generated spheres. Mismatches: " << mismatches << "\n" << results.str();
+        if (mismatches > 0)
+            elog << "The OBJ loader read " << mismatches << " things differently!\n";
+        return mismatches > 0;
+    }
+    
+    /**
+     * Mapping meshes from their .rtmesh files against parsing and indexing the OBJ files, checking the mapped meshes are the same
+     * and that a mesh file is ignored once its OBJ file changes. Works on copies in the temporary directory so no mesh files are left
+     * next to the resources.
+     */
+    static int meshFileBenchmark(Parser& parser) {
+        const auto resources = parser.getOptionValue("--resources");
+        const auto directory = std::filesystem::temp_directory_path() / "raytracing_benchmark_meshes";
+        std::filesystem::create_directories(directory);
+        
+        std::vector<std::string> files;
+        for (const std::string model : {"debugcube.obj", "house.obj", "deathsphere.obj", "spider.obj", "monkey.obj"}) {
+            files.push_back((directory / model).string());
+            std::filesystem::copy_file(resources + "models/" + model, files.back(), std::filesystem::copy_options::overwrite_existing);
+        }
+        files.push_back((directory / "sphere256x512.obj").string());
+        writeSphereOBJ(files.back(), 256, 512, false);
+        
+        int failures = 0;
+        double totalParse = 0, totalMap = 0;
+        std::stringstream results;
+        results << std::left << std::setw(22) << "mesh" << std::right << std::setw(11) << "triangles" << std::setw(10) << "OBJ MB" << std::setw(12)
+                << "rtmesh MB" << std::setw(12) << "parse (ms)" << std::setw(10) << "map (ms)" << std::setw(10) << "speedup" << std::setw(9) << "same"
+                << "\n" << std::fixed;
+        for (const auto& file : files) {
+            auto start = BenchmarkClock::now();
+            IndexedMesh parsed{OBJLoader::loadModel(file)};
+            auto parseTime = millisecondsSince(start);
+            if (!MeshFile::write(file, parsed)) {
+                failures++;
+                continue;
+            }
+            start = BenchmarkClock::now();
+            auto mapped = MeshFile::load(file);
+            auto mapTime = millisecondsSince(start);
+            
+            auto same = [](auto a, auto b) -> bool { return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size_bytes()) == 0; };
+            bool matches = mapped && mapped->isMapped() && same(parsed.getPositions(), mapped->getPositions()) &&
+                           same(parsed.getIndices(), mapped->getIndices()) && same(parsed.getAttributes(), mapped->getAttributes()) &&
+                           parsed.getAABB().getMin() == mapped->getAABB().getMin() && parsed.getAABB().getMax() == mapped->getAABB().getMax();
+            failures += !matches;
+            totalParse += parseTime;
+            totalMap += mapTime;
+            results << std::left << std::setw(22) << std::filesystem::path(file).filename().string() << std::right << std::setw(11)
+                    << parsed.getTriangleCount() << std::setprecision(3) << std::setw(10) << (double) std::filesystem::file_size(file) / (1024.0 * 1024.0)
+                    << std::setw(12) << (double) std::filesystem::file_size(MeshFile::pathFor(file)) / (1024.0 * 1024.0) << std::setprecision(2)
+                    << std::setw(12) << parseTime << std::setw(10) << mapTime << std::setw(9) << parseTime / mapTime << "x" << std::setw(9)
+                    << (matches ? "yes" : "NO") << "\n";
+        }
+        
+        // once the OBJ file changes its mesh file must not be used
+        auto changed = files.front();
+        std::filesystem::last_write_time(changed, std::filesystem::last_write_time(changed) + std::chrono::seconds(1));
+        bool staleIgnored = !MeshFile::load(changed).has_value();
+        failures += !staleIgnored;
+        std::filesystem::remove_all(directory);
+        
+        ilog << "Mesh files against parsing the OBJ files, " << totalParse / totalMap << "x faster overall. Changed OBJ file "
+             << (staleIgnored ? "ignored its mesh file" : "STILL USED its mesh file") << ":\n" << results.str();
+        if (failures > 0)
+            elog << "The mesh files didn't match their meshes " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    static int textureCacheBenchmark(Parser& parser) {
+        const auto images = parser.getOptionValue("--resources") + "images/";
+        // the textures of the scene, with the files it uses twice, and the same image at a second scale and through other paths
+        std::vector<std::pair<std::string, float>> textures;
+        for (const std::string texture : {"029a_-_Survival_of_the_Idiots_349.jpg", "029a_-_Survival_of_the_Idiots_349.jpg", "760213.png",
+                                          "1531688878833.png", "1540046285552.jpg", "1540093100131.jpg", "1542926123924.png",
+                                          "1544568744585.jpg", "1544568782473.jpg", "1616466348379.png",
+                                          "livingmylifeinstereodoesntseemthatbad.PNG", "1659204763642001.jpg", "1659204763642001.jpg",
+                                          "zucc.png", "zucc.png", "brockboy.jpg", "brockboy.jpg"})
+            textures.emplace_back(images + texture, 1.0f);
+        textures.emplace_back(images + "brick_floor_diff_1k.png", 4.0f);
+        textures.emplace_back(images + "brick_floor_diff_1k.png", 1.0f);
+        textures.emplace_back(images + "../images/zucc.png", 2.0f);
+        const auto copy = (std::filesystem::temp_directory_path() / "raytracing_benchmark_texture.png").string();
+        std::filesystem::copy_file(images + "zucc.png", copy, std::filesystem::copy_options::overwrite_existing);
+        textures.emplace_back(copy, 1.0f);
+        
+        // every material decoding its own copy, which is what happened before the cache
+        auto start = BenchmarkClock::now();
+        std::vector<unsigned char*> separate;
+        std::vector<std::pair<int, int>> separateSizes;
+        for (const auto& texture : textures) {
+            int width, height, channels;
+            separate.push_back(stbi_load(texture.first.c_str(), &width, &height, &channels, 4));
+            separateSizes.emplace_back(width, height);
+        }
+        auto separateTime = millisecondsSince(start);
+        
+        int failures = 0;
+        std::unordered_set<const TextureImage*> distinct;
+        start = BenchmarkClock::now();
+        std::vector<std::unique_ptr<TexturedMaterial>> materials;
+        for (const auto& texture : textures)
+            materials.push_back(std::make_unique<TexturedMaterial>(texture.first, texture.second));
+        auto cacheTime = millisecondsSince(start);
+        auto stats = TextureCache::getStats();
+        // the memory the images would use if every material had its own
+        size_t separateBytes = 0;
+        for (size_t i = 0; i < materials.size(); i++) {
+            const auto& image = materials[i]->getImage();
+            bool matches = image != nullptr && separate[i] != nullptr && image->getWidth() == separateSizes[i].first &&
+                           image->getHeight() == separateSizes[i].second;
+            // the tiled full resolution level has to hold exactly the decoded pixels
+            for (int y = 0; matches && y < image->getHeight(); y++) {
+                for (int x = 0; x < image->getWidth(); x++) {
+                    uint32_t pixel;
+                    std::memcpy(&pixel, separate[i] + ((size_t) y * image->getWidth() + x) * 4, sizeof(pixel));
+                    matches &= image->getTexel(x, y) == pixel;
+                }
+            }
+            if (!matches) {
+                failures++;
+                continue;
+            }
+            separateBytes += image->getMemoryUsage();
+            distinct.insert(image.get());
+        }
+        for (auto* data : separate)
+            stbi_image_free(data);
+        // the two scales of the floor have to share one image, as do the four zucc.png materials through three different paths
+        bool contentShared = materials[17]->getImage() == materials[18]->getImage() && materials[13]->getImage() == materials[14]->getImage() &&
+                             materials[13]->getImage() == materials[19]->getImage() && materials[13]->getImage() == materials[20]->getImage();
+        failures += !contentShared;
+        failures += stats.residentImages != distinct.size();
+        
+        materials.clear();
+        std::filesystem::remove(copy);
+        bool released = TextureCache::getStats().residentImages == 0;
+        failures += !released;
+        
+        ilog << textures.size() << " textured materials using " << distinct.size() << " distinct images. Separate decoding: "
+             << separateTime << "ms, " << (double) separateBytes / (1024.0 * 1024.0) << " MB with their mip chains. Texture cache: " << cacheTime << "ms, "
+             << (double) stats.residentBytes / (1024.0 * 1024.0) << " MB, " << stats.shared << " of " << stats.requests << " loads shared, "
+             << (double) separateBytes / (double) stats.residentBytes << "x less memory. Scales, paths and copies of a file "
+             << (contentShared ? "shared" : "DID NOT SHARE") << " their image, images " << (released ? "freed" : "STILL RESIDENT") << " with their materials.\n";
+        if (failures > 0)
+            elog << "The cached images didn't match decoding them separately " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    static int textureSamplingBenchmark(Parser& parser) {
+        const auto file = parser.getOptionValue("--resources") + "images/brick_floor_diff_1k.png";
+        TexturedMaterial material{file};
+        int width, height, channels;
+        auto pixels = stbi_load(file.c_str(), &width, &height, &channels, 0);
+        if (material.getImage() == nullptr || pixels == nullptr) {
+            elog << "Unable to load " << file << " for the texture sampling benchmark!\n";
+            stbi_image_free(pixels);
+            return 1;
+        }
+        // the lookup materials used to do, a point sample of the full resolution image stored row by row
+        auto pointSample = [&](PRECISION_TYPE u, PRECISION_TYPE v) -> Vec4 {
+            u = u - std::floor(u);
+            v = 1.0 - (v - std::floor(v));
+            auto x = std::min((int) (width * u), width - 1);
+            auto y = std::min((int) (height * v), height - 1);
+            const PRECISION_TYPE colorFactor = 1.0 / 255.0;
+            const auto pixel = pixels + ((size_t) y * width + x) * channels;
+            return {pixel[0] * colorFactor, pixel[1] * colorFactor, pixel[2] * colorFactor};
+        };
+        
+        // a pixel covering a square of the texture is sampled a few times around its center, and converges to the average over the square
+        const int pixelCount = 4096, samplesPerPixel = 4, referenceSamples = 256, lookups = 1024 * 1024;
+        const PRECISION_TYPE size = std::sqrt(PRECISION_TYPE(width) * height);
+        Random random{0.0, 1.0};
+        std::stringstream results;
+        results << std::right << std::setw(16) << "texels / sample" << std::setw(16) << "point error" << std::setw(14) << "mip error" << std::setw(16)
+                << "point (ns)" << std::setw(12) << "mip (ns)" << "\n" << std::fixed << std::setprecision(4);
+        int failures = 0;
+        for (PRECISION_TYPE footprint : {0.5, 2.0, 8.0, 32.0, 128.0}) {
+            auto jitter = [&](PRECISION_TYPE center) { return center + (random.getDouble() - 0.5) * footprint / size; };
+            double pointError = 0, mipError = 0;
+            for (int pixel = 0; pixel < pixelCount; pixel++) {
+                auto u = random.getDouble(), v = random.getDouble();
+                Vec4 reference, point, mip;
+                for (int i = 0; i < referenceSamples; i++)
+                    reference = reference + pointSample(jitter(u), jitter(v));
+                for (int i = 0; i < samplesPerPixel; i++) {
+                    point = point + pointSample(jitter(u), jitter(v));
+                    mip = mip + material.getColor(jitter(u), jitter(v), footprint / size);
+                }
+                reference = reference / referenceSamples;
+                pointError += (point / samplesPerPixel - reference).lengthSquared();
+                mipError += (mip / samplesPerPixel - reference).lengthSquared();
+            }
+            pointError = std::sqrt(pointError / pixelCount);
+            mipError = std::sqrt(mipError / pixelCount);
+            // the mip chain is an average of the same texels, so it can never be further from them than sampling the full image
+            failures += mipError > pointError * 1.1 + 0.01;
+            
+            // the lookups of a grid of pixels looking at a rotated plane, the way camera rays walk across a textured floor
+            std::vector<std::pair<PRECISION_TYPE, PRECISION_TYPE>> coords;
+            const int gridSize = (int) std::sqrt(lookups);
+            const PRECISION_TYPE step = footprint / size, cosine = std::cos(0.5), sine = std::sin(0.5);
+            for (int y = 0; y < gridSize; y++)
+                for (int x = 0; x < gridSize; x++)
+                    coords.emplace_back((x * cosine - y * sine) * step, (x * sine + y * cosine) * step);
+            Vec4 sum;
+            auto start = BenchmarkClock::now();
+            for (const auto& coord : coords)
+                sum = sum + pointSample(coord.first, coord.second);
+            auto pointTime = millisecondsSince(start) * 1e6 / (double) coords.size();
+            start = BenchmarkClock::now();
+            for (const auto& coord : coords)
+                sum = sum + material.getColor(coord.first, coord.second, footprint / size);
+            auto mipTime = millisecondsSince(start) * 1e6 / (double) coords.size();
+            // keeps the lookups from being optimized out
+            failures += std::isnan(sum.x());
+            results << std::setw(16) << std::setprecision(1) << footprint << std::setprecision(4) << std::setw(16) << pointError << std::setw(14)
+                    << mipError << std::setprecision(1) << std::setw(16) << pointTime << std::setw(12) << mipTime << "\n";
+        }
+        stbi_image_free(pixels);
+        
+        ilog << "Point sampling the full image against sampling the mip level matching the footprint, " << samplesPerPixel
+             << " samples per pixel against the average of " << referenceSamples << ". " << width << "x" << height << " texture with "
+             << material.getImage()->getLevelCount() << " levels:\n" << results.str();
+        if (failures > 0)
+            elog << "The mip levels were further from the footprint's average than point sampling " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    static int texturePagingBenchmark(Parser& parser) {
+        const auto images = parser.getOptionValue("--resources") + "images/";
+        // copied so the tiled files aren't written next to the scene's images
+        const auto directory = std::filesystem::temp_directory_path() / "raytracing_benchmark_textures";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        std::vector<std::string> files;
+        for (const std::string image : {"brick_floor_diff_1k.png", "1659204763642001.jpg", "zucc.png", "1542926123924.png", "brockboy.jpg"}) {
+            files.push_back((directory / image).string());
+            std::filesystem::copy_file(images + image, files.back());
+        }
+        
+        // the same images kept resident, made directly so the cache doesn't hand the paged images out in their place
+        int failures = 0;
+        std::vector<std::unique_ptr<TextureImage>> resident;
+        size_t residentBytes = 0;
+        auto start = BenchmarkClock::now();
+        for (const auto& file : files) {
+            int width, height, channels;
+            auto pixels = stbi_load(file.c_str(), &width, &height, &channels, 4);
+            if (pixels == nullptr) {
+                elog << "Unable to load " << file << " for the texture paging benchmark!\n";
+                std::filesystem::remove_all(directory);
+                return 1;
+            }
+            resident.push_back(std::make_unique<TextureImage>(pixels, width, height, channels, 0, 0));
+            residentBytes += resident.back()->getMemoryUsage();
+            stbi_image_free(pixels);
+        }
+        auto decodeTime = millisecondsSince(start);
+        
+        // a budget of a fifth of the textures, the first load decodes every image and writes its tiled file, the second only opens the files
+        const size_t budget = residentBytes / 5;
+        TextureCache::setBudget(budget);
+        auto loadPaged = [&files]() {
+            std::vector<std::shared_ptr<const TextureImage>> paged;
+            for (const auto& file : files)
+                paged.push_back(TextureCache::load(file));
+            return paged;
+        };
+        start = BenchmarkClock::now();
+        auto paged = loadPaged();
+        auto tileTime = millisecondsSince(start);
+        paged.clear();
+        start = BenchmarkClock::now();
+        paged = loadPaged();
+        auto openTime = millisecondsSince(start);
+        for (const auto& image : paged)
+            failures += image == nullptr || !image->isPaged();
+        if (failures > 0) {
+            elog << "The images weren't paged!\n";
+            TextureCache::setBudget(0);
+            std::filesystem::remove_all(directory);
+            return 1;
+        }
+        
+        // every texel of every level read back through a budget far smaller than the images, so most pages are evicted before the end
+        size_t texelsChecked = 0;
+        for (size_t i = 0; i < paged.size(); i++) {
+            for (int level = 0; level < resident[i]->getLevelCount(); level++) {
+                for (int y = 0; y < resident[i]->getHeight(level); y++) {
+                    for (int x = 0; x < resident[i]->getWidth(level); x++)
+                        failures += paged[i]->getTexel(x, y, level) != resident[i]->getTexel(x, y, level);
+                }
+                texelsChecked += (size_t) resident[i]->getWidth(level) * resident[i]->getHeight(level);
+            }
+        }
+        auto checkStats = TextureCache::getStats();
+        
+        // render threads walking along rows of a random image and level, the way neighbouring rays walk across a texture
+        const unsigned int threadCount = 4;
+        const int walks = 4096, walkLength = 256;
+        auto walk = [&](const std::vector<const TextureImage*>& walked, std::atomic<int>& mismatches) {
+            std::vector<std::thread> threads;
+            for (unsigned int thread = 0; thread < threadCount; thread++) {
+                threads.emplace_back([&, thread]() {
+                    std::mt19937 random{thread};
+                    for (int i = 0; i < walks; i++) {
+                        auto image = random() % walked.size();
+                        auto level = (int) (random() % 3);
+                        auto width = resident[image]->getWidth(level), height = resident[image]->getHeight(level);
+                        auto y = (int) (random() % height), x = (int) (random() % width);
+                        for (int step = 0; step < walkLength; step++)
+                            mismatches += walked[image]->getTexel((x + step) % width, y, level) != resident[image]->getTexel((x + step) % width, y, level);
+                    }
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+        };
+        std::vector<const TextureImage*> residentImages, pagedImages;
+        for (size_t i = 0; i < paged.size(); i++) {
+            residentImages.push_back(resident[i].get());
+            pagedImages.push_back(paged[i].get());
+        }
+        std::atomic<int> mismatches = 0;
+        const double lookups = (double) threadCount * walks * walkLength;
+        start = BenchmarkClock::now();
+        walk(residentImages, mismatches);
+        auto residentTime = millisecondsSince(start) * 1e6 / lookups;
+        auto before = TextureCache::getStats();
+        start = BenchmarkClock::now();
+        walk(pagedImages, mismatches);
+        auto pagedTime = millisecondsSince(start) * 1e6 / lookups;
+        auto walkStats = TextureCache::getStats();
+        // with every page fitting in the budget the second walk only finds pages already in memory, which takes no lock
+        TextureCache::setBudget(residentBytes * 2);
+        walk(pagedImages, mismatches);
+        auto warmStats = TextureCache::getStats();
+        start = BenchmarkClock::now();
+        walk(pagedImages, mismatches);
+        auto hitTime = millisecondsSince(start) * 1e6 / lookups;
+        auto hitStats = TextureCache::getStats();
+        failures += mismatches;
+        failures += hitStats.pageLoads != warmStats.pageLoads;
+        failures += checkStats.residentPages > checkStats.budgetPages || walkStats.residentPages > walkStats.budgetPages;
+        
+        // once an image changes its tiled file must be made again
+        paged.clear();
+        std::filesystem::last_write_time(files.front(), std::filesystem::last_write_time(files.front()) + std::chrono::seconds(1));
+        auto changed = TextureCache::load(files.front());
+        bool staleRemade = changed != nullptr && changed->isPaged() && changed->getTexel(17, 3) == resident.front()->getTexel(17, 3);
+        failures += !staleRemade;
+        changed = nullptr;
+        TextureCache::setBudget(0);
+        bool released = TextureCache::getStats().residentPages == 0;
+        failures += !released;
+        std::filesystem::remove_all(directory);
+        
+        ilog << files.size() << " images, " << (double) residentBytes / (1024.0 * 1024.0) << " MB resident, paged through a "
+             << (double) budget / (1024.0 * 1024.0) << " MB budget. Decoding: " << decodeTime << "ms, decoding and writing the tiled files: "
+             << tileTime << "ms, opening the tiled files: " << openTime << "ms. Every texel of every level ("
+             << texelsChecked << ") read back with " << checkStats.pageLoads << " page reads and " << checkStats.evictions << " evictions.\n"
+             << threadCount << " threads walking " << walkLength << " texels at a time: resident " << residentTime << "ns per texel, paged under the budget "
+             << pagedTime << "ns (" << walkStats.pageLoads - before.pageLoads << " page reads), paged with every page in memory " << hitTime
+             << "ns. Changed image " << (staleRemade ? "had its tiled file made again" : "KEPT ITS OLD TILED FILE") << ", pages "
+             << (released ? "freed" : "STILL RESIDENT") << " with their images.\n";
+        if (failures > 0)
+            elog << "The paged images didn't match the resident images " << failures << " times!\n";
+        return failures > 0;
+    }
+    
+    static std::vector<Benchmarks::Benchmark> benchmarks{
+            {"meshBVH", "Per mesh triangle BVH against testing every triangle", meshBVHBenchmark},
+            {"bvhBuild", "Build time, tree quality and trace time of each BVH builder, including spatial splits", bvhBuildBenchmark},
+            {"bvhUpdate", "Refitting and incrementally updating the world BVH against rebuilding it", bvhUpdateBenchmark},
+            {"bvhWide", "Four wide BVH with SIMD box tests against the binary BVH", bvhWideBenchmark},
+            {"triangleSIMD", "Eight wide single precision triangle test against the double precision test, checking t, u and v", triangleSIMDBenchmark},
+            {"meshInstancing", "A hundred thousand transformed instances of shared meshes, checked against meshes with the transform baked in",
+             meshInstancingBenchmark},
+            {"precision", "Throughput and image of the float build against the double build, compared through the --benchmarkReference file",
+             precisionBenchmark},
+            {"simdKernels", "Box, triangle, sphere and pixel kernels of every instruction set the CPU supports and the mix picked from them against the scalar code",
+             simdKernelsBenchmark},
+            {"meshMemory", "Memory of the indexed meshes against storing every triangle separately, checking the compressed normals and uvs",
+             meshMemoryBenchmark},
+            {"objLoader", "Mapped, parallel OBJ loader against reading the file line by line, including quads and negative indices",
+             objLoaderBenchmark},
+            {"meshFile", "Mapping meshes from .rtmesh files against parsing and indexing the OBJ files", meshFileBenchmark},
+            {"textureCache", "Materials sharing images through the texture cache against every material decoding its own copy",
+             textureCacheBenchmark},
+            {"textureSampling", "Mip level picked from the ray footprint against point sampling the full image, error and lookup time",
+             textureSamplingBenchmark},
+            {"texturePaging", "Paged textures under a budget against keeping them resident, checking every texel and the lookups from several threads",
+             texturePagingBenchmark}
+    };
+
+    int Benchmarks::run(const std::string& name, Parser& parser) {
+        if (name == "list") {
+            for (const auto& benchmark : benchmarks)
+                ilog << benchmark.name << " - " << benchmark.description << "\n";
+            return 0;
+        }
+        int result = 0;
+        bool found = false;
+        for (const auto& benchmark : benchmarks) {
+            if (name != "all" && name != benchmark.name)
+                continue;
+            found = true;
+            ilog << "Running benchmark " << benchmark.name << "\n";
+            result |= benchmark.func(parser);
+        }
+        if (!found) {
+            elog << "Unknown benchmark {" << name << "}. Use --benchmark list to see the available benchmarks.\n";
+            return 1;
+        }
+        return result;
+    }
+}
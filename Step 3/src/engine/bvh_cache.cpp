@@ -0,0 +1,251 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/bvh_cache.h>
+#include <engine/world.h>
+#include <engine/util/mapped_file.h>
+#include <engine/util/cache_file.h>
+#include <filesystem>
+#include <cstring>
+
+namespace Raytracing {
+
+    static constexpr char BVH_CACHE_MAGIC[8] = {'R', 'T', 'B', 'V', 'H', 'C', 'A', 'C'};
+    // every array in the file starts on a cache line, which is what the nodes are aligned to in memory.
+    static constexpr uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+    struct BVHCacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t treeCount;
+        uint64_t sceneHash;
+        // sizes of the stored types, a build with a different PRECISION_TYPE or node layout can't use the file
+        uint32_t precisionSize;
+        uint32_t nodeSize;
+        uint32_t wideNodeSize;
+        uint32_t padding;
+        uint64_t fileSize;
+    };
+
+    struct BVHCacheTreeEntry {
+        uint64_t nodeOffset, nodeCount;
+        uint64_t indexOffset, indexCount;
+        uint64_t wideOffset, wideCount;
+        PRECISION_TYPE sahCost;
+        // hashMesh of the mesh the tree belongs to, 0 for the world BVH
+        uint64_t meshHash;
+    };
+
+    /**
+     * 64 bit FNV-1a, simple and fast enough to hash every triangle of the scene on startup.
+     */
+    class FNV1a {
+        private:
+            uint64_t hash = 14695981039346656037ull;
+        public:
+            void add(const void* data, size_t size) {
+                auto* bytes = static_cast<const unsigned char*>(data);
+                for (size_t i = 0; i < size; i++) {
+                    hash ^= bytes[i];
+                    hash *= 1099511628211ull;
+                }
+            }
+
+            template<typename T>
+            void add(const T& value) { add(&value, sizeof(T)); }
+
+            void add(const Vec4& vec) {
+                add(vec.x());
+                add(vec.y());
+                add(vec.z());
+            }
+
+            void add(const AABB& aabb) {
+                add(aabb.getMin());
+                add(aabb.getMax());
+            }
+
+            void add(const BVHBuildOptions& options) {
+                // field by field, the padding between them isn't guaranteed to be the same
+                add((uint32_t) options.builder);
+                add(options.binCount);
+                add(options.maxLeafSize);
+                add(options.traversalCost);
+                add(options.intersectionCost);
+                add(options.width);
+                add(options.splitBudget);
+            }
+
+            [[nodiscard]] uint64_t get() const { return hash; }
+    };
+
+    static uint64_t alignOffset(uint64_t offset) {
+        return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+    }
+
+    uint64_t BVHCache::hashMesh(const MeshAsset& mesh) {
+        FNV1a hash;
+        hash.add(mesh.getBVHOptions());
+        const auto& geometry = mesh.getGeometry();
+        hash.add(geometry.getTriangleCount());
+        for (size_t i = 0; i < geometry.getTriangleCount(); i++) {
+            hash.add(geometry.getVertex(i, 0));
+            hash.add(geometry.getVertex(i, 1));
+            hash.add(geometry.getVertex(i, 2));
+        }
+        return hash.get();
+    }
+
+    uint64_t BVHCache::hashScene(const std::vector<Object*>& objects, const std::vector<uint64_t>& meshHashes, const BVHBuildOptions& worldOptions) {
+        FNV1a hash;
+        hash.add(BVH_CACHE_VERSION);
+        hash.add(worldOptions);
+        hash.add(objects.size());
+        // the world BVH only depends on where the objects are
+        for (auto* obj : objects) {
+            hash.add(obj->getPosition());
+            hash.add(obj->getAABB());
+        }
+        hash.add(meshHashes.size());
+        for (auto meshHash : meshHashes)
+            hash.add(meshHash);
+        return hash.get();
+    }
+
+    /**
+     * @return true if the header was written by this version with the same types, and the table of trees fits in the file
+     */
+    static bool compatible(const BVHCacheHeader& header, size_t size) {
+        return std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) == 0 && header.version == BVH_CACHE_VERSION &&
+               header.precisionSize == sizeof(PRECISION_TYPE) && header.nodeSize == sizeof(BVHFlatNode) && header.wideNodeSize == sizeof(BVH4Node) &&
+               header.fileSize == size && sizeof(BVHCacheHeader) + header.treeCount * sizeof(BVHCacheTreeEntry) <= size;
+    }
+
+    bool BVHCache::containsMesh(const std::string& path, uint64_t meshHash) {
+        auto mapping = MappedFile::map(path);
+        if (mapping == nullptr || mapping->size < sizeof(BVHCacheHeader))
+            return false;
+        auto* bytes = static_cast<const char*>(mapping->data);
+        const auto& header = *reinterpret_cast<const BVHCacheHeader*>(bytes);
+        if (!compatible(header, mapping->size))
+            return false;
+        auto* entries = reinterpret_cast<const BVHCacheTreeEntry*>(bytes + sizeof(BVHCacheHeader));
+        // tree 0 is the world BVH
+        for (size_t i = 1; i < header.treeCount; i++) {
+            if (entries[i].meshHash == meshHash)
+                return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<BVHCache> BVHCache::load(const std::string& path, uint64_t sceneHash, size_t treeCount) {
+        std::error_code error;
+        if (!std::filesystem::exists(path, error)) {
+            ilog << "No BVH cache found at " << path << ", the BVHs will be built and cached.\n";
+            return nullptr;
+        }
+        // copy on write so the trees can be refit in place without touching the file
+        auto mapping = MappedFile::map(path, MapMode::COPY_ON_WRITE);
+        if (mapping == nullptr || mapping->size < sizeof(BVHCacheHeader)) {
+            wlog << "BVH cache " << path << " can't be mapped or is too small to be a cache, it will be rebuilt.\n";
+            return nullptr;
+        }
+        const auto size = mapping->size;
+        auto* bytes = static_cast<char*>(mapping->data);
+
+        const auto& header = *reinterpret_cast<const BVHCacheHeader*>(bytes);
+        if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) != 0 || header.version != BVH_CACHE_VERSION ||
+            header.precisionSize != sizeof(PRECISION_TYPE) || header.nodeSize != sizeof(BVHFlatNode) || header.wideNodeSize != sizeof(BVH4Node)) {
+            ilog << "BVH cache " << path << " was written by a different version, it will be rebuilt.\n";
+            return nullptr;
+        }
+        if (header.sceneHash != sceneHash || header.treeCount != treeCount) {
+            ilog << "BVH cache " << path << " is for a different scene, it will be rebuilt.\n";
+            return nullptr;
+        }
+        if (header.fileSize != size || sizeof(BVHCacheHeader) + treeCount * sizeof(BVHCacheTreeEntry) > size) {
+            wlog << "BVH cache " << path << " is damaged, it will be rebuilt.\n";
+            return nullptr;
+        }
+
+        auto* entries = reinterpret_cast<const BVHCacheTreeEntry*>(bytes + sizeof(BVHCacheHeader));
+        auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) -> bool {
+            return offset % BVH_CACHE_ALIGNMENT == 0 && offset <= size && count <= (size - offset) / elementSize;
+        };
+        std::vector<BVHCachedTree> trees;
+        trees.reserve(treeCount);
+        for (size_t i = 0; i < treeCount; i++) {
+            const auto& entry = entries[i];
+            if (!fits(entry.nodeOffset, entry.nodeCount, sizeof(BVHFlatNode)) || !fits(entry.indexOffset, entry.indexCount, sizeof(uint32_t)) ||
+                !fits(entry.wideOffset, entry.wideCount, sizeof(BVH4Node))) {
+                wlog << "BVH cache " << path << " is damaged, it will be rebuilt.\n";
+                return nullptr;
+            }
+            BVHCachedTree tree;
+            tree.nodes = {reinterpret_cast<BVHFlatNode*>(bytes + entry.nodeOffset), entry.nodeCount};
+            tree.primitiveIndices = {reinterpret_cast<uint32_t*>(bytes + entry.indexOffset), entry.indexCount};
+            tree.wideNodes = {reinterpret_cast<BVH4Node*>(bytes + entry.wideOffset), entry.wideCount};
+            tree.sahCost = entry.sahCost;
+            trees.push_back(tree);
+        }
+        ilog << "Loaded " << treeCount << " BVHs from the BVH cache " << path << "\n";
+        return std::unique_ptr<BVHCache>(new BVHCache(mapping, std::move(trees)));
+    }
+
+    bool BVHCache::write(const std::string& path, uint64_t sceneHash, const std::vector<const FlatBVH*>& trees, const std::vector<uint64_t>& meshHashes) {
+        BVHCacheHeader header{};
+        std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+        header.version = BVH_CACHE_VERSION;
+        header.treeCount = (uint32_t) trees.size();
+        header.sceneHash = sceneHash;
+        header.precisionSize = sizeof(PRECISION_TYPE);
+        header.nodeSize = sizeof(BVHFlatNode);
+        header.wideNodeSize = sizeof(BVH4Node);
+
+        // lay out the arrays of every tree after the header and the table of trees
+        std::vector<BVHCacheTreeEntry> entries;
+        uint64_t offset = sizeof(BVHCacheHeader) + trees.size() * sizeof(BVHCacheTreeEntry);
+        for (size_t i = 0; i < trees.size(); i++) {
+            const auto* tree = trees[i];
+            BVHCacheTreeEntry entry{};
+            entry.meshHash = i == 0 ? 0 : meshHashes[i - 1];
+            entry.nodeOffset = offset = alignOffset(offset);
+            entry.nodeCount = tree->getNodes().size();
+            offset += entry.nodeCount * sizeof(BVHFlatNode);
+            entry.indexOffset = offset = alignOffset(offset);
+            entry.indexCount = tree->getPrimitiveIndices().size();
+            offset += entry.indexCount * sizeof(uint32_t);
+            entry.wideOffset = offset = alignOffset(offset);
+            entry.wideCount = tree->getWideTree().getNodes().size();
+            offset += entry.wideCount * sizeof(BVH4Node);
+            entry.sahCost = tree->getSAHCost();
+            entries.push_back(entry);
+        }
+        header.fileSize = offset;
+
+        std::string error;
+        bool written = CacheFile::write(path, [&](std::ostream& file) {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(entries.data()), (std::streamsize) (entries.size() * sizeof(BVHCacheTreeEntry)));
+            for (size_t i = 0; i < trees.size(); i++) {
+                auto nodes = trees[i]->getNodes();
+                auto indices = trees[i]->getPrimitiveIndices();
+                auto wideNodes = trees[i]->getWideTree().getNodes();
+                CacheFile::padTo(file, entries[i].nodeOffset);
+                file.write(reinterpret_cast<const char*>(nodes.data()), (std::streamsize) nodes.size_bytes());
+                CacheFile::padTo(file, entries[i].indexOffset);
+                file.write(reinterpret_cast<const char*>(indices.data()), (std::streamsize) indices.size_bytes());
+                CacheFile::padTo(file, entries[i].wideOffset);
+                file.write(reinterpret_cast<const char*>(wideNodes.data()), (std::streamsize) wideNodes.size_bytes());
+            }
+        }, error);
+        if (!written) {
+            wlog << "Unable to write the BVH cache to " << path << ": " << error << "\n";
+            return false;
+        }
+        ilog << "Wrote " << trees.size() << " BVHs to the BVH cache " << path << " (" << header.fileSize << " bytes)\n";
+        return true;
+    }
+
+}
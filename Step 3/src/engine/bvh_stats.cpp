@@ -0,0 +1,158 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/bvh_stats.h>
+#include <fstream>
+#include <iomanip>
+#include <unordered_set>
+
+namespace Raytracing {
+
+    /**
+     * Sum of the statistics of every mesh BVH. The histograms line up since they are indexed by depth and leaf size.
+     */
+    struct MeshBVHTotals {
+        size_t meshCount = 0;
+        size_t triangleCount = 0;
+        BVHStatistics sum;
+        PRECISION_TYPE maxSAHCost = 0;
+        
+        void add(const BVHStatistics& stats, size_t triangles) {
+            auto addHistogram = [](std::vector<size_t>& total, const std::vector<size_t>& histogram) -> void {
+                if (total.size() < histogram.size())
+                    total.resize(histogram.size());
+                for (size_t i = 0; i < histogram.size(); i++)
+                    total[i] += histogram[i];
+            };
+            meshCount++;
+            triangleCount += triangles;
+            sum.nodeCount += stats.nodeCount;
+            sum.leafCount += stats.leafCount;
+            sum.wideNodeCount += stats.wideNodeCount;
+            addHistogram(sum.depthHistogram, stats.depthHistogram);
+            addHistogram(sum.leafSizeHistogram, stats.leafSizeHistogram);
+            sum.sahCost += stats.sahCost;
+            sum.memoryUsage += stats.memoryUsage;
+            sum.overlapArea += stats.overlapArea;
+            sum.interiorArea += stats.interiorArea;
+            maxSAHCost = std::max(maxSAHCost, stats.sahCost);
+        }
+    };
+    
+    static void writeHistogram(std::ostream& out, const std::vector<size_t>& histogram) {
+        out << "[";
+        for (size_t i = 0; i < histogram.size(); i++)
+            out << (i > 0 ? ", " : "") << histogram[i];
+        out << "]";
+    }
+    
+    /**
+     * Writes the members shared by the world and mesh objects, indented to sit inside them
+     */
+    static void writeTreeStatistics(std::ostream& out, const BVHStatistics& stats) {
+        out << "    \"nodes\": " << stats.nodeCount << ",\n";
+        out << "    \"leaves\": " << stats.leafCount << ",\n";
+        out << "    \"wideNodes\": " << stats.wideNodeCount << ",\n";
+        out << "    \"maxDepth\": " << (stats.depthHistogram.empty() ? 0 : stats.depthHistogram.size() - 1) << ",\n";
+        out << "    \"depthHistogram\": ";
+        writeHistogram(out, stats.depthHistogram);
+        out << ",\n    \"leafSizeHistogram\": ";
+        writeHistogram(out, stats.leafSizeHistogram);
+        out << ",\n    \"memoryBytes\": " << stats.memoryUsage << ",\n";
+        out << "    \"overlapRatio\": " << stats.getOverlapRatio() << ",\n";
+    }
+    
+    /**
+     * Mean, median, 99th percentile and max of the per ray counts. The percentiles use the nearest rank.
+     */
+    static void writeDistribution(std::ostream& out, std::vector<uint32_t>& values) {
+        std::sort(values.begin(), values.end());
+        auto percentile = [&values](double p) -> uint32_t {
+            auto rank = (size_t) std::ceil(p * (double) values.size());
+            return values[std::clamp(rank, (size_t) 1, values.size()) - 1];
+        };
+        double total = 0;
+        for (auto value : values)
+            total += value;
+        out << "{\"mean\": " << total / (double) values.size() << ", \"p50\": " << percentile(0.5) << ", \"p99\": " << percentile(0.99)
+            << ", \"max\": " << values.back() << "}";
+    }
+    
+    int BVHStatsReport::write(World& world, Camera& camera, const Image& image, int rayCount, const std::string& output) {
+        if (rayCount <= 0) {
+            elog << "The BVH statistics need at least one ray, not " << rayCount << "\n";
+            return 1;
+        }
+        if (world.getBVH() == nullptr)
+            world.generateBVH();
+        const auto* bvh = world.getBVH();
+        
+        // instances share the BVH of their mesh, which is only counted once
+        MeshBVHTotals meshes;
+        std::unordered_set<const MeshAsset*> seen;
+        for (auto* obj : world.getObjectsInWorld()) {
+            auto* model = dynamic_cast<ModelObject*>(obj);
+            if (model == nullptr || model->getMesh()->getTriangleBVH() == nullptr || !seen.insert(model->getMesh().get()).second)
+                continue;
+            meshes.add(model->getMesh()->getTriangleBVH()->computeStatistics(), model->getMesh()->getGeometry().getTriangleCount());
+        }
+        
+        Random random{0.0, 1.0};
+        std::vector<uint32_t> nodesVisited, primitivesTested;
+        nodesVisited.reserve(rayCount);
+        primitivesTested.reserve(rayCount);
+        size_t hits = 0;
+        for (int i = 0; i < rayCount; i++) {
+            auto ray = camera.projectRay(random.getDouble() * (PRECISION_TYPE) image.getWidth(), random.getDouble() * (PRECISION_TYPE) image.getHeight());
+            BVHTraversalStats stats;
+            hits += world.checkIfHit(ray, 0.001, infinity, stats).hit;
+            nodesVisited.push_back(stats.nodesVisited);
+            primitivesTested.push_back(stats.primitivesTested);
+        }
+        
+        const auto& options = bvh->getOptions();
+        auto worldStats = bvh->computeStatistics();
+        std::stringstream out;
+        out << std::setprecision(6);
+        out << "{\n";
+        out << "  \"options\": {\"builder\": \"" << BVHBuildOptions::builderToString(options.builder) << "\", \"binCount\": " << options.binCount
+            << ", \"maxLeafSize\": " << options.maxLeafSize << ", \"traversalCost\": " << options.traversalCost << ", \"intersectionCost\": "
+            << options.intersectionCost << ", \"width\": " << options.width << ", \"splitBudget\": " << options.splitBudget << "},\n";
+        out << "  \"world\": {\n";
+        out << "    \"objects\": " << world.getObjectsInWorld().size() << ",\n";
+        out << "    \"unboundedObjects\": " << bvh->noAABBObjects.size() << ",\n";
+        writeTreeStatistics(out, worldStats);
+        out << "    \"sahCost\": " << worldStats.sahCost << "\n";
+        out << "  },\n";
+        out << "  \"meshes\": {\n";
+        out << "    \"count\": " << meshes.meshCount << ",\n";
+        out << "    \"triangles\": " << meshes.triangleCount << ",\n";
+        writeTreeStatistics(out, meshes.sum);
+        out << "    \"sahCostMean\": " << (meshes.meshCount > 0 ? meshes.sum.sahCost / (PRECISION_TYPE) meshes.meshCount : 0) << ",\n";
+        out << "    \"sahCostMax\": " << meshes.maxSAHCost << "\n";
+        out << "  },\n";
+        out << "  \"rays\": {\n";
+        out << "    \"count\": " << rayCount << ",\n";
+        out << "    \"hits\": " << hits << ",\n";
+        out << "    \"nodesVisited\": ";
+        writeDistribution(out, nodesVisited);
+        out << ",\n    \"primitivesTested\": ";
+        writeDistribution(out, primitivesTested);
+        out << "\n  }\n";
+        out << "}\n";
+        
+        if (output == "-") {
+            std::cout << out.str();
+            return 0;
+        }
+        std::ofstream file(output);
+        file << out.str();
+        if (!file) {
+            elog << "Unable to write the BVH statistics to " << output << "\n";
+            return 1;
+        }
+        ilog << "Wrote the BVH statistics to " << output << "\n";
+        return 0;
+    }
+}
@@ -3,6 +3,7 @@
  * Copyright (c) Brett Terpstra 2022 All Rights Reserved
  */
 #include "engine/image/image.h"
+#include "engine/math/simd.h"
 #include <ios>
 #include <fstream>
 
@@ -60,7 +61,7 @@ namespace Raytracing {
             if (array[i + 3] == 0)
                 continue;
             // if it was set and if the processes are properly isolated there should be no issue with overriding the pixel
-            pixelData[i / 4] = Vec4{array[i], array[i + 1], array[i + 2], array[i + 3]};
+            pixelData[i / 4] = Vec4(array[i], array[i + 1], array[i + 2], array[i + 3]);
         }
     }
     
@@ -73,13 +74,28 @@ namespace Raytracing {
         if (!lowerExtension.ends_with("hdr")) {
             // unfortunately we do have to put the data into a format that STB can read
             auto* data = new unsigned char[(unsigned long) (image.getWidth()) * (unsigned long) image.getHeight() * 3];
-            int pixelIndex = 0;
-            for (int j = image.getHeight() - 1; j >= 0; j--) {
-                for (int i = 0; i < image.getWidth(); i++) {
-                    data[pixelIndex++] = image.getPixelR(i, j);
-                    data[pixelIndex++] = image.getPixelG(i, j);
-                    data[pixelIndex++] = image.getPixelB(i, j);
-                }
+            const int width = image.getWidth(), height = image.getHeight();
+            const auto rowSize = (ptrdiff_t) width * 3;
+            // the output is flipped, row 0 is the top of the image
+            auto output = [&](int x, int y) { return data + (height - 1 - y) * rowSize + x * 3; };
+            // the pixels are stored column by column, so they are converted in blocks which read a short run of each column
+            // instead of jumping a whole column ahead for every pixel of a row
+            auto convert = SIMD::kernels().pixelsToRGB8;
+            const int blockWidth = width - width % PIXEL_BLOCK_SIZE, blockHeight = height - height % PIXEL_BLOCK_SIZE;
+            for (int x = 0; x < blockWidth; x += PIXEL_BLOCK_SIZE) {
+                for (int y = 0; y < blockHeight; y += PIXEL_BLOCK_SIZE)
+                    convert(image.getPixelData() + (size_t) x * height + y, height, output(x, y), -rowSize);
+            }
+            // the edges the blocks don't cover
+            auto convertPixel = [&](int x, int y) {
+                auto* out = output(x, y);
+                out[0] = image.getPixelR(x, y);
+                out[1] = image.getPixelG(x, y);
+                out[2] = image.getPixelB(x, y);
+            };
+            for (int x = 0; x < width; x++) {
+                for (int y = x < blockWidth ? blockHeight : 0; y < height; y++)
+                    convertPixel(x, y);
             }
             
             // Writing a PPM was giving me issues, so I switched to using STB Image Write
@@ -0,0 +1,476 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include "engine/image/texture_cache.h"
+#include "engine/util/mapped_file.h"
+#include "engine/util/cache_file.h"
+#include "engine/image/stb/stb_image.h"
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <cstring>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Raytracing {
+
+    static constexpr char TEXTURE_FILE_MAGIC[8] = {'R', 'T', 'T', 'E', 'X', 'T', 'U', 'R'};
+    static constexpr size_t TEXTURE_PAGE_BYTES = TEXTURE_PAGE_TEXELS * sizeof(uint32_t);
+    // the pages start on a disk block so reading one never touches more blocks than it has to
+    static constexpr uint64_t TEXTURE_FILE_ALIGNMENT = 4096;
+
+    struct TextureFileHeader {
+        char magic[8];
+        uint32_t version;
+        // the page and tile size the file was laid out with, a build where they differ can't use it
+        uint32_t pageSize;
+        uint32_t tileSize;
+        int32_t width, height, channels;
+        // the image file the pages were made from, the tiled file is only used while these still match it
+        uint64_t sourceSize;
+        int64_t sourceModified;
+        uint64_t contentHash;
+        uint64_t pageCount;
+        uint64_t pagesOffset;
+        uint64_t fileSize;
+    };
+
+    // everything the cache knows about, only ever touched while holding the lock
+    static std::mutex cacheLock;
+    static std::unordered_map<std::string, std::weak_ptr<const TextureImage>> imagesByPath;
+    static std::unordered_map<uint64_t, std::weak_ptr<const TextureImage>> imagesByContent;
+    static TextureCache::Stats cacheStats;
+    static size_t budgetBytes = 0;
+
+    /**
+     * The memory the pages of every paged image are read into. Memory is allocated a page at a time as pages are first read until
+     * the budget is reached, from then on a page has to be evicted for every page read. Everything in here is guarded by the lock,
+     * which only threads looking up a page that isn't in memory take.
+     */
+    class TexturePool {
+        private:
+            struct Holder {
+                // the image and page the memory holds, nullptr while it is free or being filled
+                const TextureImage* image = nullptr;
+                size_t page = 0;
+            };
+            
+            std::vector<std::unique_ptr<TexturePage>> memory;
+            std::vector<Holder> holders;
+            std::vector<size_t> unused;
+            // owners of the pages being read outside the lock, other threads wanting them wait for them instead of reading them again
+            std::unordered_set<uint64_t> filling;
+            std::condition_variable filled;
+            size_t clockHand = 0;
+            size_t nextKey = 1;
+            
+            /**
+             * Finds memory for a page, evicting the page least recently looked up if the pool is as large as the budget allows.
+             * The memory is given back marked as being filled.
+             */
+            size_t take() {
+                if (!unused.empty()) {
+                    auto index = unused.back();
+                    unused.pop_back();
+                    return index;
+                }
+                if (budgetPages == 0 || memory.size() < budgetPages)
+                    return allocate();
+                // the clock: every page looked up since the hand last passed it gets another round, the first page which wasn't is evicted.
+                // two turns are enough to clear every referenced page, unless every page is being filled.
+                for (size_t step = 0; step < memory.size() * 2; step++) {
+                    auto index = clockHand;
+                    clockHand = (clockHand + 1) % memory.size();
+                    auto& holder = holders[index];
+                    if (holder.image == nullptr || memory[index]->referenced.exchange(false, std::memory_order_relaxed))
+                        continue;
+                    holder.image->pages[holder.page].store(nullptr, std::memory_order_relaxed);
+                    memory[index]->owner.store(0, std::memory_order_relaxed);
+                    holder.image = nullptr;
+                    evictions++;
+                    return index;
+                }
+                // more threads are reading pages at once than the budget has pages, going over it is the only way to let them all continue
+                return allocate();
+            }
+            
+            size_t allocate() {
+                memory.push_back(std::make_unique<TexturePage>());
+                holders.emplace_back();
+                return memory.size() - 1;
+            }
+            
+            void give(const TextureImage& image, size_t page, size_t index, uint64_t owner) {
+                auto& resident = *memory[index];
+                resident.owner.store(owner, std::memory_order_relaxed);
+                resident.referenced.store(true, std::memory_order_relaxed);
+                holders[index] = {&image, page};
+                image.pages[page].store(&resident, std::memory_order_release);
+            }
+        
+        public:
+            std::mutex lock;
+            size_t budgetPages = 0;
+            size_t pageLoads = 0;
+            size_t evictions = 0;
+            
+            uint64_t makeKey() {
+                std::scoped_lock guard(lock);
+                return nextKey++ << 32;
+            }
+            
+            [[nodiscard]] size_t residentPages() const {
+                return memory.size() - unused.size();
+            }
+            
+            uint32_t load(const TextureImage& image, size_t page, size_t index) {
+                const auto owner = image.key + page;
+                std::unique_lock guard(lock);
+                while (true) {
+                    // nothing can evict the page while the lock is held
+                    if (auto* resident = image.pages[page].load(std::memory_order_relaxed)) {
+                        resident->referenced.store(true, std::memory_order_relaxed);
+                        return std::atomic_ref<uint32_t>(resident->texels[index]).load(std::memory_order_relaxed);
+                    }
+                    if (!filling.contains(owner))
+                        break;
+                    filled.wait(guard);
+                }
+                filling.insert(owner);
+                auto memoryIndex = take();
+                auto& resident = *memory[memoryIndex];
+                pageLoads++;
+                guard.unlock();
+                
+                // threads which found the evicted page before it was evicted may still be reading this memory. The page is read
+                // somewhere else and copied in with atomic stores, the fence makes sure anyone reading a new texel also sees the old owner gone.
+                thread_local std::vector<uint32_t> buffer(TEXTURE_PAGE_TEXELS);
+                auto bytes = pread(image.file, buffer.data(), TEXTURE_PAGE_BYTES, (off_t) (image.pagesOffset + page * TEXTURE_PAGE_BYTES));
+                if (bytes != (ssize_t) TEXTURE_PAGE_BYTES) {
+                    elog << "Unable to read page " << page << " of a tiled texture, it will be black!\n";
+                    std::fill(buffer.begin(), buffer.end(), 0);
+                }
+                std::atomic_thread_fence(std::memory_order_release);
+                for (size_t i = 0; i < TEXTURE_PAGE_TEXELS; i++)
+                    std::atomic_ref<uint32_t>(resident.texels[i]).store(buffer[i], std::memory_order_relaxed);
+                
+                guard.lock();
+                give(image, page, memoryIndex, owner);
+                filling.erase(owner);
+                filled.notify_all();
+                return buffer[index];
+            }
+            
+            /**
+             * Frees the memory of every page of the image, which is being destroyed.
+             */
+            void release(const TextureImage& image) {
+                std::scoped_lock guard(lock);
+                for (size_t index = 0; index < holders.size(); index++) {
+                    if (holders[index].image != &image)
+                        continue;
+                    memory[index]->owner.store(0, std::memory_order_relaxed);
+                    holders[index].image = nullptr;
+                    unused.push_back(index);
+                }
+            }
+    };
+
+    static TexturePool pool;
+
+    void TextureImage::layout(int width, int height) {
+        size_t page = 0, tailOffset = 0;
+        int levelWidth = width, levelHeight = height;
+        while (true) {
+            // every level from 32x32 down shares one page, a 1024x1024 image would otherwise spend six pages on its last 1365 texels
+            if (levelWidth <= TEXTURE_PAGE_SIZE / 2 && levelHeight <= TEXTURE_PAGE_SIZE / 2) {
+                int tilesX = (levelWidth + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+                int tilesY = (levelHeight + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+                levels.push_back({levelWidth, levelHeight, 1, tilesX, page, tailOffset});
+                tailOffset += (size_t) tilesX * tilesY * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+            } else {
+                int pagesX = (levelWidth + TEXTURE_PAGE_SIZE - 1) / TEXTURE_PAGE_SIZE;
+                int pagesY = (levelHeight + TEXTURE_PAGE_SIZE - 1) / TEXTURE_PAGE_SIZE;
+                levels.push_back({levelWidth, levelHeight, pagesX, TEXTURE_PAGE_SIZE / TEXTURE_TILE_SIZE, page, 0});
+                page += (size_t) pagesX * pagesY;
+            }
+            if (levelWidth == 1 && levelHeight == 1)
+                break;
+            levelWidth = std::max(1, levelWidth / 2);
+            levelHeight = std::max(1, levelHeight / 2);
+        }
+        pageCount = page + (tailOffset > 0);
+    }
+
+    TextureImage::TextureImage(const unsigned char* pixels, int width, int height, int channels, uint64_t contentHash, size_t fileSize):
+            channels(channels), size(std::sqrt(PRECISION_TYPE(width) * height)), contentHash(contentHash), fileSize(fileSize) {
+        layout(width, height);
+        texels.resize(pageCount * TEXTURE_PAGE_TEXELS);
+        auto tiledIndex = [](const MipLevel& level, int x, int y) { return pageOf(level, x, y) * TEXTURE_PAGE_TEXELS + indexInPage(level, x, y); };
+        
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint32_t texel;
+                std::memcpy(&texel, pixels + ((size_t) y * width + x) * 4, sizeof(texel));
+                texels[tiledIndex(levels[0], x, y)] = texel;
+            }
+        }
+        // every texel of a level is the average of the 2x2 texels under it in the level before, odd sizes repeat the last row or column
+        for (size_t level = 1; level < levels.size(); level++) {
+            const auto& parent = levels[level - 1];
+            const auto& mip = levels[level];
+            for (int y = 0; y < mip.height; y++) {
+                for (int x = 0; x < mip.width; x++) {
+                    int x0 = std::min(x * 2, parent.width - 1), x1 = std::min(x * 2 + 1, parent.width - 1);
+                    int y0 = std::min(y * 2, parent.height - 1), y1 = std::min(y * 2 + 1, parent.height - 1);
+                    uint32_t corners[4] = {texels[tiledIndex(parent, x0, y0)], texels[tiledIndex(parent, x1, y0)], texels[tiledIndex(parent, x0, y1)],
+                                           texels[tiledIndex(parent, x1, y1)]};
+                    uint32_t texel = 0;
+                    for (int channel = 0; channel < 32; channel += 8) {
+                        uint32_t sum = 2;
+                        for (auto corner : corners)
+                            sum += (corner >> channel) & 0xFF;
+                        texel |= (sum / 4) << channel;
+                    }
+                    texels[tiledIndex(mip, x, y)] = texel;
+                }
+            }
+        }
+    }
+
+    TextureImage::TextureImage(int file, uint64_t pagesOffset, int width, int height, int channels, uint64_t contentHash, size_t fileSize):
+            file(file), pagesOffset(pagesOffset), key(pool.makeKey()), channels(channels), size(std::sqrt(PRECISION_TYPE(width) * height)),
+            contentHash(contentHash), fileSize(fileSize) {
+        layout(width, height);
+        pages = std::make_unique<std::atomic<TexturePage*>[]>(pageCount);
+    }
+
+    TextureImage::~TextureImage() {
+        if (pages != nullptr)
+            pool.release(*this);
+        if (file >= 0)
+            close(file);
+    }
+
+    uint32_t TextureImage::loadTexel(size_t page, size_t index) const {
+        return pool.load(*this, page, index);
+    }
+
+    /**
+     * Opens the tiled texture file of the image as a paged image.
+     * @return the image, or nullptr if there is no tiled file or it is from another version, damaged or made from an older image
+     */
+    static std::shared_ptr<const TextureImage> openTiled(const std::string& imageFile) {
+        auto path = TextureCache::pathFor(imageFile);
+        int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+            return nullptr;
+        TextureFileHeader header{};
+        struct stat fileStats{};
+        if (pread(file, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fstat(file, &fileStats) != 0 ||
+            std::memcmp(header.magic, TEXTURE_FILE_MAGIC, sizeof(TEXTURE_FILE_MAGIC)) != 0 || header.version != TEXTURE_FILE_VERSION ||
+            header.pageSize != TEXTURE_PAGE_SIZE || header.tileSize != TEXTURE_TILE_SIZE) {
+            ilog << "Tiled texture " << path << " was written by a different version, decoding " << imageFile << " instead.\n";
+            close(file);
+            return nullptr;
+        }
+        auto source = SourceStamp::of(imageFile);
+        if (!source || *source != SourceStamp{header.sourceSize, header.sourceModified}) {
+            ilog << "Tiled texture " << path << " was made from an older " << imageFile << ", decoding it instead.\n";
+            close(file);
+            return nullptr;
+        }
+        if (header.width <= 0 || header.height <= 0 || header.fileSize != (uint64_t) fileStats.st_size || header.pagesOffset < sizeof(header) ||
+            header.pageCount > (header.fileSize - std::min(header.fileSize, header.pagesOffset)) / TEXTURE_PAGE_BYTES ||
+            (uint64_t) header.width * (uint64_t) header.height > header.pageCount * TEXTURE_PAGE_TEXELS) {
+            wlog << "Tiled texture " << path << " is damaged, decoding " << imageFile << " instead.\n";
+            close(file);
+            return nullptr;
+        }
+        auto image = std::make_shared<const TextureImage>(file, header.pagesOffset, header.width, header.height, header.channels, header.contentHash,
+                                                          header.sourceSize);
+        if (image->getPageCount() != header.pageCount) {
+            wlog << "Tiled texture " << path << " is damaged, decoding " << imageFile << " instead.\n";
+            return nullptr;
+        }
+        return image;
+    }
+
+    /**
+     * Writes the pages of the resident image as the tiled texture file of the image file.
+     * @return true if the file was written
+     */
+    static bool writeTiled(const std::string& imageFile, const TextureImage& image) {
+        auto path = TextureCache::pathFor(imageFile);
+        TextureFileHeader header{};
+        std::memcpy(header.magic, TEXTURE_FILE_MAGIC, sizeof(TEXTURE_FILE_MAGIC));
+        header.version = TEXTURE_FILE_VERSION;
+        header.pageSize = TEXTURE_PAGE_SIZE;
+        header.tileSize = TEXTURE_TILE_SIZE;
+        header.width = image.getWidth();
+        header.height = image.getHeight();
+        header.channels = image.getChannels();
+        auto source = SourceStamp::of(imageFile);
+        if (!source)
+            return false;
+        header.sourceSize = source->size;
+        header.sourceModified = source->modified;
+        header.contentHash = image.getContentHash();
+        header.pageCount = image.getPageCount();
+        header.pagesOffset = TEXTURE_FILE_ALIGNMENT;
+        header.fileSize = header.pagesOffset + header.pageCount * TEXTURE_PAGE_BYTES;
+        
+        std::string error;
+        bool written = CacheFile::write(path, [&](std::ostream& file) {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            CacheFile::padTo(file, header.pagesOffset);
+            file.write(reinterpret_cast<const char*>(image.getPages().data()), (std::streamsize) (header.pageCount * TEXTURE_PAGE_BYTES));
+        }, error);
+        if (!written) {
+            wlog << "Unable to write the tiled texture " << path << ": " << error << ", " << imageFile << " will be kept in memory.\n";
+            return false;
+        }
+        ilog << "Wrote tiled texture " << path << " (" << header.fileSize << " bytes)\n";
+        return true;
+    }
+
+    /**
+     * 64 bit FNV-1a of the file, a fraction of the time it takes to decode it.
+     */
+    static uint64_t hashContents(const unsigned char* bytes, size_t size) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /**
+     * @return the image if it is still alive and came from a file with the same contents
+     */
+    static std::shared_ptr<const TextureImage> findByContent(uint64_t hash, size_t size) {
+        auto found = imagesByContent.find(hash);
+        if (found == imagesByContent.end())
+            return nullptr;
+        auto image = found->second.lock();
+        if (image == nullptr || image->getFileSize() != size)
+            return nullptr;
+        return image;
+    }
+
+    std::string TextureCache::pathFor(const std::string& imageFile) {
+        // added rather than replacing the extension, so a.png and a.jpg get a tiled file each
+        return imageFile + ".rttex";
+    }
+
+    void TextureCache::setBudget(size_t bytes) {
+        {
+            std::scoped_lock guard(cacheLock);
+            budgetBytes = bytes;
+        }
+        std::scoped_lock guard(pool.lock);
+        // the memory of a page includes its owner, so the budget is never exceeded by the pages' bookkeeping
+        pool.budgetPages = bytes == 0 ? 0 : std::max<size_t>(1, bytes / sizeof(TexturePage));
+    }
+
+    std::shared_ptr<const TextureImage> TextureCache::load(const std::string& file) {
+        // "../resources/images/a.png" and "/home/.../resources/images/a.png" are the same file
+        std::error_code error;
+        auto path = std::filesystem::weakly_canonical(file, error).string();
+        if (error)
+            path = file;
+        bool paged;
+        {
+            std::scoped_lock guard(cacheLock);
+            cacheStats.requests++;
+            paged = budgetBytes > 0;
+            auto found = imagesByPath.find(path);
+            if (found != imagesByPath.end()) {
+                if (auto image = found->second.lock()) {
+                    cacheStats.shared++;
+                    return image;
+                }
+            }
+        }
+        // the tiled file remembers the hash of the image, so the image doesn't even have to be read
+        if (paged) {
+            if (auto tiled = openTiled(path)) {
+                std::scoped_lock guard(cacheLock);
+                if (auto image = findByContent(tiled->getContentHash(), tiled->getFileSize())) {
+                    imagesByPath[path] = image;
+                    cacheStats.shared++;
+                    return image;
+                }
+                imagesByPath[path] = tiled;
+                imagesByContent[tiled->getContentHash()] = tiled;
+                return tiled;
+            }
+        }
+        auto mapping = MappedFile::map(path);
+        if (mapping == nullptr)
+            return nullptr;
+        auto bytes = static_cast<const unsigned char*>(mapping->data);
+        auto hash = hashContents(bytes, mapping->size);
+        {
+            std::scoped_lock guard(cacheLock);
+            if (auto image = findByContent(hash, mapping->size)) {
+                imagesByPath[path] = image;
+                cacheStats.shared++;
+                return image;
+            }
+        }
+        int width, height, channels;
+        // always decoded to RGBA so every texel is one aligned word. We are going to have to ignore transparency for now. TODO:?
+        auto data = stbi_load_from_memory(bytes, (int) mapping->size, &width, &height, &channels, 4);
+        if (data == nullptr)
+            return nullptr;
+        std::shared_ptr<const TextureImage> decoded = std::make_shared<const TextureImage>(data, width, height, channels, hash, mapping->size);
+        stbi_image_free(data);
+        // the decoded pages are only needed long enough to write them out
+        if (paged && writeTiled(path, *decoded)) {
+            if (auto tiled = openTiled(path))
+                decoded = std::move(tiled);
+        }
+        std::scoped_lock guard(cacheLock);
+        // another thread may have decoded the same file while we were, in which case we use theirs so there is only ever one copy
+        if (auto image = findByContent(hash, mapping->size)) {
+            imagesByPath[path] = image;
+            cacheStats.shared++;
+            return image;
+        }
+        imagesByPath[path] = decoded;
+        imagesByContent[hash] = decoded;
+        return decoded;
+    }
+
+    TextureCache::Stats TextureCache::getStats() {
+        std::scoped_lock guard(cacheLock);
+        Stats stats = cacheStats;
+        stats.residentImages = 0;
+        stats.residentBytes = 0;
+        stats.pagedImages = 0;
+        // forget images every material has let go of while we are going through them anyway
+        for (auto it = imagesByContent.begin(); it != imagesByContent.end();) {
+            if (auto image = it->second.lock()) {
+                stats.residentImages++;
+                stats.residentBytes += image->getMemoryUsage();
+                stats.pagedImages += image->isPaged();
+                it++;
+            } else
+                it = imagesByContent.erase(it);
+        }
+        std::erase_if(imagesByPath, [](const auto& entry) { return entry.second.expired(); });
+        std::scoped_lock poolGuard(pool.lock);
+        stats.residentPages = pool.residentPages();
+        stats.residentBytes += stats.residentPages * sizeof(TexturePage);
+        stats.budgetPages = pool.budgetPages;
+        stats.pageLoads = pool.pageLoads;
+        stats.evictions = pool.evictions;
+        return stats;
+    }
+
+}
@@ -3,7 +3,13 @@
 #include "engine/image/image.h"
 #include "engine/raytracing.h"
 #include "engine/world.h"
+#include "engine/benchmark.h"
+#include "engine/math/simd.h"
+#include "engine/bvh_stats.h"
+#include "engine/asset_loader.h"
+#include "engine/util/mesh_file.h"
 #include <chrono>
+#include <filesystem>
 #include "engine/util/debug.h"
 #include "opencl/open_ray_tracing.h"
 #include <config.h>
@@ -117,6 +123,89 @@ int main(int argc, char** args) {
             "--openmp", "Use OpenMP\n"
                         "\tTells the raycaster to use OpenMP to run the raycaster algorithm\n"
     );
+    parser.addOption(
+            "--bvhBuilder", "BVH Builder\n"
+                            "\tSets the algorithm used to build the world and mesh BVHs. Either sah, sbvh, lbvh or midpoint.\n"
+                            "\tlbvh builds much faster than sah on large scenes but creates a slower tree.\n"
+                            "\tsbvh also splits large objects between nodes, which helps when big objects overlap everything else.\n"
+                            "\tThe SAH cost of the built tree is printed so builders can be compared.\n", "sah"
+    );
+    parser.addOption(
+            "--bvhBins", "SAH Bin Count\n"
+                         "\tNumber of bins used along each axis by the SAH builder.\n", "16"
+    );
+    parser.addOption(
+            "--bvhMaxLeafSize", "BVH Max Leaf Size\n"
+                                "\tLargest number of objects the SAH builder is allowed to put in a single leaf.\n", "4"
+    );
+    parser.addOption(
+            "--bvhTraversalCost", "BVH Traversal Cost\n"
+                                  "\tCost of visiting a BVH node, relative to the intersection cost. Used by the SAH.\n", "1"
+    );
+    parser.addOption(
+            "--bvhIntersectionCost", "BVH Intersection Cost\n"
+                                     "\tCost of testing an object in a BVH leaf, relative to the traversal cost. Used by the SAH.\n", "2"
+    );
+    parser.addOption(
+            "--bvhSplitBudget", "SBVH Split Budget\n"
+                                "\tExtra references the sbvh builder may create by splitting objects, as a fraction of the number of objects.\n", "0.25"
+    );
+    parser.addOption(
+            "--bvhWidth", "BVH Width\n"
+                          "\tNumber of children per BVH node used when tracing, either 2 or 4.\n"
+                          "\tThe 4 wide BVH is collapsed from the binary one and tests all four children at once using SIMD.\n", "4"
+    );
+    parser.addOption(
+            "--bvhCache", "BVH Cache File\n"
+                          "\tFile the built BVHs are stored in so the next run of the same scene can load them instead of building them.\n"
+                          "\tThe cache is rebuilt whenever the scene or the BVH options change. Use 'none' to always build the BVHs.\n", "bvh.cache"
+    );
+    parser.addOption(
+            "--bvhStats", "BVH Statistics\n"
+                          "\tWrites the node count, depth and leaf size histograms, SAH cost, memory and overlap of the world and mesh BVHs\n"
+                          "\tas JSON to the file given, along with the nodes visited and primitives tested by camera rays, then exits.\n"
+                          "\tThe report is printed if no file is given.\n"
+    );
+    parser.addOption(
+            "--bvhStatsRays", "BVH Statistics Ray Count\n"
+                              "\tNumber of camera rays traced to measure the BVH traversal.\n", "4096"
+    );
+    parser.addOption(
+            "--isa", "Instruction Set\n"
+                     "\tWidest instruction set used by the ray/box, ray/triangle and ray/sphere tests and the image output. Each is\n"
+                     "\ttimed at startup and uses the fastest one up to it, scalar included. One of scalar, sse4.2, avx2 or avx512.\n"
+                     "\tBy default the widest one the CPU supports is the limit.\n", "auto"
+    );
+    parser.addOption(
+            "--loadThreads", "Asset Loading Threads\n"
+                             "\tNumber of threads the meshes and textures of the scene are loaded on, along with the BVH of every mesh.\n"
+                             "\tDefaults to all cores of your cpu. Use 1 to load them one after another.\n", "0"
+    );
+    parser.addOption(
+            "--textureBudget", "Texture Memory Budget\n"
+                               "\tMegabytes of texture pages kept in memory. Textures are split into pages read on first use from a .rttex file\n"
+                               "\twritten next to each image, and the least recently used pages are evicted once the budget is used up.\n"
+                               "\tDefaults to 0, which keeps every texture fully in memory instead.\n", "0"
+    );
+    parser.addOption(
+            "--convertMeshes", "Convert Meshes\n"
+                               "\tWrites a .rtmesh file next to the OBJ file given, or next to every OBJ file in the directory given, then exits.\n"
+                               "\tThe .rtmesh file is mapped instead of parsing the OBJ for as long as the OBJ doesn't change.\n"
+    );
+    parser.addOption(
+            "--benchmark", "Run a Benchmark\n"
+                           "\tRuns the named benchmark instead of rendering the scene and exits.\n"
+                           "\tUse 'list' to see the available benchmarks or 'all' to run all of them.\n"
+    );
+    parser.addOption(
+            "--benchmarkRays", "Benchmark Ray Count\n"
+                               "\tNumber of rays traced by each benchmark.\n", "1000"
+    );
+    parser.addOption(
+            "--benchmarkReference", "Benchmark Reference File\n"
+                                    "\tWhere the precision benchmark keeps the image of the last build it ran in. A build with the other\n"
+                                    "\tprecision compares its own image and throughput against it.\n", "precision_reference.bin"
+    );
     
     // disabled because don't currently have a way to parse vectors. TODO
     //parser.addOption("--position", "Camera Position\n\tSets the position used to render the scene with the camera.\n", "{0, 0, 0}");
@@ -126,6 +215,44 @@ int main(int argc, char** args) {
     if (parser.parse(args, argc))
         return 0;
     
+    // before anything is traced, benchmarks included, so the same binary can be compared against itself on each instruction set
+    auto supportedLevel = SIMD::detect();
+    auto isa = parser.getOptionValue("--isa");
+    if (!SIMD::select(isa == "auto" ? supportedLevel : SIMD::levelFromString(isa))) {
+        elog << "This CPU doesn't support " << isa << ", it supports up to " << SIMD::levelToString(supportedLevel)
+             << "\n";
+        return 1;
+    }
+    ilog << "Using the kernels up to " << SIMD::levelToString(SIMD::kernels().level) << " (this CPU supports up to " << SIMD::levelToString(supportedLevel)
+         << "): " << SIMD::describe(SIMD::kernels()) << "\n";
+    
+    if (parser.hasOption("--benchmark"))
+        return Benchmarks::run(parser.getOptionValue("--benchmark"), parser);
+    
+    if (parser.hasOption("--convertMeshes")) {
+        std::filesystem::path path = parser.getOptionValue("--convertMeshes");
+        std::vector<std::string> files;
+        if (std::filesystem::is_directory(path)) {
+            for (const auto& entry : std::filesystem::directory_iterator(path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".obj")
+                    files.push_back(entry.path().string());
+            }
+            std::sort(files.begin(), files.end());
+        } else
+            files.push_back(path.string());
+        int failures = 0;
+        for (const auto& file : files) {
+            try {
+                failures += !MeshFile::convert(file);
+            } catch (const std::exception& e) {
+                elog << e.what() << "\n";
+                failures++;
+            }
+        }
+        ilog << "Converted " << files.size() - failures << " of " << files.size() << " meshes.\n";
+        return failures > 0;
+    }
+    
     if (signal(
             SIGTERM, [](int sig) -> void {
                 ilog << "Computations complete.\nHalting now...\n";
@@ -179,28 +306,27 @@ int main(int argc, char** args) {
     WorldConfig worldConfig;
 #endif
     worldConfig.useBVH = true;
-    
+    worldConfig.bvhOptions.builder = BVHBuildOptions::builderFromString(parser.getOptionValue("--bvhBuilder"));
+    worldConfig.bvhOptions.binCount = std::stoi(parser.getOptionValue("--bvhBins"));
+    worldConfig.bvhOptions.maxLeafSize = std::stoi(parser.getOptionValue("--bvhMaxLeafSize"));
+    worldConfig.bvhOptions.traversalCost = std::stod(parser.getOptionValue("--bvhTraversalCost"));
+    worldConfig.bvhOptions.intersectionCost = std::stod(parser.getOptionValue("--bvhIntersectionCost"));
+    worldConfig.bvhOptions.width = std::stoi(parser.getOptionValue("--bvhWidth"));
+    worldConfig.bvhOptions.splitBudget = std::stod(parser.getOptionValue("--bvhSplitBudget"));
+    if (parser.getOptionValue("--bvhCache") != "none")
+        worldConfig.bvhCachePath = parser.getOptionValue("--bvhCache");
+
     Raytracing::World world{worldConfig};
     
     // assumes you are running it from a subdirectory, "build" or "cmake-build-release", etc.
     // this can be changed of course using the --resources option.
-    Raytracing::ModelData spider = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/spider.obj");
-    Raytracing::ModelData house = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/house.obj");
-    Raytracing::ModelData plane = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/plane.obj");
-    Raytracing::ModelData planeflipped = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/planeflipped.obj");
-    Raytracing::ModelData debugCube = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/debugcube.obj");
-    Raytracing::ModelData skyboxCube = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/cubeflipped.obj");
-    Raytracing::ModelData floor = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/floor.obj");
-    Raytracing::ModelData deathSphere = Raytracing::OBJLoader::loadModel(parser.getOptionValue("--resources") + "models/deathsphere.obj");
-    
-    world.add("greenDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{0, 1.0, 0, 1}});
-    world.add("redDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{1.0, 0, 0, 1}});
-    world.add("blueDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{0, 0, 1.0, 1}});
-    
-    world.add("greenMetal", new Raytracing::MetalMaterial{Raytracing::Vec4{0.4, 1.0, 0.4, 1}});
-    world.add("blueMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.4, 0.4, 0.9, 1}, 0.01f});
-    world.add("imperfectMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.8, 0.8, 0.8, 1}, 0.4f});
-    world.add("perfectMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.8, 0.8, 0.8, 1}, 0.0f});
+    const std::string resources = parser.getOptionValue("--resources");
+    TextureCache::setBudget((size_t) (std::stod(parser.getOptionValue("--textureBudget")) * 1024 * 1024));
+    // the meshes are loaded and the images decoded on every core at once while the rest of the scene is set up,
+    // and the BVH of each mesh starts building as soon as the mesh is loaded.
+    Raytracing::AssetLoader assets{world, (unsigned int) std::stoul(parser.getOptionValue("--loadThreads"))};
+    for (const char* model : {"spider", "house", "plane", "planeflipped", "debugcube", "cubeflipped", "floor", "deathsphere"})
+        assets.loadMesh(resources + "models/" + model + ".obj");
     
     // Textures in here will automatically be added to the world and used when generating the objects in the world.
     std::vector<std::string> textures = {
@@ -222,23 +348,42 @@ int main(int argc, char** args) {
             "brockboy.jpg",
             "brockboy.jpg"
     };
-    for (const std::string& texture : textures) {
-        world.add(texture, new Raytracing::TexturedMaterial{parser.getOptionValue("--resources") + "images/" + texture});
-    }
-    world.add("floor", new Raytracing::TexturedMaterial{parser.getOptionValue("--resources") + "images/brick_floor_diff_1k.png", 4.0f});
-    world.add("skybox", new Raytracing::TexturedMaterial{parser.getOptionValue("--resources") + "images/robson.jpeg", 2.0f});
+    for (const std::string& texture : textures)
+        assets.loadTexture(texture, resources + "images/" + texture);
+    assets.loadTexture("floor", resources + "images/brick_floor_diff_1k.png", 4.0f);
+    assets.loadTexture("skybox", resources + "images/robson.jpeg", 2.0f);
+    
+    world.add("greenDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{0, 1.0, 0, 1}});
+    world.add("redDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{1.0, 0, 0, 1}});
+    world.add("blueDiffuse", new Raytracing::DiffuseMaterial{Raytracing::Vec4{0, 0, 1.0, 1}});
     
-    world.add(new Raytracing::ModelObject({0, 0, 0}, floor, world.getMaterial("floor")));
-    world.add(new Raytracing::ModelObject({0, 0, 0}, skyboxCube, world.getMaterial("skybox")));
+    world.add("greenMetal", new Raytracing::MetalMaterial{Raytracing::Vec4{0.4, 1.0, 0.4, 1}});
+    world.add("blueMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.4, 0.4, 0.9, 1}, 0.01f});
+    world.add("imperfectMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.8, 0.8, 0.8, 1}, 0.4f});
+    world.add("perfectMirror", new Raytracing::BrushedMetalMaterial{Raytracing::Vec4{0.8, 0.8, 0.8, 1}, 0.0f});
+    
+    assets.wait();
+    // every mesh is loaded once and shared by all the objects using it
+    auto spider = world.loadMesh(resources + "models/spider.obj");
+    auto house = world.loadMesh(resources + "models/house.obj");
+    auto plane = world.loadMesh(resources + "models/plane.obj");
+    auto planeflipped = world.loadMesh(resources + "models/planeflipped.obj");
+    auto debugCube = world.loadMesh(resources + "models/debugcube.obj");
+    auto skyboxCube = world.loadMesh(resources + "models/cubeflipped.obj");
+    auto floor = world.loadMesh(resources + "models/floor.obj");
+    auto deathSphere = world.loadMesh(resources + "models/deathsphere.obj");
+    
+    world.add(new Raytracing::ModelObject(floor, Raytracing::Transform{{0, 0, 0}}, world.getMaterial("floor")));
+    world.add(new Raytracing::ModelObject(skyboxCube, Raytracing::Transform{{0, 0, 0}}, world.getMaterial("skybox")));
     // odds and ends
-    world.add(new Raytracing::ModelObject({10, 4, -20}, deathSphere, world.getMaterial("imperfectMirror")));
+    world.add(new Raytracing::ModelObject(deathSphere, Raytracing::Transform{{10, 4, -20}}, world.getMaterial("imperfectMirror")));
     
-    world.add(new Raytracing::ModelObject({0, 2, 0}, spider, world.getMaterial("redDiffuse")));
-    world.add(new Raytracing::ModelObject({-5, 5, 0}, plane, world.getMaterial("greenMetal")));
-    world.add(new Raytracing::ModelObject({-5.001, 5, 0}, planeflipped, world.getMaterial("greenMetal")));
+    world.add(new Raytracing::ModelObject(spider, Raytracing::Transform{{0, 2, 0}}, world.getMaterial("redDiffuse")));
+    world.add(new Raytracing::ModelObject(plane, Raytracing::Transform{{-5, 5, 0}}, world.getMaterial("greenMetal")));
+    world.add(new Raytracing::ModelObject(planeflipped, Raytracing::Transform{{-5.001, 5, 0}}, world.getMaterial("greenMetal")));
     
-    world.add(new Raytracing::ModelObject({0, 1, -5}, house, world.getMaterial("blueDiffuse")));
-    world.add(new Raytracing::ModelObject({0, 1, 5}, house, world.getMaterial("blueDiffuse")));
+    world.add(new Raytracing::ModelObject(house, Raytracing::Transform{{0, 1, -5}}, world.getMaterial("blueDiffuse")));
+    world.add(new Raytracing::ModelObject(house, Raytracing::Transform{{0, 1, 5}}, world.getMaterial("blueDiffuse")));
     
     Random chance(0.0, 1.0);
     Random textureIndexSelect(0, textures.size() - 1);
@@ -251,21 +396,21 @@ int main(int argc, char** args) {
             if (i2 + j2 < 125)
                 continue;
             if (chance.getDouble() <= 0.25) {
-                auto pos = Vec4{i + chance.getDouble(), 0, j + chance.getDouble()};
+                auto pos = Vec4{(PRECISION_TYPE) (i + chance.getDouble()), 0, (PRECISION_TYPE) (j + chance.getDouble())};
                 if (i % 2 == 0) {
                     // cubes are 1 off the ground
                     pos = Vec4{pos.x(), 1, pos.z()};
                     auto& texture = textures[textureIndexSelect.getLong()];
-                    world.add(new Raytracing::ModelObject{pos, debugCube, world.getMaterial(texture)});
+                    world.add(new Raytracing::ModelObject{debugCube, Raytracing::Transform{pos}, world.getMaterial(texture)});
                 } else {
-                    auto radius = (chance.getDouble() + 0.15f) * 2.0f;
+                    PRECISION_TYPE radius = (chance.getDouble() + 0.15f) * 2.0f;
                     // while spheres have a variable radius
                     pos = Vec4{pos.x(), radius, pos.z()};
                     if (chance.getDouble() <= 0.75) {
                         auto& texture = textures[textureIndexSelect.getLong()];
                         world.add(new Raytracing::SphereObject{pos, radius, world.getMaterial(texture)});
                     } else {
-                        world.add(new Raytracing::SphereObject{pos, chance.getDouble() * 2.5f, world.getMaterial("blueMirror")});
+                        world.add(new Raytracing::SphereObject(pos, chance.getDouble() * 2.5f, world.getMaterial("blueMirror")));
                     }
                 }
             }
@@ -275,6 +420,12 @@ int main(int argc, char** args) {
     
     //world.add(new Raytracing::ModelObject({0, 0, 0}, debugCube, world.getMaterial("cat")));
     
+    if (parser.hasOption("--bvhStats")) {
+        auto output = parser.getOptionValue("--bvhStats");
+        // the parser stores "true" for options given without a value
+        return BVHStatsReport::write(world, camera, image, std::stoi(parser.getOptionValue("--bvhStatsRays")), output == "true" ? "-" : output);
+    }
+
     if (parser.hasOption("--gui") || parser.hasOption("-g")) {
 #ifdef COMPILE_GUI
         Raytracing::RayCaster rayCaster{camera, image, world, parser};
@@ -328,6 +479,10 @@ int main(int argc, char** args) {
     }
     
     profiler::print("Raytracer Results");
+    auto textureStats = TextureCache::getStats();
+    if (textureStats.pagedImages > 0)
+        ilog << "Texture pages: " << textureStats.pageLoads << " read, " << textureStats.evictions << " evicted, " << textureStats.residentPages
+             << " of the budget's " << textureStats.budgetPages << " in memory.\n";
 
 #ifdef USE_MPI
     // Wait for all processes to finish before trying to send data
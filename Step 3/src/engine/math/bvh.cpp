@@ -3,58 +3,18 @@
  * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
  */
 #include <engine/math/bvh.h>
-#include <queue>
+#include <engine/world.h>
+#include <engine/util/debug.h>
+#include <chrono>
+#include <bit>
 
-namespace Raytracing {
-    
-    /*
-     * Triangle BVH Node Class
-     * -------------------------------------------------------------------------
-     */
-    
-    /**
-     * Returns the first bounding tree with objects in it hit by the provided ray.
-     * @param r the ray to check for intersection with
-     * @param min the min t allowed in intersection
-     * @param max the max t value allowed in intersection
-     * @return BVHHitData, a structure containing the node, AABB intersection and whether we actually hit anything or not.
-     */
-    TriangleBVHNode::BVHHitData TriangleBVHNode::firstHitRayIntersectTraversal(const Ray& r, PRECISION_TYPE min, PRECISION_TYPE max) {
-        // first we need to check if the ray actually intersects with this node,
-        auto ourHitData = aabb.intersects(r, min, max);
-        // if it doesn't we need to immediately return, which prunes all subtrees to this node.
-        if (!ourHitData.hit)
-            return {this, ourHitData, false};
-        // storage for left and right subtree results.
-        BVHHitData leftHit{};
-        BVHHitData rightHit{};
-        // make sure we actually have a left or right node, and if we do traverse them recursively
-        if (left != nullptr)
-            leftHit = left->firstHitRayIntersectTraversal(r, min, max);
-        if (right != nullptr)
-            rightHit = right->firstHitRayIntersectTraversal(r, min, max);
-        // once we are either in a bounding box with objects or we are not.
-        // to ensure that we keep order and return the first bounding box with objects hit by the ray,
-        // we must check if the left tree is closer than the right tree, or we didn't hit the right tree.
-        // if we didn't hit the right tree than we can propagate the left tree up
-        if (leftHit.hit && (leftHit.data.tMax < rightHit.data.tMax || !rightHit.hit))
-            return leftHit;
-        // the same goes for the right tree. if we reach this point the left tree didn't get it or was farther than the right tree
-        // and so we do the same check. make sure that the right tree is closer, or we didn't hit the left tree.
-        else if (rightHit.hit && (rightHit.data.tMax < leftHit.data.tMax || !leftHit.hit))
-            return rightHit;
-        // if we hit neither tree in all likelihood this is a leaf node, and we can return accordingly
-        // but if this isn't a leaf node there will be problems. So if this isn't a leaf node (doesn't have objects)
-        // we can pretend like we didn't hit anything.
-        return {this, ourHitData, !objs.empty()};
-    }
-    
-    
-    
-    
-    
-    
+#ifdef USE_OPENMP
     
+    #include <omp.h>
+
+#endif
+
+namespace Raytracing {
     
     /*
      * BVH Tree Class
@@ -65,13 +25,13 @@ namespace Raytracing {
      * Creates a BVH using the supplied vector of objects
      * @param objects objects used to generate the BVH
      */
-    void BVHTree::addObjects(const std::vector<Object*>& objects) {
-        if (root != nullptr)
+    void BVHTree::addObjects(const std::vector<Object*>& objects, const BVHCachedTree* cachedTree, std::shared_ptr<void> mapping) {
+        if (!nodes.empty())
             throw std::runtime_error("BVHTree already exists. What are you trying to do?");
         // move all the object's aabb's into world position
         std::vector<BVHObject> objs;
         for (auto* obj: objects) {
-            // we don't want to store all the AABBs which don't exist: ie spheres
+            // objects without bounds can't be placed in the tree
             if (obj->getAABB().isEmpty()) {
                 noAABBObjects.push_back(obj);
                 continue;
@@ -81,272 +41,1303 @@ namespace Raytracing {
             // returns a copy of the AABB object and assigns it in to the tree storage object
             bvhObject.aabb = obj->getAABB().translate(obj->getPosition());
             // which means we don't have to do memory management, since we are using the pointer without ownership or coping now.
-            bvhObject.ptr = obj;
+            bvhObject.index = (uint32_t) primitives.size();
+            primitives.push_back(obj);
+            primitiveTypes.push_back(obj->getType());
             objs.push_back(bvhObject);
         }
-        root = addObjectsRecursively(objs, {});
+        if (objs.empty())
+            return;
+        if (cachedTree != nullptr) {
+            if (useCachedTree(*cachedTree, std::move(mapping), objs.size())) {
+                ilog << "Loaded BVH over " << objs.size() << " objects from the BVH cache. SAH cost: " << sahCost << ", " << nodes.size()
+                     << " nodes\n";
+                return;
+            }
+            wlog << "The cached world BVH doesn't match the objects in the world, building it instead\n";
+        }
+        build(objs);
+        ilog << "Built BVH over " << objs.size() << " objects using the " << BVHBuildOptions::builderToString(options.builder)
+             << " builder in " << buildTime << "ms. SAH cost: " << sahCost << ", " << nodes.size() << " nodes using " << getMemoryUsage()
+             << " bytes\n";
+    }
+    
+    AABB BVHTree::getPrimitiveAABB(uint32_t i) const {
+        auto* obj = getPrimitive(i);
+        if (obj == nullptr)
+            return {};
+        return obj->getAABB().translate(obj->getPosition());
+    }
+    
+    void BVHTree::rebuild() {
+        std::vector<Object*> objects;
+        objects.reserve(primitives.size() + insertedObjects.size());
+        for (auto* obj : primitives) {
+            if (obj != nullptr)
+                objects.push_back(obj);
+        }
+        objects.insert(objects.end(), insertedObjects.begin(), insertedObjects.end());
+        clear();
+        primitives.clear();
+        primitiveTypes.clear();
+        insertedObjects.clear();
+        removedCount = 0;
+        addObjects(objects);
+    }
+    
+    void BVHTree::insert(Object* object) {
+        // same as when building, objects without bounds can't be put in the tree
+        if (object->getAABB().isEmpty())
+            noAABBObjects.push_back(object);
+        else
+            insertedObjects.push_back(object);
+    }
+    
+    bool BVHTree::remove(Object* object) {
+        auto eraseFrom = [object](std::vector<Object*>& objects) -> bool {
+            auto pos = std::find(objects.begin(), objects.end(), object);
+            if (pos == objects.end())
+                return false;
+            objects.erase(pos);
+            return true;
+        };
+        if (eraseFrom(insertedObjects) || eraseFrom(noAABBObjects))
+            return true;
+        // the leaves reference the primitives by index, so the slot stays until the next rebuild. refit() will shrink the leaf.
+        auto pos = std::find(primitives.begin(), primitives.end(), object);
+        if (pos == primitives.end())
+            return false;
+        *pos = nullptr;
+        removedCount++;
+        return true;
     }
     
+    PRECISION_TYPE BVHTree::getDegradation() const {
+        // every inserted object is tested by every ray which reaches the world
+        PRECISION_TYPE insertedCost = options.intersectionCost * (PRECISION_TYPE) insertedObjects.size();
+        if (sahCost <= 0)
+            return insertedObjects.empty() && removedCount == 0 ? 1 : std::numeric_limits<PRECISION_TYPE>::infinity();
+        return (refitSAHCost + insertedCost) / sahCost;
+    }
+    
+    bool BVHTree::update() {
+        refit();
+        // a tree which is mostly removed objects is still cheap to trace but is holding on to a lot of empty slots
+        if (getDegradation() > options.rebuildThreshold || removedCount * 2 > primitives.size()) {
+            rebuild();
+            return true;
+        }
+        return false;
+    }
+
+    // ranges smaller than this are built on the current thread, creating tasks for them would cost more than building them.
+    constexpr size_t BVH_TASK_THRESHOLD = 1024;
+    
+    struct BVHBuildState {
+        const std::vector<BVHObject>& objects;
+        // the center of every object's AABB, calculated once instead of at every level of the tree
+        std::vector<Vec4> centroids;
+        // the builders partition this array in place, each node owns a contiguous range of it.
+        std::vector<uint32_t> indices;
+        // only used by the LBVH builder, the morton code of the object at the same position in the index array
+        std::vector<uint64_t> mortonCodes;
+        // only used by the SBVH builder, spatial splits are only tried when the children of the best object split overlap by more than this area
+        PRECISION_TYPE minSpatialSplitOverlap = 0;
+        
+        explicit BVHBuildState(const std::vector<BVHObject>& objects): objects(objects) {
+            centroids.reserve(objects.size());
+            indices.reserve(objects.size());
+            for (const auto& obj : objects) {
+                indices.push_back((uint32_t) centroids.size());
+                centroids.push_back(obj.aabb.getCenter());
+            }
+        }
+        
+        [[nodiscard]] inline const AABB& getAABB(size_t i) const { return objects[indices[i]].aabb; }
+        
+        [[nodiscard]] inline const Vec4& getCentroid(size_t i) const { return centroids[indices[i]]; }
+    };
+    
     /**
-     * Splits the objects into the two distinct spaces provided in the aabbs param based on their intersection
-     * This is left side based and produces two vectors which are unique.
-     * @param aabbs the two spaces which to split the objs vector into
-     * @param objs object vector to be split into aabbs
-     * @return BVHPartitionedSpace, a structure with two vectors containing the split objects. Is left side based and unique.
+     * Spreads the lower 21 bits of the value out so there are two zero bits between each of them
      */
-    BVHPartitionedSpace BVHTree::partition(const std::pair<AABB, AABB>& aabbs, const std::vector<BVHObject>& objs) {
-        BVHPartitionedSpace space;
-        for (const auto& obj: objs) {
-            // if this object doesn't have an AABB, we cannot use a BVH on it. If this ever fails we have a problem with the implementation.
-            RTAssert(!obj.aabb.isEmpty());
-            if (aabbs.first.intersects(obj.aabb))
-                space.left.push_back(obj);
-            else if (aabbs.second.intersects(obj.aabb))
-                space.right.push_back(obj);
-        }
-        return space;
+    static inline uint64_t expandBits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8) & 0x100f00f00f00f00f;
+        v = (v | v << 4) & 0x10c30c30c30c30c3;
+        v = (v | v << 2) & 0x1249249249249249;
+        return v;
     }
     
+    struct MortonPrimitive {
+        uint64_t code;
+        uint32_t index;
+    };
+    
     /**
-     * Returns all the objects intersected by the provided ray. The returned objects are in no particular order.
-     * @param ray to use in AABB intersection
-     * @param min min t allowed for intersection search
-     * @param max max t allowed
-     * @return a unordered array of objects intersected by ray in this BVH.
+     * Stable least significant digit radix sort of the morton codes, one byte per pass. Each thread counts the digits of its own chunk,
+     * then the chunks are scattered in order so the result doesn't depend on the number of threads.
      */
-    std::vector<BVHObject> BVHTree::rayAnyHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) {
-        std::queue<BVHNode*> nodes{};
-        std::vector<BVHObject> objects;
-        nodes.push(root);
+    static void radixSort(std::vector<MortonPrimitive>& values) {
+        constexpr int bitsPerPass = 8;
+        constexpr int bucketCount = 1 << bitsPerPass;
+        // the codes are 63 bits
+        constexpr int passes = (63 + bitsPerPass - 1) / bitsPerPass;
+        const size_t size = values.size();
+        std::vector<MortonPrimitive> temp(size);
         
-        while (!nodes.empty()) {
-            auto* node = nodes.front();
-            
-            auto AABB = node->aabb;
-            auto nodeHitData = AABB.intersects(ray, min, max);
-            if (nodeHitData.hit) {
-                if (node->left != nullptr)
-                    nodes.push(node->left);
-                if (node->right != nullptr)
-                    nodes.push(node->right);
-    
-                if (!node->objs.empty()) {
-                    for (const auto& obj: node->objs)
-                        objects.push_back(obj);
+        int chunks = 1;
+#ifdef USE_OPENMP
+        // small arrays aren't worth splitting
+        chunks = (int) std::max((size_t) 1, std::min((size_t) omp_get_max_threads(), size / 16384));
+#endif
+        const size_t chunkSize = (size + chunks - 1) / chunks;
+        std::vector<size_t> offsets((size_t) chunks * bucketCount);
+        
+        for (int pass = 0; pass < passes; pass++) {
+            const int shift = pass * bitsPerPass;
+            std::fill(offsets.begin(), offsets.end(), 0);
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(chunks) if(chunks > 1)
+#endif
+            for (int c = 0; c < chunks; c++) {
+                size_t* counts = &offsets[(size_t) c * bucketCount];
+                for (size_t i = c * chunkSize; i < std::min(size, (c + 1) * chunkSize); i++)
+                    counts[(values[i].code >> shift) & (bucketCount - 1)]++;
+            }
+            // every chunk's part of a bucket comes after the same bucket of the chunks before it, which keeps the sort stable
+            size_t total = 0;
+            for (int b = 0; b < bucketCount; b++) {
+                for (int c = 0; c < chunks; c++) {
+                    auto count = offsets[(size_t) c * bucketCount + b];
+                    offsets[(size_t) c * bucketCount + b] = total;
+                    total += count;
                 }
             }
-            nodes.pop();
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(chunks) if(chunks > 1)
+#endif
+            for (int c = 0; c < chunks; c++) {
+                size_t* positions = &offsets[(size_t) c * bucketCount];
+                for (size_t i = c * chunkSize; i < std::min(size, (c + 1) * chunkSize); i++)
+                    temp[positions[(values[i].code >> shift) & (bucketCount - 1)]++] = values[i];
+            }
+            std::swap(values, temp);
         }
-        return objects;
     }
     
-    BVHNode* BVHTree::addObjectsRecursively(const std::vector<BVHObject>& objects, const BVHPartitionedSpace& prevSpace) {
-        // create a volume for the entire world.
-        // yes, we could use a recursion provided AABB, but that wouldn't be minimum, only half. this ensures that we have a minimum AABB.
-        AABB world;
-        for (const auto& obj: objects)
-            world = world.expand(obj.aabb);
+    /**
+     * Orders the index array along a morton curve through the centroids of the objects, which is what the LBVH builder splits.
+     */
+    static void sortByMortonCode(BVHBuildState& state) {
+        const size_t size = state.indices.size();
+        Vec4 centroidMin = state.centroids[0];
+        Vec4 centroidMax = centroidMin;
+        for (const auto& center : state.centroids) {
+            centroidMin = {std::min(centroidMin.x(), center.x()), std::min(centroidMin.y(), center.y()), std::min(centroidMin.z(), center.z())};
+            centroidMax = {std::max(centroidMax.x(), center.x()), std::max(centroidMax.y(), center.y()), std::max(centroidMax.z(), center.z())};
+        }
+        // each axis is quantized to 21 bits, giving a 63 bit code
+        constexpr PRECISION_TYPE gridSize = (1 << 21) - 1;
+        auto extent = centroidMax - centroidMin;
+        PRECISION_TYPE scale[3] = {
+                extent.x() > 0 ? gridSize / extent.x() : 0, extent.y() > 0 ? gridSize / extent.y() : 0, extent.z() > 0 ? gridSize / extent.z() : 0
+        };
+        
+        std::vector<MortonPrimitive> primitives(size);
+#ifdef USE_OPENMP
+#pragma omp parallel for if(size > 16384)
+#endif
+        for (size_t i = 0; i < size; i++) {
+            const auto& center = state.centroids[i];
+            auto x = (uint64_t) ((center.x() - centroidMin.x()) * scale[0]);
+            auto y = (uint64_t) ((center.y() - centroidMin.y()) * scale[1]);
+            auto z = (uint64_t) ((center.z() - centroidMin.z()) * scale[2]);
+            primitives[i] = {expandBits(x) << 2 | expandBits(y) << 1 | expandBits(z), (uint32_t) i};
+        }
+        radixSort(primitives);
+        
+        state.mortonCodes.resize(size);
+        for (size_t i = 0; i < size; i++) {
+            state.indices[i] = primitives[i].index;
+            state.mortonCodes[i] = primitives[i].code;
+        }
+    }
     
-        // if we have a single object then we can create a leaf.
-        if ((objects.size() <= 1 && !objects.empty())) {
-            return new BVHNode(objects, world, nullptr, nullptr);
-        } else if (objects.empty()) // should never reach here!!
-            return nullptr;
-            
-        // then split and partition the world
-        auto splitAABBs = world.splitByLongestAxis();
-        auto partitionedObjs = partition(splitAABBs, objects);
-        if (prevSpace == partitionedObjs) {
-            // if we haven't made progress in splitting the world, try inverting the order we add objects first
-            partitionedObjs = partition({splitAABBs.second, splitAABBs.first}, objects);
-            // if we fail then try splitting on another axis
-            if (prevSpace == partitionedObjs) {
-                // try all axis
-                for (int i = 0; i < 3; i++){
-                    splitAABBs = world.splitAlongAxis(i == 0 ? X : i == 1 ? Y : Z);
-                    partitionedObjs = partition(splitAABBs, objects);
-                    // and once we have an axis that works we can break.
-                    if (prevSpace != partitionedObjs)
-                        break;
-                }
+    // Stich et al. only try spatial splits when the children of the best object split overlap by more than this fraction of the root's area.
+    // below it the object split is good enough that looking for a spatial split would only slow the build down.
+    constexpr PRECISION_TYPE SBVH_MIN_OVERLAP = 1e-5;
+    
+    /**
+     * Moves the references of every SBVH leaf into the index array, depth first, and points the leaves at their range of it.
+     */
+    static void collectReferences(BVHNode* node, std::vector<uint32_t>& indices) {
+        if (node->left != nullptr) {
+            collectReferences(node->left, indices);
+            collectReferences(node->right, indices);
+            return;
+        }
+        node->begin = indices.size();
+        indices.insert(indices.end(), node->references.begin(), node->references.end());
+        node->end = indices.size();
+        node->references = {};
+    }
+    
+    void FlatBVH::build(std::vector<BVHObject>& objs) {
+        auto start = std::chrono::steady_clock::now();
+        BVHBuildState state{objs};
+        // sorting has its own parallel loops, so it has to happen before the build's parallel region.
+        if (options.builder == LBVH)
+            sortByMortonCode(state);
+        std::vector<BVHObject> references;
+        size_t splitBudget = 0;
+        if (options.builder == SBVH) {
+            // the references start as the whole objects, the index being the object's position in the build state
+            references.reserve(objs.size());
+            AABB world = objs[0].aabb;
+            for (const auto& obj : objs) {
+                world = world.expand(obj.aabb);
+                references.push_back({obj.aabb, (uint32_t) references.size()});
             }
+            splitBudget = (size_t) ((PRECISION_TYPE) objs.size() * std::max((PRECISION_TYPE) 0, options.splitBudget));
+            state.minSpatialSplitOverlap = SBVH_MIN_OVERLAP * world.surfaceArea();
         }
-        // if we were unable to find a partition that isn't the same as our last, we should create a leaf here
-        // otherwise we'll get infinite recursion
-        if (prevSpace == partitionedObjs) {
-            return new BVHNode(objects, world, nullptr, nullptr);
+        BVHNode* root = nullptr;
+        // a single thread starts building, and large subtrees are handed to the rest of the threads as tasks.
+        // if we are already inside a parallel region (building multiple trees at once) this will just use the current thread.
+#ifdef USE_OPENMP
+#pragma omp parallel shared(root, state, references)
+#pragma omp single
+#endif
+        {
+            if (options.builder == SBVH)
+                root = addObjectsSBVH(state, references, splitBudget, 0);
+            else
+                root = addObjects(state, 0, objs.size(), 0);
+        }
+        // objects can be in more than one SBVH leaf, so the index array is created from the leaves instead of being partitioned in place
+        if (options.builder == SBVH) {
+            state.indices.clear();
+            collectReferences(root, state.indices);
         }
+        // the leaves reference ranges of the partitioned index array, so it becomes the primitive array of the tree.
+        primitiveIndexStorage.reserve(state.indices.size());
+        for (auto i : state.indices)
+            primitiveIndexStorage.push_back(objs[i].index);
+        // the pointer based tree is only used while building, once it is flat we no longer need it.
+        flatten(root);
+        delete (root);
+        nodes = nodeStorage;
+        primitiveIndices = primitiveIndexStorage;
+        sahCost = refitSAHCost = computeSAHCost(options.traversalCost, options.intersectionCost);
+        buildWideTree();
+        buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
     
-        BVHNode* left = nullptr;
-        BVHNode* right = nullptr;
-        // don't try to explore nodes which don't have anything in them.
-        if (!partitionedObjs.left.empty())
-            left = addObjectsRecursively(partitionedObjs.left, partitionedObjs);
-        if (!partitionedObjs.right.empty())
-            right = addObjectsRecursively(partitionedObjs.right, partitionedObjs);
+    BVHNode* FlatBVH::addObjects(BVHBuildState& state, size_t begin, size_t end, int depth) {
+        switch (options.builder) {
+            case SAH:
+                return addObjectsSAH(state, begin, end, depth);
+            case LBVH:
+                return addObjectsLBVH(state, begin, end, depth);
+            // spatial splits need their own references, only the build over every object can use them
+            case SBVH:
+            case MIDPOINT:
+                break;
+        }
+        return addObjectsMidpoint(state, begin, end, depth);
+    }
     
-        if (left == nullptr && right == nullptr)
-            return new BVHNode(objects, world, left, right);
-        else
-            return new BVHNode({}, world, left, right);
+    std::pair<BVHNode*, BVHNode*> FlatBVH::addChildren(BVHBuildState& state, size_t begin, size_t mid, size_t end, int depth) {
+        auto build = [&](size_t childBegin, size_t childEnd) -> BVHNode* {
+            return addObjects(state, childBegin, childEnd, depth + 1);
+        };
+        BVHNode* left;
+        BVHNode* right;
+#ifdef USE_OPENMP
+        if (end - begin >= BVH_TASK_THRESHOLD) {
+#pragma omp task default(shared)
+            left = build(begin, mid);
+            right = build(mid, end);
+#pragma omp taskwait
+            return {left, right};
+        }
+#endif
+        left = build(begin, mid);
+        right = build(mid, end);
+        return {left, right};
     }
     
+    /**
+     * @return the axis along which the children are the most separated, which is the one we use to order traversal
+     */
+    static uint32_t separationAxis(const AABB& left, const AABB& right) {
+        auto separation = right.getCenter() - left.getCenter();
+        PRECISION_TYPE sx = std::abs(separation.x()), sy = std::abs(separation.y()), sz = std::abs(separation.z());
+        return sx > sy && sx > sz ? 0 : sy > sz ? 1 : 2;
+    }
     
+    uint32_t FlatBVH::flatten(const BVHNode* node) {
+        auto index = (uint32_t) nodeStorage.size();
+        nodeStorage.emplace_back();
+        auto min = node->aabb.getMin();
+        auto max = node->aabb.getMax();
+        // has to be done through the index since the vector can be reallocated when the children are added
+        nodeStorage[index] = {{min.x(), min.y(), min.z()}, {max.x(), max.y(), max.z()}, 0, 0, 0};
+        
+        if (node->left == nullptr) {
+            nodeStorage[index].offset = (uint32_t) node->begin;
+            nodeStorage[index].count = (uint32_t) (node->end - node->begin);
+            return index;
+        }
+        
+        // the left child is always directly after the parent.
+        flatten(node->left);
+        auto right = flatten(node->right);
+        nodeStorage[index].offset = right;
+        nodeStorage[index].axis = separationAxis(node->left->aabb, node->right->aabb);
+        return index;
+    }
     
+    void FlatBVH::refit() {
+        // children are always after their parent in the array, so going backwards visits them first.
+        for (size_t i = nodes.size(); i-- > 0;) {
+            auto& node = nodes[i];
+            AABB bounds;
+            if (node.isLeaf()) {
+                for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++) {
+                    auto aabb = getPrimitiveAABB(slot);
+                    if (!aabb.isEmpty())
+                        bounds = bounds.expand(aabb);
+                }
+            } else {
+                auto left = nodes[i + 1].getAABB();
+                auto right = nodes[node.offset].getAABB();
+                // an empty child has collapsed to a point, which would stretch the parent to wherever that point is.
+                if (!left.isEmpty())
+                    bounds = bounds.expand(left);
+                if (!right.isEmpty())
+                    bounds = bounds.expand(right);
+                if (!left.isEmpty() && !right.isEmpty())
+                    node.axis = separationAxis(left, right);
+            }
+            if (bounds.isEmpty()) {
+                auto center = node.getAABB().getCenter();
+                bounds = {center, center};
+            }
+            node.setAABB(bounds);
+        }
+        refitSAHCost = computeSAHCost(options.traversalCost, options.intersectionCost);
+        // the structure hasn't changed but the wide nodes store copies of the bounds
+        buildWideTree();
+    }
     
+    void FlatBVH::buildWideTree() {
+        if (options.width == BVH4_WIDTH)
+            wideTree.build(nodes, wideLeafSize);
+    }
     
+    bool FlatBVH::useCachedTree(const BVHCachedTree& tree, std::shared_ptr<void> mapping, size_t primitiveCount) {
+        // an SBVH can reference a primitive from more than one leaf, every other builder references each primitive exactly once
+        bool sizeMatches = options.builder == SBVH ? tree.primitiveIndices.size() >= primitiveCount : tree.primitiveIndices.size() == primitiveCount;
+        if (!sizeMatches || tree.nodes.empty() || (options.width == BVH4_WIDTH && tree.wideNodes.empty()))
+            return false;
+        const size_t slotCount = tree.primitiveIndices.size();
+        // the scene hash should stop this from happening, but a damaged file must not send traversal outside the arrays
+        for (auto index : tree.primitiveIndices) {
+            if (index >= primitiveCount)
+                return false;
+        }
+        // children always come after their parent, so one pass forward knows the depth of every parent before its children. The traversal
+        // stacks only have room for trees as deep as the builders make them.
+        std::vector<int> depths(tree.nodes.size());
+        for (size_t i = 0; i < tree.nodes.size(); i++) {
+            const auto& node = tree.nodes[i];
+            if (node.isLeaf() ? (size_t) node.offset + node.count > slotCount : node.offset <= i + 1 || node.offset >= tree.nodes.size())
+                return false;
+            if (depths[i] >= BVH_MAX_DEPTH)
+                return false;
+            if (!node.isLeaf()) {
+                depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+                depths[node.offset] = std::max(depths[node.offset], depths[i] + 1);
+            }
+        }
+        depths.assign(tree.wideNodes.size(), 0);
+        for (size_t i = 0; i < tree.wideNodes.size(); i++) {
+            const auto& node = tree.wideNodes[i];
+            if (depths[i] >= BVH_MAX_DEPTH)
+                return false;
+            for (int slot = 0; slot < BVH4_WIDTH; slot++) {
+                // empty slots point at the root but have inverted bounds so they are never hit
+                bool inner = node.count[slot] == 0 && node.child[slot] != 0;
+                bool valid = node.count[slot] > 0 ? (size_t) node.child[slot] + node.count[slot] <= slotCount
+                                                  : !inner ? node.bounds[0][0][slot] > node.bounds[1][0][slot]
+                                                           : node.child[slot] > i && node.child[slot] < tree.wideNodes.size();
+                if (!valid)
+                    return false;
+                if (inner)
+                    depths[node.child[slot]] = std::max(depths[node.child[slot]], depths[i] + 1);
+            }
+        }
+        clear();
+        cacheMapping = std::move(mapping);
+        nodes = tree.nodes;
+        primitiveIndices = tree.primitiveIndices;
+        sahCost = refitSAHCost = tree.sahCost;
+        if (options.width == BVH4_WIDTH)
+            wideTree.useNodes(tree.wideNodes);
+        return true;
+    }
     
+    void FlatBVH::clear() {
+        nodeStorage.clear();
+        primitiveIndexStorage.clear();
+        nodes = {};
+        primitiveIndices = {};
+        wideTree.useNodes({});
+        cacheMapping = nullptr;
+        sahCost = refitSAHCost = 0;
+    }
     
+    void BVH4::build(std::span<const BVHFlatNode> binaryNodes, uint32_t mergeSize) {
+        nodeStorage.clear();
+        nodes = {};
+        if (binaryNodes.empty())
+            return;
+        nodeStorage.reserve(binaryNodes.size() / 2 + 1);
+        // children always come after their parent, so walking backwards sees both children before the parent
+        std::vector<SubtreeRange> ranges(mergeSize > 0 ? binaryNodes.size() : 0);
+        for (size_t i = ranges.size(); i-- > 0;) {
+            const auto& node = binaryNodes[i];
+            if (node.isLeaf()) {
+                ranges[i] = {node.offset, node.count, true};
+                continue;
+            }
+            const auto& left = ranges[i + 1];
+            const auto& right = ranges[node.offset];
+            ranges[i].first = std::min(left.first, right.first);
+            ranges[i].count = left.count + right.count;
+            ranges[i].contiguous = left.contiguous && right.contiguous &&
+                                   (left.first + left.count == right.first || right.first + right.count == left.first);
+        }
+        collapse(binaryNodes, ranges, mergeSize, 0);
+        nodes = nodeStorage;
+    }
     
+    uint32_t BVH4::collapse(std::span<const BVHFlatNode> binaryNodes, std::span<const SubtreeRange> ranges, uint32_t mergeSize, uint32_t index) {
+        auto wideIndex = (uint32_t) nodeStorage.size();
+        nodeStorage.emplace_back();
+        auto isLeaf = [&](uint32_t i) -> bool {
+            return binaryNodes[i].isLeaf() || (mergeSize > 0 && ranges[i].contiguous && ranges[i].count <= mergeSize);
+        };
+
+        // a binary tree which is a single leaf becomes a node with one child
+        std::vector<uint32_t> children;
+        if (isLeaf(index))
+            children.push_back(index);
+        else
+            children = {index + 1, binaryNodes[index].offset};
+        // keep opening the largest interior child, since it is the one most likely to be hit, until the node is full
+        while (children.size() < BVH4_WIDTH) {
+            int largest = -1;
+            PRECISION_TYPE largestArea = -1;
+            for (size_t i = 0; i < children.size(); i++) {
+                const auto& child = binaryNodes[children[i]];
+                if (!isLeaf(children[i]) && child.getAABB().surfaceArea() > largestArea) {
+                    largest = (int) i;
+                    largestArea = child.getAABB().surfaceArea();
+                }
+            }
+            if (largest < 0)
+                break;
+            auto opened = children[largest];
+            children[largest] = opened + 1;
+            children.push_back(binaryNodes[opened].offset);
+        }
+        
+        constexpr auto inf = std::numeric_limits<PRECISION_TYPE>::infinity();
+        for (int slot = 0; slot < BVH4_WIDTH; slot++) {
+            if (slot >= (int) children.size()) {
+                nodeStorage[wideIndex].setChildAABB(slot, {inf, inf, inf, -inf, -inf, -inf});
+                nodeStorage[wideIndex].child[slot] = 0;
+                nodeStorage[wideIndex].count[slot] = 0;
+                continue;
+            }
+            const auto& child = binaryNodes[children[slot]];
+            // has to be done through the index since the vector can be reallocated when the children are added
+            nodeStorage[wideIndex].setChildAABB(slot, child.getAABB());
+            if (child.isLeaf()) {
+                nodeStorage[wideIndex].child[slot] = child.offset;
+                nodeStorage[wideIndex].count[slot] = child.count;
+            } else if (isLeaf(children[slot])) {
+                nodeStorage[wideIndex].child[slot] = ranges[children[slot]].first;
+                nodeStorage[wideIndex].count[slot] = ranges[children[slot]].count;
+            } else {
+                auto childIndex = collapse(binaryNodes, ranges, mergeSize, children[slot]);
+                nodeStorage[wideIndex].child[slot] = childIndex;
+                nodeStorage[wideIndex].count[slot] = 0;
+            }
+        }
+        return wideIndex;
+    }
+
+    BVHBuilderType BVHBuildOptions::builderFromString(const std::string& name) {
+        auto lower = String::toLowerCase(name);
+        if (lower == "sah")
+            return SAH;
+        if (lower == "sbvh")
+            return SBVH;
+        if (lower == "lbvh")
+            return LBVH;
+        if (lower == "midpoint")
+            return MIDPOINT;
+        throw std::runtime_error("Unknown BVH builder {" + name + "}. Please use sah, sbvh, lbvh or midpoint");
+    }
     
+    std::string BVHBuildOptions::builderToString(BVHBuilderType type) {
+        switch (type) {
+            case SAH:
+                return "sah";
+            case SBVH:
+                return "sbvh";
+            case LBVH:
+                return "lbvh";
+            case MIDPOINT:
+                return "midpoint";
+        }
+        return "unknown";
+    }
     
+    PRECISION_TYPE FlatBVH::computeSAHCost(PRECISION_TYPE traversalCost, PRECISION_TYPE intersectionCost) const {
+        if (nodes.empty())
+            return 0;
+        PRECISION_TYPE rootArea = nodes[0].getAABB().surfaceArea();
+        // a flat world has no area to compare against, every ray that hits it will visit the whole tree.
+        if (rootArea <= 0)
+            return 0;
+        // interior nodes cost one traversal step, leaves cost an intersection test for every object inside them.
+        // both weighted by the chance a ray which hits the root also hits the node
+        PRECISION_TYPE cost = 0;
+        for (const auto& node : nodes) {
+            if (node.isLeaf())
+                cost += node.getAABB().surfaceArea() * intersectionCost * (PRECISION_TYPE) node.count;
+            else
+                cost += node.getAABB().surfaceArea() * traversalCost;
+        }
+        return cost / rootArea;
+    }
     
-    /*
-     * Triangle BVH Tree Class
-     * -------------------------------------------------------------------------
+    BVHStatistics FlatBVH::computeStatistics() const {
+        BVHStatistics stats;
+        stats.nodeCount = nodes.size();
+        stats.wideNodeCount = wideTree.getNodes().size();
+        stats.sahCost = sahCost;
+        stats.memoryUsage = getMemoryUsage();
+        if (nodes.empty())
+            return stats;
+        
+        std::vector<std::pair<uint32_t, size_t>> stack{{0, 0}};
+        while (!stack.empty()) {
+            auto [index, depth] = stack.back();
+            stack.pop_back();
+            if (stats.depthHistogram.size() <= depth)
+                stats.depthHistogram.resize(depth + 1);
+            stats.depthHistogram[depth]++;
+            const auto& node = nodes[index];
+            if (node.isLeaf()) {
+                stats.leafCount++;
+                if (stats.leafSizeHistogram.size() <= node.count)
+                    stats.leafSizeHistogram.resize(node.count + 1);
+                stats.leafSizeHistogram[node.count]++;
+                continue;
+            }
+            const auto& left = nodes[index + 1];
+            const auto& right = nodes[node.offset];
+            // the intersection of the children is empty along any axis they don't overlap on
+            PRECISION_TYPE overlap[3];
+            for (int axis = 0; axis < 3; axis++)
+                overlap[axis] = std::max((PRECISION_TYPE) 0, std::min(left.max[axis], right.max[axis]) - std::max(left.min[axis], right.min[axis]));
+            stats.overlapArea += 2 * (overlap[0] * overlap[1] + overlap[1] * overlap[2] + overlap[2] * overlap[0]);
+            stats.interiorArea += node.getAABB().surfaceArea();
+            stack.emplace_back(node.offset, depth + 1);
+            stack.emplace_back(index + 1, depth + 1);
+        }
+        return stats;
+    }
+    
+    /**
+     * Tests an object in the tree using the type stored with it, the objects the tree knows about are called directly.
+     */
+    static inline HitRecord intersectObject(const Object* obj, ObjectType type, const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) {
+        switch (type) {
+            case ObjectType::SPHERE:
+                return static_cast<const SphereObject*>(obj)->SphereObject::intersect(ray, min, max);
+            case ObjectType::MODEL:
+                return static_cast<const ModelObject*>(obj)->ModelObject::intersect(ray, min, max);
+            case ObjectType::OBJECT:
+                break;
+        }
+        return obj->intersect(ray, min, max);
+    }
+    
+    HitRecord BVHTree::rayClosestHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+        HitRecord closest{false, max};
+        // spheres in the same leaf are tested together. Any other object tests the spheres gathered before it first,
+        // so the objects are still tested in order and ties go to the same object as testing them one by one
+        SphereBatch spheres;
+        traverseClosestHitLeaves(
+                ray, min, max, [&](uint32_t first, uint32_t count, PRECISION_TYPE& tMax) {
+                    for (uint32_t i = first; i < first + count; i++) {
+                        auto index = primitiveIndices[i];
+                        auto* obj = primitives[index];
+                        if (obj == nullptr)
+                            continue;
+                        // a lone sphere is cheaper to test directly
+                        if (count > 1 && primitiveTypes[index] == ObjectType::SPHERE) {
+                            static_cast<SphereObject*>(obj)->addTo(spheres);
+                            if (spheres.full())
+                                SphereObject::intersect(spheres, ray, min, closest);
+                            continue;
+                        }
+                        SphereObject::intersect(spheres, ray, min, closest);
+                        // only check up to the closest hit so far, which means any hit we get is closer.
+                        auto result = intersectObject(obj, primitiveTypes[index], ray, min, closest.t);
+                        if (result.hit) {
+                            closest = result;
+                            closest.object = obj;
+                        }
+                    }
+                    SphereObject::intersect(spheres, ray, min, closest);
+                    tMax = closest.t;
+                }
+        );
+        // objects inserted since the build aren't in the tree yet
+        for (auto* obj : insertedObjects) {
+            if (obj->getType() == ObjectType::SPHERE) {
+                static_cast<SphereObject*>(obj)->addTo(spheres);
+                if (spheres.full())
+                    SphereObject::intersect(spheres, ray, min, closest);
+                continue;
+            }
+            SphereObject::intersect(spheres, ray, min, closest);
+            auto result = obj->intersect(ray, min, closest.t);
+            if (result.hit) {
+                closest = result;
+                closest.object = obj;
+            }
+        }
+        SphereObject::intersect(spheres, ray, min, closest);
+        return closest;
+    }
+
+    /**
+     * Bucket used by the binned SAH builder. Stores the bounds of every object whose centroid falls in the bucket.
      */
+    struct SAHBin {
+        AABB bounds;
+        size_t count = 0;
+        
+        inline void add(const AABB& aabb) {
+            bounds = count == 0 ? aabb : bounds.expand(aabb);
+            count++;
+        }
+        
+        inline void add(const SAHBin& bin) {
+            if (bin.count == 0)
+                return;
+            bounds = count == 0 ? bin.bounds : bounds.expand(bin.bounds);
+            count += bin.count;
+        }
+    };
+    
+    static inline PRECISION_TYPE getAxis(const Vec4& vec, int axis) {
+        return axis == 0 ? vec.x() : axis == 1 ? vec.y() : vec.z();
+    }
     
     /**
-     * Returns the object array from the first bounding tree with objects in it hit by the provided ray.
-     * @firstHitRayIntersectTraversal for more information.
+     * Bounds containing both AABBs. Unlike AABB::expand a box with no size is still a place which has to be enclosed,
+     * which matters for the clipped references of the SBVH builder.
      */
-    std::vector<TriangleBVHObject> TriangleBVHTree::rayFirstHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) {
-        RTAssert(root != nullptr);
-        auto results = root->firstHitRayIntersectTraversal(ray, min, max);
-        RTAssert(results.ptr != nullptr);
-        if (results.hit)
-            return results.ptr->objs;
-        else
-            return {};
+    static inline AABB enclose(const AABB& a, const AABB& b) {
+        auto aMin = a.getMin(), aMax = a.getMax(), bMin = b.getMin(), bMax = b.getMax();
+        return {
+                std::min(aMin.x(), bMin.x()), std::min(aMin.y(), bMin.y()), std::min(aMin.z(), bMin.z()), std::max(aMax.x(), bMax.x()),
+                std::max(aMax.y(), bMax.y()), std::max(aMax.z(), bMax.z())
+        };
     }
     
     /**
-     * Splits the objects into the two distinct spaces provided in the aabbs param based on their intersection
-     * This is left side based and produces two vectors which are unique.
-     * @param aabbs the two spaces which to split the objs vector into
-     * @param objs object vector to be split into aabbs
-     * @return BVHPartitionedSpace, a structure with two vectors containing the split objects. Is left side based and unique.
+     * Surface area of the space shared by the two AABBs, 0 if they don't overlap
+     */
+    static inline PRECISION_TYPE overlapArea(const AABB& a, const AABB& b) {
+        PRECISION_TYPE overlap[3];
+        for (int axis = 0; axis < 3; axis++) {
+            overlap[axis] = std::max(
+                    (PRECISION_TYPE) 0, std::min(getAxis(a.getMax(), axis), getAxis(b.getMax(), axis)) -
+                                        std::max(getAxis(a.getMin(), axis), getAxis(b.getMin(), axis))
+            );
+        }
+        return 2 * (overlap[0] * overlap[1] + overlap[1] * overlap[2] + overlap[2] * overlap[0]);
+    }
+    
+    /**
+     * Cheapest split of a node's objects into two groups by which side of a plane their centers are on.
+     */
+    struct ObjectSplit {
+        PRECISION_TYPE cost = infinity;
+        // -1 if the objects couldn't be split
+        int axis = -1;
+        // objects whose center is in a bin before this one go on the left
+        int bin = 0;
+        int binCount = 0;
+        PRECISION_TYPE axisMin = 0, scale = 0;
+        // bounds of the objects on either side of the split
+        AABB left, right;
+        
+        [[nodiscard]] inline bool isLeft(const Vec4& centroid) const {
+            return std::min(binCount - 1, (int) ((getAxis(centroid, axis) - axisMin) * scale)) < bin;
+        }
+    };
+    
+    /**
+     * Finds the best object split of count objects using the binned surface area heuristic, used by both the SAH and SBVH builders.
+     * @param getAABB returns the bounds of the object i in [0, count)
+     * @param getCentroid returns the center of the object i
+     */
+    template<typename GetAABB, typename GetCentroid>
+    static ObjectSplit findObjectSplit(
+            const BVHBuildOptions& options, size_t count, const Vec4& centroidMin, const Vec4& centroidMax, PRECISION_TYPE worldArea,
+            GetAABB&& getAABB, GetCentroid&& getCentroid
+    ) {
+        ObjectSplit best;
+        best.binCount = std::max(2, options.binCount);
+        const int binCount = best.binCount;
+        
+        // find the cheapest split over all three axis
+        std::vector<SAHBin> bins(binCount);
+        std::vector<PRECISION_TYPE> rightCosts(binCount);
+        std::vector<AABB> rightBounds(binCount);
+        for (int axis = 0; axis < 3; axis++) {
+            PRECISION_TYPE axisMin = getAxis(centroidMin, axis);
+            PRECISION_TYPE extent = getAxis(centroidMax, axis) - axisMin;
+            // all the centers are in the same place along this axis, we can't split on it.
+            if (extent <= 0)
+                continue;
+            for (auto& bin : bins)
+                bin = {};
+            PRECISION_TYPE scale = binCount / extent;
+            for (size_t i = 0; i < count; i++) {
+                int b = std::min(binCount - 1, (int) ((getAxis(getCentroid(i), axis) - axisMin) * scale));
+                bins[b].add(getAABB(i));
+            }
+            // sweep from the right to get the cost of everything to the right of each split plane
+            SAHBin right;
+            for (int i = binCount - 1; i > 0; i--) {
+                right.add(bins[i]);
+                rightCosts[i] = right.count == 0 ? 0 : right.bounds.surfaceArea() * (PRECISION_TYPE) right.count;
+                rightBounds[i] = right.bounds;
+            }
+            // then sweep from the left, the split i puts bins [0, i) on the left side
+            SAHBin left;
+            for (int i = 1; i < binCount; i++) {
+                left.add(bins[i - 1]);
+                if (left.count == 0 || left.count == count)
+                    continue;
+                PRECISION_TYPE leftCost = left.bounds.surfaceArea() * (PRECISION_TYPE) left.count;
+                PRECISION_TYPE cost = options.traversalCost + options.intersectionCost * (leftCost + rightCosts[i]) / worldArea;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.axisMin = axisMin;
+                    best.scale = scale;
+                    best.left = left.bounds;
+                    best.right = rightBounds[i];
+                }
+            }
+        }
+        return best;
+    }
+    
+    BVHNode* FlatBVH::addObjectsSAH(BVHBuildState& state, size_t begin, size_t end, int depth) {
+        const size_t count = end - begin;
+        // bounds of every object, used for the node, and the bounds of the centers which are used to place the objects in bins
+        AABB world = state.getAABB(begin);
+        Vec4 centroidMin = state.getCentroid(begin);
+        Vec4 centroidMax = centroidMin;
+        for (size_t i = begin + 1; i < end; i++) {
+            world = world.expand(state.getAABB(i));
+            const auto& center = state.getCentroid(i);
+            centroidMin = {std::min(centroidMin.x(), center.x()), std::min(centroidMin.y(), center.y()), std::min(centroidMin.z(), center.z())};
+            centroidMax = {std::max(centroidMax.x(), center.x()), std::max(centroidMax.y(), center.y()), std::max(centroidMax.z(), center.z())};
+        }
+        
+        if (count <= 1 || depth >= BVH_MAX_DEPTH - 1)
+            return new BVHNode(world, begin, end);
+        
+        auto split = findObjectSplit(
+                options, count, centroidMin, centroidMax, world.surfaceArea(), [&](size_t i) -> const AABB& { return state.getAABB(begin + i); },
+                [&](size_t i) -> const Vec4& { return state.getCentroid(begin + i); }
+        );
+        
+        // every object has the same center, no split plane could ever separate them.
+        if (split.axis < 0)
+            return new BVHNode(world, begin, end);
+        
+        // small nodes can be turned into leaves if testing all the objects is cheaper than splitting them further
+        PRECISION_TYPE leafCost = options.intersectionCost * (PRECISION_TYPE) count;
+        if (count <= (size_t) options.maxLeafSize && leafCost <= split.cost)
+            return new BVHNode(world, begin, end);
+        
+        auto middle = std::partition(
+                state.indices.begin() + (long) begin, state.indices.begin() + (long) end, [&](uint32_t index) -> bool {
+                    return split.isLeft(state.centroids[index]);
+                }
+        );
+        auto mid = (size_t) (middle - state.indices.begin());
+        
+        auto children = addChildren(state, begin, mid, end, depth);
+        return new BVHNode(world, children.first, children.second);
+    }
+    
+    /**
+     * Bucket used when looking for a spatial split. Objects are clipped to the buckets they cross, and are counted
+     * as entering the bucket their bounds start in and exiting the one they end in.
+     */
+    struct SpatialBin {
+        AABB bounds;
+        bool hasBounds = false;
+        size_t entries = 0;
+        size_t exits = 0;
+        
+        inline void add(const AABB& aabb) {
+            bounds = hasBounds ? enclose(bounds, aabb) : aabb;
+            hasBounds = true;
+        }
+    };
+    
+    struct SpatialSplit {
+        PRECISION_TYPE cost = infinity;
+        // -1 if no spatial split was found
+        int axis = -1;
+        PRECISION_TYPE position = 0;
+    };
+    
+    /**
+     * Finds the cheapest plane to split the node's space with. Unlike an object split, objects crossing the plane are put on both sides,
+     * each side only getting the part of the object which is on it.
+     * @param splitReference splits a reference by a plane, as FlatBVH::splitPrimitive
      */
-    TriangleBVHPartitionedSpace TriangleBVHTree::partition(const std::pair<AABB, AABB>& aabbs, const std::vector<TriangleBVHObject>& objs) {
-        TriangleBVHPartitionedSpace space;
-        for (const auto& obj: objs) {
-            // if this object doesn't have an AABB, we cannot use a BVH on it. If this ever fails we have a problem with the implementation.
-            RTAssert(!obj.aabb.isEmpty());
-            if (aabbs.first.intersects(obj.aabb))
-                space.left.push_back(obj);
-            else if (aabbs.second.intersects(obj.aabb))
-                space.right.push_back(obj);
+    template<typename SplitReference>
+    static SpatialSplit findSpatialSplit(
+            const BVHBuildOptions& options, const std::vector<BVHObject>& references, const AABB& world, SplitReference&& splitReference
+    ) {
+        const int binCount = std::max(2, options.binCount);
+        const PRECISION_TYPE worldArea = world.surfaceArea();
+        SpatialSplit best;
+        std::vector<SpatialBin> bins(binCount);
+        std::vector<SpatialBin> rightSides(binCount);
+        for (int axis = 0; axis < 3; axis++) {
+            PRECISION_TYPE axisMin = getAxis(world.getMin(), axis);
+            PRECISION_TYPE binSize = (getAxis(world.getMax(), axis) - axisMin) / binCount;
+            if (binSize <= 0)
+                continue;
+            for (auto& bin : bins)
+                bin = {};
+            auto binOf = [&](PRECISION_TYPE position) -> int {
+                return std::clamp((int) ((position - axisMin) / binSize), 0, binCount - 1);
+            };
+            // chop every reference into the bins it crosses
+            for (const auto& reference : references) {
+                int first = binOf(getAxis(reference.aabb.getMin(), axis));
+                int last = binOf(getAxis(reference.aabb.getMax(), axis));
+                AABB remaining = reference.aabb;
+                for (int b = first; b < last; b++) {
+                    auto parts = splitReference(reference, remaining, axis, axisMin + binSize * (PRECISION_TYPE) (b + 1));
+                    bins[b].add(parts.first);
+                    remaining = parts.second;
+                }
+                bins[last].add(remaining);
+                bins[first].entries++;
+                bins[last].exits++;
+            }
+            // everything which ends right of a plane is on the right, everything which starts left of it is on the left
+            SpatialBin right;
+            for (int i = binCount - 1; i > 0; i--) {
+                if (bins[i].hasBounds)
+                    right.add(bins[i].bounds);
+                right.exits += bins[i].exits;
+                rightSides[i] = right;
+            }
+            SpatialBin left;
+            for (int i = 1; i < binCount; i++) {
+                if (bins[i - 1].hasBounds)
+                    left.add(bins[i - 1].bounds);
+                left.entries += bins[i - 1].entries;
+                const auto& rightSide = rightSides[i];
+                if (left.entries == 0 || rightSide.exits == 0)
+                    continue;
+                PRECISION_TYPE cost = options.traversalCost + options.intersectionCost *
+                                                              (left.bounds.surfaceArea() * (PRECISION_TYPE) left.entries +
+                                                               rightSide.bounds.surfaceArea() * (PRECISION_TYPE) rightSide.exits) / worldArea;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = axisMin + binSize * (PRECISION_TYPE) i;
+                }
+            }
+        }
+        return best;
+    }
+    
+    BVHNode* FlatBVH::addObjectsSBVH(BVHBuildState& state, std::vector<BVHObject>& references, size_t splitBudget, int depth) {
+        const size_t count = references.size();
+        AABB world = references[0].aabb;
+        Vec4 centroidMin = world.getCenter();
+        Vec4 centroidMax = centroidMin;
+        for (size_t i = 1; i < count; i++) {
+            world = enclose(world, references[i].aabb);
+            auto center = references[i].aabb.getCenter();
+            centroidMin = {std::min(centroidMin.x(), center.x()), std::min(centroidMin.y(), center.y()), std::min(centroidMin.z(), center.z())};
+            centroidMax = {std::max(centroidMax.x(), center.x()), std::max(centroidMax.y(), center.y()), std::max(centroidMax.z(), center.z())};
+        }
+        auto createLeaf = [&]() -> BVHNode* {
+            std::vector<uint32_t> indices;
+            indices.reserve(count);
+            for (const auto& reference : references)
+                indices.push_back(reference.index);
+            return new BVHNode(world, std::move(indices));
+        };
+        
+        if (count <= 1 || depth >= BVH_MAX_DEPTH - 1)
+            return createLeaf();
+        
+        const PRECISION_TYPE worldArea = world.surfaceArea();
+        auto objectSplit = findObjectSplit(
+                options, count, centroidMin, centroidMax, worldArea, [&](size_t i) -> const AABB& { return references[i].aabb; },
+                [&](size_t i) -> Vec4 { return references[i].aabb.getCenter(); }
+        );
+        auto splitReference = [&](const BVHObject& reference, const AABB& bounds, int axis, PRECISION_TYPE position) -> std::pair<AABB, AABB> {
+            return splitPrimitive(state.objects[reference.index].index, bounds, axis, position);
+        };
+        // spatial splits are only worth looking for when the children of the object split overlap, which is where they help
+        SpatialSplit spatialSplit;
+        if (splitBudget > 0 && (objectSplit.axis < 0 || overlapArea(objectSplit.left, objectSplit.right) > state.minSpatialSplitOverlap))
+            spatialSplit = findSpatialSplit(options, references, world, splitReference);
+        
+        bool useSpatialSplit = spatialSplit.axis >= 0 && spatialSplit.cost < objectSplit.cost;
+        if (!useSpatialSplit && objectSplit.axis < 0)
+            return createLeaf();
+        PRECISION_TYPE leafCost = options.intersectionCost * (PRECISION_TYPE) count;
+        if (count <= (size_t) options.maxLeafSize && leafCost <= std::min(objectSplit.cost, spatialSplit.cost))
+            return createLeaf();
+        
+        std::vector<BVHObject> left, right;
+        size_t duplicates = 0;
+        if (useSpatialSplit) {
+            const int axis = spatialSplit.axis;
+            const PRECISION_TYPE position = spatialSplit.position;
+            std::vector<std::pair<BVHObject, std::pair<AABB, AABB>>> crossing;
+            AABB leftBounds, rightBounds;
+            bool hasLeft = false, hasRight = false;
+            auto addTo = [](AABB& bounds, bool& hasBounds, const AABB& aabb) -> void {
+                bounds = hasBounds ? enclose(bounds, aabb) : aabb;
+                hasBounds = true;
+            };
+            for (const auto& reference : references) {
+                if (getAxis(reference.aabb.getMax(), axis) <= position) {
+                    left.push_back(reference);
+                    addTo(leftBounds, hasLeft, reference.aabb);
+                } else if (getAxis(reference.aabb.getMin(), axis) >= position) {
+                    right.push_back(reference);
+                    addTo(rightBounds, hasRight, reference.aabb);
+                } else {
+                    auto parts = splitReference(reference, reference.aabb, axis, position);
+                    addTo(leftBounds, hasLeft, parts.first);
+                    addTo(rightBounds, hasRight, parts.second);
+                    crossing.emplace_back(reference, parts);
+                }
+            }
+            // reference unsplitting, an object crossing the plane is moved entirely to one side if that is cheaper than referencing it on both
+            auto leftCount = (PRECISION_TYPE) (left.size() + crossing.size());
+            auto rightCount = (PRECISION_TYPE) (right.size() + crossing.size());
+            for (const auto& [reference, parts] : crossing) {
+                PRECISION_TYPE splitCost = leftBounds.surfaceArea() * leftCount + rightBounds.surfaceArea() * rightCount;
+                auto leftWithReference = enclose(leftBounds, reference.aabb);
+                auto rightWithReference = enclose(rightBounds, reference.aabb);
+                PRECISION_TYPE leftOnlyCost = leftWithReference.surfaceArea() * leftCount + rightBounds.surfaceArea() * (rightCount - 1);
+                PRECISION_TYPE rightOnlyCost = leftBounds.surfaceArea() * (leftCount - 1) + rightWithReference.surfaceArea() * rightCount;
+                if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost) {
+                    left.push_back(reference);
+                    leftBounds = leftWithReference;
+                    rightCount--;
+                } else if (rightOnlyCost < splitCost) {
+                    right.push_back(reference);
+                    rightBounds = rightWithReference;
+                    leftCount--;
+                } else {
+                    left.push_back({parts.first, reference.index});
+                    right.push_back({parts.second, reference.index});
+                    duplicates++;
+                }
+            }
+            // the split can't use more references than the budget allows, and must leave something on both sides
+            if (duplicates > splitBudget || left.empty() || right.empty()) {
+                if (objectSplit.axis < 0)
+                    return createLeaf();
+                useSpatialSplit = false;
+                left.clear();
+                right.clear();
+                duplicates = 0;
+            }
+        }
+        if (!useSpatialSplit) {
+            for (const auto& reference : references) {
+                if (objectSplit.isLeft(reference.aabb.getCenter()))
+                    left.push_back(reference);
+                else
+                    right.push_back(reference);
+            }
         }
-        return space;
+        // the references of this node are no longer needed, and there can be a lot of them near the root
+        std::vector<BVHObject>().swap(references);
+        
+        // whatever wasn't used here is shared by the children based on how many references each of them has
+        size_t remainingBudget = splitBudget - duplicates;
+        size_t leftBudget = remainingBudget * left.size() / (left.size() + right.size());
+        size_t rightBudget = remainingBudget - leftBudget;
+        BVHNode* leftNode;
+        BVHNode* rightNode;
+#ifdef USE_OPENMP
+        if (count >= BVH_TASK_THRESHOLD) {
+#pragma omp task default(shared)
+            leftNode = addObjectsSBVH(state, left, leftBudget, depth + 1);
+            rightNode = addObjectsSBVH(state, right, rightBudget, depth + 1);
+#pragma omp taskwait
+            return new BVHNode(world, leftNode, rightNode);
+        }
+#endif
+        leftNode = addObjectsSBVH(state, left, leftBudget, depth + 1);
+        rightNode = addObjectsSBVH(state, right, rightBudget, depth + 1);
+        return new BVHNode(world, leftNode, rightNode);
+    }
+    
+    std::pair<AABB, AABB> FlatBVH::splitPrimitive(uint32_t, const AABB& bounds, int axis, PRECISION_TYPE position) const {
+        PRECISION_TYPE min[3] = {bounds.getMin().x(), bounds.getMin().y(), bounds.getMin().z()};
+        PRECISION_TYPE max[3] = {bounds.getMax().x(), bounds.getMax().y(), bounds.getMax().z()};
+        PRECISION_TYPE leftMax[3] = {max[0], max[1], max[2]};
+        PRECISION_TYPE rightMin[3] = {min[0], min[1], min[2]};
+        leftMax[axis] = std::min(max[axis], position);
+        rightMin[axis] = std::max(min[axis], position);
+        return {
+                AABB{min[0], min[1], min[2], leftMax[0], leftMax[1], leftMax[2]},
+                AABB{rightMin[0], rightMin[1], rightMin[2], max[0], max[1], max[2]}
+        };
     }
     
-    TriangleBVHNode* TriangleBVHTree::addObjectsRecursively(const std::vector<TriangleBVHObject>& objects, const TriangleBVHPartitionedSpace& prevSpace) {
+    BVHNode* FlatBVH::addObjectsMidpoint(BVHBuildState& state, size_t begin, size_t end, int depth) {
         // create a volume for the entire world.
         // yes, we could use a recursion provided AABB, but that wouldn't be minimum, only half. this ensures that we have a minimum AABB.
         AABB world;
-        for (const auto& obj: objects)
-            world = world.expand(obj.aabb);
+        for (size_t i = begin; i < end; i++)
+            world = world.expand(state.getAABB(i));
         
         // if we have a single object then we can create a leaf.
-        if ((objects.size() <= 1 && !objects.empty())) {
-            return new TriangleBVHNode(objects, world, nullptr, nullptr);
-        } else if (objects.empty()) // should never reach here!!
-            return nullptr;
+        if (end - begin <= 1 || depth >= BVH_MAX_DEPTH - 1)
+            return new BVHNode(world, begin, end);
+        
+        // objects are put on the side they intersect, if they intersect both the preferred side wins.
+        auto partition = [&](const AABB& preferred) -> size_t {
+            auto middle = std::partition(
+                    state.indices.begin() + (long) begin, state.indices.begin() + (long) end, [&](uint32_t index) -> bool {
+                        return preferred.intersects(state.objects[index].aabb);
+                    }
+            );
+            return (size_t) (middle - state.indices.begin());
+        };
         
         // then split and partition the world
         auto splitAABBs = world.splitByLongestAxis();
-        auto partitionedObjs = partition(splitAABBs, objects);
-        if (prevSpace == partitionedObjs) {
+        auto mid = partition(splitAABBs.first);
+        if (mid == begin || mid == end) {
             // if we haven't made progress in splitting the world, try inverting the order we add objects first
-            partitionedObjs = partition({splitAABBs.second, splitAABBs.first}, objects);
+            mid = partition(splitAABBs.second);
             // if we fail then try splitting on another axis
-            if (prevSpace == partitionedObjs) {
+            if (mid == begin || mid == end) {
                 // try all axis
-                for (int i = 0; i < 3; i++){
+                for (int i = 0; i < 3; i++) {
                     splitAABBs = world.splitAlongAxis(i == 0 ? X : i == 1 ? Y : Z);
-                    partitionedObjs = partition(splitAABBs, objects);
+                    mid = partition(splitAABBs.first);
                     // and once we have an axis that works we can break.
-                    if (prevSpace != partitionedObjs)
+                    if (mid != begin && mid != end)
                         break;
                 }
             }
         }
-        // if we were unable to find a partition that isn't the same as our last, we should create a leaf here
+        // if we were unable to split the objects into two sides we should create a leaf here
         // otherwise we'll get infinite recursion
-        if (prevSpace == partitionedObjs) {
-            return new TriangleBVHNode(objects, world, nullptr, nullptr);
-        }
-    
-        TriangleBVHNode* left = nullptr;
-        TriangleBVHNode* right = nullptr;
-        // don't try to explore nodes which don't have anything in them.
-        if (!partitionedObjs.left.empty())
-            left = addObjectsRecursively(partitionedObjs.left, partitionedObjs);
-        if (!partitionedObjs.right.empty())
-            right = addObjectsRecursively(partitionedObjs.right, partitionedObjs);
+        if (mid == begin || mid == end)
+            return new BVHNode(world, begin, end);
         
-        if (left == nullptr && right == nullptr)
-            return new TriangleBVHNode(objects, world, left, right);
-        else
-            return new TriangleBVHNode({}, world, left, right);
+        auto children = addChildren(state, begin, mid, end, depth);
+        return new BVHNode(world, children.first, children.second);
     }
     
-    /**
- * Creates a BVH using the supplied vector of objects
- * @param objects objects used to generate the BVH
- */
-    void TriangleBVHTree::addObjects(const std::vector<TriangleBVHObject>& objects) {
-        if (root != nullptr)
-            throw std::runtime_error("Triangle BVHTree already exists. What are you trying to do?");
-        // move all the object's aabb's into world position
-        std::vector<TriangleBVHObject> objs;
-        for (const auto& obj: objects) {
-            // we don't want to store all the AABBs which don't exist
-            RTAssert(!obj.aabb.isEmpty());
-            
-            TriangleBVHObject bvhObject;
-            // returns a copy of the AABB object and assigns it in to the tree storage object
-            bvhObject.position = obj.position;
-            bvhObject.aabb = obj.tri->aabb.translate(obj.position);
-            bvhObject.tri = obj.tri;
-            objs.push_back(bvhObject);
+    BVHNode* FlatBVH::addObjectsLBVH(BVHBuildState& state, size_t begin, size_t end, int depth) {
+        const size_t count = end - begin;
+        if (count <= (size_t) std::max(1, options.maxLeafSize) || depth >= BVH_MAX_DEPTH - 1) {
+            AABB world = state.getAABB(begin);
+            for (size_t i = begin + 1; i < end; i++)
+                world = world.expand(state.getAABB(i));
+            return new BVHNode(world, begin, end);
+        }
+        
+        const uint64_t firstCode = state.mortonCodes[begin];
+        const uint64_t lastCode = state.mortonCodes[end - 1];
+        size_t mid;
+        if (firstCode == lastCode) {
+            // the objects are too close together to have different codes, so there is nothing better than splitting the range in half
+            mid = begin + count / 2;
+        } else {
+            // the codes are sorted, so everything before the first code with the highest differing bit set goes on the left
+            const uint64_t splitBit = (uint64_t) 1 << (63 - std::countl_zero(firstCode ^ lastCode));
+            mid = (size_t) (std::partition_point(
+                    state.mortonCodes.begin() + (long) begin, state.mortonCodes.begin() + (long) end, [splitBit](uint64_t code) -> bool {
+                        return (code & splitBit) == 0;
+                    }
+            ) - state.mortonCodes.begin());
         }
-        root = addObjectsRecursively(objs, {});
+        
+        auto children = addChildren(state, begin, mid, end, depth);
+        // the bounds come from the children instead of looking at every object again, keeping the build linear
+        return new BVHNode(children.first->aabb.expand(children.second->aabb), children.first, children.second);
     }
     
-    /**
-     * Returns all the objects intersected by the provided ray. The returned objects are in no particular order.
-     * @param ray to use in AABB intersection
-     * @param min min t allowed for intersection search
-     * @param max max t allowed
-     * @return a unordered array of objects intersected by ray in this BVH.
+    /*
+     * Triangle BVH Tree Class
+     * -------------------------------------------------------------------------
      */
-    std::vector<TriangleBVHObject> TriangleBVHTree::rayAnyHitIntersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) {
-        std::queue<TriangleBVHNode*> nodes{};
-        std::vector<TriangleBVHObject> objects;
-        nodes.push(root);
-        
-        while (!nodes.empty()) {
-            auto* node = nodes.front();
-            
-            auto AABB = node->aabb;
-            auto nodeHitData = AABB.intersects(ray, min, max);
-            if (nodeHitData.hit) {
-                if (node->left != nullptr)
-                    nodes.push(node->left);
-                if (node->right != nullptr)
-                    nodes.push(node->right);
-                
-                if (!node->objs.empty()) {
-                    for (const auto& obj: node->objs)
-                        objects.push_back(obj);
+    
+    TriangleBVHTree::TriangleBVHTree(
+            const IndexedMesh& mesh, const BVHBuildOptions& buildOptions, const BVHCachedTree* cachedTree, std::shared_ptr<void> mapping
+    ): FlatBVH(buildOptions), mesh(mesh) {
+        // a leaf of the wide tree is tested as blocks of triangles, which costs about the same for one triangle as for a whole block
+        wideLeafSize = TRIANGLE_BLOCK_WIDTH;
+        if (mesh.getTriangleCount() == 0)
+            return;
+        if (cachedTree != nullptr) {
+            if (useCachedTree(*cachedTree, std::move(mapping), mesh.getTriangleCount())) {
+                buildBlocks();
+                return;
+            }
+            wlog << "A cached mesh BVH doesn't match its mesh, building it instead\n";
+        }
+        std::vector<BVHObject> objs;
+        objs.reserve(mesh.getTriangleCount());
+        for (size_t i = 0; i < mesh.getTriangleCount(); i++)
+            objs.push_back({mesh.getTriangleAABB(i), (uint32_t) i});
+        build(objs);
+        buildBlocks();
+    }
+    
+    void TriangleBVHTree::buildBlocks() {
+        blocks.clear();
+        leafBlocks.assign(primitiveIndices.size(), 0);
+        // the leaves the traversal will hand over, the wide tree can have merged some of the binary leaves together
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+        if (options.width == BVH4_WIDTH) {
+            for (const auto& node : wideTree.getNodes()) {
+                for (int slot = 0; slot < BVH4_WIDTH; slot++) {
+                    if (node.count[slot] > 0)
+                        leaves.emplace_back(node.child[slot], node.count[slot]);
+                }
+            }
+        } else {
+            for (const auto& node : nodes) {
+                if (node.isLeaf() && node.count > 0)
+                    leaves.emplace_back(node.offset, node.count);
+            }
+        }
+        for (auto [offset, count] : leaves) {
+            leafBlocks[offset] = (uint32_t) blocks.size();
+            for (uint32_t first = offset; first < offset + count; first += TRIANGLE_BLOCK_WIDTH) {
+                // value initialized, the empty lanes are all zeros
+                auto& block = blocks.emplace_back();
+                uint32_t lanes = std::min(offset + count - first, (uint32_t) TRIANGLE_BLOCK_WIDTH);
+                block.laneMask = (1u << lanes) - 1;
+                // anchored at the first vertex of the first triangle, every other vertex in a leaf is close to it
+                auto anchor = mesh.getVertex(primitiveIndices[first], 0);
+                block.anchor[0] = anchor.x(), block.anchor[1] = anchor.y(), block.anchor[2] = anchor.z();
+                for (uint32_t lane = 0; lane < lanes; lane++) {
+                    uint32_t index = primitiveIndices[first + lane];
+                    auto vertex0 = mesh.getVertex(index, 0);
+                    auto edge1 = mesh.getVertex(index, 1) - vertex0;
+                    auto edge2 = mesh.getVertex(index, 2) - vertex0;
+                    auto relative = vertex0 - anchor;
+                    block.triangle[lane] = index;
+                    block.vertex0[0][lane] = (float) relative.x(), block.vertex0[1][lane] = (float) relative.y(), block.vertex0[2][lane] = (float) relative.z();
+                    block.edge1[0][lane] = (float) edge1.x(), block.edge1[1][lane] = (float) edge1.y(), block.edge1[2][lane] = (float) edge1.z();
+                    block.edge2[0][lane] = (float) edge2.x(), block.edge2[1][lane] = (float) edge2.y(), block.edge2[2][lane] = (float) edge2.z();
+                    for (int i = 0; i < 3; i++) {
+                        block.vertex0Size[lane] += std::abs(block.vertex0[i][lane]);
+                        block.edge1Size[lane] += std::abs(block.edge1[i][lane]);
+                        block.edge2Size[lane] += std::abs(block.edge2[i][lane]);
+                    }
                 }
             }
-            nodes.pop();
         }
-        return objects;
     }
     
+    std::pair<AABB, AABB> TriangleBVHTree::splitPrimitive(uint32_t primitive, const AABB& bounds, int axis, PRECISION_TYPE position) const {
+        const Vec4 vertices[3] = {mesh.getVertex(primitive, 0), mesh.getVertex(primitive, 1), mesh.getVertex(primitive, 2)};
+        constexpr auto inf = std::numeric_limits<PRECISION_TYPE>::infinity();
+        PRECISION_TYPE sideMin[2][3] = {{inf, inf, inf}, {inf, inf, inf}};
+        PRECISION_TYPE sideMax[2][3] = {{-inf, -inf, -inf}, {-inf, -inf, -inf}};
+        auto addPoint = [&](int side, const PRECISION_TYPE point[3]) -> void {
+            for (int i = 0; i < 3; i++) {
+                sideMin[side][i] = std::min(sideMin[side][i], point[i]);
+                sideMax[side][i] = std::max(sideMax[side][i], point[i]);
+            }
+        };
+        // walk the edges of the triangle, every vertex goes on its side of the plane and every edge crossing the plane adds the crossing to both
+        for (int v = 0; v < 3; v++) {
+            const auto& start = vertices[v];
+            const auto& end = vertices[(v + 1) % 3];
+            PRECISION_TYPE a[3] = {start.x(), start.y(), start.z()};
+            PRECISION_TYPE b[3] = {end.x(), end.y(), end.z()};
+            if (a[axis] <= position)
+                addPoint(0, a);
+            if (a[axis] >= position)
+                addPoint(1, a);
+            if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+                PRECISION_TYPE t = (position - a[axis]) / (b[axis] - a[axis]);
+                PRECISION_TYPE crossing[3];
+                for (int i = 0; i < 3; i++)
+                    crossing[i] = a[i] + (b[i] - a[i]) * t;
+                crossing[axis] = position;
+                addPoint(0, crossing);
+                addPoint(1, crossing);
+            }
+        }
+        // the part of the triangle on each side is then limited to the bounds being split, which may have been clipped before
+        auto clipped = FlatBVH::splitPrimitive(primitive, bounds, axis, position);
+        auto clip = [&](int side, const AABB& limit) -> AABB {
+            auto limitMin = limit.getMin(), limitMax = limit.getMax();
+            PRECISION_TYPE min[3], max[3];
+            for (int i = 0; i < 3; i++) {
+                min[i] = std::max(sideMin[side][i], getAxis(limitMin, i));
+                max[i] = std::min(sideMax[side][i], getAxis(limitMax, i));
+                // the clipped triangle doesn't reach into the limit, which only happens through rounding. fall back to the clipped bounds
+                if (min[i] > max[i])
+                    return limit;
+            }
+            return {min[0], min[1], min[2], max[0], max[1], max[2]};
+        };
+        return {clip(0, clipped.first), clip(1, clipped.second)};
+    }
+
 }
 
 /**
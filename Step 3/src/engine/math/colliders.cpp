@@ -99,7 +99,7 @@ namespace Raytracing {
         tmin = std::max(tmin, std::min(tz1, tz2));
         tmax = std::min(tmax, std::max(tz1, tz2));
         
-        tmin = std::max(tmin, 0.0);
+        tmin = std::max(tmin, (PRECISION_TYPE) 0.0);
         
         // TODO: nans?
         //tlog << "TMin: " << tmin << " TMax: " << tmax << " Case: " << (tmax > tmin) << "\n";
@@ -0,0 +1,354 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/math/simd.h>
+#include <engine/math/bvh.h>
+#include <chrono>
+
+namespace Raytracing {
+
+    // the pixel kernels read the image as plain arrays of four values
+    static_assert(sizeof(Vec4) == 4 * sizeof(PRECISION_TYPE));
+
+    /*
+     * Scalar kernels, used when the CPU has none of the instruction sets below and as the reference the others are checked against.
+     * -------------------------------------------------------------------------
+     */
+
+    static int boxes4(const BVH4Node& node, const BVH4Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax, PRECISION_TYPE* tEntry) {
+        int mask = 0;
+        for (int c = 0; c < BVH4_WIDTH; c++) {
+            PRECISION_TYPE tNear = std::max(tmin, (PRECISION_TYPE) 0.0);
+            PRECISION_TYPE tFar = tmax;
+            for (int i = 0; i < 3; i++) {
+                PRECISION_TYPE near = (node.bounds[ray.sign[i]][i][c] - ray.origin[i]) * ray.inverse[i];
+                PRECISION_TYPE far = (node.bounds[1 - ray.sign[i]][i][c] - ray.origin[i]) * ray.inverse[i];
+                tNear = std::max(tNear, near);
+                tFar = std::min(tFar, far);
+            }
+            tEntry[c] = tNear;
+            if (tFar >= tNear)
+                mask |= 1 << c;
+        }
+        return mask;
+    }
+
+    template<bool computeHit>
+    static int triangles8(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v) {
+        int mask = 0;
+        for (int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+            const float* d = ray.direction;
+            float s[3], e1[3], e2[3];
+            for (int i = 0; i < 3; i++) {
+                s[i] = ray.origin[i] - block.vertex0[i][lane];
+                e1[i] = block.edge1[i][lane];
+                e2[i] = block.edge2[i][lane];
+            }
+            float h[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+            float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+            float a = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+            float aSign = a < 0 ? -1.0f : 1.0f;
+            float aAbs = std::abs(a);
+            float uN = aSign * (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]);
+            float vN = aSign * (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]);
+            float tN = aSign * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+            if constexpr (computeHit) {
+                t[lane] = tN / aAbs;
+                u[lane] = uN / aAbs;
+                v[lane] = vN / aAbs;
+            }
+
+            float sTolerance = TRIANGLE_BLOCK_TOLERANCE * (ray.originSize + block.vertex0Size[lane]);
+            float aError = TRIANGLE_BLOCK_TOLERANCE * ray.directionSize * block.edge1Size[lane] * block.edge2Size[lane];
+            float uError = sTolerance * ray.directionSize * block.edge2Size[lane];
+            float vError = sTolerance * ray.directionSize * block.edge1Size[lane];
+            float tError = sTolerance * block.edge1Size[lane] * block.edge2Size[lane];
+            bool inside = uN >= -uError && vN >= -vError && uN + vN <= aAbs + aError + uError + vError &&
+                          tN + tError >= ray.min * (aAbs - aError) && tN - tError <= ray.max * (aAbs + aError);
+            bool undecided = aAbs <= aError && aError > 0;
+            if (inside || undecided)
+                mask |= 1 << lane;
+        }
+        return mask & (int) block.laneMask;
+    }
+
+    static int triangles8(const TriangleBlock& block, const TriangleBlockRay& ray) {
+        return triangles8<false>(block, ray, nullptr, nullptr, nullptr);
+    }
+
+    static int triangleHits8(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v) {
+        return triangles8<true>(block, ray, t, u, v);
+    }
+
+    static int spheres(const SphereBatch& batch, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max, PRECISION_TYPE& t) {
+        // exactly the steps of SphereObject::intersect, one sphere after the other with max shrinking to the closest hit
+        const double dir[3] = {direction.x(), direction.y(), direction.z()};
+        const double a = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+        double closest = max;
+        int hit = -1;
+        for (int i = 0; i < batch.count; i++) {
+            double RayWRTSphere[3] = {double(origin.x()) - batch.centerX[i], double(origin.y()) - batch.centerY[i], double(origin.z()) - batch.centerZ[i]};
+            double b = RayWRTSphere[0] * dir[0] + RayWRTSphere[1] * dir[1] + RayWRTSphere[2] * dir[2];
+            double c = RayWRTSphere[0] * RayWRTSphere[0] + RayWRTSphere[1] * RayWRTSphere[1] + RayWRTSphere[2] * RayWRTSphere[2] -
+                       batch.radius[i] * batch.radius[i];
+            double discriminant = b * b - (a * c);
+            if (discriminant < 0)
+                continue;
+            auto root = (-b - std::sqrt(discriminant)) / a;
+            if (root < min || root > closest) {
+                root = (-b + std::sqrt(discriminant)) / a;
+                if (root < min || root > closest)
+                    continue;
+            }
+            closest = root;
+            hit = i;
+        }
+        if (hit >= 0)
+            t = (PRECISION_TYPE) closest;
+        return hit;
+    }
+
+    static void pixelsToRGB8(const Vec4* pixels, size_t height, unsigned char* rgb, ptrdiff_t rowStride) {
+        for (int x = 0; x < PIXEL_BLOCK_SIZE; x++) {
+            const Vec4* column = pixels + x * height;
+            for (int y = 0; y < PIXEL_BLOCK_SIZE; y++) {
+                auto* out = rgb + y * rowStride + x * 3;
+                out[0] = (unsigned char) int(255.0 * column[y].r());
+                out[1] = (unsigned char) int(255.0 * column[y].g());
+                out[2] = (unsigned char) int(255.0 * column[y].b());
+            }
+        }
+    }
+
+    const SIMDKernels SCALAR_KERNELS{SIMDLevel::SCALAR, boxes4, triangles8, triangleHits8, spheres, pixelsToRGB8};
+
+    /*
+     * Dispatch
+     * -------------------------------------------------------------------------
+     */
+
+    SIMDKernels SIMD::active = SIMD::kernelsFor(SIMD::detect());
+
+    // rounds every kernel is timed for, the fastest round counts so a burst of noise doesn't decide
+    constexpr int CALIBRATION_ROUNDS = 5;
+    constexpr int CALIBRATION_RAYS = 32;
+    constexpr int CALIBRATION_ITEMS = 16;
+
+    /**
+     * Made up nodes, triangles, spheres and pixels around the origin and rays from all around towards them, so each kernel sees a mix of
+     * hits and misses like it does in a scene.
+     */
+    struct CalibrationData {
+        std::vector<Ray> rays;
+        std::vector<BVH4Node> nodes;
+        std::vector<TriangleBlock> blocks;
+        std::vector<SphereBatch> batches;
+        std::vector<Vec4> pixels;
+        // written by the pixel kernels, never read
+        mutable std::vector<unsigned char> rgb;
+
+        CalibrationData(): nodes(CALIBRATION_ITEMS), blocks(CALIBRATION_ITEMS), batches(CALIBRATION_ITEMS),
+                           pixels(PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE * CALIBRATION_ITEMS), rgb(pixels.size() * 3) {
+            Random random{-1.0, 1.0};
+            auto point = [&random](PRECISION_TYPE scale) -> Vec4 {
+                return {(PRECISION_TYPE) random.getDouble() * scale, (PRECISION_TYPE) random.getDouble() * scale, (PRECISION_TYPE) random.getDouble() * scale};
+            };
+            for (int i = 0; i < CALIBRATION_RAYS; i++) {
+                auto origin = point(8);
+                rays.emplace_back(origin, (point(1) - origin).normalize());
+            }
+            for (auto& node : nodes) {
+                for (int c = 0; c < BVH4_WIDTH; c++) {
+                    auto center = point(2), extent = point(1);
+                    extent = {std::abs(extent.x()), std::abs(extent.y()), std::abs(extent.z())};
+                    node.setChildAABB(c, {center - extent, center + extent});
+                    node.child[c] = node.count[c] = 0;
+                }
+            }
+            for (auto& block : blocks) {
+                for (int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+                    block.vertex0Size[lane] = block.edge1Size[lane] = block.edge2Size[lane] = 0;
+                    for (int i = 0; i < 3; i++) {
+                        block.vertex0[i][lane] = (float) (random.getDouble() * 2);
+                        block.edge1[i][lane] = (float) random.getDouble();
+                        block.edge2[i][lane] = (float) random.getDouble();
+                        block.vertex0Size[lane] += std::abs(block.vertex0[i][lane]);
+                        block.edge1Size[lane] += std::abs(block.edge1[i][lane]);
+                        block.edge2Size[lane] += std::abs(block.edge2[i][lane]);
+                    }
+                    block.triangle[lane] = lane;
+                }
+                block.anchor[0] = block.anchor[1] = block.anchor[2] = 0;
+                block.laneMask = (1u << TRIANGLE_BLOCK_WIDTH) - 1;
+            }
+            for (size_t i = 0; i < batches.size(); i++) {
+                for (size_t j = 0; j <= i % SPHERE_BATCH_WIDTH; j++)
+                    batches[i].add(nullptr, point(3), (PRECISION_TYPE) (0.5 + std::abs(random.getDouble())));
+            }
+            for (auto& pixel : pixels)
+                pixel = {(PRECISION_TYPE) std::abs(random.getDouble()), (PRECISION_TYPE) std::abs(random.getDouble()), (PRECISION_TYPE) std::abs(random.getDouble())};
+        }
+    };
+
+    /**
+     * @return milliseconds the calls took
+     */
+    template<typename Calls>
+    static double timeCalls(const Calls& calls) {
+        auto start = std::chrono::steady_clock::now();
+        calls();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    SIMDLevel SIMD::detect() {
+#if defined(__x86_64__) || defined(__i386__)
+        // also checks the OS saves the wider registers on a context switch, which AVX and AVX-512 need
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512bw"))
+            return SIMDLevel::AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return SIMDLevel::AVX2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return SIMDLevel::SSE42;
+#endif
+        return SIMDLevel::SCALAR;
+    }
+
+    bool SIMD::select(SIMDLevel level) {
+        if (level > detect())
+            return false;
+        active = dispatchFor(level);
+        return true;
+    }
+
+    SIMDKernels SIMD::dispatchFor(SIMDLevel level) {
+        // which level is fastest differs between kernels and between CPUs (the box and sphere kernels have been slower at the wider levels,
+        // sometimes slower than scalar), so they are timed on this CPU instead of assumed
+        static const CalibrationData data;
+        constexpr int KERNEL_COUNT = 5;
+        const int levelCount = (int) level + 1;
+        double fastest[KERNEL_COUNT][4];
+        for (auto& times : fastest)
+            std::fill(std::begin(times), std::end(times), std::numeric_limits<double>::infinity());
+        volatile int sink = 0;
+        // the rounds of the levels take turns so a slow moment affects one round of one level rather than all of a level
+        for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+            for (int l = 0; l < levelCount; l++) {
+                const auto& kernels = kernelsFor((SIMDLevel) l);
+                int result = 0;
+                double times[KERNEL_COUNT] = {
+                        timeCalls([&]() {
+                            for (const auto& ray : data.rays) {
+                                BVH4Ray wideRay{ray};
+                                alignas(32) PRECISION_TYPE tEntry[BVH4_WIDTH];
+                                for (const auto& node : data.nodes)
+                                    result += kernels.boxes4(node, wideRay, 0.001, infinity, tEntry);
+                            }
+                        }),
+                        timeCalls([&]() {
+                            for (const auto& ray : data.rays) {
+                                for (const auto& block : data.blocks)
+                                    result += kernels.triangles8(block, block.makeRay(ray.getStartingPoint(), ray.getDirection(), 0.001, infinity));
+                            }
+                        }),
+                        timeCalls([&]() {
+                            alignas(32) float t[TRIANGLE_BLOCK_WIDTH], u[TRIANGLE_BLOCK_WIDTH], v[TRIANGLE_BLOCK_WIDTH];
+                            for (const auto& ray : data.rays) {
+                                for (const auto& block : data.blocks)
+                                    result += kernels.triangleHits8(block, block.makeRay(ray.getStartingPoint(), ray.getDirection(), 0.001, infinity), t, u, v);
+                            }
+                        }),
+                        timeCalls([&]() {
+                            for (const auto& ray : data.rays) {
+                                for (const auto& batch : data.batches) {
+                                    PRECISION_TYPE t = infinity;
+                                    result += kernels.spheres(batch, ray.getStartingPoint(), ray.getDirection(), 0.001, infinity, t);
+                                }
+                            }
+                        }),
+                        timeCalls([&]() {
+                            // the blocks side by side in an image CALIBRATION_ITEMS blocks wide
+                            const auto rowSize = (ptrdiff_t) (PIXEL_BLOCK_SIZE * CALIBRATION_ITEMS * 3);
+                            for (int i = 0; i < CALIBRATION_RAYS / 4; i++) {
+                                for (int block = 0; block < CALIBRATION_ITEMS; block++)
+                                    kernels.pixelsToRGB8(data.pixels.data() + block * PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE, PIXEL_BLOCK_SIZE,
+                                                         data.rgb.data() + block * PIXEL_BLOCK_SIZE * 3, rowSize);
+                            }
+                        })
+                };
+                sink = sink + result;
+                for (int k = 0; k < KERNEL_COUNT; k++)
+                    fastest[k][l] = std::min(fastest[k][l], times[k]);
+            }
+        }
+        int best[KERNEL_COUNT];
+        for (int k = 0; k < KERNEL_COUNT; k++)
+            best[k] = (int) (std::min_element(fastest[k], fastest[k] + levelCount) - fastest[k]);
+        SIMDKernels kernels = kernelsFor(level);
+        kernels.boxes4 = kernelsFor((SIMDLevel) best[0]).boxes4;
+        kernels.triangles8 = kernelsFor((SIMDLevel) best[1]).triangles8;
+        kernels.triangleHits8 = kernelsFor((SIMDLevel) best[2]).triangleHits8;
+        kernels.spheres = kernelsFor((SIMDLevel) best[3]).spheres;
+        kernels.pixelsToRGB8 = kernelsFor((SIMDLevel) best[4]).pixelsToRGB8;
+        return kernels;
+    }
+
+    std::string SIMD::describe(const SIMDKernels& kernels) {
+        // a kernel's level is the level whose table has the same function
+        auto levelOf = [](auto slot, const auto& function) -> std::string {
+            for (int l = (int) SIMDLevel::SCALAR; l <= (int) SIMDLevel::AVX512; l++) {
+                if (kernelsFor((SIMDLevel) l).*slot == function)
+                    return levelToString((SIMDLevel) l);
+            }
+            return "unknown";
+        };
+        return "boxes " + levelOf(&SIMDKernels::boxes4, kernels.boxes4) + ", triangles " + levelOf(&SIMDKernels::triangles8, kernels.triangles8) +
+               ", triangle hits " + levelOf(&SIMDKernels::triangleHits8, kernels.triangleHits8) + ", spheres " +
+               levelOf(&SIMDKernels::spheres, kernels.spheres) + ", pixels " + levelOf(&SIMDKernels::pixelsToRGB8, kernels.pixelsToRGB8);
+    }
+
+    const SIMDKernels& SIMD::kernelsFor(SIMDLevel level) {
+        switch (level) {
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMDLevel::AVX512:
+                return AVX512_KERNELS;
+            case SIMDLevel::AVX2:
+                return AVX2_KERNELS;
+            case SIMDLevel::SSE42:
+                return SSE42_KERNELS;
+#endif
+            default:
+                return SCALAR_KERNELS;
+        }
+    }
+
+    SIMDLevel SIMD::levelFromString(const std::string& name) {
+        auto lower = String::toLowerCase(name);
+        if (lower == "scalar")
+            return SIMDLevel::SCALAR;
+        if (lower == "sse4.2" || lower == "sse42")
+            return SIMDLevel::SSE42;
+        if (lower == "avx2")
+            return SIMDLevel::AVX2;
+        if (lower == "avx512" || lower == "avx-512")
+            return SIMDLevel::AVX512;
+        throw std::runtime_error("Unknown instruction set {" + name + "}. Please use scalar, sse4.2, avx2 or avx512");
+    }
+
+    std::string SIMD::levelToString(SIMDLevel level) {
+        switch (level) {
+            case SIMDLevel::SCALAR:
+                return "scalar";
+            case SIMDLevel::SSE42:
+                return "sse4.2";
+            case SIMDLevel::AVX2:
+                return "avx2";
+            case SIMDLevel::AVX512:
+                return "avx512";
+        }
+        return "unknown";
+    }
+
+}
@@ -0,0 +1,210 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/math/simd.h>
+#include <engine/math/bvh.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// see simd_sse42.cpp for why the headers come first
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+namespace Raytracing {
+
+    static int boxes4(const BVH4Node& node, const BVH4Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax, PRECISION_TYPE* tEntry) {
+#ifdef USE_FLOAT_PRECISION
+        // four floats only fill half an AVX register, an SSE register holds a coordinate of every child
+        __m128 tNear = _mm_set1_ps(std::max(tmin, (PRECISION_TYPE) 0.0));
+        __m128 tFar = _mm_set1_ps(tmax);
+        for (int i = 0; i < 3; i++) {
+            __m128 origin = _mm_set1_ps(ray.origin[i]);
+            __m128 inverse = _mm_set1_ps(ray.inverse[i]);
+            __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.sign[i]][i]), origin), inverse);
+            __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - ray.sign[i]][i]), origin), inverse);
+            tNear = _mm_max_ps(near, tNear);
+            tFar = _mm_min_ps(far, tFar);
+        }
+        _mm_storeu_ps(tEntry, tNear);
+        return _mm_movemask_ps(_mm_cmp_ps(tFar, tNear, _CMP_GE_OQ));
+#else
+        __m256d tNear = _mm256_set1_pd(std::max(tmin, (PRECISION_TYPE) 0.0));
+        __m256d tFar = _mm256_set1_pd(tmax);
+        for (int i = 0; i < 3; i++) {
+            __m256d origin = _mm256_set1_pd(ray.origin[i]);
+            __m256d inverse = _mm256_set1_pd(ray.inverse[i]);
+            __m256d near = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node.bounds[ray.sign[i]][i]), origin), inverse);
+            __m256d far = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node.bounds[1 - ray.sign[i]][i]), origin), inverse);
+            // max/min return the second operand if either is NaN, keeping the current interval like std::max(tmin, NaN) does
+            tNear = _mm256_max_pd(near, tNear);
+            tFar = _mm256_min_pd(far, tFar);
+        }
+        _mm256_storeu_pd(tEntry, tNear);
+        return _mm256_movemask_pd(_mm256_cmp_pd(tFar, tNear, _CMP_GE_OQ));
+#endif
+    }
+
+    static inline void cross(const __m256 a[3], const __m256 b[3], __m256 out[3]) {
+        out[0] = _mm256_fmsub_ps(a[1], b[2], _mm256_mul_ps(a[2], b[1]));
+        out[1] = _mm256_fmsub_ps(a[2], b[0], _mm256_mul_ps(a[0], b[2]));
+        out[2] = _mm256_fmsub_ps(a[0], b[1], _mm256_mul_ps(a[1], b[0]));
+    }
+
+    static inline __m256 dot(const __m256 a[3], const __m256 b[3]) {
+        return _mm256_fmadd_ps(a[0], b[0], _mm256_fmadd_ps(a[1], b[1], _mm256_mul_ps(a[2], b[2])));
+    }
+
+    template<bool computeHit>
+    static int triangles8(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v) {
+        const __m256 signMask = _mm256_set1_ps(-0.0f);
+        __m256 d[3], s[3], e1[3], e2[3];
+        for (int i = 0; i < 3; i++) {
+            d[i] = _mm256_set1_ps(ray.direction[i]);
+            s[i] = _mm256_sub_ps(_mm256_set1_ps(ray.origin[i]), _mm256_load_ps(block.vertex0[i]));
+            e1[i] = _mm256_load_ps(block.edge1[i]);
+            e2[i] = _mm256_load_ps(block.edge2[i]);
+        }
+        __m256 h[3], q[3];
+        cross(d, e2, h);
+        cross(s, e1, q);
+        __m256 a = dot(e1, h);
+        // flipping the numerators by the sign of the determinant lets every test compare against |a|
+        __m256 aSign = _mm256_and_ps(a, signMask);
+        __m256 aAbs = _mm256_andnot_ps(signMask, a);
+        __m256 uN = _mm256_xor_ps(dot(s, h), aSign);
+        __m256 vN = _mm256_xor_ps(dot(d, q), aSign);
+        __m256 tN = _mm256_xor_ps(dot(e2, q), aSign);
+        if constexpr (computeHit) {
+            __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), aAbs);
+            _mm256_store_ps(t, _mm256_mul_ps(tN, f));
+            _mm256_store_ps(u, _mm256_mul_ps(uN, f));
+            _mm256_store_ps(v, _mm256_mul_ps(vN, f));
+        }
+
+        const __m256 tolerance = _mm256_set1_ps(TRIANGLE_BLOCK_TOLERANCE);
+        __m256 dSize = _mm256_set1_ps(ray.directionSize);
+        __m256 e1Size = _mm256_load_ps(block.edge1Size);
+        __m256 e2Size = _mm256_load_ps(block.edge2Size);
+        // s is the difference of two floats, so its error follows the size of both of them rather than s itself
+        __m256 sTolerance = _mm256_mul_ps(tolerance, _mm256_add_ps(_mm256_set1_ps(ray.originSize), _mm256_load_ps(block.vertex0Size)));
+        __m256 aError = _mm256_mul_ps(_mm256_mul_ps(tolerance, dSize), _mm256_mul_ps(e1Size, e2Size));
+        __m256 uError = _mm256_mul_ps(sTolerance, _mm256_mul_ps(dSize, e2Size));
+        __m256 vError = _mm256_mul_ps(sTolerance, _mm256_mul_ps(dSize, e1Size));
+        __m256 tError = _mm256_mul_ps(sTolerance, _mm256_mul_ps(e1Size, e2Size));
+
+        // u >= 0, v >= 0, u + v <= 1, min <= t <= max
+        __m256 inside = _mm256_and_ps(
+                _mm256_cmp_ps(uN, _mm256_xor_ps(uError, signMask), _CMP_GE_OQ), _mm256_cmp_ps(vN, _mm256_xor_ps(vError, signMask), _CMP_GE_OQ));
+        __m256 sumLimit = _mm256_add_ps(_mm256_add_ps(aAbs, aError), _mm256_add_ps(uError, vError));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(uN, vN), sumLimit, _CMP_LE_OQ));
+        __m256 tNear = _mm256_mul_ps(_mm256_set1_ps(ray.min), _mm256_sub_ps(aAbs, aError));
+        __m256 tFar = _mm256_mul_ps(_mm256_set1_ps(ray.max), _mm256_add_ps(aAbs, aError));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(tN, tError), tNear, _CMP_GE_OQ));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_sub_ps(tN, tError), tFar, _CMP_LE_OQ));
+        // a determinant this close to 0 means the ray is (nearly) parallel and even its sign can't be trusted.
+        // degenerate triangles have no size at all and are left to fail
+        __m256 undecided = _mm256_and_ps(_mm256_cmp_ps(aAbs, aError, _CMP_LE_OQ), _mm256_cmp_ps(aError, _mm256_setzero_ps(), _CMP_GT_OQ));
+        return _mm256_movemask_ps(_mm256_or_ps(inside, undecided)) & (int) block.laneMask;
+    }
+
+    static int triangles8(const TriangleBlock& block, const TriangleBlockRay& ray) {
+        return triangles8<false>(block, ray, nullptr, nullptr, nullptr);
+    }
+
+    static int triangleHits8(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v) {
+        return triangles8<true>(block, ray, t, u, v);
+    }
+
+    static int spheres(const SphereBatch& batch, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max, PRECISION_TYPE& t) {
+        const double dir[3] = {direction.x(), direction.y(), direction.z()};
+        // no FMA here, the roots have to come out exactly as the scalar test's
+        const __m256d a = _mm256_set1_pd(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        const __m256d dx = _mm256_set1_pd(dir[0]), dy = _mm256_set1_pd(dir[1]), dz = _mm256_set1_pd(dir[2]);
+        const __m256d ox = _mm256_set1_pd(origin.x()), oy = _mm256_set1_pd(origin.y()), oz = _mm256_set1_pd(origin.z());
+        const __m256d minimum = _mm256_set1_pd(min), maximum = _mm256_set1_pd(max);
+        const __m256d signMask = _mm256_set1_pd(-0.0);
+        double closest = max;
+        int hit = -1;
+        for (int base = 0; base < batch.count; base += 4) {
+            __m256d rx = _mm256_sub_pd(ox, _mm256_load_pd(batch.centerX + base));
+            __m256d ry = _mm256_sub_pd(oy, _mm256_load_pd(batch.centerY + base));
+            __m256d rz = _mm256_sub_pd(oz, _mm256_load_pd(batch.centerZ + base));
+            __m256d radius = _mm256_load_pd(batch.radius + base);
+            __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rx, dx), _mm256_mul_pd(ry, dy)), _mm256_mul_pd(rz, dz));
+            __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rx, rx), _mm256_mul_pd(ry, ry)), _mm256_mul_pd(rz, rz)),
+                                      _mm256_mul_pd(radius, radius));
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(a, c));
+            __m256d root = _mm256_sqrt_pd(discriminant);
+            __m256d negativeB = _mm256_xor_pd(b, signMask);
+            __m256d near = _mm256_div_pd(_mm256_sub_pd(negativeB, root), a);
+            __m256d far = _mm256_div_pd(_mm256_add_pd(negativeB, root), a);
+            __m256d nearValid = _mm256_and_pd(_mm256_cmp_pd(near, minimum, _CMP_NLT_UQ), _mm256_cmp_pd(near, maximum, _CMP_NGT_UQ));
+            __m256d farValid = _mm256_and_pd(_mm256_cmp_pd(far, minimum, _CMP_NLT_UQ), _mm256_cmp_pd(far, maximum, _CMP_NGT_UQ));
+            __m256d roots = _mm256_blendv_pd(far, near, nearValid);
+            int valid = _mm256_movemask_pd(
+                    _mm256_and_pd(_mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_NLT_UQ), _mm256_or_pd(nearValid, farValid)));
+            if (valid == 0)
+                continue;
+            alignas(32) double lanes[4];
+            _mm256_store_pd(lanes, roots);
+            for (int lane = 0; lane < 4 && base + lane < batch.count; lane++) {
+                if ((valid & (1 << lane)) && lanes[lane] <= closest) {
+                    closest = lanes[lane];
+                    hit = base + lane;
+                }
+            }
+        }
+        if (hit >= 0)
+            t = (PRECISION_TYPE) closest;
+        return hit;
+    }
+
+    /**
+     * Writes the rows of a block of pixels converted to RGBA, block[y][x], as RGB. Four pixels at a time lose their alpha in one shuffle.
+     */
+    static inline void storeRGBRows(const uint32_t block[PIXEL_BLOCK_SIZE][PIXEL_BLOCK_SIZE], unsigned char* rgb, ptrdiff_t rowStride) {
+        const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        for (int y = 0; y < PIXEL_BLOCK_SIZE; y++) {
+            auto* out = rgb + y * rowStride;
+            for (int x = 0; x < PIXEL_BLOCK_SIZE; x += 4) {
+                __m128i packed = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(block[y] + x)), dropAlpha);
+                // twelve bytes, a sixteen byte store would write into the next block or past the end of the row
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x * 3), packed);
+                int last = _mm_extract_epi32(packed, 2);
+                std::memcpy(out + x * 3 + 8, &last, sizeof(last));
+            }
+        }
+    }
+
+    static void pixelsToRGB8(const Vec4* pixels, size_t height, unsigned char* rgb, ptrdiff_t rowStride) {
+        const __m256d scale = _mm256_set1_pd(255.0);
+        // the low byte of each int, which is what assigning the int to an unsigned char keeps
+        const __m128i lowBytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        // the columns of the block are read down, each a short run of memory, and written across the rows from here
+        alignas(16) uint32_t block[PIXEL_BLOCK_SIZE][PIXEL_BLOCK_SIZE];
+        for (int x = 0; x < PIXEL_BLOCK_SIZE; x++) {
+            const auto* column = reinterpret_cast<const PRECISION_TYPE*>(pixels + x * height);
+            for (int y = 0; y < PIXEL_BLOCK_SIZE; y++) {
+#ifdef USE_FLOAT_PRECISION
+                __m256d values = _mm256_cvtps_pd(_mm_loadu_ps(column + y * 4));
+#else
+                __m256d values = _mm256_loadu_pd(column + y * 4);
+#endif
+                __m128i ints = _mm256_cvttpd_epi32(_mm256_mul_pd(values, scale));
+                block[y][x] = (uint32_t) _mm_cvtsi128_si32(_mm_shuffle_epi8(ints, lowBytes));
+            }
+        }
+        storeRGBRows(block, rgb, rowStride);
+    }
+
+    const SIMDKernels AVX2_KERNELS{SIMDLevel::AVX2, boxes4, triangles8, triangleHits8, spheres, pixelsToRGB8};
+
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/math/simd.h>
+#include <engine/math/bvh.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// Only the functions below are compiled for SSE4.2. The headers have to be included before this, otherwise the inline functions
+// in them would be compiled for SSE4.2 too and the linker could pick that copy for the rest of the engine.
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt")
+
+namespace Raytracing {
+
+    static int boxes4(const BVH4Node& node, const BVH4Ray& ray, PRECISION_TYPE tmin, PRECISION_TYPE tmax, PRECISION_TYPE* tEntry) {
+#ifdef USE_FLOAT_PRECISION
+        // a coordinate of all four children fits in one register
+        __m128 tNear = _mm_set1_ps(std::max(tmin, (PRECISION_TYPE) 0.0));
+        __m128 tFar = _mm_set1_ps(tmax);
+        for (int i = 0; i < 3; i++) {
+            __m128 origin = _mm_set1_ps(ray.origin[i]);
+            __m128 inverse = _mm_set1_ps(ray.inverse[i]);
+            __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.sign[i]][i]), origin), inverse);
+            __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - ray.sign[i]][i]), origin), inverse);
+            // max/min return the second operand if either is NaN, keeping the current interval like std::max(tmin, NaN) does
+            tNear = _mm_max_ps(near, tNear);
+            tFar = _mm_min_ps(far, tFar);
+        }
+        _mm_storeu_ps(tEntry, tNear);
+        return _mm_movemask_ps(_mm_cmpge_ps(tFar, tNear));
+#else
+        // two doubles per register, so the first two children go in one and the last two in the other
+        __m128d tNear[2], tFar[2];
+        tNear[0] = tNear[1] = _mm_set1_pd(std::max(tmin, (PRECISION_TYPE) 0.0));
+        tFar[0] = tFar[1] = _mm_set1_pd(tmax);
+        for (int i = 0; i < 3; i++) {
+            __m128d origin = _mm_set1_pd(ray.origin[i]);
+            __m128d inverse = _mm_set1_pd(ray.inverse[i]);
+            for (int half = 0; half < 2; half++) {
+                __m128d near = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node.bounds[ray.sign[i]][i] + half * 2), origin), inverse);
+                __m128d far = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node.bounds[1 - ray.sign[i]][i] + half * 2), origin), inverse);
+                tNear[half] = _mm_max_pd(near, tNear[half]);
+                tFar[half] = _mm_min_pd(far, tFar[half]);
+            }
+        }
+        _mm_storeu_pd(tEntry, tNear[0]);
+        _mm_storeu_pd(tEntry + 2, tNear[1]);
+        return _mm_movemask_pd(_mm_cmpge_pd(tFar[0], tNear[0])) | _mm_movemask_pd(_mm_cmpge_pd(tFar[1], tNear[1])) << 2;
+#endif
+    }
+
+    /**
+     * The same test as the AVX2 kernel on four lanes of the block starting at offset, without FMA.
+     */
+    template<bool computeHit>
+    static int triangles4(const TriangleBlock& block, const TriangleBlockRay& ray, int offset, float* t, float* u, float* v) {
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        __m128 d[3], s[3], e1[3], e2[3];
+        for (int i = 0; i < 3; i++) {
+            d[i] = _mm_set1_ps(ray.direction[i]);
+            s[i] = _mm_sub_ps(_mm_set1_ps(ray.origin[i]), _mm_load_ps(block.vertex0[i] + offset));
+            e1[i] = _mm_load_ps(block.edge1[i] + offset);
+            e2[i] = _mm_load_ps(block.edge2[i] + offset);
+        }
+        auto cross = [](const __m128 a[3], const __m128 b[3], __m128 out[3]) {
+            out[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+            out[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+            out[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+        };
+        auto dot = [](const __m128 a[3], const __m128 b[3]) {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+        };
+        __m128 h[3], q[3];
+        cross(d, e2, h);
+        cross(s, e1, q);
+        __m128 a = dot(e1, h);
+        __m128 aSign = _mm_and_ps(a, signMask);
+        __m128 aAbs = _mm_andnot_ps(signMask, a);
+        __m128 uN = _mm_xor_ps(dot(s, h), aSign);
+        __m128 vN = _mm_xor_ps(dot(d, q), aSign);
+        __m128 tN = _mm_xor_ps(dot(e2, q), aSign);
+        if constexpr (computeHit) {
+            __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), aAbs);
+            _mm_store_ps(t + offset, _mm_mul_ps(tN, f));
+            _mm_store_ps(u + offset, _mm_mul_ps(uN, f));
+            _mm_store_ps(v + offset, _mm_mul_ps(vN, f));
+        }
+
+        const __m128 tolerance = _mm_set1_ps(TRIANGLE_BLOCK_TOLERANCE);
+        __m128 dSize = _mm_set1_ps(ray.directionSize);
+        __m128 e1Size = _mm_load_ps(block.edge1Size + offset);
+        __m128 e2Size = _mm_load_ps(block.edge2Size + offset);
+        __m128 sTolerance = _mm_mul_ps(tolerance, _mm_add_ps(_mm_set1_ps(ray.originSize), _mm_load_ps(block.vertex0Size + offset)));
+        __m128 aError = _mm_mul_ps(_mm_mul_ps(tolerance, dSize), _mm_mul_ps(e1Size, e2Size));
+        __m128 uError = _mm_mul_ps(sTolerance, _mm_mul_ps(dSize, e2Size));
+        __m128 vError = _mm_mul_ps(sTolerance, _mm_mul_ps(dSize, e1Size));
+        __m128 tError = _mm_mul_ps(sTolerance, _mm_mul_ps(e1Size, e2Size));
+
+        __m128 inside = _mm_and_ps(_mm_cmpge_ps(uN, _mm_xor_ps(uError, signMask)), _mm_cmpge_ps(vN, _mm_xor_ps(vError, signMask)));
+        __m128 sumLimit = _mm_add_ps(_mm_add_ps(aAbs, aError), _mm_add_ps(uError, vError));
+        inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_add_ps(uN, vN), sumLimit));
+        __m128 tNear = _mm_mul_ps(_mm_set1_ps(ray.min), _mm_sub_ps(aAbs, aError));
+        __m128 tFar = _mm_mul_ps(_mm_set1_ps(ray.max), _mm_add_ps(aAbs, aError));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(tN, tError), tNear));
+        inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_sub_ps(tN, tError), tFar));
+        __m128 undecided = _mm_and_ps(_mm_cmple_ps(aAbs, aError), _mm_cmpgt_ps(aError, _mm_setzero_ps()));
+        return _mm_movemask_ps(_mm_or_ps(inside, undecided)) << offset;
+    }
+
+    static int triangles8(const TriangleBlock& block, const TriangleBlockRay& ray) {
+        return (triangles4<false>(block, ray, 0, nullptr, nullptr, nullptr) | triangles4<false>(block, ray, 4, nullptr, nullptr, nullptr)) &
+               (int) block.laneMask;
+    }
+
+    static int triangleHits8(const TriangleBlock& block, const TriangleBlockRay& ray, float* t, float* u, float* v) {
+        return (triangles4<true>(block, ray, 0, t, u, v) | triangles4<true>(block, ray, 4, t, u, v)) & (int) block.laneMask;
+    }
+
+    static int spheres(const SphereBatch& batch, const Vec4& origin, const Vec4& direction, PRECISION_TYPE min, PRECISION_TYPE max, PRECISION_TYPE& t) {
+        const double dir[3] = {direction.x(), direction.y(), direction.z()};
+        // the same operations in the same order as the scalar test, so every sphere gets exactly the same roots
+        const __m128d a = _mm_set1_pd(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        const __m128d dx = _mm_set1_pd(dir[0]), dy = _mm_set1_pd(dir[1]), dz = _mm_set1_pd(dir[2]);
+        const __m128d ox = _mm_set1_pd(origin.x()), oy = _mm_set1_pd(origin.y()), oz = _mm_set1_pd(origin.z());
+        const __m128d minimum = _mm_set1_pd(min), maximum = _mm_set1_pd(max);
+        const __m128d signMask = _mm_set1_pd(-0.0);
+        double closest = max;
+        int hit = -1;
+        for (int base = 0; base < batch.count; base += 2) {
+            __m128d rx = _mm_sub_pd(ox, _mm_load_pd(batch.centerX + base));
+            __m128d ry = _mm_sub_pd(oy, _mm_load_pd(batch.centerY + base));
+            __m128d rz = _mm_sub_pd(oz, _mm_load_pd(batch.centerZ + base));
+            __m128d radius = _mm_load_pd(batch.radius + base);
+            __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rx, dx), _mm_mul_pd(ry, dy)), _mm_mul_pd(rz, dz));
+            __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(rx, rx), _mm_mul_pd(ry, ry)), _mm_mul_pd(rz, rz)), _mm_mul_pd(radius, radius));
+            __m128d discriminant = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(a, c));
+            __m128d root = _mm_sqrt_pd(discriminant);
+            __m128d negativeB = _mm_xor_pd(b, signMask);
+            __m128d near = _mm_div_pd(_mm_sub_pd(negativeB, root), a);
+            __m128d far = _mm_div_pd(_mm_add_pd(negativeB, root), a);
+            // the not-less and not-greater compares pass NaN like the scalar test's rejections do
+            __m128d nearValid = _mm_and_pd(_mm_cmpnlt_pd(near, minimum), _mm_cmpngt_pd(near, maximum));
+            __m128d farValid = _mm_and_pd(_mm_cmpnlt_pd(far, minimum), _mm_cmpngt_pd(far, maximum));
+            __m128d roots = _mm_blendv_pd(far, near, nearValid);
+            int valid = _mm_movemask_pd(_mm_and_pd(_mm_cmpnlt_pd(discriminant, _mm_setzero_pd()), _mm_or_pd(nearValid, farValid)));
+            if (valid == 0)
+                continue;
+            alignas(16) double lanes[2];
+            _mm_store_pd(lanes, roots);
+            // max was fixed for the whole batch, so keep the closest root. On a tie the later sphere wins, same as testing them in order
+            for (int lane = 0; lane < 2 && base + lane < batch.count; lane++) {
+                if ((valid & (1 << lane)) && lanes[lane] <= closest) {
+                    closest = lanes[lane];
+                    hit = base + lane;
+                }
+            }
+        }
+        if (hit >= 0)
+            t = (PRECISION_TYPE) closest;
+        return hit;
+    }
+
+    /**
+     * Writes the rows of a block of pixels converted to RGBA, block[y][x], as RGB. Four pixels at a time lose their alpha in one shuffle.
+     */
+    static inline void storeRGBRows(const uint32_t block[PIXEL_BLOCK_SIZE][PIXEL_BLOCK_SIZE], unsigned char* rgb, ptrdiff_t rowStride) {
+        const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        for (int y = 0; y < PIXEL_BLOCK_SIZE; y++) {
+            auto* out = rgb + y * rowStride;
+            for (int x = 0; x < PIXEL_BLOCK_SIZE; x += 4) {
+                __m128i packed = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(block[y] + x)), dropAlpha);
+                // twelve bytes, a sixteen byte store would write into the next block or past the end of the row
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x * 3), packed);
+                int last = _mm_extract_epi32(packed, 2);
+                std::memcpy(out + x * 3 + 8, &last, sizeof(last));
+            }
+        }
+    }
+
+    static void pixelsToRGB8(const Vec4* pixels, size_t height, unsigned char* rgb, ptrdiff_t rowStride) {
+        const __m128d scale = _mm_set1_pd(255.0);
+        // the low byte of each int, which is what assigning the int to an unsigned char keeps
+        const __m128i lowBytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        // the columns of the block are read down, each a short run of memory, and written across the rows from here
+        alignas(16) uint32_t block[PIXEL_BLOCK_SIZE][PIXEL_BLOCK_SIZE];
+        for (int x = 0; x < PIXEL_BLOCK_SIZE; x++) {
+            const auto* column = reinterpret_cast<const PRECISION_TYPE*>(pixels + x * height);
+            for (int y = 0; y < PIXEL_BLOCK_SIZE; y++) {
+                const auto* pixel = column + y * 4;
+#ifdef USE_FLOAT_PRECISION
+                __m128 values = _mm_loadu_ps(pixel);
+                __m128d rg = _mm_cvtps_pd(values);
+                __m128d ba = _mm_cvtps_pd(_mm_movehl_ps(values, values));
+#else
+                __m128d rg = _mm_loadu_pd(pixel);
+                __m128d ba = _mm_loadu_pd(pixel + 2);
+#endif
+                __m128i ints = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(rg, scale)), _mm_cvttpd_epi32(_mm_mul_pd(ba, scale)));
+                block[y][x] = (uint32_t) _mm_cvtsi128_si32(_mm_shuffle_epi8(ints, lowBytes));
+            }
+        }
+        storeRGBRows(block, rgb, rowStride);
+    }
+
+    const SIMDKernels SSE42_KERNELS{SIMDLevel::SSE42, boxes4, triangles8, triangleHits8, spheres, pixelsToRGB8};
+
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include "engine/math/vectors.h"
+#include <stdexcept>
+
+namespace Raytracing {
+
+    Transform::Transform(const Vec4& translation, const Vec4& rotation, const Vec4& scale): translation(translation) {
+        if (rotation == Vec4{} && scale == Vec4{1, 1, 1})
+            return;
+        if (scale.x() == 0 || scale.y() == 0 || scale.z() == 0)
+            throw std::runtime_error("A transform can't have a scale of zero, it would flatten the object.");
+        translationOnly = false;
+        PRECISION_TYPE cx = std::cos(rotation.x()), sx = std::sin(rotation.x());
+        PRECISION_TYPE cy = std::cos(rotation.y()), sy = std::sin(rotation.y());
+        PRECISION_TYPE cz = std::cos(rotation.z()), sz = std::sin(rotation.z());
+        // Rz * Ry * Rx, so the rotation around x happens first
+        PRECISION_TYPE rotate[3][3] = {
+                {cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx},
+                {sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx},
+                {-sy,     cy * sx,                cy * cx}
+        };
+        PRECISION_TYPE scales[3] = {scale.x(), scale.y(), scale.z()};
+        // the scale happens before the rotation, so it scales the columns. The inverse of a rotation is its transpose
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                linear[i][j] = rotate[i][j] * scales[j];
+                inverse[i][j] = rotate[j][i] / scales[i];
+            }
+        }
+    }
+
+    Mat4x4 Transform::toMatrix() const {
+        Mat4x4 matrix{};
+        matrix.translate(translation);
+        // the matrix is stored column major, m(column, row)
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++)
+                matrix.m(column, row, float(linear[row][column]));
+        }
+        return matrix;
+    }
+
+}
@@ -101,6 +101,10 @@ namespace Raytracing {
     Vec4 RayCaster::raycast(const Ray& ray) {
         Ray localRay = ray;
         Vec4 color{1.0, 1.0, 1.0};
+        // the ray is treated as a cone covering its pixel, which grows with distance and widens at every rough bounce.
+        // its width where it hits a surface is what textures use to pick their mip level.
+        PRECISION_TYPE coneWidth = 0;
+        PRECISION_TYPE coneSpread = camera.getPixelSpread();
         for (int CURRENT_BOUNCE = 0; CURRENT_BOUNCE < maxBounceDepth; CURRENT_BOUNCE++) {
             if (RTSignal->haltExecution || RTSignal->haltRaytracing)
                 return color;
@@ -108,14 +112,25 @@ namespace Raytracing {
                 std::this_thread::sleep_for(std::chrono::milliseconds(16));
             
             auto hit = world.checkIfHit(localRay, 0.001, infinity);
-            if (hit.first.hit) {
-                auto object = hit.second;
-                auto scatterResults = object->getMaterial()->scatter(localRay, hit.first);
-                //auto emission = object->getMaterial()->emission(hit.first.u, hit.first.v, hit.first.hitPoint);
+            if (hit.hit) {
+                auto object = hit.object;
+                // only the closest hit needs its surface, which is where the normals and UVs get computed
+                auto surface = object->surfaceInteraction(localRay, hit);
+                auto direction = localRay.getDirection();
+                auto length = direction.magnitude();
+                coneWidth += coneSpread * hit.t * length;
+                // the cone makes an ellipse on the surface, stretched by 1 / cos of the angle it hits at. Textures are filtered by its area
+                // rather than its long side, which keeps surfaces seen at a grazing angle from blurring out entirely.
+                auto normalLength = surface.normal.magnitude();
+                PRECISION_TYPE cosine = normalLength > 0 ? std::abs(Vec4::dot(direction, surface.normal)) / (length * normalLength) : 1;
+                surface.footprint = coneWidth / std::sqrt(std::max(cosine, (PRECISION_TYPE) 0.01));
+                auto scatterResults = object->getMaterial()->scatter(localRay, surface);
+                //auto emission = object->getMaterial()->emission(surface.u, surface.v, surface.hitPoint);
                 // if the material scatters the ray, ie casts a new one,
                 if (scatterResults.scattered) { // attenuate the recursive raycast by the material's color
                     color = color * scatterResults.attenuationColor;
                     localRay = scatterResults.newRay;
+                    coneSpread += scatterResults.spread;
                 } else {
                     // if we don't scatter, we don't need to keep looping
                     // but we should return whatever the material's emission is
@@ -0,0 +1,60 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/util/cache_file.h>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+namespace Raytracing {
+
+    std::optional<SourceStamp> SourceStamp::of(const std::string& file) {
+        std::error_code error;
+        SourceStamp stamp;
+        stamp.size = std::filesystem::file_size(file, error);
+        if (error)
+            return std::nullopt;
+        auto time = std::filesystem::last_write_time(file, error);
+        if (error)
+            return std::nullopt;
+        stamp.modified = (int64_t) time.time_since_epoch().count();
+        return stamp;
+    }
+
+    bool CacheFile::write(const std::string& path, const std::function<void(std::ostream&)>& contents, std::string& error) {
+        // unique to the process and thread, several loader threads can write the same file
+        auto tempPath = path + ".tmp" + std::to_string(getpid()) + "_" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                error = "unable to create " + tempPath;
+                return false;
+            }
+            contents(file);
+            if (!file) {
+                error = "unable to write " + tempPath;
+                file.close();
+                std::error_code removeError;
+                std::filesystem::remove(tempPath, removeError);
+                return false;
+            }
+        }
+        std::error_code renameError;
+        std::filesystem::rename(tempPath, path, renameError);
+        if (renameError) {
+            error = renameError.message();
+            std::filesystem::remove(tempPath, renameError);
+            return false;
+        }
+        return true;
+    }
+
+    void CacheFile::padTo(std::ostream& file, uint64_t offset) {
+        static const char zeros[64]{};
+        for (auto position = (uint64_t) file.tellp(); position < offset; position += sizeof(zeros))
+            file.write(zeros, (std::streamsize) std::min((uint64_t) sizeof(zeros), offset - position));
+    }
+
+}
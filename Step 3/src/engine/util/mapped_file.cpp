@@ -0,0 +1,31 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/util/mapped_file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Raytracing {
+
+    std::shared_ptr<MappedFile> MappedFile::map(const std::string& path, MapMode mode) {
+        int file = open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            return nullptr;
+        struct stat fileStats{};
+        if (fstat(file, &fileStats) != 0 || fileStats.st_size <= 0) {
+            close(file);
+            return nullptr;
+        }
+        auto size = (size_t) fileStats.st_size;
+        void* data = mmap(nullptr, size, mode == MapMode::COPY_ON_WRITE ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (data == MAP_FAILED)
+            return nullptr;
+        if (mode == MapMode::READ_SEQUENTIAL)
+            madvise(data, size, MADV_SEQUENTIAL);
+        return std::make_shared<MappedFile>(data, size);
+    }
+
+}
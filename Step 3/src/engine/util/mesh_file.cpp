@@ -0,0 +1,141 @@
+/*
+ * Created by Brett Terpstra 6920201 on 17/10/26.
+ * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
+ */
+#include <engine/util/mesh_file.h>
+#include <engine/util/mapped_file.h>
+#include <engine/util/cache_file.h>
+#include <filesystem>
+#include <cstring>
+
+namespace Raytracing {
+
+    static constexpr char MESH_FILE_MAGIC[8] = {'R', 'T', 'M', 'E', 'S', 'H', 'F', 'L'};
+    // every array in the file starts on a cache line
+    static constexpr uint64_t MESH_FILE_ALIGNMENT = 64;
+
+    struct MeshFileHeader {
+        char magic[8];
+        uint32_t version;
+        // sizes of the stored types, a build where they differ can't use the file
+        uint32_t positionSize;
+        uint32_t attributeSize;
+        uint32_t padding;
+        // the OBJ file the mesh was made from, the mesh file is only used while these still match it
+        uint64_t sourceSize;
+        int64_t sourceModified;
+        uint64_t vertexCount;
+        uint64_t indexCount;
+        uint64_t positionOffset;
+        uint64_t indexOffset;
+        uint64_t attributeOffset;
+        // bounds of the positions, exact as floats since the positions are
+        float bounds[6];
+        uint64_t fileSize;
+    };
+
+    static uint64_t alignOffset(uint64_t offset) {
+        return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+    }
+
+    std::string MeshFile::pathFor(const std::string& objFile) {
+        return std::filesystem::path(objFile).replace_extension(".rtmesh").string();
+    }
+
+    std::optional<IndexedMesh> MeshFile::load(const std::string& objFile) {
+        auto path = pathFor(objFile);
+        if (!std::filesystem::exists(path))
+            return std::nullopt;
+        auto mapping = MappedFile::map(path);
+        if (mapping == nullptr || mapping->size < sizeof(MeshFileHeader)) {
+            wlog << "Unable to read the mesh file " << path << ", parsing " << objFile << " instead.\n";
+            return std::nullopt;
+        }
+        auto* bytes = static_cast<const char*>(mapping->data);
+        const auto& header = *reinterpret_cast<const MeshFileHeader*>(bytes);
+        if (std::memcmp(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC)) != 0 || header.version != MESH_FILE_VERSION ||
+            header.positionSize != sizeof(MeshPosition) || header.attributeSize != sizeof(MeshVertexAttributes)) {
+            ilog << "Mesh file " << path << " was written by a different version, parsing " << objFile << " instead.\n";
+            return std::nullopt;
+        }
+        auto source = SourceStamp::of(objFile);
+        if (!source || *source != SourceStamp{header.sourceSize, header.sourceModified}) {
+            ilog << "Mesh file " << path << " was made from an older " << objFile << ", parsing it instead. Use --convertMeshes to update it.\n";
+            return std::nullopt;
+        }
+        auto size = mapping->size;
+        auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) -> bool {
+            return offset % MESH_FILE_ALIGNMENT == 0 && offset <= size && count <= (size - offset) / elementSize;
+        };
+        if (header.fileSize != size || header.indexCount % 3 != 0 || header.vertexCount > std::numeric_limits<uint32_t>::max() ||
+            !fits(header.positionOffset, header.vertexCount, sizeof(MeshPosition)) || !fits(header.indexOffset, header.indexCount, sizeof(uint32_t)) ||
+            !fits(header.attributeOffset, header.vertexCount, sizeof(MeshVertexAttributes))) {
+            wlog << "Mesh file " << path << " is damaged, parsing " << objFile << " instead.\n";
+            return std::nullopt;
+        }
+        std::span<const uint32_t> indices{reinterpret_cast<const uint32_t*>(bytes + header.indexOffset), header.indexCount};
+        // a damaged file must not send the intersection tests outside the positions
+        for (auto index : indices) {
+            if (index >= header.vertexCount) {
+                wlog << "Mesh file " << path << " is damaged, parsing " << objFile << " instead.\n";
+                return std::nullopt;
+            }
+        }
+        std::span<const MeshPosition> positions{reinterpret_cast<const MeshPosition*>(bytes + header.positionOffset), header.vertexCount};
+        std::span<const MeshVertexAttributes> attributes{reinterpret_cast<const MeshVertexAttributes*>(bytes + header.attributeOffset), header.vertexCount};
+        AABB aabb{header.bounds[0], header.bounds[1], header.bounds[2], header.bounds[3], header.bounds[4], header.bounds[5]};
+        ilog << "Mapped mesh file " << path << ", " << header.vertexCount << " vertices and " << header.indexCount / 3 << " triangles.\n";
+        return std::optional<IndexedMesh>{std::in_place, positions, indices, attributes, aabb, std::move(mapping)};
+    }
+
+    bool MeshFile::write(const std::string& objFile, const IndexedMesh& mesh) {
+        auto path = pathFor(objFile);
+        MeshFileHeader header{};
+        std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC));
+        header.version = MESH_FILE_VERSION;
+        header.positionSize = sizeof(MeshPosition);
+        header.attributeSize = sizeof(MeshVertexAttributes);
+        auto source = SourceStamp::of(objFile);
+        if (!source) {
+            wlog << "Unable to read " << objFile << ", no mesh file will be written for it\n";
+            return false;
+        }
+        header.sourceSize = source->size;
+        header.sourceModified = source->modified;
+        auto positions = mesh.getPositions();
+        auto indices = mesh.getIndices();
+        auto attributes = mesh.getAttributes();
+        header.vertexCount = positions.size();
+        header.indexCount = indices.size();
+        header.positionOffset = alignOffset(sizeof(MeshFileHeader));
+        header.indexOffset = alignOffset(header.positionOffset + positions.size_bytes());
+        header.attributeOffset = alignOffset(header.indexOffset + indices.size_bytes());
+        header.fileSize = header.attributeOffset + attributes.size_bytes();
+        auto min = mesh.getAABB().getMin(), max = mesh.getAABB().getMax();
+        const float bounds[6] = {(float) min.x(), (float) min.y(), (float) min.z(), (float) max.x(), (float) max.y(), (float) max.z()};
+        std::memcpy(header.bounds, bounds, sizeof(bounds));
+
+        std::string error;
+        bool written = CacheFile::write(path, [&](std::ostream& file) {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            CacheFile::padTo(file, header.positionOffset);
+            file.write(reinterpret_cast<const char*>(positions.data()), (std::streamsize) positions.size_bytes());
+            CacheFile::padTo(file, header.indexOffset);
+            file.write(reinterpret_cast<const char*>(indices.data()), (std::streamsize) indices.size_bytes());
+            CacheFile::padTo(file, header.attributeOffset);
+            file.write(reinterpret_cast<const char*>(attributes.data()), (std::streamsize) attributes.size_bytes());
+        }, error);
+        if (!written) {
+            wlog << "Unable to write the mesh file " << path << ": " << error << "\n";
+            return false;
+        }
+        ilog << "Wrote mesh file " << path << " (" << header.fileSize << " bytes)\n";
+        return true;
+    }
+
+    bool MeshFile::convert(const std::string& objFile) {
+        IndexedMesh mesh{OBJLoader::loadModel(objFile)};
+        return write(objFile, mesh);
+    }
+
+}
@@ -3,107 +3,516 @@
  * Copyright (c) 2022 Brett Terpstra. All Rights Reserved.
  */
 #include "engine/util/models.h"
-#include <fstream>
-#include <ios>
+#include "engine/util/mapped_file.h"
+#include "engine/util/mesh_file.h"
+#include <cstring>
+#include <cmath>
+#include <charconv>
+#include <exception>
+#include <chrono>
+#include <filesystem>
 
-Raytracing::ModelData Raytracing::OBJLoader::loadModel(const std::string& file) {
-    std::ifstream modelFile;
-    
-    modelFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    modelFile.open(file);
-    std::stringstream modelSource;
-    
-    std::cout.flush();
-    // read the entire file into a string
-    modelSource << modelFile.rdbuf();
-    
-    modelFile.close();
-    std::string modelUnprocessedSource = modelSource.str();
-    
-    auto lines = String::split(modelUnprocessedSource, "\n");
-    ilog << "Loading of model file " << file << " complete! Now processing " << lines.size() << " lines.\n";
-    
-    ModelData data;
-    
-    for (const auto& line : lines) {
-        auto spaces = String::split(line, " ");
-        if (line.starts_with("v ")) { // vertex
-            data.vertices.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), std::stof(spaces[3]));
-        } else if (line.starts_with("vt ")) { // uv
-            data.uvs.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), 0);
-        } else if (line.starts_with("vn ")) { // normal
-            data.normals.emplace_back(std::stof(spaces[1]), std::stof(spaces[2]), std::stof(spaces[3]));
-        } else if (line.starts_with("f ")) { // face
-            // we've reached the faces, we'll need to process them later.
-            auto t1 = String::split(spaces[1], "/");
-            auto t2 = String::split(spaces[2], "/");
-            auto t3 = String::split(spaces[3], "/");
-            face f{};
+#ifdef USE_OPENMP
+    
+    #include <omp.h>
+
+#endif
+
+namespace Raytracing {
+    
+    /*
+     * OBJ loading
+     */
+    
+    // fewest bytes worth giving a thread of their own
+    constexpr size_t OBJ_MIN_CHUNK_SIZE = 1 << 20;
+    // marks a uv or normal a face corner didn't give
+    constexpr int OBJ_NO_INDEX = std::numeric_limits<int>::min();
+    
+    /**
+     * What one line aligned chunk of a file holds. Negative indices count back from the vertices read so far, which for a chunk in the
+     * middle of the file aren't known until the chunks before it are parsed, so those are kept relative to the start of the chunk
+     * and fixed up when the chunks are merged.
+     */
+    struct OBJChunk {
+        std::vector<Vec4> vertices;
+        std::vector<Vec4> uvs;
+        std::vector<Vec4> normals;
+        std::vector<face> faces;
+        // faces using negative indices, with a bit for each of the nine indices in the order v1 v2 v3 uv1 uv2 uv3 n1 n2 n3
+        std::vector<std::pair<size_t, uint16_t>> relativeFaces;
+        // the first error in the chunk, rethrown once every chunk has finished
+        std::exception_ptr error;
+    };
+    
+    /**
+     * Reads the numbers of one line, starting after the keyword. Nothing is allocated, the values are parsed straight from the mapped file.
+     */
+    class OBJLineReader {
+        private:
+            const char* position;
+            const char* end;
+            
+            inline void skipSpaces() {
+                while (position < end && (*position == ' ' || *position == '\t'))
+                    position++;
+            }
             
-            // obj files are 1 indexed,
-            // but arrays are 0 indexed,
-            // must be transformed.
-            f.v1 = std::stoi(t1[0]) - 1;
-            f.v2 = std::stoi(t2[0]) - 1;
-            f.v3 = std::stoi(t3[0]) - 1;
+            // from_chars doesn't take the plus sign stof and stoi did
+            inline void skipPlus() {
+                if (position < end && *position == '+')
+                    position++;
+            }
+        
+        public:
+            OBJLineReader(const char* position, const char* end): position(position), end(end) {}
+            
+            [[nodiscard]] inline bool atEnd() {
+                skipSpaces();
+                return position >= end;
+            }
+            
+            inline bool readFloat(float& value) {
+                skipSpaces();
+                skipPlus();
+                auto result = std::from_chars(position, end, value);
+                position = result.ptr;
+                return result.ec == std::errc();
+            }
+            
+            inline bool readInt(int& value) {
+                skipPlus();
+                auto result = std::from_chars(position, end, value);
+                position = result.ptr;
+                return result.ec == std::errc();
+            }
             
-            f.uv1 = std::stoi(t1[1]) - 1;
-            f.uv2 = std::stoi(t2[1]) - 1;
-            f.uv3 = std::stoi(t3[1]) - 1;
+            /**
+             * Reads an index of a face corner. OBJ_NO_INDEX is never a valid index, a file giving it must not pass as leaving the index out.
+             */
+            inline bool readIndex(int& value) {
+                return readInt(value) && value != OBJ_NO_INDEX;
+            }
+            
+            /**
+             * Reads one face corner, which is "v", "v/vt", "v//vn" or "v/vt/vn". The indices are left as the file gives them,
+             * with OBJ_NO_INDEX for the ones which aren't there.
+             */
+            inline bool readCorner(int& v, int& uv, int& n) {
+                skipSpaces();
+                uv = n = OBJ_NO_INDEX;
+                if (!readIndex(v))
+                    return false;
+                if (position >= end || *position != '/')
+                    return true;
+                position++;
+                if (position < end && *position != '/' && !readIndex(uv))
+                    return false;
+                if (position >= end || *position != '/')
+                    return true;
+                position++;
+                return readIndex(n);
+            }
+    };
+    
+    /**
+     * Turns an index from the file into an index into the arrays of the chunk. Positive indices count from 1 at the start of the file,
+     * negative ones back from the last element read so far, which are returned relative to the start of the chunk.
+     */
+    static inline int resolveOBJIndex(int index, size_t chunkCount, uint16_t& relative, int bit) {
+        if (index > 0)
+            return index - 1;
+        if (index == OBJ_NO_INDEX)
+            return index;
+        if (index == 0)
+            throw std::runtime_error("OBJ indices start at 1, found a 0");
+        relative |= 1 << bit;
+        return (int) chunkCount + index;
+    }
+    
+    static void parseOBJChunk(const char* begin, const char* end, OBJChunk& chunk) {
+        std::vector<int> corners;
+        for (const char* line = begin; line < end;) {
+            const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', end - line));
+            if (lineEnd == nullptr)
+                lineEnd = end;
+            const char* stop = lineEnd;
+            if (stop > line && stop[-1] == '\r')
+                stop--;
+            const char* start = line;
+            line = lineEnd + 1;
+            while (start < stop && (*start == ' ' || *start == '\t'))
+                start++;
             
-            f.n1 = std::stoi(t1[2]) - 1;
-            f.n2 = std::stoi(t2[2]) - 1;
-            f.n3 = std::stoi(t3[2]) - 1;
+            // the keyword has to be followed by whitespace, so "vt" and "vn" aren't taken for "v"
+            auto keyword = [&](const char* word, size_t length) -> bool {
+                return (size_t) (stop - start) > length && std::memcmp(start, word, length) == 0 && (start[length] == ' ' || start[length] == '\t');
+            };
+            auto malformed = [&]() {
+                throw std::runtime_error("Unable to parse OBJ line {" + std::string(start, stop) + "}");
+            };
             
-            data.faces.push_back(f);
+            if (keyword("v", 1)) { // vertex
+                OBJLineReader reader{start + 1, stop};
+                float x, y, z;
+                if (!reader.readFloat(x) || !reader.readFloat(y) || !reader.readFloat(z))
+                    malformed();
+                chunk.vertices.emplace_back(x, y, z);
+            } else if (keyword("vt", 2)) { // uv, which can leave out the v
+                OBJLineReader reader{start + 2, stop};
+                float u, v = 0;
+                if (!reader.readFloat(u) || (!reader.atEnd() && !reader.readFloat(v)))
+                    malformed();
+                chunk.uvs.emplace_back(u, v, 0);
+            } else if (keyword("vn", 2)) { // normal
+                OBJLineReader reader{start + 2, stop};
+                float x, y, z;
+                if (!reader.readFloat(x) || !reader.readFloat(y) || !reader.readFloat(z))
+                    malformed();
+                chunk.normals.emplace_back(x, y, z);
+            } else if (keyword("f", 1)) { // face, split into a fan of triangles if it has more than three corners
+                OBJLineReader reader{start + 1, stop};
+                corners.clear();
+                while (!reader.atEnd()) {
+                    int v, uv, n;
+                    if (!reader.readCorner(v, uv, n))
+                        malformed();
+                    corners.insert(corners.end(), {v, uv, n});
+                }
+                if (corners.size() < 9)
+                    malformed();
+                for (size_t c = 6; c < corners.size(); c += 3) {
+                    uint16_t relative = 0;
+                    const int* fan[3] = {&corners[0], &corners[c - 3], &corners[c]};
+                    face f{};
+                    int* fields[3][3] = {{&f.v1, &f.v2, &f.v3}, {&f.uv1, &f.uv2, &f.uv3}, {&f.n1, &f.n2, &f.n3}};
+                    const size_t counts[3] = {chunk.vertices.size(), chunk.uvs.size(), chunk.normals.size()};
+                    for (int type = 0; type < 3; type++) {
+                        for (int corner = 0; corner < 3; corner++)
+                            *fields[type][corner] = resolveOBJIndex(fan[corner][type], counts[type], relative, type * 3 + corner);
+                    }
+                    if (relative != 0)
+                        chunk.relativeFaces.emplace_back(chunk.faces.size(), relative);
+                    chunk.faces.push_back(f);
+                }
+            }
+            // everything else (objects, groups, smoothing and materials) doesn't matter to the mesh
         }
     }
     
+    /**
+     * Appends the chunks to the model in file order, resolving the negative indices and filling in what the faces left out.
+     */
+    static void mergeOBJChunks(std::vector<OBJChunk>& chunks, ModelData& data) {
+        size_t vertexCount = 0, uvCount = 0, normalCount = 0, faceCount = 0;
+        for (const auto& chunk : chunks) {
+            vertexCount += chunk.vertices.size();
+            uvCount += chunk.uvs.size();
+            normalCount += chunk.normals.size();
+            faceCount += chunk.faces.size();
+        }
+        data.vertices.reserve(vertexCount);
+        data.uvs.reserve(uvCount + 1);
+        data.normals.reserve(normalCount);
+        data.faces.reserve(faceCount);
+        for (auto& chunk : chunks) {
+            const int bases[3] = {(int) data.vertices.size(), (int) data.uvs.size(), (int) data.normals.size()};
+            size_t firstFace = data.faces.size();
+            data.vertices.insert(data.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+            data.uvs.insert(data.uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+            data.normals.insert(data.normals.end(), chunk.normals.begin(), chunk.normals.end());
+            data.faces.insert(data.faces.end(), chunk.faces.begin(), chunk.faces.end());
+            for (auto [index, relative] : chunk.relativeFaces) {
+                auto& f = data.faces[firstFace + index];
+                int* fields[9] = {&f.v1, &f.v2, &f.v3, &f.uv1, &f.uv2, &f.uv3, &f.n1, &f.n2, &f.n3};
+                for (int i = 0; i < 9; i++) {
+                    if (relative & (1 << i))
+                        *fields[i] += bases[i / 3];
+                }
+            }
+            chunk = {};
+        }
+        
+        int missingUV = -1;
+        for (auto& f : data.faces) {
+            int* fields[9] = {&f.v1, &f.v2, &f.v3, &f.uv1, &f.uv2, &f.uv3, &f.n1, &f.n2, &f.n3};
+            const size_t counts[3] = {data.vertices.size(), data.uvs.size(), data.normals.size()};
+            for (int i = 0; i < 9; i++) {
+                // uvs and normals may be left out, the position never can be
+                if ((i < 3 || *fields[i] != OBJ_NO_INDEX) && (*fields[i] < 0 || (size_t) *fields[i] >= counts[i / 3]))
+                    throw std::runtime_error("A face refers to {" + std::to_string(*fields[i] + 1) + "} which is past the end of the data it indexes");
+            }
+            // corners without a uv all share one at 0, 0
+            if (f.uv1 == OBJ_NO_INDEX || f.uv2 == OBJ_NO_INDEX || f.uv3 == OBJ_NO_INDEX) {
+                if (missingUV < 0) {
+                    missingUV = (int) data.uvs.size();
+                    data.uvs.emplace_back(0, 0, 0);
+                }
+                for (int* uv : {&f.uv1, &f.uv2, &f.uv3}) {
+                    if (*uv == OBJ_NO_INDEX)
+                        *uv = missingUV;
+                }
+            }
+            // a face without normals is shaded flat, facing the side its corners go counterclockwise around
+            if (f.n1 == OBJ_NO_INDEX || f.n2 == OBJ_NO_INDEX || f.n3 == OBJ_NO_INDEX) {
+                const auto& v1 = data.vertices[f.v1];
+                auto normal = Vec4::cross(data.vertices[f.v2] - v1, data.vertices[f.v3] - v1);
+                if (normal.lengthSquared() > 0)
+                    normal = normal.normalize();
+                int index = (int) data.normals.size();
+                data.normals.push_back(normal);
+                for (int* n : {&f.n1, &f.n2, &f.n3}) {
+                    if (*n == OBJ_NO_INDEX)
+                        *n = index;
+                }
+            }
+        }
+    }
     
-    ilog << "Completed extracting vertex data from model file " << file << "!\n";
-    return data;
-}
-
-Raytracing::TriangulatedModel::TriangulatedModel(const Raytracing::ModelData& data) {
-    auto faces = data.faces;
-    auto vertices = data.vertices;
-    auto uvs = data.uvs;
-    auto normals = data.normals;
-    
-    PRECISION_TYPE minX = infinity, minY = infinity, minZ = infinity, maxX = ninfinity, maxY = ninfinity, maxZ = ninfinity;
-    
-    // create triangles from the faces
-    for (face f : faces) {
-        auto t = std::make_shared<Triangle>(
-                vertices[f.v1], vertices[f.v2], vertices[f.v3],
-                uvs[f.uv1], uvs[f.uv2], uvs[f.uv3],
-                normals[f.n1], normals[f.n2], normals[f.n3]
-        );
+    ModelData OBJLoader::loadModel(const std::string& file) {
+        auto start = std::chrono::steady_clock::now();
+        ModelData data;
+        // the file is only read front to back, so the kernel can read ahead of the chunks instead of it being copied into a string first
+        auto mapping = MappedFile::map(file, MapMode::READ_SEQUENTIAL);
+        if (mapping == nullptr) {
+            std::error_code error;
+            if (std::filesystem::is_regular_file(file, error) && std::filesystem::file_size(file, error) == 0 && !error) {
+                wlog << "Model file " << file << " is empty!\n";
+                return data;
+            }
+            throw std::runtime_error("Unable to open model file {" + file + "}");
+        }
+        const auto size = mapping->size;
+        const auto* text = static_cast<const char*>(mapping->data);
         
-        PRECISION_TYPE tMinX = infinity, tMinY = infinity, tMinZ = infinity, tMaxX = ninfinity, tMaxY = ninfinity, tMaxZ = ninfinity;
-        // find the min and max of all the triangles
-        tMinX = std::min(t->vertex1.x(), std::min(t->vertex2.x(), std::min(t->vertex3.x(), tMinX)));
-        tMinY = std::min(t->vertex1.y(), std::min(t->vertex2.y(), std::min(t->vertex3.y(), tMinY)));
-        tMinZ = std::min(t->vertex1.z(), std::min(t->vertex2.z(), std::min(t->vertex3.z(), tMinZ)));
+        int chunkCount = 1;
+#ifdef USE_OPENMP
+        chunkCount = (int) std::max((size_t) 1, std::min((size_t) omp_get_max_threads(), size / OBJ_MIN_CHUNK_SIZE));
+#endif
+        // each chunk ends just after a newline, so no line is split between two of them
+        std::vector<size_t> bounds{0};
+        for (int c = 1; c < chunkCount; c++) {
+            size_t bound = std::max(bounds.back(), size * c / chunkCount);
+            const void* newline = std::memchr(text + bound, '\n', size - bound);
+            bound = newline == nullptr ? size : static_cast<const char*>(newline) - text + 1;
+            bounds.push_back(bound);
+        }
+        bounds.push_back(size);
+        
+        std::vector<OBJChunk> chunks(chunkCount);
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(chunkCount) if(chunkCount > 1)
+#endif
+        for (int c = 0; c < chunkCount; c++) {
+            // exceptions can't leave an OpenMP loop
+            try {
+                parseOBJChunk(text + bounds[c], text + bounds[c + 1], chunks[c]);
+            } catch (...) {
+                chunks[c].error = std::current_exception();
+            }
+        }
+        try {
+            for (const auto& chunk : chunks) {
+                if (chunk.error)
+                    std::rethrow_exception(chunk.error);
+            }
+            mergeOBJChunks(chunks, data);
+        } catch (const std::exception& e) {
+            throw std::runtime_error("Unable to load model file {" + file + "}: " + e.what());
+        }
+        
+        auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        auto megabytes = (double) size / (1024.0 * 1024.0);
+        ilog << "Loaded model file " << file << " (" << megabytes << " MB) in " << time << "ms using " << chunkCount << " threads, "
+             << megabytes / (time / 1000.0) << " MB/s. " << data.vertices.size() << " vertices, " << data.faces.size() << " triangles.\n";
+        return data;
+    }
+    
+    IndexedMesh OBJLoader::loadMesh(const std::string& file) {
+        if (auto mesh = MeshFile::load(file))
+            return std::move(*mesh);
+        return IndexedMesh{loadModel(file)};
+    }
+    
+    
+    /*
+     * Half precision floats, rounded to nearest even like a hardware conversion would
+     */
+    
+    static uint16_t floatToHalf(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000;
+        uint32_t mantissa = bits & 0x7fffff;
+        int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+        if (((bits >> 23) & 0xff) == 0xff) // infinity or NaN
+            return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        if (exponent >= 31) // too large for a half
+            return sign | 0x7c00;
+        if (exponent <= 0) {
+            // becomes a subnormal half, or zero if too small for even that
+            if (exponent < -10)
+                return sign;
+            mantissa |= 0x800000;
+            int shift = 14 - exponent;
+            uint32_t half = mantissa >> shift;
+            uint32_t remainder = mantissa & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+            if (remainder > halfway || (remainder == halfway && (half & 1)))
+                half++;
+            return sign | half;
+        }
+        uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+        uint32_t remainder = mantissa & 0x1fff;
+        // a carry out of the mantissa moves up the exponent, which is the right answer
+        if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    
+    static float halfToFloat(uint16_t half) {
+        uint32_t sign = uint32_t(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1f;
+        uint32_t mantissa = half & 0x3ff;
+        if (exponent == 0) {
+            // zero or subnormal, all of which are normal floats
+            float value = std::ldexp((float) mantissa, -24);
+            return sign ? -value : value;
+        }
+        uint32_t bits = exponent == 0x1f ? sign | 0x7f800000 | (mantissa << 13) : sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    /*
+     * Octahedral normals. The unit sphere is projected onto the octahedron |x| + |y| + |z| = 1 and the lower half folded over the
+     * upper so every direction lands on the square [-1, 1]^2.
+     */
+    
+    static inline PRECISION_TYPE signNotZero(PRECISION_TYPE value) { return value < 0 ? -1.0 : 1.0; }
+    
+    static inline int16_t toSnorm16(PRECISION_TYPE value) {
+        return (int16_t) std::lround(std::clamp(value, (PRECISION_TYPE) -1.0, (PRECISION_TYPE) 1.0) * 32767.0);
+    }
+    
+    MeshVertexAttributes MeshVertexAttributes::encode(const Vec4& normal, const Vec4& uv) {
+        MeshVertexAttributes attributes{};
+        PRECISION_TYPE length = std::abs(normal.x()) + std::abs(normal.y()) + std::abs(normal.z());
+        if (length > 0) {
+            PRECISION_TYPE x = normal.x() / length, y = normal.y() / length;
+            if (normal.z() < 0) {
+                PRECISION_TYPE foldedX = (1 - std::abs(y)) * signNotZero(x);
+                y = (1 - std::abs(x)) * signNotZero(y);
+                x = foldedX;
+            }
+            attributes.normal[0] = toSnorm16(x);
+            attributes.normal[1] = toSnorm16(y);
+        } else // marks the missing normal, no direction ends up on this corner of the square
+            attributes.normal[0] = attributes.normal[1] = INT16_MIN;
+        attributes.uv[0] = floatToHalf((float) uv.x());
+        attributes.uv[1] = floatToHalf((float) uv.y());
+        return attributes;
+    }
+    
+    Vec4 MeshVertexAttributes::decodeNormal() const {
+        if (normal[0] == INT16_MIN && normal[1] == INT16_MIN)
+            return {};
+        PRECISION_TYPE x = normal[0] / 32767.0, y = normal[1] / 32767.0;
+        PRECISION_TYPE z = 1 - std::abs(x) - std::abs(y);
+        if (z < 0) {
+            PRECISION_TYPE foldedX = (1 - std::abs(y)) * signNotZero(x);
+            y = (1 - std::abs(x)) * signNotZero(y);
+            x = foldedX;
+        }
+        return Vec4{x, y, z}.normalize();
+    }
+    
+    Vec4 MeshVertexAttributes::decodeUV() const {
+        return {halfToFloat(uv[0]), halfToFloat(uv[1]), 0};
+    }
+    
+    /*
+     * Indexed mesh
+     */
+    
+    struct MeshVertexKey {
+        int position, uv, normal;
         
-        tMaxX = std::max(t->vertex1.x(), std::max(t->vertex2.x(), std::max(t->vertex3.x(), tMaxX)));
-        tMaxY = std::max(t->vertex1.y(), std::max(t->vertex2.y(), std::max(t->vertex3.y(), tMaxY)));
-        tMaxZ = std::max(t->vertex1.z(), std::max(t->vertex2.z(), std::max(t->vertex3.z(), tMaxZ)));
+        bool operator==(const MeshVertexKey& key) const = default;
+    };
+    
+    struct MeshVertexKeyHash {
+        size_t operator()(const MeshVertexKey& key) const {
+            return std::hash<uint64_t>()((uint64_t(uint32_t(key.position)) << 32 | uint32_t(key.uv)) * 0x9E3779B97F4A7C15ull ^ uint32_t(key.normal));
+        }
+    };
+    
+    IndexedMesh::IndexedMesh(const ModelData& data) {
+        std::unordered_map<MeshVertexKey, uint32_t, MeshVertexKeyHash> vertexIndices;
+        vertexIndices.reserve(data.vertices.size());
+        indexStorage.reserve(data.faces.size() * 3);
         
-        // create a AABB for model local BVH
-        t->aabb = {tMinX, tMinY, tMinZ, tMaxX, tMaxY, tMaxZ};
+        PRECISION_TYPE minX = infinity, minY = infinity, minZ = infinity, maxX = ninfinity, maxY = ninfinity, maxZ = ninfinity;
         
-        // and of course for a model AABB,
-        minX = std::min(tMinX, minX);
-        minY = std::min(tMinY, minY);
-        minZ = std::min(tMinZ, minZ);
+        auto addCorner = [&](int v, int uv, int n) {
+            auto inserted = vertexIndices.try_emplace({v, uv, n}, (uint32_t) positionStorage.size());
+            if (inserted.second) {
+                const auto& vertex = data.vertices[v];
+                positionStorage.push_back({(float) vertex.x(), (float) vertex.y(), (float) vertex.z()});
+                attributeStorage.push_back(MeshVertexAttributes::encode(data.normals[n], data.uvs[uv]));
+                
+                // the positions only hold vertices a face uses, so their bounds are the bounds of the triangles
+                auto position = positionStorage.back().toVec4();
+                minX = std::min(position.x(), minX);
+                minY = std::min(position.y(), minY);
+                minZ = std::min(position.z(), minZ);
+                
+                maxX = std::max(position.x(), maxX);
+                maxY = std::max(position.y(), maxY);
+                maxZ = std::max(position.z(), maxZ);
+            }
+            indexStorage.push_back(inserted.first->second);
+        };
         
-        maxX = std::max(tMaxX, maxX);
-        maxY = std::max(tMaxY, maxY);
-        maxZ = std::max(tMaxZ, maxZ);
+        for (const face& f : data.faces) {
+            addCorner(f.v1, f.uv1, f.n1);
+            addCorner(f.v2, f.uv2, f.n2);
+            addCorner(f.v3, f.uv3, f.n3);
+        }
+        positionStorage.shrink_to_fit();
+        attributeStorage.shrink_to_fit();
+        positions = positionStorage;
+        indices = indexStorage;
+        attributes = attributeStorage;
         
-        triangles.push_back(t);
+        aabb = {minX, minY, minZ, maxX, maxY, maxZ};
+    }
+    
+    AABB IndexedMesh::getTriangleAABB(size_t triangle) const {
+        auto v1 = getVertex(triangle, 0), v2 = getVertex(triangle, 1), v3 = getVertex(triangle, 2);
+        return {
+                std::min(v1.x(), std::min(v2.x(), v3.x())), std::min(v1.y(), std::min(v2.y(), v3.y())), std::min(v1.z(), std::min(v2.z(), v3.z())),
+                std::max(v1.x(), std::max(v2.x(), v3.x())), std::max(v1.y(), std::max(v2.y(), v3.y())), std::max(v1.z(), std::max(v2.z(), v3.z()))
+        };
+    }
+    
+    Triangle IndexedMesh::getTriangle(size_t triangle) const {
+        Triangle t{
+                getVertex(triangle, 0), getVertex(triangle, 1), getVertex(triangle, 2),
+                getUV(triangle, 0), getUV(triangle, 1), getUV(triangle, 2),
+                getNormal(triangle, 0), getNormal(triangle, 1), getNormal(triangle, 2)
+        };
+        t.aabb = getTriangleAABB(triangle);
+        return t;
+    }
+    
+    std::vector<Triangle> IndexedMesh::getTriangles() const {
+        std::vector<Triangle> triangles;
+        triangles.reserve(getTriangleCount());
+        for (size_t i = 0; i < getTriangleCount(); i++)
+            triangles.push_back(getTriangle(i));
+        return triangles;
     }
-    // to generate a AABB
-    aabb = {minX, minY, minZ, maxX, maxY, maxZ};
+    
 }
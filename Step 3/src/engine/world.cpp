@@ -4,10 +4,17 @@
  */
 #include "engine/world.h"
 #include "engine/raytracing.h"
-#include "engine/image/stb/stb_image.h"
+#include "engine/util/debug.h"
+#include "engine/bvh_cache.h"
+#include <unordered_set>
+#include <chrono>
 
 namespace Raytracing {
     
+    // how much a diffuse bounce widens the ray cone. The bounce goes anywhere in the hemisphere, this is about the spread of the
+    // middle of the cosine lobe, enough for the textures seen after it to be sampled from levels which converge quickly.
+    static constexpr PRECISION_TYPE DIFFUSE_CONE_SPREAD = 1.0;
+    
     World::~World() {
         for (auto* p : objects)
             delete (p);
@@ -16,22 +23,27 @@ namespace Raytracing {
         //delete(bvhObjects);
     }
     
-    HitData SphereObject::checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
-        PRECISION_TYPE radiusSquared = radius * radius;
+    HitRecord SphereObject::intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+        // solved in double even when PRECISION_TYPE is float. c and the discriminant are differences of large, nearly equal numbers
+        // for rays starting on or far from the sphere, a float keeps so few digits of them that the ray can hit the surface it left from.
+        double radiusSquared = double(radius) * radius;
         // move the ray to be with respects to the sphere
-        Vec4 RayWRTSphere = ray.getStartingPoint() - position;
+        const auto start = ray.getStartingPoint();
+        const auto direction = ray.getDirection();
+        double RayWRTSphere[3] = {double(start.x()) - position.x(), double(start.y()) - position.y(), double(start.z()) - position.z()};
+        double dir[3] = {direction.x(), direction.y(), direction.z()};
         // now determine the discriminant for the quadratic formula for the function of line sphere intercept
-        PRECISION_TYPE a = ray.getDirection().lengthSquared();
-        PRECISION_TYPE b = Raytracing::Vec4::dot(RayWRTSphere, ray.getDirection());
-        PRECISION_TYPE c = RayWRTSphere.lengthSquared() - radiusSquared;
+        double a = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+        double b = RayWRTSphere[0] * dir[0] + RayWRTSphere[1] * dir[1] + RayWRTSphere[2] * dir[2];
+        double c = RayWRTSphere[0] * RayWRTSphere[0] + RayWRTSphere[1] * RayWRTSphere[1] + RayWRTSphere[2] * RayWRTSphere[2] - radiusSquared;
         // > 0: the hit has two roots, meaning we hit both sides of the sphere
         // = 0: the ray has one root, we hit the edge of the sphere
         // < 0: ray isn't inside the sphere.
-        PRECISION_TYPE discriminant = b * b - (a * c);
+        double discriminant = b * b - (a * c);
         
         // < 0: ray isn't inside the sphere. Don't need to bother calculating the roots.
         if (discriminant < 0)
-            return {false, Vec4(), Vec4(), 0};
+            return {false, max};
         
         // now we have to find the root which exists inside our range [min,max]
         auto root = (-b - std::sqrt(discriminant)) / a;
@@ -41,11 +53,27 @@ namespace Raytracing {
             root = (-b + std::sqrt(discriminant)) / a;
             if (root < min || root > max) {
                 // if the second isn't in the range then we also must return false.
-                return {false, Vec4(), Vec4(), 0};
+                return {false, max};
             }
         }
+        return {true, (PRECISION_TYPE) root};
+    }
+    
+    void SphereObject::intersect(SphereBatch& batch, const Ray& ray, PRECISION_TYPE min, HitRecord& closest) {
+        if (batch.count == 0)
+            return;
+        PRECISION_TYPE t;
+        int hit = SIMD::kernels().spheres(batch, ray.getStartingPoint(), ray.getDirection(), min, closest.t, t);
+        if (hit >= 0) {
+            closest = {true, t};
+            closest.object = batch.spheres[hit];
+        }
+        batch.count = 0;
+    }
+    
+    HitData SphereObject::surfaceInteraction(const Ray& ray, const HitRecord& record) const {
         // the hit point is where the ray is when extended to the root
-        auto RayAtRoot = ray.along(root);
+        auto RayAtRoot = ray.along(record.t);
         // The normal of a sphere is just the point of the hit minus the center position
         auto normal = (RayAtRoot - position) / radius;
         
@@ -57,63 +85,179 @@ namespace Raytracing {
         // calculate the uv coords and normalize to [0, 1]
         PRECISION_TYPE u = (atan2(-normal.z(), normal.x()) + std::numbers::pi) / (2 * std::numbers::pi);
         PRECISION_TYPE v = acos(normal.y()) / std::numbers::pi;
-        // have to invert the v since we have to invert the v again later due to triangles
-        return {true, RayAtRoot, normal, root, u, 1.0 - v};
+        // have to invert the v since we have to invert the v again later due to triangles.
+        // u wraps around the sphere once and v goes from pole to pole, the density is the geometric mean of the two ignoring the poles.
+        return {true, RayAtRoot, normal, record.t, u, 1 - v, PRECISION_TYPE(1 / (std::numbers::pi * std::numbers::sqrt2 * std::abs(radius)))};
     }
     
-    std::pair<HitData, Object*> World::checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+    HitRecord World::checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
         // actually speeds up rendering by about 110,000ms (total across 16 threads)
         if (bvhObjects != nullptr && m_config.useBVH) {
-            auto hResult = HitData{false, Vec4(), Vec4(), max};
-            Object* objPtr = nullptr;
-            
-            auto intersected = bvhObjects->rayAnyHitIntersect(ray, min, max);
+            // the BVH gives us the closest object it contains, which is then used as the max for everything else.
+            auto hResult = bvhObjects->rayClosestHitIntersect(ray, min, max);
             
-            for (const auto& ptr : intersected) {
-                auto cResult = ptr.ptr->checkIfHit(ray, min, hResult.length);
-                if (cResult.hit) {
-                    hResult = cResult;
-                    objPtr = ptr.ptr;
-                }
-            }
-            // after we check the BVH, we have to check for other missing objects
-            // since stuff like spheres currently don't have AABB and AABB isn't a requirement
-            // for the object class (to be assigned)
+            // after we check the BVH, we have to check the objects which couldn't be put in it
+            // since AABB isn't a requirement for the object class (to be assigned)
             for (auto* obj : bvhObjects->noAABBObjects) {
                 // check up to the point of the last closest hit,
                 // will give the closest object's hit result
-                auto cResult = obj->checkIfHit(ray, min, hResult.length);
+                auto cResult = obj->intersect(ray, min, hResult.t);
                 if (cResult.hit) {
                     hResult = cResult;
-                    objPtr = obj;
+                    hResult.object = obj;
                 }
             }
             
-            return {hResult, objPtr};
+            return hResult;
         } else {
             // rejection algo without using a binary space partitioning data structure
-            auto hResult = HitData{false, Vec4(), Vec4(), max};
-            Object* objPtr = nullptr;
+            HitRecord hResult{false, max};
+            // runs of spheres are tested together, anything else first tests the spheres before it to keep the order of the tests
+            SphereBatch spheres;
             for (auto* obj : objects) {
+                if (obj->getType() == ObjectType::SPHERE) {
+                    static_cast<SphereObject*>(obj)->addTo(spheres);
+                    if (spheres.full())
+                        SphereObject::intersect(spheres, ray, min, hResult);
+                    continue;
+                }
+                SphereObject::intersect(spheres, ray, min, hResult);
                 // check up to the point of the last closest hit,
                 // will give the closest object's hit result
-                auto cResult = obj->checkIfHit(ray, min, hResult.length);
+                auto cResult = obj->intersect(ray, min, hResult.t);
                 if (cResult.hit) {
                     hResult = cResult;
-                    objPtr = obj;
+                    hResult.object = obj;
                 }
             }
-            return {hResult, objPtr};
+            SphereObject::intersect(spheres, ray, min, hResult);
+            return hResult;
         }
     }
     
+    HitRecord World::checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, BVHTraversalStats& stats) const {
+        HitRecord hResult{false, max};
+        auto test = [&](Object* obj, PRECISION_TYPE tMax) -> void {
+            HitRecord cResult;
+            // meshes count the nodes and triangles of their own BVH, every other object is a single primitive
+            if (obj->getType() == ObjectType::MODEL)
+                cResult = static_cast<const ModelObject*>(obj)->intersect(ray, min, tMax, stats);
+            else {
+                stats.testPrimitive();
+                cResult = obj->intersect(ray, min, tMax);
+            }
+            if (cResult.hit) {
+                hResult = cResult;
+                hResult.object = obj;
+            }
+        };
+        PRECISION_TYPE bvhMax = max;
+        bvhObjects->traverseClosestHit(
+                ray, min, bvhMax, [&](uint32_t index, PRECISION_TYPE& tMax) {
+                    auto* obj = bvhObjects->getObject(index);
+                    if (obj == nullptr)
+                        return;
+                    test(obj, tMax);
+                    tMax = hResult.t;
+                }, stats
+        );
+        for (auto* obj : bvhObjects->getInsertedObjects())
+            test(obj, hResult.t);
+        for (auto* obj : bvhObjects->noAABBObjects)
+            test(obj, hResult.t);
+        return hResult;
+    }
+    
+    std::shared_ptr<MeshAsset> World::loadMesh(const std::string& file) {
+        auto found = meshes.find(file);
+        if (found != meshes.end())
+            return found->second;
+        auto mesh = std::make_shared<MeshAsset>(OBJLoader::loadMesh(file), m_config.bvhOptions);
+        meshes.insert({file, mesh});
+        return mesh;
+    }
+    
+    void World::buildMeshBVHs(const std::vector<MeshAsset*>& models) {
+        // meshes the AssetLoader already built are skipped, the largest of the rest are started first so they don't finish last
+        std::vector<MeshAsset*> missing;
+        for (auto* model : models)
+            if (model->getTriangleBVH() == nullptr)
+                missing.push_back(model);
+        std::sort(missing.begin(), missing.end(), [](const MeshAsset* a, const MeshAsset* b) {
+            return a->getGeometry().getTriangleCount() > b->getGeometry().getTriangleCount();
+        });
+        // one mesh is left to use every core itself, otherwise each mesh is built on its own core
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1) if(missing.size() > 1)
+#endif
+        for (size_t i = 0; i < missing.size(); i++)
+            missing[i]->buildBVH();
+    }
+    
     void World::generateBVH() {
-        bvhObjects = std::make_unique<BVHTree>(objects);
+        profiler::start("Raytracer Results", "BVH Build");
+        auto start = std::chrono::steady_clock::now();
+        // every mesh once, in the order the objects first use them. Instances share the BVH of their mesh
+        std::vector<MeshAsset*> models;
+        std::unordered_set<MeshAsset*> seen;
+        for (auto* obj : objects) {
+            auto* model = dynamic_cast<ModelObject*>(obj);
+            if (model != nullptr && seen.insert(model->getMesh().get()).second)
+                models.push_back(model->getMesh().get());
+        }
+        // trees which are in the cache are used straight from the file, the rest are built below
+        uint64_t sceneHash = 0;
+        std::vector<uint64_t> meshHashes;
+        std::unique_ptr<BVHCache> cache;
+        if (!m_config.bvhCachePath.empty()) {
+            for (auto* model : models)
+                meshHashes.push_back(BVHCache::hashMesh(*model));
+            sceneHash = BVHCache::hashScene(objects, meshHashes, m_config.bvhOptions);
+            cache = BVHCache::load(m_config.bvhCachePath, sceneHash, models.size() + 1);
+        }
+        if (cache != nullptr) {
+            for (size_t i = 0; i < models.size(); i++)
+                models[i]->useCachedBVH(cache->getTree(i + 1), cache->getMapping());
+            bvhObjects = std::make_unique<BVHTree>(objects, m_config.bvhOptions, &cache->getTree(0), cache->getMapping());
+        } else {
+            buildMeshBVHs(models);
+            for (auto* obj : objects)
+                obj->buildBVH();
+            bvhObjects = std::make_unique<BVHTree>(objects, m_config.bvhOptions);
+            if (!m_config.bvhCachePath.empty()) {
+                std::vector<const FlatBVH*> trees{bvhObjects.get()};
+                for (auto* model : models)
+                    trees.push_back(model->getTriangleBVH());
+                BVHCache::write(m_config.bvhCachePath, sceneHash, trees, meshHashes);
+            }
+        }
+        profiler::end("Raytracer Results", "BVH Build");
+        ilog << (cache != nullptr ? "Loaded the BVHs from the cache in " : "Built the world BVH in ")
+             << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms.\n";
 #ifdef COMPILE_GUI
         new DebugBVH(bvhObjects.get(), m_config.worldShader);
 #endif
     }
     
+    bool World::remove(Object* object) {
+        auto pos = std::find(objects.begin(), objects.end(), object);
+        if (pos == objects.end())
+            return false;
+        objects.erase(pos);
+        if (bvhObjects != nullptr)
+            bvhObjects->remove(object);
+        return true;
+    }
+    
+    bool World::updateBVH() {
+        if (bvhObjects == nullptr)
+            return false;
+        profiler::start("Raytracer Results", "BVH Update");
+        bool rebuilt = bvhObjects->update();
+        profiler::end("Raytracer Results", "BVH Update");
+        return rebuilt;
+    }
+
     ScatterResults DiffuseMaterial::scatter(const Ray& ray, const HitData& hitData) const {
         Vec4 newRay = hitData.normal + Raytracing::RayCaster::randomUnitVector().normalize();
         
@@ -121,7 +265,7 @@ namespace Raytracing {
         if (newRay.x() < EPSILON && newRay.y() < EPSILON && newRay.z() < EPSILON && newRay.w() < EPSILON)
             newRay = hitData.normal;
         
-        return {true, Ray{hitData.hitPoint, newRay}, getBaseColor()};
+        return {true, Ray{hitData.hitPoint, newRay}, getBaseColor(), DIFFUSE_CONE_SPREAD};
     }
     
     ScatterResults MetalMaterial::scatter(const Ray& ray, const HitData& hitData) const {
@@ -137,7 +281,7 @@ namespace Raytracing {
         Vec4 newRay = reflect(ray.getDirection().normalize(), hitData.normal);
         // make sure our reflected ray is outside the sphere and doesn't point inwards
         bool shouldReflect = Vec4::dot(newRay, hitData.normal) > 0;
-        return {shouldReflect, Ray{hitData.hitPoint, newRay + RayCaster::randomUnitVector() * fuzzyness}, getBaseColor()};
+        return {shouldReflect, Ray{hitData.hitPoint, newRay + RayCaster::randomUnitVector() * fuzzyness}, getBaseColor(), fuzzyness};
     }
     
     ScatterResults TexturedMaterial::scatter(const Ray& ray, const HitData& hitData) const {
@@ -147,150 +291,167 @@ namespace Raytracing {
         if (newRay.x() < EPSILON && newRay.y() < EPSILON && newRay.z() < EPSILON && newRay.w() < EPSILON)
             newRay = hitData.normal;
         
-        return {true, Ray{hitData.hitPoint, newRay}, getColor(hitData.u * scale, hitData.v * scale)};
+        auto footprint = hitData.footprint * hitData.uvDensity * scale;
+        return {true, Ray{hitData.hitPoint, newRay}, getColor(hitData.u * scale, hitData.v * scale, footprint), DIFFUSE_CONE_SPREAD};
     }
     
-    Vec4 TexturedMaterial::getColor(PRECISION_TYPE u, PRECISION_TYPE v) const {
+    Vec4 TexturedMaterial::getColor(PRECISION_TYPE u, PRECISION_TYPE v, PRECISION_TYPE footprint) const {
         // if we are unable to load the image return the debug color.
-        if (!data)
+        if (!image)
             return Vec4{0.2, 1, 0} * Vec4{u, v, 1.0};
         
-        //u = clamp(u, 0.0, 1.0);
-        u = fmod(u, 1.0);
-        v = fmod(v, 1.0);
+        u = u - std::floor(u);
+        v = v - std::floor(v);
         // fix that pesky issue of the v being rotated 90* compared to the image
         v = 1.0 - v;
         
-        auto imageX = (int) (width * u);
-        auto imageY = (int) (height * v);
-        
-        if (imageX >= width) imageX = width - 1;
-        if (imageY >= height) imageY = height - 1;
-        
-        // since stbi loads in RGB8 [0, 255] but the engine works on [0, 1] we need to scale the data down.
-        // this is best done with a single division followed by multiple multiplication.
-        // since this function needs to be cheap to run.
-        const PRECISION_TYPE colorFactor = 1.0 / 255.0;
-        const auto pixelData = data + (imageY * channels * width + imageX * channels);
-        
-        return {pixelData[0] * colorFactor, pixelData[1] * colorFactor, pixelData[2] * colorFactor};
+        // the footprint in texels of the full image is halved by every level up, until it fits in a texel of the level.
+        // what is left over says how close it is to the next level.
+        int level = 0;
+        const int lastLevel = image->getLevelCount() - 1;
+        auto texels = footprint * image->getSize();
+        while (texels >= 2 && level < lastLevel) {
+            texels *= 0.5;
+            level++;
+        }
+        if (texels > 1 && level < lastLevel) {
+            // a hash of where the sample landed picks between the two levels. The samples of a pixel are jittered across it,
+            // so this is as random as the random generator and much cheaper to call for every texture lookup.
+            auto hash = uint32_t(u * 4294967295.0) * 0x9E3779B1u ^ uint32_t(v * 4294967295.0) * 0x85EBCA77u;
+            hash = (hash ^ (hash >> 15)) * 0x2C1B3C6Du;
+            hash ^= hash >> 12;
+            if (PRECISION_TYPE(hash >> 8) * (1.0 / 16777216.0) < texels - 1)
+                level++;
+        }
+        return image->sample(u, v, level);
     }
     
-    TexturedMaterial::TexturedMaterial(const std::string& file): Material({}) {
-        // we are going to have to ignore transparency for now. TODO:?
-        data = stbi_load(file.c_str(), &width, &height, &channels, 0);
-        if (!data)
+    TexturedMaterial::TexturedMaterial(const std::string& file): TexturedMaterial(file, TextureCache::load(file)) {}
+    
+    TexturedMaterial::TexturedMaterial(const std::string& file, float scale): TexturedMaterial(file, TextureCache::load(file), scale) {}
+    
+    TexturedMaterial::TexturedMaterial(const std::string& file, std::shared_ptr<const TextureImage> image, float scale):
+            Material({}), scale(scale), image(std::move(image)) {
+        if (!this->image)
             elog << "Unable to load image file " << file << "!\n";
         else
-            ilog << "Loaded image " << file << " with " << width << " " << height << " " << channels << "!\n";
+            ilog << "Loaded image " << file << " with " << this->image->getWidth() << " " << this->image->getHeight() << " "
+                 << this->image->getChannels() << "!\n";
     }
     
-    TexturedMaterial::~TexturedMaterial() {
-        stbi_image_free(data);
+    PRECISION_TYPE sign(PRECISION_TYPE i) {
+        return i >= 0 ? 1 : -1;
     }
     
-    TexturedMaterial::TexturedMaterial(const std::string& file, float scale): TexturedMaterial(file) {
-        this->scale = scale;
+    MeshAsset::MeshAsset(IndexedMesh mesh, const BVHBuildOptions& bvhOptions): geometry(std::move(mesh)), bvhOptions(bvhOptions) {}
+    
+    template<typename Stats>
+    HitRecord MeshAsset::intersectTriangles(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, Stats&& stats) const {
+        auto origin = ray.getStartingPoint();
+        auto direction = ray.getDirection();
+        HitRecord closest{false, max};
+        
+        // the triangle BVH visits the closest triangles first, and every hit shrinks the max so farther nodes get skipped.
+        // the leaves are tested eight triangles at a time in single precision, which only leaves the likely hits for the exact test
+        triangleBVH->traverseClosestHitBlocks(
+                ray, min, max, [&](uint32_t index, PRECISION_TYPE& tMax) {
+                    PRECISION_TYPE t, u, v;
+                    if (geometry.intersects(index, origin, direction, min, tMax, t, u, v)) {
+                        closest = {true, t, index, u, v};
+                        tMax = t;
+                    }
+                }, stats
+        );
+        return closest;
     }
     
-    PRECISION_TYPE sign(PRECISION_TYPE i) {
-        return i >= 0 ? 1 : -1;
+    HitRecord MeshAsset::intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+        if (triangleBVH == nullptr)
+            return intersectBruteForce(ray, min, max);
+        return intersectTriangles(ray, min, max, BVHNoStats{});
     }
     
-    static HitData checkIfTriangleGotHit(const Triangle& theTriangle, const Vec4& position, const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) {
-        // Möller–Trumbore intersection algorithm
-        // https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
-        Vec4 edge1, edge2, h, s, q;
-        PRECISION_TYPE a, f, u, v;
-        edge1 = (theTriangle.vertex2 + position) - (theTriangle.vertex1 + position);
-        edge2 = (theTriangle.vertex3 + position) - (theTriangle.vertex1 + position);
-        
-        h = Vec4::cross(ray.getDirection(), edge2);
-        a = Vec4::dot(edge1, h);
-        
-        if (a > -EPSILON && a < EPSILON)
-            return {false, Vec4(), Vec4(), 0}; //parallel to triangle
-        
-        f = 1.0 / a;
-        s = ray.getStartingPoint() - (theTriangle.vertex1 + position);
-        u = f * Vec4::dot(s, h);
-        
-        if (u < 0.0 || u > 1.0)
-            return {false, Vec4(), Vec4(), 0};
-        
-        q = Vec4::cross(s, edge1);
-        v = f * Vec4::dot(ray.getDirection(), q);
-        if (v < 0.0 || u + v > 1.0)
-            return {false, Vec4(), Vec4(), 0};
-        
-        // At this stage we can compute t to find out where the intersection point is on the line.
-        PRECISION_TYPE t = f * Vec4::dot(edge2, q);
-        // keep t in reasonable bounds, ensuring we respect depth
-        if (t > EPSILON && t >= min && t <= max) {
-            // ray intersects
-            Vec4 rayIntersectionPoint = ray.along(t);
-            Vec4 normal;
-            
-            // calculate triangle berry centric coords
-            // first we need the vector that runs between the vertex and the intersection point for all three vertices
-            // we must subtract the position of the triangle from the intersection point because this calc must happen in triangle space not world space.
-            // you won't believe the time it took me to figure this out, since the U coord was correct but the V coord was always 1.
-            auto vertex1ToIntersect = theTriangle.vertex1 - (rayIntersectionPoint - position);
-            auto vertex2ToIntersect = theTriangle.vertex2 - (rayIntersectionPoint - position);
-            auto vertex3ToIntersect = theTriangle.vertex3 - (rayIntersectionPoint - position);
-            
-            // the magnitude of the cross product of two vectors is double the area formed by the triangle of their intersection.
-            auto fullAreaVec = Vec4::cross(theTriangle.vertex1 - theTriangle.vertex2, theTriangle.vertex1 - theTriangle.vertex3);
-            auto areaVert1Vec = Vec4::cross(vertex2ToIntersect, vertex3ToIntersect);
-            auto areaVert2Vec = Vec4::cross(vertex3ToIntersect, vertex1ToIntersect);
-            auto areaVert3Vec = Vec4::cross(vertex1ToIntersect, vertex2ToIntersect);
-            auto fullArea = 1.0 / fullAreaVec.magnitude();
-            // scale the area of sub triangles to be proportion to the area of the triangle
-            auto areaVert1 = areaVert1Vec.magnitude() * fullArea;
-            auto areaVert2 = areaVert2Vec.magnitude() * fullArea;
-            auto areaVert3 = areaVert3Vec.magnitude() * fullArea;
-            
-            // since we are calculating UV coords, the hard interpolation part is already done.
-            // so use said calculation to determine the overall normal based on the 3 individual vertexes
-            normal = theTriangle.normal1 * areaVert1 + theTriangle.normal2 * areaVert2 + theTriangle.normal3 * areaVert3;
-            
-            // that area is how much each UV factors into the final UV coord
-            // since the z and w component isn't used it's best to do this individually. (Where's that TODO on lower order vectors!!!)
-            auto t_u = theTriangle.uv1.x() * areaVert1 + theTriangle.uv2.x() * areaVert2 + theTriangle.uv3.x() * areaVert3;
-            auto t_v = theTriangle.uv1.y() * areaVert1 + theTriangle.uv2.y() * areaVert2 + theTriangle.uv3.y() * areaVert3;
-            
-            return {true, rayIntersectionPoint, normal, t, t_u, t_v};
+    HitRecord MeshAsset::intersect(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max, BVHTraversalStats& stats) const {
+        if (triangleBVH == nullptr) {
+            stats.primitivesTested += geometry.getTriangleCount();
+            return intersectBruteForce(ray, min, max);
         }
-        
-        return {false, Vec4(), Vec4(), 0};
+        return intersectTriangles(ray, min, max, stats);
     }
     
-    HitData ModelObject::checkIfHit(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
-        auto hResult = HitData{false, Vec4(), Vec4(), max};
-        
-        //auto tris = triangleBVH->rayAnyHitIntersect(ray, min, max);
+    HitRecord MeshAsset::intersectBruteForce(const Ray& ray, PRECISION_TYPE min, PRECISION_TYPE max) const {
+        auto origin = ray.getStartingPoint();
+        auto direction = ray.getDirection();
+        HitRecord closest{false, max};
         
         // must check through all the triangles in the object
         // respecting depth along the way
         // but reducing the max it can reach my the last longest vector length.
-        for (const auto& t : triangles) {
-            auto cResult = checkIfTriangleGotHit(*t, position, ray, min, hResult.length);
-            if (cResult.hit)
-                hResult = cResult;
+        for (size_t i = 0; i < geometry.getTriangleCount(); i++) {
+            PRECISION_TYPE t, u, v;
+            if (geometry.intersects(i, origin, direction, min, closest.t, t, u, v))
+                closest = {true, t, (uint32_t) i, u, v};
         }
-        /*auto hResult = HitData{false, Vec4(), Vec4(), max};
+        return closest;
+    }
+    
+    HitData MeshAsset::surfaceInteraction(const HitRecord& record) const {
+        // the barycentric coords from the intersection test are how much the second and third vertex factor into the hit,
+        // which is all that is needed to interpolate the normals and UVs of the vertices
+        PRECISION_TYPE areaVert1 = 1 - record.u - record.v;
+        auto areaVert2 = record.u;
+        auto areaVert3 = record.v;
         
-        auto intersected = tree->rayIntersect(ray, min, max);
+        // this is the only place the normals and uvs of the mesh are read
+        auto triangle = record.primitive;
+        auto normal = geometry.getNormal(triangle, 0) * areaVert1 + geometry.getNormal(triangle, 1) * areaVert2 +
+                      geometry.getNormal(triangle, 2) * areaVert3;
         
-        for (auto t : intersected){
-            // apparently this kind of casting is okay
-            // which makes sense since the actual data behind it is a empty object
-            // just this is really bad and im too annoyed to figure out a better way. TODO:.
-            auto cResult = checkIfTriangleGotHit(((EmptyObject*)(t))->tri, position, ray, min, hResult.length);
-            if (cResult.hit)
-                hResult = cResult;
-        }*/
+        auto uv1 = geometry.getUV(triangle, 0), uv2 = geometry.getUV(triangle, 1), uv3 = geometry.getUV(triangle, 2);
+        auto t_u = uv1.x() * areaVert1 + uv2.x() * areaVert2 + uv3.x() * areaVert3;
+        auto t_v = uv1.y() * areaVert1 + uv2.y() * areaVert2 + uv3.y() * areaVert3;
         
-        return hResult;
+        return {true, Vec4(), normal, record.t, t_u, t_v};
+    }
+    
+    PRECISION_TYPE MeshAsset::getUVDensity(size_t triangle, const Transform& transform) const {
+        auto vertex1 = geometry.getVertex(triangle, 0);
+        auto edge1 = transform.vectorToWorld(geometry.getVertex(triangle, 1) - vertex1);
+        auto edge2 = transform.vectorToWorld(geometry.getVertex(triangle, 2) - vertex1);
+        auto uv1 = geometry.getUV(triangle, 0), uv2 = geometry.getUV(triangle, 1), uv3 = geometry.getUV(triangle, 2);
+        // both are twice the area, which cancels out
+        auto uvArea = std::abs((uv2.x() - uv1.x()) * (uv3.y() - uv1.y()) - (uv3.x() - uv1.x()) * (uv2.y() - uv1.y()));
+        auto area = Vec4::cross(edge1, edge2).magnitude();
+        return area > 0 ? std::sqrt(uvArea / area) : 0;
+    }
+    
+    void ModelObject::updateAABB() {
+        if (transform.isTranslationOnly()) {
+            aabb = mesh->getAABB();
+            return;
+        }
+        // the bounds of the mesh's bounds once they've been rotated and scaled
+        auto min = mesh->getAABB().getMin(), max = mesh->getAABB().getMax();
+        const auto inf = (PRECISION_TYPE) infinity;
+        PRECISION_TYPE boundsMin[3] = {inf, inf, inf}, boundsMax[3] = {-inf, -inf, -inf};
+        for (int corner = 0; corner < 8; corner++) {
+            Vec4 point{corner & 1 ? max.x() : min.x(), corner & 2 ? max.y() : min.y(), corner & 4 ? max.z() : min.z()};
+            auto transformed = transform.vectorToWorld(point);
+            PRECISION_TYPE values[3] = {transformed.x(), transformed.y(), transformed.z()};
+            for (int i = 0; i < 3; i++) {
+                boundsMin[i] = std::min(boundsMin[i], values[i]);
+                boundsMax[i] = std::max(boundsMax[i], values[i]);
+            }
+        }
+        aabb = {boundsMin[0], boundsMin[1], boundsMin[2], boundsMax[0], boundsMax[1], boundsMax[2]};
+    }
+    
+    HitData ModelObject::surfaceInteraction(const Ray& ray, const HitRecord& record) const {
+        auto surface = mesh->surfaceInteraction(record);
+        // t is the same in both spaces, so the hit point can come straight from the world ray
+        surface.hitPoint = ray.along(record.t);
+        surface.normal = transform.normalToWorld(surface.normal);
+        surface.uvDensity = mesh->getUVDensity(record.primitive, transform);
+        return surface;
     }
 }
\ No newline at end of file
@@ -65,11 +65,7 @@ namespace Raytracing {
                 ), objects.end());
     }
     
-    DebugBVH::DebugBVH(BVHTree* bvhTree, Shader& shader): m_bvhTree(bvhTree), m_shader(shader) {
-        DebugMenus::add(std::shared_ptr<DebugObject>(this));
-    }
-    
-    DebugBVH::DebugBVH(TriangleBVHTree* bvhTree, Shader& shader): m_triangleBVHTree(bvhTree), m_shader(shader) {
+    DebugBVH::DebugBVH(FlatBVH* bvhTree, Shader& shader, std::string name): m_bvhTree(bvhTree), m_name(std::move(name)), m_shader(shader) {
         DebugMenus::add(std::shared_ptr<DebugObject>(this));
     }
     
@@ -84,208 +80,66 @@ namespace Raytracing {
         return transform;
     }
     
-    void draw(Shader& worldShader, BVHNode* node) {
-        worldShader.setVec3("color", {1.0, 1.0, 1.0});
-        aabbVAO->bind();
-        if (selected == node->index) {
-            if (selected == node->index && ImGui::BeginListBox("", ImVec2(250, 350))) {
-                std::stringstream strs;
-                strs << node->aabb;
-                ImGui::Text("%s", strs.str().c_str());
-                for (const auto& item : node->objs) {
-                    auto pos = item.ptr->getPosition();
-                    std::stringstream stm;
-                    stm << item.aabb;
-                    ImGui::Text(
-                            "%s,\n\t%s", (std::to_string(pos.x()) + " " + std::to_string(pos.y()) + " " + std::to_string(pos.z())).c_str(),
-                            stm.str().c_str());
-                }
-                ImGui::EndListBox();
-            }
-            
-            for (const auto& obj : node->objs) {
-                auto transform = getTransform(obj.aabb);
-                worldShader.setMatrix("transform", transform);
-                aabbVAO->draw(worldShader);
-            }
-            auto transform = getTransform(node->aabb);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);
-            
-            /*auto splitAABBs = aabb.splitByLongestAxis();
-            transform = getTransform(splitAABBs.second);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);
-            transform = getTransform(splitAABBs.first);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);*/
-        }
-        if (node->hit) {
-            if (node->hit == 1)
-                worldShader.setVec3("color", {0.0, 0.0, 1.0});
-            else if (node->hit == 2)
-                worldShader.setVec3("color", {0.0, 1.0, 0.0});
-            else
-                worldShader.setVec3("color", {1.0, 0.5, 0.5});
-            auto transform = getTransform(node->aabb);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);
-        }
-    }
-    
-    void gui(BVHNode* node) {
-        
-        int c1 = -1;
-        int c2 = -1;
-        if (node->left != nullptr)
-            c1 = node->left->index;
-        if (node->right != nullptr)
-            c2 = node->right->index;
-        std::string t;
-        if (c1 == -1 && c2 == -1)
-            t = " LEAF";
-        else
-            t = " L: " + std::to_string(c1) + " R: " + std::to_string(c2);
-        if (ImGui::Selectable(("S: " + std::to_string(node->objs.size()) + " I: " + std::to_string(node->index) + t).c_str(), selected == node->index
-        ))
-            selected = node->index;
-    }
-    
-    void drawNodesRecur(Shader& worldShader, BVHNode* node) {
-        draw(worldShader, node);
-        if (node->left != nullptr)
-            drawNodesRecur(worldShader, node->left);
-        if (node->right != nullptr)
-            drawNodesRecur(worldShader, node->right);
-    }
-    
-    void guiNodesRecur(BVHNode* node) {
-        gui(node);
-        if (node->left != nullptr)
-            guiNodesRecur(node->left);
-        if (node->right != nullptr)
-            guiNodesRecur(node->right);
-    }
-    
-    void draw(Shader& worldShader, TriangleBVHNode* node) {
+    void draw(Shader& worldShader, FlatBVH* tree, uint32_t index) {
+        const auto& node = tree->getNodes()[index];
         worldShader.setVec3("color", {1.0, 1.0, 1.0});
         aabbVAO->bind();
-        if (selected == node->index) {
-            if (selected == node->index && ImGui::BeginListBox("", ImVec2(250, 350))) {
+        if (selected == (int) index) {
+            if (ImGui::BeginListBox("", ImVec2(250, 350))) {
                 std::stringstream strs;
-                strs << node->aabb;
+                strs << node.getAABB();
                 ImGui::Text("%s", strs.str().c_str());
-                for (const auto& item : node->objs) {
-                    auto pos = item.position;
+                for (uint32_t i = node.offset; node.isLeaf() && i < node.offset + node.count; i++) {
                     std::stringstream stm;
-                    stm << item.aabb;
-                    ImGui::Text(
-                            "%s,\n\t%s", (std::to_string(pos.x()) + " " + std::to_string(pos.y()) + " " + std::to_string(pos.z())).c_str(),
-                            stm.str().c_str());
+                    stm << tree->getPrimitiveAABB(i);
+                    ImGui::Text("%s", stm.str().c_str());
                 }
                 ImGui::EndListBox();
             }
             
-            for (const auto& obj : node->objs) {
-                auto transform = getTransform(obj.aabb);
+            for (uint32_t i = node.offset; node.isLeaf() && i < node.offset + node.count; i++) {
+                auto transform = getTransform(tree->getPrimitiveAABB(i));
                 worldShader.setMatrix("transform", transform);
                 aabbVAO->draw(worldShader);
             }
-            auto transform = getTransform(node->aabb);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);
-            
-            /*auto splitAABBs = aabb.splitByLongestAxis();
-            transform = getTransform(splitAABBs.second);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);
-            transform = getTransform(splitAABBs.first);
-            worldShader.setMatrix("transform", transform);
-            aabbVAO->draw(worldShader);*/
-        }
-        if (node->hit) {
-            if (node->hit == 1)
-                worldShader.setVec3("color", {0.0, 0.0, 1.0});
-            else if (node->hit == 2)
-                worldShader.setVec3("color", {0.0, 1.0, 0.0});
-            else
-                worldShader.setVec3("color", {1.0, 0.5, 0.5});
-            auto transform = getTransform(node->aabb);
+            auto transform = getTransform(node.getAABB());
             worldShader.setMatrix("transform", transform);
             aabbVAO->draw(worldShader);
         }
     }
     
-    void gui(TriangleBVHNode* node) {
-        
-        int c1 = -1;
-        int c2 = -1;
-        if (node->left != nullptr)
-            c1 = node->left->index;
-        if (node->right != nullptr)
-            c2 = node->right->index;
+    void gui(FlatBVH* tree, uint32_t index) {
+        const auto& node = tree->getNodes()[index];
         std::string t;
-        if (c1 == -1 && c2 == -1)
+        if (node.isLeaf())
             t = " LEAF";
         else
-            t = " L: " + std::to_string(c1) + " R: " + std::to_string(c2);
-        if (ImGui::Selectable(("S: " + std::to_string(node->objs.size()) + " I: " + std::to_string(node->index) + t).c_str(), selected == node->index
-        ))
-            selected = node->index;
+            t = " L: " + std::to_string(index + 1) + " R: " + std::to_string(node.offset);
+        if (ImGui::Selectable(("S: " + std::to_string(node.count) + " I: " + std::to_string(index) + t).c_str(), selected == (int) index))
+            selected = (int) index;
     }
     
-    void drawNodesRecur(Shader& worldShader, TriangleBVHNode* node) {
-        draw(worldShader, node);
-        if (node->left != nullptr)
-            drawNodesRecur(worldShader, node->left);
-        if (node->right != nullptr)
-            drawNodesRecur(worldShader, node->right);
+    // the flat tree is already in depth first order, so we can simply go through the array
+    void drawNodes(Shader& worldShader, FlatBVH* tree) {
+        for (uint32_t i = 0; i < tree->getNodes().size(); i++)
+            draw(worldShader, tree, i);
     }
     
-    void guiNodesRecur(TriangleBVHNode* node) {
-        gui(node);
-        if (node->left != nullptr)
-            guiNodesRecur(node->left);
-        if (node->right != nullptr)
-            guiNodesRecur(node->right);
+    void guiNodes(FlatBVH* tree) {
+        for (uint32_t i = 0; i < tree->getNodes().size(); i++)
+            gui(tree, i);
     }
     
     void DebugBVH::render() {
         glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
         if (m_bvhTree != nullptr) {
-            ImGui::Begin(("BVH Data "), nullptr, ImGuiWindowFlags_NoCollapse);
+            ImGui::Begin(m_name.c_str(), nullptr, ImGuiWindowFlags_NoCollapse);
             m_shader.use();
             m_shader.setInt("useWhite", 1);
             m_shader.setVec3("color", {1.0, 1.0, 1.0});
             {
                 ImGui::BeginChild("left pane", ImVec2(250, 0), true);
-                guiNodesRecur(m_bvhTree->getRoot());
-                ImGui::EndChild();
-            }
-            ImGui::SameLine();
-            {
-                ImGui::BeginGroup();
-                ImGui::BeginChild(
-                        "item view",
-                        ImVec2(0, -ImGui::GetFrameHeightWithSpacing()),
-                        true,
-                        ImGuiWindowFlags_AlwaysAutoResize
-                ); // Leave room for 1 line below us
-                drawNodesRecur(m_shader, m_bvhTree->getRoot());
-                ImGui::EndChild();
-                ImGui::EndGroup();
-            }
-            m_shader.setInt("useWhite", 0);
-            ImGui::End();
-        }
-        if (m_triangleBVHTree) {
-            ImGui::Begin((std::string("TBVH Data ") + std::to_string(m_triangleBVHTree->index)).c_str(), nullptr, ImGuiWindowFlags_NoCollapse);
-            m_shader.use();
-            m_shader.setInt("useWhite", 1);
-            m_shader.setVec3("color", {1.0, 1.0, 1.0});
-            {
-                ImGui::BeginChild("left pane", ImVec2(280, 0), true);
-                guiNodesRecur(m_triangleBVHTree->getRoot());
+                guiNodes(m_bvhTree);
                 ImGui::EndChild();
             }
             ImGui::SameLine();
@@ -297,7 +151,7 @@ namespace Raytracing {
                         true,
                         ImGuiWindowFlags_AlwaysAutoResize
                 ); // Leave room for 1 line below us
-                drawNodesRecur(m_shader, m_triangleBVHTree->getRoot());
+                drawNodes(m_shader, m_bvhTree);
                 ImGui::EndChild();
                 ImGui::EndGroup();
             }
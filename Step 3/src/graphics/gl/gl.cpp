@@ -274,6 +274,11 @@ void VAO::draw(Raytracing::Shader& shader, const std::vector<Raytracing::Vec4>&
     }
 }
 
+void VAO::draw(Raytracing::Shader& shader, Raytracing::Mat4x4 transform) const {
+    shader.setMatrix("transform", transform);
+    glDrawArrays(GL_TRIANGLES, 0, drawCount);
+}
+
 void VAO::draw(Raytracing::Shader& shader) {
     glDrawArrays(GL_TRIANGLES, 0, drawCount);
 }
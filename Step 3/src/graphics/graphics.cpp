@@ -617,7 +617,7 @@ namespace Raytracing {
             for (auto obj : objs) {
                 if (obj->getVAO() != nullptr) {
                     obj->getVAO()->bind();
-                    obj->getVAO()->draw(m_worldShader, {obj->getPosition()});
+                    obj->getVAO()->draw(m_worldShader, obj->getModelMatrix());
                 }
             }
             DebugMenus::render();
@@ -113,17 +113,17 @@ namespace Raytracing {
             MemoryConvert::writeBytes(buffer, currentIndex, (unsigned long) triangles.size());
             for (auto& triangle: triangles) {
                 // write vertex
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->vertex1);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->vertex2);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->vertex3);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.vertex1);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.vertex2);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.vertex3);
                 // next in the struct is normals
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->normal1);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->normal2);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->normal3);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.normal1);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.normal2);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.normal3);
                 // finally the UVs
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->uv1);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->uv2);
-                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle->uv3);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.uv1);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.uv2);
+                MemoryConvert::writeVectorBytes(buffer, currentIndex, triangle.uv3);
             }
         }
 //        for (auto* object: objects) {